@@ -44,7 +44,9 @@ struct rl_msg_layout rl_ker_numtables[] = {
         },
     [RLITE_KER_FLOW_FETCH_RESP] =
         {
-            .copylen = sizeof(struct rl_kmsg_flow_fetch_resp),
+            .copylen = sizeof(struct rl_kmsg_flow_fetch_resp) -
+                       1 * sizeof(struct rl_buf_field),
+            .buffers = 1,
         },
     [RLITE_KER_IPCP_UPDATE] =
         {
@@ -155,14 +157,20 @@ struct rl_msg_layout rl_ker_numtables[] = {
         },
     [RLITE_KER_REG_FETCH_RESP] =
         {
-            .copylen =
-                sizeof(struct rl_kmsg_reg_fetch_resp) - 1 * sizeof(char *),
-            .strings = 1,
+            .copylen = sizeof(struct rl_kmsg_reg_fetch_resp) -
+                       1 * sizeof(struct rl_buf_field),
+            .buffers = 1,
         },
     [RLITE_KER_FLOW_STATE] =
         {
             .copylen = sizeof(struct rl_kmsg_flow_state),
         },
+    [RLITE_KER_IPCP_PDUFT_BATCH] =
+        {
+            .copylen = sizeof(struct rl_kmsg_ipcp_pduft_batch) -
+                       1 * sizeof(struct rl_buf_field),
+            .buffers = 1,
+        },
     [RLITE_KER_MSG_MAX] =
         {
             .copylen = 0,
@@ -425,7 +425,8 @@ rl_numtables_max_size(struct rl_msg_layout *numtables, unsigned int n)
     for (i = 0; i < n; i++) {
         unsigned int cur = numtables[i].copylen +
                            numtables[i].names * sizeof(struct rina_name) +
-                           numtables[i].strings * sizeof(char *);
+                           numtables[i].strings * sizeof(char *) +
+                           numtables[i].buffers * sizeof(struct rl_buf_field);
 
         if (cur > max) {
             max = cur;
@@ -134,7 +134,11 @@ struct rl_msg_base_resp {
 /* The control device wants to be notified about creation, removal or
  * update of IPCPs. */
 #define RL_F_IPCPS (1 << 0)
-#define RL_F_ALL RL_F_IPCPS
+/* A read() on the control device returns as many whole messages as
+ * fit into the user buffer, each one preceded by its length, stored
+ * as a native uint32_t. */
+#define RL_F_BATCH (1 << 1)
+#define RL_F_ALL (RL_F_IPCPS | RL_F_BATCH)
 
 /* Bind the flow identified by port_id to
  * this rl_io device. */
@@ -165,7 +169,10 @@ struct rl_ioctl_info {
  * the former case 'local_port' should refer to an existing N-1 flow
  * ('remote_addr' is ignored), while in the latter 'remote_addr' should
  * refer to an N-IPCP that will be reached as specified by the PDUFT
- * ('local_port' is ignored).
+ * ('local_port' is ignored). If 'remote_addr' is a multicast address in
+ * the PDUFT, the SDU is replicated to all the neighbors in the group,
+ * except for the one reachable through 'local_port' (RL_PORT_ID_NONE
+ * to exclude none).
  * When reading a management SDU, the header will contain the local port
  * where the SDU was received and the source (remote) address that sent it.
  */
@@ -222,6 +229,7 @@ struct rl_flow_config {
     rlm_seq_t max_sdu_gap;
     uint8_t dtcp_present;
     struct dtcp_config dtcp;
+    rl_qosid_t qos_id; /* selects the forwarding table */
 
     /* Currently used by shim-tcp4 and shim-udp4. */
     int32_t fd;
@@ -39,6 +39,13 @@ int rl_write_msg(int rfd, struct rl_msg_base *msg, int quiet);
 
 struct rl_msg_base *rl_read_next_msg(int rfd, int quiet);
 
+/* Read a batch of messages from a control device with the RL_F_BATCH
+ * flag set, calling @cb on each of them. The messages are freed when
+ * @cb returns. Returns the number of messages processed, or -1 on
+ * error. */
+int rl_read_msgs(int rfd, int (*cb)(struct rl_msg_base *msg, void *opaque),
+                 void *opaque, int quiet);
+
 int rl_fa_req_fill(struct rl_kmsg_fa_req *req, uint32_t event_id,
                    const char *dif_name, const char *local_appl,
                    const char *remote_appl,
@@ -61,6 +61,7 @@ enum {
     RLITE_KER_REG_FETCH,             /* 29 */
     RLITE_KER_REG_FETCH_RESP,        /* 30 */
     RLITE_KER_FLOW_STATE,            /* 31 */
+    RLITE_KER_IPCP_PDUFT_BATCH,      /* 32 */
 
     RLITE_KER_MSG_MAX,
 };
@@ -104,7 +105,15 @@ struct rl_kmsg_ipcp_create_resp {
 /* application --> kernel message to destroy an IPC process. */
 #define rl_kmsg_ipcp_destroy rl_kmsg_ipcp_create_resp
 
-/* application --> kernel message to ask for a list of flows. */
+/* Maximum size of the entries buffer carried by a fetch response, chosen
+ * so that each response fits the 4 KiB buffers used to read kernel
+ * messages. */
+#define RL_FETCH_ENTRIES_MAXLEN 3072
+
+/* application --> kernel message to ask for a list of flows. The kernel
+ * returns a page of flows starting from the (opaque) cursor, together
+ * with the cursor for the next request. A zero cursor starts from the
+ * beginning. */
 struct rl_kmsg_flow_fetch {
     rl_msg_t msg_type;
     uint32_t event_id;
@@ -112,14 +121,13 @@ struct rl_kmsg_flow_fetch {
     /* If ipcp_id != ~0 filter flows by ipcp_id, otherwise
      * fetch all of them. */
     rl_ipcp_id_t ipcp_id;
-};
-
-/* application <-- kernel message to fetch flow information. */
-struct rl_kmsg_flow_fetch_resp {
-    rl_msg_t msg_type;
-    uint32_t event_id;
+    uint32_t cursor;
+    /* Max number of entries in the response (0 means no limit). */
+    uint16_t max_entries;
+} __attribute__((packed));
 
-    uint8_t end;
+/* A single entry in the flow fetch response. */
+struct rl_flow_fetch_entry {
     rl_ipcp_id_t ipcp_id;
     rl_port_t local_port;
     rl_port_t remote_port;
@@ -129,18 +137,30 @@ struct rl_kmsg_flow_fetch_resp {
     uint8_t flow_control;
 } __attribute__((packed));
 
-#define rl_kmsg_reg_fetch rl_kmsg_flow_fetch
-
-struct rl_kmsg_reg_fetch_resp {
+/* application <-- kernel message to fetch flow information. */
+struct rl_kmsg_flow_fetch_resp {
     rl_msg_t msg_type;
     uint32_t event_id;
 
-    uint8_t end;
-    uint8_t pending; /* Is registration pending ? */
+    uint8_t end;         /* no more entries after this page */
+    uint32_t cursor;     /* cursor for the next request */
+    uint16_t num_entries;
+    struct rl_buf_field entries; /* array of struct rl_flow_fetch_entry */
+} __attribute__((packed));
+
+#define rl_kmsg_reg_fetch rl_kmsg_flow_fetch
+
+/* A single entry in the registration fetch response, followed by
+ * the null-terminated application name (name_len bytes, including
+ * the terminator). */
+struct rl_reg_fetch_entry {
     rl_ipcp_id_t ipcp_id;
-    char *appl_name;
+    uint8_t pending; /* Is registration pending ? */
+    uint16_t name_len;
 } __attribute__((packed));
 
+#define rl_kmsg_reg_fetch_resp rl_kmsg_flow_fetch_resp
+
 #define RL_IPCP_UPDATE_ADD 0x01
 #define RL_IPCP_UPDATE_UPD 0x02
 #define RL_IPCP_UPDATE_UIPCP_DEL 0x03
@@ -293,6 +313,45 @@ struct rl_kmsg_ipcp_pduft_mod {
     /* The local port through which the remote IPCP
      * can be reached. */
     uint16_t local_port;
+    /* RL_PDUFT_F_* flags. */
+    uint8_t flags;
+} __attribute__((packed));
+
+/* The entry is a member of a multicast group: PDUs directed to
+ * 'dst_addr' are replicated to all the member ports. Deleting a
+ * multicast entry only removes the 'local_port' member. */
+#define RL_PDUFT_F_MCAST (1 << 0)
+/* The request refers to the backup port of the (unicast) entry for
+ * 'dst_addr', which must already exist. The kernel switches to the
+ * backup port as soon as the primary one goes down. */
+#define RL_PDUFT_F_BACKUP (1 << 1)
+
+/* A single modification in a PDUFT batch. */
+struct rl_pduft_batch_entry {
+    rlm_addr_t dst_addr;
+    uint16_t local_port;
+    uint8_t op;    /* RL_PDUFT_OP_* */
+    uint8_t flags; /* RL_PDUFT_F_* */
+    rl_qosid_t qos_id; /* 0 for the default table */
+} __attribute__((packed));
+
+#define RL_PDUFT_OP_SET 1
+#define RL_PDUFT_OP_DEL 2
+
+/* application --> kernel to apply many PDUFT modifications at once.
+ * The whole batch is rejected if any entry refers to an invalid flow
+ * or operation. Otherwise the modifications are applied in order,
+ * under a single acquisition of the PDUFT lock. This is best-effort:
+ * a modification that fails (e.g. the removal of a missing entry, or
+ * out of memory) is skipped and the error reported, while the others
+ * are kept. */
+struct rl_kmsg_ipcp_pduft_batch {
+    rl_msg_t msg_type;
+    uint32_t event_id;
+
+    rl_ipcp_id_t ipcp_id;
+    uint32_t num_entries;
+    struct rl_buf_field entries; /* array of struct rl_pduft_batch_entry */
 } __attribute__((packed));
 
 /* application --> kernel message to flush the PDUFT of an IPC Process. */
@@ -110,10 +110,20 @@ list_del_init(struct list_head *elem)
 #define list_next_entry(_cur, _member)                                         \
     container_of((_cur)->_member.succ, typeof(*(_cur)), _member)
 
+#define list_last_entry(_list, _type, _member)                                 \
+    container_of((_list)->prev, _type, _member)
+
+#define list_prev_entry(_cur, _member)                                         \
+    container_of((_cur)->_member.prev, typeof(*(_cur)), _member)
+
 #define list_for_each_entry(_cur, _list, _member)                              \
     for (_cur = list_first_entry(_list, typeof(*_cur), _member);               \
          &_cur->_member != (_list); _cur = list_next_entry(_cur, _member))
 
+#define list_for_each_entry_reverse(_cur, _list, _member)                      \
+    for (_cur = list_last_entry(_list, typeof(*_cur), _member);                \
+         &_cur->_member != (_list); _cur = list_prev_entry(_cur, _member))
+
 #define list_for_each_entry_safe(_cur, _tmp, _list, _member)                   \
     for (_cur = list_first_entry(_list, typeof(*_cur), _member),               \
         _tmp  = list_next_entry(_cur, _member);                                \
@@ -36,6 +36,7 @@
 #include <linux/sched.h>
 #include <linux/bitmap.h>
 #include <linux/hashtable.h>
+#include <linux/idr.h>
 #include <linux/spinlock.h>
 #include <asm/compat.h>
 
@@ -55,25 +56,26 @@ struct rl_ctrl {
 
     struct file *file; /* backpointer */
 
-    /* Upqueue-related data structures. */
-    struct list_head upqueue;
+    /* Upqueue-related data structures. Messages are serialized in place
+     * into a preallocated ring, each one preceded by its length (a zero
+     * length marks the end of the used part, before wrapping around).
+     * Messages never wrap. The upqueue_size field accounts for the
+     * headers and for the wasted space at the end of the ring. */
+    char *upqueue;
 #define RL_UPQUEUE_SIZE_MAX (1 << 14)
     unsigned int upqueue_size;
+    unsigned int upqueue_head; /* next message to read */
+    unsigned int upqueue_tail; /* where to write the next message */
     spinlock_t upqueue_lock;
     wait_queue_head_t upqueue_wqh;
+    struct mutex upqueue_rmutex; /* serializes readers */
 
-    struct list_head flows_fetch_q;
-    struct list_head regs_fetch_q;
     struct list_head node;
 
     unsigned flags;
 };
 
-struct upqueue_entry {
-    void *sermsg;
-    size_t serlen;
-    struct list_head node;
-};
+typedef uint32_t upqueue_hdr_t;
 
 struct registered_appl {
     /* Name of the registered application. */
@@ -100,11 +102,9 @@ struct registered_appl {
 };
 
 #define IPCP_ID_BITMAP_SIZE 256
-#define PORT_ID_BITMAP_SIZE 65536
-#define CEP_ID_BITMAP_SIZE PORT_ID_BITMAP_SIZE
+#define PORT_ID_MAX RL_PORT_ID_NONE /* exclusive */
+#define CEP_ID_MAX RL_PKTGEN_CEP    /* exclusive, see flow_entry->local_cep */
 #define IPCP_HASHTABLE_BITS 6
-#define PORT_ID_HASHTABLE_BITS 10
-#define CEP_ID_HASHTABLE_BITS 10
 
 struct rl_dm {
     /* Bitmap to manage IPC process ids. */
@@ -113,17 +113,14 @@ struct rl_dm {
     /* Hash table to store information about each IPC process. */
     DECLARE_HASHTABLE(ipcp_table, IPCP_HASHTABLE_BITS);
 
-    /* Bitmap to manage port ids. */
-    DECLARE_BITMAP(port_id_bitmap, PORT_ID_BITMAP_SIZE);
-
-    /* Hash tables to store information about each flow. */
-    DECLARE_HASHTABLE(flow_table, PORT_ID_HASHTABLE_BITS);
-    DECLARE_HASHTABLE(flow_table_by_cep, CEP_ID_HASHTABLE_BITS);
+    /* Flows indexed by port id and by connection endpoint id. The
+     * IDRs also allocate the ids (cyclically, to delay reuse), and
+     * grow with the number of flows. Lookups are lockless (RCU),
+     * updates happen under FLOCK. */
+    struct idr port_idr;
+    struct idr cep_idr;
     uint32_t uid_cnt;
 
-    /* Bitmap to manage connection endpoint ids. */
-    DECLARE_BITMAP(cep_id_bitmap, CEP_ID_BITMAP_SIZE);
-
     struct list_head ipcp_factories;
 
     struct list_head difs;
@@ -206,7 +203,8 @@ rl_ipcp_factory_register(struct ipcp_factory *factory)
     }
 
     if (factory->ops.pduft_set &&
-        (!factory->ops.pduft_del || !factory->ops.pduft_del_addr)) {
+        (!factory->ops.pduft_del || !factory->ops.pduft_del_addr ||
+         !factory->ops.pduft_mod_batch)) {
         ret = -EINVAL;
         goto out;
     }
@@ -249,44 +247,90 @@ rl_ipcp_factory_unregister(const char *dif_type)
 }
 EXPORT_SYMBOL(rl_ipcp_factory_unregister);
 
-static inline unsigned int
-upqentry_size(struct upqueue_entry *entry)
+/* Reserve room for a message of @serlen bytes in the upqueue, returning
+ * a pointer where to serialize it, or NULL if there is not enough space.
+ * Must be called under the upqueue lock. */
+static void *
+upqueue_reserve(struct rl_ctrl *rc, unsigned int serlen)
+{
+    unsigned int len      = sizeof(upqueue_hdr_t) + serlen;
+    unsigned int tailroom = RL_UPQUEUE_SIZE_MAX - rc->upqueue_tail;
+    unsigned int need     = len;
+    upqueue_hdr_t hdr     = serlen;
+    char *p;
+
+    if (rc->upqueue_size == 0) {
+        /* Rewind, to avoid wrapping as much as possible. */
+        rc->upqueue_head = rc->upqueue_tail = 0;
+        tailroom         = RL_UPQUEUE_SIZE_MAX;
+    }
+
+    if (tailroom < len) {
+        /* The message does not fit at the end, we need to wrap
+         * and waste the space at the end. */
+        need += tailroom;
+    }
+
+    if (rc->upqueue_size + need > RL_UPQUEUE_SIZE_MAX) {
+        return NULL;
+    }
+
+    if (tailroom < len) {
+        if (tailroom >= sizeof(hdr)) {
+            upqueue_hdr_t wrap = 0;
+
+            memcpy(rc->upqueue + rc->upqueue_tail, &wrap, sizeof(wrap));
+        }
+        rc->upqueue_tail = 0;
+    }
+
+    p = rc->upqueue + rc->upqueue_tail;
+    memcpy(p, &hdr, sizeof(hdr));
+    rc->upqueue_tail += len;
+    rc->upqueue_size += need;
+
+    return p + sizeof(hdr);
+}
+
+/* Skip the wasted space at the end of the ring, if the next message
+ * to read is at the beginning. Must be called under the upqueue lock. */
+static void
+upqueue_head_wrap(struct rl_ctrl *rc)
 {
-    return entry->serlen + sizeof(*entry);
+    unsigned int headroom = RL_UPQUEUE_SIZE_MAX - rc->upqueue_head;
+    upqueue_hdr_t hdr;
+
+    if (rc->upqueue_size == 0) {
+        return;
+    }
+
+    if (headroom >= sizeof(hdr)) {
+        memcpy(&hdr, rc->upqueue + rc->upqueue_head, sizeof(hdr));
+        if (hdr != 0) {
+            return;
+        }
+    }
+
+    rc->upqueue_size -= headroom;
+    rc->upqueue_head = 0;
 }
 
 int
 rl_upqueue_append(struct rl_ctrl *rc, const struct rl_msg_base *rmsg,
                   bool maysleep)
 {
-    gfp_t gfp        = maysleep ? GFP_KERNEL : GFP_ATOMIC;
     unsigned long to = msecs_to_jiffies(5);
     DECLARE_WAITQUEUE(wait, current);
-    struct upqueue_entry *entry;
     unsigned long exp;
     unsigned int serlen;
     void *serbuf;
     int ret = 0;
 
-    entry = rl_alloc(sizeof(*entry), gfp | __GFP_ZERO, RL_MT_UPQ);
-    if (!entry) {
-        PE("Out of memory\n");
-        return -ENOMEM;
-    }
-
-    /* Serialize the response into serbuf and then put it into the upqueue. */
     serlen = rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX, rmsg);
-    serbuf = rl_alloc(serlen, gfp | __GFP_ZERO, RL_MT_UPQ);
-    if (!serbuf) {
-        rl_free(entry, RL_MT_UPQ);
-        PE("Out of memory\n");
-        return -ENOMEM;
+    if (serlen + sizeof(upqueue_hdr_t) > RL_UPQUEUE_SIZE_MAX) {
+        PE("Message too long [%u]\n", serlen);
+        return -EINVAL;
     }
-    serlen =
-        serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf, rmsg);
-
-    entry->sermsg = serbuf;
-    entry->serlen = serlen;
 
     if (maysleep) {
         add_wait_queue(&rc->upqueue_wqh, &wait);
@@ -296,13 +340,12 @@ rl_upqueue_append(struct rl_ctrl *rc, const struct rl_msg_base *rmsg,
 
     for (;;) {
         spin_lock(&rc->upqueue_lock);
-        if (rc->upqueue_size + upqentry_size(entry) > RL_UPQUEUE_SIZE_MAX) {
+        serbuf = upqueue_reserve(rc, serlen);
+        if (!serbuf) {
             /* No free space in the queue. */
             spin_unlock(&rc->upqueue_lock);
             if (!maysleep || !time_before(jiffies, exp)) {
                 RPD(2, "upqueue overrun, dropping [cansleep=%d]\n", maysleep);
-                rl_free(serbuf, RL_MT_UPQ);
-                rl_free(entry, RL_MT_UPQ);
                 ret = -ENOSPC;
                 break;
             }
@@ -311,8 +354,8 @@ rl_upqueue_append(struct rl_ctrl *rc, const struct rl_msg_base *rmsg,
             schedule_timeout_interruptible(to);
             continue;
         }
-        list_add_tail(&entry->node, &rc->upqueue);
-        rc->upqueue_size += upqentry_size(entry);
+        /* Serialize the message directly into the upqueue. */
+        serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf, rmsg);
         spin_unlock(&rc->upqueue_lock);
         break;
     }
@@ -870,35 +913,32 @@ application_del_by_rc(struct rl_ctrl *rc)
     }
 }
 
-/* To be called under FLOCK. */
+/* To be called under FLOCK or rcu_read_lock(). */
 struct flow_entry *
 flow_lookup(rl_port_t port_id)
 {
-    struct flow_entry *entry;
-    struct hlist_head *head;
-    head = &rl_dm.flow_table[hash_min(port_id, HASH_BITS(rl_dm.flow_table))];
-    hlist_for_each_entry (entry, head, node) {
-        if (entry->local_port == port_id) {
-            return entry;
-        }
-    }
-
-    return NULL;
+    return idr_find(&rl_dm.port_idr, port_id);
 }
 EXPORT_SYMBOL(flow_lookup);
 
+/* Lookups don't take FLOCK, since they are performed on the datapath.
+ * A flow whose reference counter already dropped to zero is being
+ * destroyed, and cannot be grabbed anymore. */
 struct flow_entry *
 flow_get(rl_port_t port_id)
 {
     struct flow_entry *flow;
 
-    FLOCK();
+    rcu_read_lock();
     flow = flow_lookup(port_id);
+    if (flow && !refcount_inc_not_zero(&flow->refcnt)) {
+        flow = NULL;
+    }
+    rcu_read_unlock();
     if (flow) {
-        flow->refcnt++;
-        PV("FLOWREFCNT %u ++: %u\n", flow->local_port, flow->refcnt);
+        PV("FLOWREFCNT %u ++: %u\n", flow->local_port,
+           refcount_read(&flow->refcnt));
     }
-    FUNLOCK();
 
     return flow;
 }
@@ -908,24 +948,19 @@ struct flow_entry *
 flow_get_by_cep(unsigned int cep_id)
 {
     struct flow_entry *entry;
-    struct hlist_head *head;
-
-    FLOCK();
 
-    head = &rl_dm.flow_table_by_cep[hash_min(
-        cep_id, HASH_BITS(rl_dm.flow_table_by_cep))];
-    hlist_for_each_entry (entry, head, node_cep) {
-        if (entry->local_cep == cep_id) {
-            entry->refcnt++;
-            PV("FLOWREFCNT %u ++: %u\n", entry->local_port, entry->refcnt);
-            FUNLOCK();
-            return entry;
-        }
+    rcu_read_lock();
+    entry = idr_find(&rl_dm.cep_idr, cep_id);
+    if (entry && !refcount_inc_not_zero(&entry->refcnt)) {
+        entry = NULL;
+    }
+    rcu_read_unlock();
+    if (entry) {
+        PV("FLOWREFCNT %u ++: %u\n", entry->local_port,
+           refcount_read(&entry->refcnt));
     }
 
-    FUNLOCK();
-
-    return NULL;
+    return entry;
 }
 EXPORT_SYMBOL(flow_get_by_cep);
 
@@ -936,10 +971,10 @@ flow_get_ref(struct flow_entry *flow)
         return;
     }
 
-    FLOCK();
-    flow->refcnt++;
-    PV("FLOWREFCNT %u ++: %u\n", flow->local_port, flow->refcnt);
-    FUNLOCK();
+    /* The caller already owns a reference. */
+    refcount_inc(&flow->refcnt);
+    PV("FLOWREFCNT %u ++: %u\n", flow->local_port,
+       refcount_read(&flow->refcnt));
 }
 EXPORT_SYMBOL(flow_get_ref);
 
@@ -947,8 +982,9 @@ EXPORT_SYMBOL(flow_get_ref);
 static void
 flows_putq_add(struct flow_entry *flow, unsigned jdelta)
 {
-    flow->refcnt++;
-    PV("FLOWREFCNT %u ++: %u\n", flow->local_port, flow->refcnt);
+    refcount_inc(&flow->refcnt);
+    PV("FLOWREFCNT %u ++: %u\n", flow->local_port,
+       refcount_read(&flow->refcnt));
 
     if (flow->expires == ~0U) { /* don't insert twice */
         struct flow_entry *cur;
@@ -1023,13 +1059,17 @@ __flow_put(struct flow_entry *entry, bool lock)
     }
 
     if (lock) {
+        /* Fast path: this is not the last reference, and so
+         * FLOCK is not needed. */
+        if (refcount_dec_not_one(&entry->refcnt)) {
+            return;
+        }
         FLOCK();
     }
 
-    dtp = &entry->dtp;
+    dtp = entry->dtp;
 
-    entry->refcnt--;
-    if (entry->refcnt) {
+    if (!refcount_dec_and_test(&entry->refcnt)) {
         /* Flow is still being used by someone. */
         if (lock) {
             FUNLOCK();
@@ -1048,23 +1088,28 @@ __flow_put(struct flow_entry *entry, bool lock)
         (entry->flags & RL_FLOW_ALLOCATED) &&
         !(entry->flags & RL_FLOW_NEVER_BOUND)) {
         entry->flags |= RL_FLOW_DEL_POSTPONED;
-        spin_lock_bh(&dtp->lock);
-        if (dtp->cwq_len > 0 || !rb_list_empty(&dtp->rtxq)) {
-            PD("Flow removal postponed, cwq contains "
-               "%u PDUs and rtxq contains %u PDUs\n",
-               dtp->cwq_len, dtp->rtxq_len);
-
-            /* No one can write or read from this flow anymore, so there
-             * is no reason to have the inactivity timer running. */
-            del_timer(&dtp->snd_inact_tmr);
-            del_timer(&dtp->rcv_inact_tmr);
+        if (dtp) {
+            spin_lock_bh(&dtp->lock);
+            if (dtp->cwq_len > 0 || !rb_list_empty(&dtp->rtxq)) {
+                PD("Flow removal postponed, cwq contains "
+                   "%u PDUs and rtxq contains %u PDUs\n",
+                   dtp->cwq_len, dtp->rtxq_len);
+
+                /* No one can write or read from this flow anymore, so
+                 * there is no reason to have the inactivity timer
+                 * running. */
+                dtp->flags &= ~(DTP_F_SND_INACT | DTP_F_RCV_INACT);
+                rl_tw_del(&dtp->inact_tmr);
+            }
+            spin_unlock_bh(&dtp->lock);
         }
-        spin_unlock_bh(&dtp->lock);
 
         /* Reference counter is zero here, we need to reset it
-         * to 1 and let the delayed remove function do its job. */
-        entry->refcnt++;
-        PV("FLOWREFCNT %u ++: %u\n", entry->local_port, entry->refcnt);
+         * to 1 and let the delayed remove function do its job.
+         * Concurrent lookups fail until then, which is fine since
+         * the flow is already deallocated. */
+        refcount_set(&entry->refcnt, 1);
+        PV("FLOWREFCNT %u = 1\n", entry->local_port);
         flows_putq_add(entry, msecs_to_jiffies(5000) /* should be MPL */);
         if (lock) {
             FUNLOCK();
@@ -1072,12 +1117,11 @@ __flow_put(struct flow_entry *entry, bool lock)
         return;
     }
 
-    /* Detach from tables. */
-    hash_del(&entry->node);
-    bitmap_clear(rl_dm.port_id_bitmap, entry->local_port, 1);
+    /* Detach from tables, releasing the ids. Lockless readers may
+     * still see the entry until a grace period elapses, see flow_del(). */
+    idr_remove(&rl_dm.port_idr, entry->local_port);
     if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-        hash_del(&entry->node_cep);
-        bitmap_clear(rl_dm.cep_id_bitmap, entry->local_cep, 1);
+        idr_remove(&rl_dm.cep_idr, entry->local_cep);
     }
 
     /* Enqueue into the remove list and schedule the work. */
@@ -1090,6 +1134,14 @@ __flow_put(struct flow_entry *entry, bool lock)
 }
 EXPORT_SYMBOL(__flow_put);
 
+static void
+flow_free_rcu(struct rcu_head *rcu)
+{
+    struct flow_entry *entry = container_of(rcu, struct flow_entry, rcu);
+
+    rl_free(entry, RL_MT_FLOW);
+}
+
 /* Called in process context (workqueue worker). */
 static void
 flow_del(struct flow_entry *entry)
@@ -1102,7 +1154,7 @@ flow_del(struct flow_entry *entry)
     struct rl_buf *rb;
     struct dtp *dtp;
 
-    dtp        = &entry->dtp;
+    dtp        = entry->dtp;
     ipcp       = entry->txrx.ipcp;
     upper_ipcp = entry->upper.ipcp;
 
@@ -1111,10 +1163,18 @@ flow_del(struct flow_entry *entry)
         ipcp->ops.flow_deallocated(ipcp, entry);
     }
 
-    if (verbosity >= RL_VERB_VERY) {
-        dtp_dump(dtp);
+    if (ipcp->ops.flow_fini) {
+        ipcp->ops.flow_fini(ipcp, entry);
+    }
+
+    if (dtp) {
+        if (verbosity >= RL_VERB_VERY) {
+            dtp_dump(dtp);
+        }
+        dtp_fini(dtp);
+        rl_free(dtp, RL_MT_DTP);
+        entry->dtp = NULL;
     }
-    dtp_fini(dtp);
 
     rb_list_foreach_safe (rb, tmp, &entry->txrx.rx_q) {
         rb_list_del(rb);
@@ -1181,7 +1241,8 @@ flow_del(struct flow_entry *entry)
     rl_iodevs_probe_flow_references(entry);
 
     PD("flow entry %u removed\n", entry->local_port);
-    rl_free(entry, RL_MT_FLOW);
+    /* Lockless lookups may still be referencing the entry. */
+    call_rcu(&entry->rcu, flow_free_rcu);
 
     if (!ipcp->ops.flow_deallocated) {
         if (!ipcp->uipcp) {
@@ -1246,6 +1307,7 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
          gfp_t gfp)
 {
     struct flow_entry *entry;
+    int port, cep;
     int ret = 0;
 
     if (ipcp->flags & RL_K_IPCP_ZOMBIE) {
@@ -1258,28 +1320,29 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
         return -ENOMEM;
     }
 
+    idr_preload(gfp);
     FLOCK();
 
-    /* Try to alloc a port id and a cep id from the bitmaps, cep
-     * ids being allocated only if needed. */
-    entry->local_port = bitmap_find_next_zero_area(
-        rl_dm.port_id_bitmap, PORT_ID_BITMAP_SIZE, 0, 1, 0);
-    if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-        entry->local_cep = bitmap_find_next_zero_area(
-            rl_dm.cep_id_bitmap, CEP_ID_BITMAP_SIZE, 0, 1, 0);
-    } else {
-        entry->local_cep = 0;
+    /* Try to alloc a port id and a cep id, cep ids being allocated
+     * only if needed. The ids are reserved with a NULL entry, which
+     * is replaced once the flow entry is fully initialized. */
+    port = idr_alloc_cyclic(&rl_dm.port_idr, NULL, 0, PORT_ID_MAX,
+                            GFP_NOWAIT);
+    cep  = 0;
+    if (port >= 0 && (ipcp->flags & RL_K_IPCP_USE_CEP_IDS)) {
+        cep = idr_alloc_cyclic(&rl_dm.cep_idr, NULL, 0, CEP_ID_MAX, GFP_NOWAIT);
+        if (cep < 0) {
+            idr_remove(&rl_dm.port_idr, port);
+            port = cep;
+        }
     }
+    idr_preload_end();
 
-    if (entry->local_port < PORT_ID_BITMAP_SIZE &&
-        entry->local_cep < CEP_ID_BITMAP_SIZE) {
-        bitmap_set(rl_dm.port_id_bitmap, entry->local_port, 1);
+    if (port >= 0) {
+        entry->local_port = port;
+        entry->local_cep  = cep;
 
-        if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-            bitmap_set(rl_dm.cep_id_bitmap, entry->local_cep, 1);
-        }
-
-        /* Build and insert a flow entry in the hash table. */
+        /* Build the flow entry. */
         entry->local_appl  = rl_strdup(local_appl, GFP_ATOMIC, RL_MT_FLOW);
         entry->remote_appl = rl_strdup(remote_appl, GFP_ATOMIC, RL_MT_FLOW);
         entry->remote_port = RL_PORT_ID_NONE; /* Not valid. */
@@ -1290,24 +1353,26 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
             get_file(upper.rc->file);
         }
         entry->event_id = event_id;
-        entry->refcnt   = 1; /* Cogito, ergo sum. */
-        entry->flags    = RL_FLOW_PENDING | RL_FLOW_NEVER_BOUND;
+        refcount_set(&entry->refcnt, 1); /* Cogito, ergo sum. */
+        entry->flags = RL_FLOW_PENDING | RL_FLOW_NEVER_BOUND;
         memcpy(&entry->spec, flowspec, sizeof(*flowspec));
         INIT_LIST_HEAD(&entry->pduft_entries);
         txrx_init(&entry->txrx, ipcp);
-        hash_add(rl_dm.flow_table, &entry->node, entry->local_port);
-        if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-            hash_add(rl_dm.flow_table_by_cep, &entry->node_cep,
-                     entry->local_cep);
-        }
         entry->uid = rl_dm.uid_cnt++; /* generate an unique id */
         INIT_LIST_HEAD(&entry->node_rm);
         entry->expires = ~0U;
         rl_flow_stats_init(&entry->stats);
-        dtp_init(&entry->dtp);
 
-        entry->refcnt++; /* on behalf of the caller */
-        PV("FLOWREFCNT %u = %u\n", entry->local_port, entry->refcnt);
+        refcount_inc(&entry->refcnt); /* on behalf of the caller */
+        PV("FLOWREFCNT %u = %u\n", entry->local_port,
+           refcount_read(&entry->refcnt));
+
+        /* Publish the entry to lockless readers only once it is
+         * completely initialized. */
+        idr_replace(&rl_dm.port_idr, entry, entry->local_port);
+        if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
+            idr_replace(&rl_dm.cep_idr, entry, entry->local_cep);
+        }
 
         /* Start the unbound timer */
         flows_putq_add(entry, RL_UNBOUND_FLOW_TO);
@@ -1323,15 +1388,24 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
             if (ipcp->ops.flow_init) {
                 /* Let the IPCP do some
                  * specific initialization. */
-                ipcp->ops.flow_init(ipcp, entry);
+                ret = ipcp->ops.flow_init(ipcp, entry);
             }
         }
+
+        if (ret) {
+            /* The flow cannot be used, delete it. */
+            PE("Failed to initialize flow %u [%d]\n", entry->local_port, ret);
+            flows_putq_del(entry); /* match flows_putq_add() */
+            flow_put(entry);       /* on behalf of the caller */
+            flow_put(entry);       /* delete */
+            *pentry = NULL;
+        }
     } else {
         FUNLOCK();
 
         rl_free(entry, RL_MT_FLOW);
         *pentry = NULL;
-        ret     = -ENOSPC;
+        ret     = port; /* -ENOSPC or -ENOMEM */
     }
 
     return ret;
@@ -1341,11 +1415,10 @@ static void
 flow_rc_probe_references(struct rl_ctrl *rc)
 {
     struct flow_entry *flow;
-    struct hlist_node *tmp;
-    int bucket;
+    int port;
 
     FLOCK();
-    hash_for_each_safe(rl_dm.flow_table, bucket, tmp, flow, node)
+    idr_for_each_entry(&rl_dm.port_idr, flow, port)
     {
         if (flow->upper.rc == rc) {
             PE("Flow %u has a dangling reference to rc %p\n", flow->local_port,
@@ -1372,8 +1445,9 @@ flow_make_mortal(struct flow_entry *flow)
          * didn't do it, the flow would live forever with its refcount
          * set to 1. */
         flow->flags &= ~RL_FLOW_NEVER_BOUND;
-        flow->refcnt--;
-        PV("FLOWREFCNT %u --: %u\n", flow->local_port, flow->refcnt);
+        refcount_dec_not_one(&flow->refcnt);
+        PV("FLOWREFCNT %u --: %u\n", flow->local_port,
+           refcount_read(&flow->refcnt));
     }
 
     FUNLOCK();
@@ -1388,10 +1462,10 @@ ipcp_probe_references(struct ipcp_entry *ipcp)
 {
     {
         struct flow_entry *flow;
-        int bucket;
+        int port;
 
         FLOCK();
-        hash_for_each(rl_dm.flow_table, bucket, flow, node)
+        idr_for_each_entry(&rl_dm.port_idr, flow, port)
         {
             if (flow->txrx.ipcp == ipcp) {
                 PE("Flow %u has a horizontal dangling reference to ipcp %u\n",
@@ -1737,19 +1811,37 @@ rl_ipcp_destroy(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
-struct flows_fetch_q_entry {
+/* Send a page of fetch results to userspace. */
+static int
+rl_fetch_resp_send(struct rl_ctrl *rc, uint32_t event_id, rl_msg_t msg_type,
+                   void *entries, uint32_t len, uint16_t num_entries,
+                   uint32_t cursor, bool end)
+{
     struct rl_kmsg_flow_fetch_resp resp;
-    struct list_head node;
-};
+
+    memset(&resp, 0, sizeof(resp));
+    resp.msg_type    = msg_type;
+    resp.event_id    = event_id;
+    resp.end         = end;
+    resp.cursor      = cursor;
+    resp.num_entries = num_entries;
+    resp.entries.buf = entries;
+    resp.entries.len = len;
+
+    return rl_upqueue_append(rc, RLITE_MB(&resp), true);
+}
 
 static int
 rl_flow_fetch(struct rl_ctrl *rc, struct rl_msg_base *b_req)
 {
     struct rl_kmsg_flow_fetch *req = (struct rl_kmsg_flow_fetch *)b_req;
-    struct flows_fetch_q_entry *fqe;
-    struct flow_entry *entry;
-    int bucket;
-    int ret = -ENOMEM;
+    struct rl_flow_fetch_entry *entries;
+    unsigned int max = RL_FETCH_ENTRIES_MAXLEN / sizeof(*entries);
+    struct flow_entry *flow;
+    unsigned int n = 0;
+    int port       = req->cursor;
+    bool end       = false;
+    int ret;
 
     if (req->ipcp_id != 0xffff) {
         /* Validate req->ipcp_id. */
@@ -1761,142 +1853,156 @@ rl_flow_fetch(struct rl_ctrl *rc, struct rl_msg_base *b_req)
         ipcp_put(ipcp);
     }
 
-    FLOCK();
-
-    if (list_empty(&rc->flows_fetch_q)) {
-        hash_for_each(rl_dm.flow_table, bucket, entry, node)
-        {
-            if (req->ipcp_id != 0xffff &&
-                entry->txrx.ipcp->id != req->ipcp_id) {
-                /* Filter out this flow as user asked only for flows
-                 * belonging to a specific IPCP. */
-                continue;
-            }
+    if (req->max_entries && req->max_entries < max) {
+        max = req->max_entries;
+    }
 
-            fqe = rl_alloc(sizeof(*fqe), GFP_ATOMIC, RL_MT_FFETCH);
-            if (!fqe) {
-                PE("Out of memory\n");
-                break;
-            }
+    entries = rl_alloc(max * sizeof(*entries), GFP_KERNEL, RL_MT_FFETCH);
+    if (!entries) {
+        return -ENOMEM;
+    }
 
-            memset(fqe, 0, sizeof(*fqe));
-            list_add_tail(&fqe->node, &rc->flows_fetch_q);
+    /* Walk the port id space starting from the cursor, without holding
+     * FLOCK: each flow is pinned with a reference while its fields are
+     * copied, so that concurrent allocations and deallocations proceed
+     * undisturbed. */
+    while (n < max) {
+        bool alive;
 
-            fqe->resp.msg_type     = RLITE_KER_FLOW_FETCH_RESP;
-            fqe->resp.end          = 0;
-            fqe->resp.ipcp_id      = entry->txrx.ipcp->id;
-            fqe->resp.local_port   = entry->local_port;
-            fqe->resp.remote_port  = entry->remote_port;
-            fqe->resp.local_addr   = entry->txrx.ipcp->addr;
-            fqe->resp.remote_addr  = entry->remote_addr;
-            fqe->resp.spec         = entry->spec;
-            fqe->resp.flow_control = entry->cfg.dtcp.flow_control;
+        rcu_read_lock();
+        flow  = idr_get_next(&rl_dm.port_idr, &port);
+        alive = flow && refcount_inc_not_zero(&flow->refcnt);
+        rcu_read_unlock();
+        if (!flow) {
+            end = true;
+            break;
         }
-
-        fqe = rl_alloc(sizeof(*fqe), GFP_ATOMIC, RL_MT_FFETCH);
-        if (!fqe) {
-            PE("Out of memory\n");
-        } else {
-            memset(fqe, 0, sizeof(*fqe));
-            list_add_tail(&fqe->node, &rc->flows_fetch_q);
-            fqe->resp.msg_type = RLITE_KER_FLOW_FETCH_RESP;
-            fqe->resp.end      = 1;
+        port++;
+        if (!alive) {
+            continue;
         }
-    }
 
-    if (!list_empty(&rc->flows_fetch_q)) {
-        fqe = list_first_entry(&rc->flows_fetch_q, struct flows_fetch_q_entry,
-                               node);
-        list_del_init(&fqe->node);
-        fqe->resp.event_id = req->event_id;
-        ret                = rl_upqueue_append(rc, RLITE_MB(&fqe->resp), false);
-        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&fqe->resp));
-        rl_free(fqe, RL_MT_FFETCH);
+        if (req->ipcp_id == 0xffff || flow->txrx.ipcp->id == req->ipcp_id) {
+            struct rl_flow_fetch_entry *e = entries + n++;
+
+            e->ipcp_id      = flow->txrx.ipcp->id;
+            e->local_port   = flow->local_port;
+            e->remote_port  = flow->remote_port;
+            e->local_addr   = flow->txrx.ipcp->addr;
+            e->remote_addr  = flow->remote_addr;
+            e->spec         = flow->spec;
+            e->flow_control = flow->cfg.dtcp.flow_control;
+        }
+        flow_put(flow);
     }
 
-    FUNLOCK();
+    ret = rl_fetch_resp_send(rc, req->event_id, RLITE_KER_FLOW_FETCH_RESP,
+                             entries, n * sizeof(*entries), n, port, end);
+    rl_free(entries, RL_MT_FFETCH);
 
     return ret;
 }
 
-struct regs_fetch_q_entry {
-    struct rl_kmsg_reg_fetch_resp resp;
-    struct list_head node;
-};
+/* The registration cursor contains the IPCP id in the upper 8 bits
+ * and the position in the list of registered applications in the
+ * lower 24 bits. */
+#define REG_CURSOR_IDX_BITS 24
+#define REG_CURSOR_IDX_MASK ((1U << REG_CURSOR_IDX_BITS) - 1)
+#define REG_CURSOR(_id, _idx)                                                  \
+    (((uint32_t)(_id) << REG_CURSOR_IDX_BITS) | (_idx))
 
 static int
 rl_reg_fetch(struct rl_ctrl *rc, struct rl_msg_base *b_req)
 {
     struct rl_kmsg_reg_fetch *req = (struct rl_kmsg_reg_fetch *)b_req;
-    struct regs_fetch_q_entry *fqe;
-    struct registered_appl *appl;
-    struct ipcp_entry *ipcp;
-    int bucket;
-    int ret = -ENOMEM;
+    unsigned int max     = req->max_entries ? req->max_entries : ~0U;
+    unsigned int ipcp_id = req->cursor >> REG_CURSOR_IDX_BITS;
+    unsigned int skip    = req->cursor & REG_CURSOR_IDX_MASK;
+    uint32_t cursor      = 0;
+    unsigned int n       = 0;
+    unsigned int len     = 0;
+    bool end             = true;
+    char *entries;
+    int ret;
+
+    BUILD_BUG_ON(IPCP_ID_BITMAP_SIZE > (1 << (32 - REG_CURSOR_IDX_BITS)));
 
     if (req->ipcp_id != 0xffff) {
         /* Validate req->ipcp_id. */
-        ipcp = ipcp_get(req->ipcp_id);
+        struct ipcp_entry *ipcp = ipcp_get(req->ipcp_id);
+
         if (!ipcp) {
             return -EINVAL;
         }
         ipcp_put(ipcp);
     }
 
-    PLOCK();
+    entries = rl_alloc(RL_FETCH_ENTRIES_MAXLEN, GFP_KERNEL, RL_MT_FFETCH);
+    if (!entries) {
+        return -ENOMEM;
+    }
 
-    if (list_empty(&rc->regs_fetch_q)) {
-        hash_for_each(rl_dm.ipcp_table, bucket, ipcp, node)
-        {
-            if (req->ipcp_id != 0xffff && ipcp->id != req->ipcp_id) {
-                /* Filter out this ipcp as user asked only for application
-                 * names registered within a specific IPCP. */
+    /* Scan the IPCPs in id order, locking one of them at a time. */
+    for (; end && ipcp_id < IPCP_ID_BITMAP_SIZE; ipcp_id++, skip = 0) {
+        struct registered_appl *appl;
+        struct ipcp_entry *ipcp;
+        unsigned int idx = 0;
+
+        if (req->ipcp_id != 0xffff && ipcp_id != req->ipcp_id) {
+            /* Filter out this ipcp as user asked only for application
+             * names registered within a specific IPCP. */
+            continue;
+        }
+
+        ipcp = ipcp_get(ipcp_id);
+        if (!ipcp) {
+            continue;
+        }
+
+        RALOCK(ipcp);
+        list_for_each_entry (appl, &ipcp->registered_appls, node) {
+            struct rl_reg_fetch_entry *e;
+            size_t namelen;
+
+            if (idx++ < skip) {
                 continue;
             }
 
-            RALOCK(ipcp);
-            list_for_each_entry (appl, &ipcp->registered_appls, node) {
-                fqe = rl_alloc(sizeof(*fqe), GFP_ATOMIC, RL_MT_FFETCH);
-                if (!fqe) {
-                    PE("Out of memory\n");
+            namelen = strlen(appl->name) + 1;
+            if (n == 0 && sizeof(*e) + namelen > RL_FETCH_ENTRIES_MAXLEN) {
+                /* This entry does not fit even in an empty page,
+                 * truncate the name, or the client would ask for
+                 * it again forever. */
+                namelen = RL_FETCH_ENTRIES_MAXLEN - sizeof(*e);
+            }
+            if (n == max ||
+                len + sizeof(*e) + namelen > RL_FETCH_ENTRIES_MAXLEN) {
+                /* This page is full, resume from this entry. */
+                if (unlikely(idx - 1 > REG_CURSOR_IDX_MASK)) {
+                    PE("Too many registrations for IPCP %u\n", ipcp_id);
                     break;
                 }
-
-                memset(fqe, 0, sizeof(*fqe));
-                list_add_tail(&fqe->node, &rc->regs_fetch_q);
-
-                fqe->resp.msg_type = RLITE_KER_REG_FETCH_RESP;
-                fqe->resp.end      = 0;
-                fqe->resp.ipcp_id  = ipcp->id;
-                fqe->resp.pending  = appl->state != APPL_REG_COMPLETE;
-                fqe->resp.appl_name =
-                    rl_strdup(appl->name, GFP_ATOMIC, RL_MT_UTILS);
+                cursor = REG_CURSOR(ipcp_id, idx - 1);
+                end    = false;
+                break;
             }
-            RAUNLOCK(ipcp);
-        }
 
-        fqe = rl_alloc(sizeof(*fqe), GFP_ATOMIC, RL_MT_FFETCH);
-        if (!fqe) {
-            PE("Out of memory\n");
-        } else {
-            memset(fqe, 0, sizeof(*fqe));
-            list_add_tail(&fqe->node, &rc->regs_fetch_q);
-            fqe->resp.msg_type = RLITE_KER_REG_FETCH_RESP;
-            fqe->resp.end      = 1;
+            e           = (struct rl_reg_fetch_entry *)(entries + len);
+            e->ipcp_id  = ipcp->id;
+            e->pending  = appl->state != APPL_REG_COMPLETE;
+            e->name_len = namelen;
+            memcpy(e + 1, appl->name, namelen - 1);
+            ((char *)(e + 1))[namelen - 1] = '\0';
+            len += sizeof(*e) + namelen;
+            n++;
         }
+        RAUNLOCK(ipcp);
+        ipcp_put(ipcp);
     }
 
-    if (!list_empty(&rc->regs_fetch_q)) {
-        fqe = list_first_entry(&rc->regs_fetch_q, struct regs_fetch_q_entry,
-                               node);
-        list_del_init(&fqe->node);
-        fqe->resp.event_id = req->event_id;
-        ret                = rl_upqueue_append(rc, RLITE_MB(&fqe->resp), false);
-        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&fqe->resp));
-        rl_free(fqe, RL_MT_FFETCH);
-    }
-
-    PUNLOCK();
+    ret = rl_fetch_resp_send(rc, req->event_id, RLITE_KER_REG_FETCH_RESP,
+                             entries, len, n, cursor, end);
+    rl_free(entries, RL_MT_FFETCH);
 
     return ret;
 }
@@ -1999,9 +2105,10 @@ rl_ipcp_pduft_mod(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
          * anymore (so references to flows in the pduft will stay there forever,
          * and so the IPCPs bound to them). */
         if (req->msg_type == RLITE_KER_IPCP_PDUFT_SET) {
-            ret = ipcp->ops.pduft_set(ipcp, req->dst_addr, flow);
+            ret = ipcp->ops.pduft_set(ipcp, req->dst_addr, flow, req->flags);
         } else { /* RLITE_KER_IPCP_PDUFT_DEL */
-            ret = ipcp->ops.pduft_del_addr(ipcp, req->dst_addr);
+            ret = ipcp->ops.pduft_del_addr(ipcp, req->dst_addr, flow,
+                                           req->flags);
         }
         mutex_unlock(&ipcp->lock);
     }
@@ -2010,13 +2117,91 @@ rl_ipcp_pduft_mod(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     ipcp_put(ipcp);
 
     if (ret == 0) {
-        PV("Set IPC process %u PDUFT entry: %llu --> %u\n", req->ipcp_id,
-           (unsigned long long)req->dst_addr, req->local_port);
+        PV("Set IPC process %u PDUFT entry: %llu --> %u%s\n", req->ipcp_id,
+           (unsigned long long)req->dst_addr, req->local_port,
+           (req->flags & RL_PDUFT_F_MCAST)
+               ? " (multicast)"
+               : ((req->flags & RL_PDUFT_F_BACKUP) ? " (backup)" : ""));
     }
 
     return ret;
 }
 
+static int
+rl_ipcp_pduft_batch(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_pduft_batch *req =
+        (struct rl_kmsg_ipcp_pduft_batch *)bmsg;
+    const struct rl_pduft_batch_entry *entries = req->entries.buf;
+    struct pduft_mod *mods                     = NULL;
+    unsigned int num_mods                      = 0;
+    struct ipcp_entry *ipcp;
+    int ret = -EINVAL; /* Report failure by default. */
+    unsigned int i;
+
+    ipcp = ipcp_get(req->ipcp_id);
+
+    if (req->entries.len != (size_t)req->num_entries * sizeof(*entries) ||
+        !ipcp || !ipcp->ops.pduft_mod_batch ||
+        (ipcp->flags & RL_K_IPCP_ZOMBIE)) {
+        goto out;
+    }
+
+    mods = rl_alloc(req->num_entries * sizeof(*mods), GFP_KERNEL, RL_MT_MISC);
+    if (!mods) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Resolve the ports before taking any lock. As in rl_ipcp_pduft_mod(),
+     * only the flows used by the requesting IPCP are accepted. Nothing
+     * is applied if any entry is invalid. */
+    ret = 0;
+    for (i = 0; i < req->num_entries; i++) {
+        const struct rl_pduft_batch_entry *e = entries + i;
+        struct flow_entry *flow              = flow_get(e->local_port);
+
+        if (!flow || flow->upper.ipcp != ipcp ||
+            (e->op != RL_PDUFT_OP_SET && e->op != RL_PDUFT_OP_DEL)) {
+            PE("Invalid PDUFT modification (addr=%llu, port=%u, op=%u)\n",
+               (unsigned long long)e->dst_addr, e->local_port, e->op);
+            flow_put(flow);
+            ret = -EINVAL;
+            break;
+        }
+        mods[num_mods].dst_addr = e->dst_addr;
+        mods[num_mods].flow     = flow;
+        mods[num_mods].op       = e->op;
+        mods[num_mods].flags    = e->flags;
+        mods[num_mods].qos_id   = e->qos_id;
+        num_mods++;
+    }
+
+    if (!ret && num_mods) {
+        mutex_lock(&ipcp->lock);
+        ret = ipcp->ops.pduft_mod_batch(ipcp, mods, num_mods);
+        mutex_unlock(&ipcp->lock);
+        PV("Applied %u PDUFT modifications for IPC process %u\n", num_mods,
+           req->ipcp_id);
+    }
+
+    for (i = 0; i < num_mods; i++) {
+        flow_put(mods[i].flow);
+    }
+
+out:
+    if (mods) {
+        rl_free(mods, RL_MT_MISC);
+    }
+    if (req->entries.buf) {
+        /* Buffers are not released by rl_msg_free(). */
+        rl_free(req->entries.buf, RL_MT_UTILS);
+    }
+    ipcp_put(ipcp);
+
+    return ret;
+}
+
 static int
 rl_ipcp_pduft_flush(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -2248,27 +2433,29 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
         ret = flow->txrx.ipcp->ops.flow_get_stats(flow, &resp.stats);
     }
 
-    /* Copy in DTP state. */
-    dtp                             = &flow->dtp;
-    resp.dtp.snd_lwe                = dtp->snd_lwe;
-    resp.dtp.snd_rwe                = dtp->snd_rwe;
-    resp.dtp.next_seq_num_to_send   = dtp->next_seq_num_to_send;
-    resp.dtp.last_seq_num_sent      = dtp->last_seq_num_sent;
-    resp.dtp.last_ctrl_seq_num_rcvd = dtp->last_ctrl_seq_num_rcvd;
-    resp.dtp.cwq_len                = dtp->cwq_len;
-    resp.dtp.max_cwq_len            = dtp->max_cwq_len;
-    resp.dtp.rtxq_len               = dtp->rtxq_len;
-    resp.dtp.max_rtxq_len           = dtp->max_rtxq_len;
-    resp.dtp.rtt                    = dtp->rtt;
-    resp.dtp.rtt_stddev             = dtp->rtt_stddev;
-    resp.dtp.rcv_lwe                = dtp->rcv_lwe;
-    resp.dtp.rcv_lwe_priv           = dtp->rcv_lwe_priv;
-    resp.dtp.rcv_rwe                = dtp->rcv_rwe;
-    resp.dtp.max_seq_num_rcvd       = dtp->max_seq_num_rcvd;
-    resp.dtp.last_snd_data_ack      = dtp->last_snd_data_ack;
-    resp.dtp.next_snd_ctl_seq       = dtp->next_snd_ctl_seq;
-    resp.dtp.last_lwe_sent          = dtp->last_lwe_sent;
-    resp.dtp.seqq_len               = dtp->seqq_len;
+    /* Copy in DTP state, if any. */
+    dtp = flow->dtp;
+    if (dtp) {
+        resp.dtp.snd_lwe                = dtp->snd_lwe;
+        resp.dtp.snd_rwe                = dtp->snd_rwe;
+        resp.dtp.next_seq_num_to_send   = dtp->next_seq_num_to_send;
+        resp.dtp.last_seq_num_sent      = dtp->last_seq_num_sent;
+        resp.dtp.last_ctrl_seq_num_rcvd = dtp->last_ctrl_seq_num_rcvd;
+        resp.dtp.cwq_len                = dtp->cwq_len;
+        resp.dtp.max_cwq_len            = dtp->max_cwq_len;
+        resp.dtp.rtxq_len               = dtp->rtxq_len;
+        resp.dtp.max_rtxq_len           = dtp->max_rtxq_len;
+        resp.dtp.rtt                    = dtp->rtt;
+        resp.dtp.rtt_stddev             = dtp->rtt_stddev;
+        resp.dtp.rcv_lwe                = dtp->rcv_lwe;
+        resp.dtp.rcv_lwe_priv           = dtp->rcv_lwe_priv;
+        resp.dtp.rcv_rwe                = dtp->rcv_rwe;
+        resp.dtp.max_seq_num_rcvd       = dtp->max_seq_num_rcvd;
+        resp.dtp.last_snd_data_ack      = dtp->last_snd_data_ack;
+        resp.dtp.next_snd_ctl_seq       = dtp->next_snd_ctl_seq;
+        resp.dtp.last_lwe_sent          = dtp->last_lwe_sent;
+        resp.dtp.seqq_len               = dtp->seqq_len;
+    }
 
     flow_put(flow);
 
@@ -2807,10 +2994,6 @@ rl_fa_resp_arrived(struct ipcp_entry *ipcp, rl_port_t local_port,
     }
     rc = flow_entry->upper.rc;
     flow_entry->flags &= ~RL_FLOW_PENDING;
-    if (response == 0) {
-        flow_entry->flags |= RL_FLOW_ALLOCATED;
-        flow_entry->upper.rc = NULL;
-    }
     flow_entry->remote_port = remote_port;
     flow_entry->remote_cep  = remote_cep;
     flow_entry->remote_addr = remote_addr;
@@ -2821,10 +3004,24 @@ rl_fa_resp_arrived(struct ipcp_entry *ipcp, rl_port_t local_port,
         if (ipcp->ops.flow_init) {
             /* Let the IPCP do some
              * specific initialization. */
-            ipcp->ops.flow_init(ipcp, flow_entry);
+            int err = ipcp->ops.flow_init(ipcp, flow_entry);
+
+            if (err && response == 0) {
+                /* The flow cannot be used, turn this into a negative
+                 * response. */
+                PE("Failed to initialize flow %u [%d]\n", local_port, err);
+                response = 1;
+            }
         }
     }
 
+    if (response == 0) {
+        spin_lock_bh(&flow_entry->txrx.rx_lock);
+        flow_entry->flags |= RL_FLOW_ALLOCATED;
+        flow_entry->upper.rc = NULL;
+        spin_unlock_bh(&flow_entry->txrx.rx_lock);
+    }
+
     PD("Flow allocation response arrived to IPC process %u, "
        "port-id %u, remote addr %llu\n",
        ipcp->id, local_port, (long long unsigned)remote_addr);
@@ -2874,6 +3071,7 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_IPCP_PDUFT_SET]        = rl_ipcp_pduft_mod,
     [RLITE_KER_IPCP_PDUFT_DEL]        = rl_ipcp_pduft_mod,
     [RLITE_KER_IPCP_PDUFT_FLUSH]      = rl_ipcp_pduft_flush,
+    [RLITE_KER_IPCP_PDUFT_BATCH]      = rl_ipcp_pduft_batch,
     [RLITE_KER_APPL_REGISTER]         = rl_appl_register,
     [RLITE_KER_APPL_REGISTER_RESP]    = rl_appl_register_resp,
     [RLITE_KER_FA_REQ]                = rl_fa_req,
@@ -2941,6 +3139,7 @@ rl_ctrl_write(struct file *f, const char __user *ubuf, size_t len, loff_t *ppos)
     case RLITE_KER_IPCP_CONFIG:
     case RLITE_KER_IPCP_PDUFT_SET:
     case RLITE_KER_IPCP_PDUFT_FLUSH:
+    case RLITE_KER_IPCP_PDUFT_BATCH:
     case RLITE_KER_APPL_REGISTER_RESP:
     case RLITE_KER_IPCP_UIPCP_SET:
     case RLITE_KER_UIPCP_FA_REQ_ARRIVED:
@@ -2974,19 +3173,26 @@ static ssize_t
 rl_ctrl_read(struct file *f, char __user *buf, size_t len, loff_t *ppos)
 {
     DECLARE_WAITQUEUE(wait, current);
-    struct upqueue_entry *entry;
-    struct rl_ctrl *rc = (struct rl_ctrl *)f->private_data;
-    bool blocking      = !(f->f_flags & O_NONBLOCK);
-    int ret            = 0;
+    struct rl_ctrl *rc    = (struct rl_ctrl *)f->private_data;
+    bool blocking         = !(f->f_flags & O_NONBLOCK);
+    bool batch            = rc->flags & RL_F_BATCH;
+    unsigned int consumed = 0;
+    unsigned int copylen  = 0;
+    unsigned int head     = 0;
+    int ret               = 0;
+
+    if (mutex_lock_interruptible(&rc->upqueue_rmutex)) {
+        return -ERESTARTSYS;
+    }
 
     if (blocking) {
         add_wait_queue(&rc->upqueue_wqh, &wait);
     }
-    while (len) {
+    for (;;) {
         current->state = TASK_INTERRUPTIBLE;
 
         spin_lock(&rc->upqueue_lock);
-        if (list_empty(&rc->upqueue)) {
+        if (rc->upqueue_size == 0) {
             /* No pending messages? Let's sleep. */
             spin_unlock(&rc->upqueue_lock);
 
@@ -3004,24 +3210,37 @@ rl_ctrl_read(struct file *f, char __user *buf, size_t len, loff_t *ppos)
             continue;
         }
 
-        entry = list_first_entry(&rc->upqueue, struct upqueue_entry, node);
-        if (len < entry->serlen) {
-            /* Not enough space? Don't pop the entry from the upqueue. */
-            ret = -ENOBUFS;
-        } else if (unlikely(copy_to_user(buf, entry->sermsg, entry->serlen))) {
-            ret = -EFAULT;
-        } else {
-            ret = entry->serlen;
-            *ppos += ret;
-
-            /* Unlink and free the upqueue entry and the associated message. */
-            list_del_init(&entry->node);
-            rc->upqueue_size -= upqentry_size(entry);
-            rl_free(entry->sermsg, RL_MT_UPQ);
-            rl_free(entry, RL_MT_UPQ);
+        /* Collect as many whole messages as fit into the user buffer,
+         * stopping at the end of the ring. In batch mode each message
+         * is preceded by its length, otherwise we return a single
+         * message. */
+        upqueue_head_wrap(rc);
+        head = rc->upqueue_head;
+        while (consumed < rc->upqueue_size &&
+               head + consumed + sizeof(upqueue_hdr_t) <=
+                   RL_UPQUEUE_SIZE_MAX) {
+            upqueue_hdr_t hdr;
+            unsigned int mlen;
+
+            memcpy(&hdr, rc->upqueue + head + consumed, sizeof(hdr));
+            if (hdr == 0) {
+                break; /* wrap marker */
+            }
+            mlen = batch ? sizeof(hdr) + hdr : hdr;
+            if (copylen + mlen > len) {
+                break;
+            }
+            copylen += mlen;
+            consumed += sizeof(hdr) + hdr;
+            if (!batch) {
+                break;
+            }
         }
-
         spin_unlock(&rc->upqueue_lock);
+        if (copylen == 0) {
+            /* Not enough space? Don't pop the message from the upqueue. */
+            ret = -ENOBUFS;
+        }
         break;
     }
 
@@ -3030,13 +3249,31 @@ rl_ctrl_read(struct file *f, char __user *buf, size_t len, loff_t *ppos)
         remove_wait_queue(&rc->upqueue_wqh, &wait);
     }
 
-    if (ret > 0) {
-        /* Some space was freed up in the upqueue: wake up processes
-         * blocked on rl_upqueue_append(). */
-        wake_up_interruptible_poll(&rc->upqueue_wqh,
-                                   POLLOUT | POLLWRNORM | POLLWRBAND);
+    if (ret == 0) {
+        /* Writers only append to the free part of the ring, and
+         * readers are serialized, so we can copy out of the lock. */
+        if (unlikely(copy_to_user(
+                buf, rc->upqueue + head + (batch ? 0 : sizeof(upqueue_hdr_t)),
+                copylen))) {
+            ret = -EFAULT;
+        } else {
+            ret = copylen;
+            *ppos += ret;
+
+            spin_lock(&rc->upqueue_lock);
+            rc->upqueue_head += consumed;
+            rc->upqueue_size -= consumed;
+            spin_unlock(&rc->upqueue_lock);
+
+            /* Some space was freed up in the upqueue: wake up processes
+             * blocked on rl_upqueue_append(). */
+            wake_up_interruptible_poll(&rc->upqueue_wqh,
+                                       POLLOUT | POLLWRNORM | POLLWRBAND);
+        }
     }
 
+    mutex_unlock(&rc->upqueue_rmutex);
+
     return ret;
 }
 
@@ -3049,7 +3286,7 @@ rl_ctrl_poll(struct file *f, poll_table *wait)
     poll_wait(f, &rc->upqueue_wqh, wait);
 
     spin_lock(&rc->upqueue_lock);
-    if (!list_empty(&rc->upqueue)) {
+    if (rc->upqueue_size) {
         mask |= POLLIN | POLLRDNORM;
     }
     spin_unlock(&rc->upqueue_lock);
@@ -3098,15 +3335,19 @@ rl_ctrl_open(struct inode *inode, struct file *f)
         return -ENOMEM;
     }
 
-    f->private_data = rc;
-    rc->file        = f;
-    INIT_LIST_HEAD(&rc->upqueue);
+    rc->upqueue = rl_alloc(RL_UPQUEUE_SIZE_MAX, GFP_KERNEL, RL_MT_UPQ);
+    if (!rc->upqueue) {
+        rl_free(rc, RL_MT_CTLDEV);
+        return -ENOMEM;
+    }
+
+    f->private_data  = rc;
+    rc->file         = f;
     rc->upqueue_size = 0;
+    rc->upqueue_head = rc->upqueue_tail = 0;
     spin_lock_init(&rc->upqueue_lock);
     init_waitqueue_head(&rc->upqueue_wqh);
-
-    INIT_LIST_HEAD(&rc->flows_fetch_q);
-    INIT_LIST_HEAD(&rc->regs_fetch_q);
+    mutex_init(&rc->upqueue_rmutex);
 
     rc->handlers = rl_ctrl_handlers;
 
@@ -3131,41 +3372,7 @@ rl_ctrl_release(struct inode *inode, struct file *f)
     application_del_by_rc(rc);
     flow_rc_probe_references(rc);
 
-    /* Drain upqueue. */
-    {
-        struct upqueue_entry *ue, *uet;
-
-        list_for_each_entry_safe (ue, uet, &rc->upqueue, node) {
-            list_del_init(&ue->node);
-            rl_free(ue->sermsg, RL_MT_UPQ);
-            rl_free(ue, RL_MT_UPQ);
-        }
-    }
-
-    /* Drain flows-fetch queue. */
-    {
-        struct flows_fetch_q_entry *fqe, *fqet;
-
-        list_for_each_entry_safe (fqe, fqet, &rc->flows_fetch_q, node) {
-            list_del_init(&fqe->node);
-            rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX,
-                        RLITE_MB(&fqe->resp));
-            rl_free(fqe, RL_MT_FFETCH);
-        }
-    }
-
-    /* Drain regs-fetch queue. */
-    {
-        struct regs_fetch_q_entry *fqe, *fqet;
-
-        list_for_each_entry_safe (fqe, fqet, &rc->regs_fetch_q, node) {
-            list_del_init(&fqe->node);
-            rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX,
-                        RLITE_MB(&fqe->resp));
-            rl_free(fqe, RL_MT_FFETCH);
-        }
-    }
-
+    rl_free(rc->upqueue, RL_MT_UPQ);
     rl_free(rc, RL_MT_CTLDEV);
     f->private_data = NULL;
 
@@ -3234,10 +3441,8 @@ rlite_init(void)
 
     bitmap_zero(rl_dm.ipcp_id_bitmap, IPCP_ID_BITMAP_SIZE);
     hash_init(rl_dm.ipcp_table);
-    bitmap_zero(rl_dm.port_id_bitmap, PORT_ID_BITMAP_SIZE);
-    hash_init(rl_dm.flow_table);
-    bitmap_zero(rl_dm.cep_id_bitmap, CEP_ID_BITMAP_SIZE);
-    hash_init(rl_dm.flow_table_by_cep);
+    idr_init(&rl_dm.port_idr);
+    idr_init(&rl_dm.cep_idr);
     mutex_init(&rl_dm.general_lock);
     spin_lock_init(&rl_dm.flows_lock);
     spin_lock_init(&rl_dm.ipcps_lock);
@@ -3281,6 +3486,9 @@ rlite_fini(void)
     del_timer(&rl_dm.flows_putq_tmr);
     cancel_work_sync(&rl_dm.flows_removew);
     cancel_work_sync(&rl_dm.appl_removew);
+    rcu_barrier(); /* wait for flow_free_rcu() */
+    idr_destroy(&rl_dm.port_idr);
+    idr_destroy(&rl_dm.cep_idr);
     misc_deregister(&rl_io_misc);
     misc_deregister(&rl_ctrl_misc);
 }
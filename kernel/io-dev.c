@@ -101,9 +101,6 @@ tx_completion_func(unsigned long arg)
     }
 }
 
-/* Userspace queue threshold in bytes. */
-#define RL_RXQ_SIZE_MAX (1 << 20)
-
 int
 rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                struct rl_buf *rb, bool qlimit)
@@ -146,6 +143,74 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
 }
 EXPORT_SYMBOL(rl_sdu_rx_flow);
 
+/* Same as rl_sdu_rx_flow(), but for a list of SDUs received on the same
+ * flow. The upper IPCP (or the application rx queue lock) is invoked
+ * (taken) only once. The list is empty on return. */
+int
+rl_sdu_rx_flow_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                     struct rb_list *rbs, bool qlimit)
+{
+    struct ipcp_entry *upper_ipcp = flow->upper.ipcp;
+    struct rl_buf *rb, *tmp;
+    struct txrx *txrx;
+
+    if (rb_list_empty(rbs)) {
+        return 0;
+    }
+
+    if (upper_ipcp) {
+        /* The flow is used by an upper IPCP. */
+        if (upper_ipcp->ops.sdu_rx_batch) {
+            upper_ipcp->ops.sdu_rx_batch(upper_ipcp, rbs, flow);
+        } else {
+            struct rb_list mgmtq;
+
+            rb_list_init(&mgmtq);
+            rb_list_foreach_safe (rb, tmp, rbs) {
+                rb_list_del(rb);
+                rb = upper_ipcp->ops.sdu_rx(upper_ipcp, rb, flow);
+                if (unlikely(rb != NULL)) {
+                    rb_list_enq(rb, &mgmtq);
+                }
+            }
+            rb_list_foreach_safe (rb, tmp, &mgmtq) {
+                rb_list_del(rb);
+                rb_list_enq(rb, rbs);
+            }
+        }
+
+        if (likely(rb_list_empty(rbs))) {
+            /* All the rbs consumed. */
+            return 0;
+        }
+
+        /* Management SDUs to be queued to userspace. */
+        txrx = upper_ipcp->mgmt_txrx;
+    } else {
+        txrx = &flow->txrx;
+    }
+
+    spin_lock_bh(&txrx->rx_lock);
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        rb_list_del(rb);
+        if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
+            RPD(2,
+                "dropping PDU [length %lu] to avoid userspace rx queue "
+                "overrun\n",
+                (long unsigned)rb->len);
+            rl_buf_free(rb);
+        } else {
+            rb_list_enq(rb, &txrx->rx_q);
+            txrx->rx_qsize += rl_buf_truesize(rb);
+        }
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+    wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_sdu_rx_flow_batch);
+
 int
 rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port)
 {
@@ -182,6 +247,49 @@ rl_sdu_rx_shortcut(struct ipcp_entry *ipcp, struct rl_buf *rb)
 }
 EXPORT_SYMBOL(rl_sdu_rx_shortcut);
 
+/* Write a list of SDUs on 'flow', falling back to the per-SDU
+ * sdu_write operation if the IPCP does not support batching.
+ * Returns -EAGAIN if some SDUs were not written; those are left
+ * in 'rbs' and the caller keeps their ownership. */
+int
+rl_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                   struct rb_list *rbs, bool maysleep)
+{
+    if (ipcp->ops.sdu_write_batch) {
+        return ipcp->ops.sdu_write_batch(ipcp, flow, rbs, maysleep);
+    }
+
+    return __rl_sdu_write_batch(ipcp, flow, rbs, maysleep);
+}
+EXPORT_SYMBOL(rl_sdu_write_batch);
+
+/* Per-SDU fallback for rl_sdu_write_batch(), also usable by the
+ * sdu_write_batch implementations for their slow paths. */
+int
+__rl_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                     struct rb_list *rbs, bool maysleep)
+{
+    int ret = 0;
+
+    while (!rb_list_empty(rbs)) {
+        struct rl_buf *rb = rb_list_front(rbs);
+        int err;
+
+        rb_list_del(rb);
+        err = ipcp->ops.sdu_write(ipcp, flow, rb, maysleep);
+        if (unlikely(err == -EAGAIN)) {
+            rb_list_push(rb, rbs);
+            return err;
+        }
+        if (unlikely(err && !ret)) {
+            ret = err;
+        }
+    }
+
+    return ret;
+}
+EXPORT_SYMBOL(__rl_sdu_write_batch);
+
 static void
 rl_write_restart_wqh(struct ipcp_entry *ipcp, wait_queue_head_t *wqh)
 {
@@ -360,6 +468,16 @@ rl_io_write_iter(struct kiocb *iocb,
                 break;
             }
 
+            if (!lower_flow) {
+                /* The PDU has already been replicated to the members
+                 * of a multicast group. */
+                rl_buf_free(rb);
+                something_sent = true;
+                left -= copylen;
+                tot += copylen;
+                continue;
+            }
+
             /* Prepare to write to an N-1 flow. */
             ipcp = lower_ipcp;
             flow = lower_flow;
@@ -37,8 +37,8 @@ static const char *mt_names[] = {
     [RL_MT_SHIM] = "SHIM",       [RL_MT_UPQ] = "UPQ",
     [RL_MT_DIF] = "DIF",         [RL_MT_IPCP] = "IPCP",
     [RL_MT_REGAPP] = "REGAPP",   [RL_MT_FLOW] = "FLOW",
-    [RL_MT_CTLDEV] = "CTLDEV",   [RL_MT_IODEV] = "IODEV",
-    [RL_MT_MISC] = "MISC",
+    [RL_MT_DTP] = "DTP",         [RL_MT_CTLDEV] = "CTLDEV",
+    [RL_MT_IODEV] = "IODEV",     [RL_MT_MISC] = "MISC",
 };
 
 void *
@@ -87,6 +87,11 @@ rl_memtrack_dump_stats(void)
     for (i = 0; i < RL_MT_MAX; i++) {
         PI("    %-8s:%8d\n", mt_names[i], atomic_read(mt_count + i));
     }
+
+    /* Per-flow footprint, without and with DTP state. DTP state used
+     * to be embedded in every flow entry. */
+    PI("Per-flow bytes: %zu (%zu with DTP)\n", sizeof(struct flow_entry),
+       sizeof(struct flow_entry) + sizeof(struct dtp));
 }
 
 #endif /* RL_MEMTRACK */
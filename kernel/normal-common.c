@@ -28,20 +28,180 @@
 #include "rlite/utils.h"
 #include "rlite-kernel.h"
 
+static void
+rl_tw_tick(unsigned long arg)
+{
+    struct rl_tw *tw  = (struct rl_tw *)arg;
+    unsigned long now = jiffies;
+    struct rl_tw_entry *e, *tmp;
+    struct list_head expired;
+    unsigned int n = 0;
+
+    INIT_LIST_HEAD(&expired);
+
+    spin_lock_bh(&tw->lock);
+
+    /* Collect the expired entries from all the slots between the last
+     * tick and now. If we are late by more than a whole revolution,
+     * all the slots have been scanned already. */
+    while (!time_after(tw->clk, now) && n++ < RL_TW_SIZE) {
+        struct list_head *slot = &tw->slots[tw->clk & RL_TW_MASK];
+
+        list_for_each_entry_safe (e, tmp, slot, node) {
+            if (!time_after(e->expires, now)) {
+                list_move_tail(&e->node, &expired);
+            }
+        }
+        tw->clk++;
+    }
+    if (!time_after(tw->clk, now)) {
+        tw->clk = now + 1;
+    }
+
+    /* Run the callbacks without holding the lock, so that they can
+     * rearm their own entry or the other ones. Entries still in the
+     * 'expired' list can be deleted or rearmed concurrently. */
+    while (!list_empty(&expired)) {
+        e = list_first_entry(&expired, struct rl_tw_entry, node);
+        list_del_init(&e->node);
+        tw->count--;
+        tw->running = e;
+        spin_unlock_bh(&tw->lock);
+        e->function(e->data);
+        spin_lock_bh(&tw->lock);
+        tw->running = NULL;
+    }
+
+    if (tw->count) {
+        mod_timer(&tw->tmr, tw->clk);
+    } else {
+        tw->armed = false;
+    }
+
+    spin_unlock_bh(&tw->lock);
+}
+
+void
+rl_tw_init(struct rl_tw *tw)
+{
+    int i;
+
+    spin_lock_init(&tw->lock);
+    for (i = 0; i < RL_TW_SIZE; i++) {
+        INIT_LIST_HEAD(&tw->slots[i]);
+    }
+    tw->clk     = jiffies;
+    tw->count   = 0;
+    tw->armed   = false;
+    tw->running = NULL;
+    setup_timer(&tw->tmr, rl_tw_tick, (unsigned long)tw);
+}
+EXPORT_SYMBOL(rl_tw_init);
+
+/* All the entries must have been deleted already. */
+void
+rl_tw_fini(struct rl_tw *tw)
+{
+    del_timer_sync(&tw->tmr);
+    if (tw->count) {
+        PE("%u timer wheel entries still pending\n", tw->count);
+    }
+}
+EXPORT_SYMBOL(rl_tw_fini);
+
+void
+rl_tw_entry_init(struct rl_tw_entry *e, struct rl_tw *tw)
+{
+    INIT_LIST_HEAD(&e->node);
+    e->expires  = 0;
+    e->function = NULL;
+    e->data     = 0;
+    e->tw       = tw;
+}
+EXPORT_SYMBOL(rl_tw_entry_init);
+
+/* Start the entry or change its expiration time, like mod_timer(). */
+void
+rl_tw_mod(struct rl_tw_entry *e, unsigned long expires)
+{
+    struct rl_tw *tw = e->tw;
+    unsigned long slot;
+
+    spin_lock_bh(&tw->lock);
+    if (rl_tw_pending(e)) {
+        list_del(&e->node);
+    } else {
+        tw->count++;
+    }
+    if (!tw->armed) {
+        /* The wheel was idle, restart from the current time. */
+        tw->clk   = jiffies;
+        tw->armed = true;
+        mod_timer(&tw->tmr, tw->clk);
+    }
+    e->expires = expires;
+    /* Entries expiring in the past go in the next slot to be
+     * processed. */
+    slot = time_before(expires, tw->clk) ? tw->clk : expires;
+    list_add_tail(&e->node, &tw->slots[slot & RL_TW_MASK]);
+    spin_unlock_bh(&tw->lock);
+}
+EXPORT_SYMBOL(rl_tw_mod);
+
+/* Stop the entry, like del_timer(). */
 void
-dtp_init(struct dtp *dtp)
+rl_tw_del(struct rl_tw_entry *e)
+{
+    struct rl_tw *tw = e->tw;
+
+    spin_lock_bh(&tw->lock);
+    if (rl_tw_pending(e)) {
+        list_del_init(&e->node);
+        tw->count--;
+    }
+    spin_unlock_bh(&tw->lock);
+}
+EXPORT_SYMBOL(rl_tw_del);
+
+/* Stop the entry and wait for its callback to complete, like
+ * del_timer_sync(). Must not be called from the entry callback. */
+void
+rl_tw_del_sync(struct rl_tw_entry *e)
+{
+    struct rl_tw *tw = e->tw;
+
+    for (;;) {
+        bool running;
+
+        spin_lock_bh(&tw->lock);
+        if (rl_tw_pending(e)) {
+            list_del_init(&e->node);
+            tw->count--;
+        }
+        running = tw->running == e;
+        spin_unlock_bh(&tw->lock);
+        if (!running) {
+            break;
+        }
+        cpu_relax();
+    }
+}
+EXPORT_SYMBOL(rl_tw_del_sync);
+
+void
+dtp_init(struct dtp *dtp, struct rl_tw *tw)
 {
     spin_lock_init(&dtp->lock);
-    init_timer(&dtp->snd_inact_tmr);
-    init_timer(&dtp->rcv_inact_tmr);
     rb_list_init(&dtp->cwq);
     dtp->cwq_len = dtp->max_cwq_len = 0;
     rb_list_init(&dtp->seqq);
     dtp->seqq_len = 0;
     rb_list_init(&dtp->rtxq);
     dtp->rtxq_len = dtp->max_rtxq_len = 0;
-    init_timer(&dtp->rtx_tmr);
-    init_timer(&dtp->a_tmr);
+    rl_tw_entry_init(&dtp->rtx_tmr, tw);
+    rl_tw_entry_init(&dtp->a_tmr, tw);
+    rl_tw_entry_init(&dtp->inact_tmr, tw);
+    RCU_INIT_POINTER(dtp->local_peer, NULL);
 }
 EXPORT_SYMBOL(dtp_init);
 
@@ -50,10 +210,10 @@ dtp_fini(struct dtp *dtp)
 {
     struct rl_buf *rb, *tmp;
 
-    del_timer_sync(&dtp->snd_inact_tmr);
-    del_timer_sync(&dtp->rcv_inact_tmr);
-    del_timer_sync(&dtp->rtx_tmr);
-    del_timer_sync(&dtp->a_tmr);
+    /* The rtx callback rearms the inactivity timer, so stop it first. */
+    rl_tw_del_sync(&dtp->rtx_tmr);
+    rl_tw_del_sync(&dtp->a_tmr);
+    rl_tw_del_sync(&dtp->inact_tmr);
 
     spin_lock_bh(&dtp->lock);
 
@@ -102,7 +262,13 @@ EXPORT_SYMBOL(dtp_dump);
 int
 flow_get_stats(struct flow_entry *flow, struct rl_flow_stats *stats)
 {
-    struct dtp *dtp = &flow->dtp;
+    struct dtp *dtp = flow->dtp;
+
+    if (!dtp) {
+        /* Stats are not updated until the DTP state exists. */
+        *stats = flow->stats;
+        return 0;
+    }
 
     spin_lock_bh(&dtp->lock);
     *stats = flow->stats;
@@ -113,14 +279,35 @@ flow_get_stats(struct flow_entry *flow, struct rl_flow_stats *stats)
 EXPORT_SYMBOL(flow_get_stats);
 
 static struct pduft_entry *
-pduft_lookup_internal(struct rl_normal *priv, rlm_addr_t dst_addr)
+pduft_lookup_internal(struct rl_normal *priv, rlm_addr_t dst_addr,
+                      rl_qosid_t qos_id)
+{
+    struct pduft_entry *entry;
+    struct hlist_head *head;
+
+    head = &priv->pdu_ft[hash_min(dst_addr, HASH_BITS(priv->pdu_ft))];
+    hlist_for_each_entry (entry, head, node) {
+        if (entry->address == dst_addr && entry->qos_id == qos_id) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Multicast addresses map to one entry per member flow, all hashed
+ * in the same bucket. Look up the member entry for 'flow'. */
+static struct pduft_entry *
+pduft_lookup_member(struct rl_normal *priv, rlm_addr_t dst_addr,
+                    struct flow_entry *flow)
 {
     struct pduft_entry *entry;
     struct hlist_head *head;
 
     head = &priv->pdu_ft[hash_min(dst_addr, HASH_BITS(priv->pdu_ft))];
     hlist_for_each_entry (entry, head, node) {
-        if (entry->address == dst_addr) {
+        if (entry->address == dst_addr && entry->flow == flow &&
+            (entry->flags & RL_PDUFT_F_MCAST)) {
             return entry;
         }
     }
@@ -128,43 +315,247 @@ pduft_lookup_internal(struct rl_normal *priv, rlm_addr_t dst_addr)
     return NULL;
 }
 
+/* Look up the next hop flow for 'dst_addr'. A QoS-specific entry
+ * matching 'qos_id' is preferred, as long as its flow is up; the
+ * default table is used otherwise. */
 struct flow_entry *
-rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr)
+rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr, rl_qosid_t qos_id)
 {
     struct pduft_entry *entry;
     struct flow_entry *flow;
 
     read_lock_bh(&priv->pduft_lock);
-    entry = pduft_lookup_internal(priv, dst_addr);
-    flow  = entry ? entry->flow : priv->pduft_dflt;
+    if (unlikely(qos_id && READ_ONCE(priv->pduft_qos))) {
+        entry = pduft_lookup_internal(priv, dst_addr, qos_id);
+        if (entry && !READ_ONCE(entry->flow->down)) {
+            flow = entry->flow;
+            read_unlock_bh(&priv->pduft_lock);
+            return flow;
+        }
+    }
+    entry = pduft_lookup_internal(priv, dst_addr, 0);
+    if (!entry) {
+        flow = priv->pduft_dflt;
+    } else if (unlikely(entry->flags & RL_PDUFT_F_MCAST)) {
+        /* Multicast addresses have no single next hop, and they must
+         * not fall back on the default entry. */
+        flow = NULL;
+    } else {
+        flow = entry->flow;
+        if (unlikely(READ_ONCE(flow->down)) && entry->backup &&
+            !READ_ONCE(entry->backup->down)) {
+            /* Fast reroute through the precomputed backup flow, until
+             * the uipcp recomputes the routes. */
+            flow = entry->backup;
+        }
+    }
     read_unlock_bh(&priv->pduft_lock);
 
     return flow;
 }
 EXPORT_SYMBOL(rl_pduft_lookup);
 
+/* Clone 'rb' once for each member of the multicast group 'dst_addr',
+ * skipping the 'exclude' flow (if any), and append the clones to the
+ * 'out' list. Clones share the payload with 'rb'. A reference to the
+ * member flow is taken for each clone and stored in the clone RMT
+ * control block: the caller must drop it after transmission.
+ * Returns -ENOENT if 'dst_addr' is not a multicast address. */
 int
-rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
-             struct flow_entry *flow)
+rl_pduft_mcast_clone(struct rl_normal *priv, rlm_addr_t dst_addr,
+                     struct rl_buf *rb, struct flow_entry *exclude,
+                     struct rb_list *out)
 {
-    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
     struct pduft_entry *entry;
+    struct hlist_head *head;
+    int ret = -ENOENT;
 
-    write_lock_bh(&priv->pduft_lock);
+    if (likely(!READ_ONCE(priv->pduft_mcast))) {
+        return ret;
+    }
+
+    read_lock_bh(&priv->pduft_lock);
+    head = &priv->pdu_ft[hash_min(dst_addr, HASH_BITS(priv->pdu_ft))];
+    hlist_for_each_entry (entry, head, node) {
+        struct rl_buf *crb;
+
+        if (entry->address != dst_addr ||
+            !(entry->flags & RL_PDUFT_F_MCAST)) {
+            continue;
+        }
+        ret = 0;
+        if (entry->flow == exclude || READ_ONCE(entry->flow->down)) {
+            continue;
+        }
+        crb = rl_buf_clone(rb, GFP_ATOMIC);
+        if (unlikely(!crb)) {
+            RPD(2, "Out of memory replicating PDU to group %lu\n",
+                (long unsigned)dst_addr);
+            continue;
+        }
+        flow_get_ref(entry->flow);
+        RL_BUF_RMT(crb).compl_flow = entry->flow;
+        rb_list_enq(crb, out);
+    }
+    read_unlock_bh(&priv->pduft_lock);
+
+    return ret;
+}
+EXPORT_SYMBOL(rl_pduft_mcast_clone);
+
+/* Tell whether 'dst_addr' is a multicast address. */
+bool
+rl_pduft_is_mcast(struct rl_normal *priv, rlm_addr_t dst_addr)
+{
+    struct pduft_entry *entry;
+    bool ret;
+
+    if (likely(!READ_ONCE(priv->pduft_mcast))) {
+        return false;
+    }
+
+    read_lock_bh(&priv->pduft_lock);
+    entry = pduft_lookup_internal(priv, dst_addr, 0);
+    ret   = entry && (entry->flags & RL_PDUFT_F_MCAST);
+    read_unlock_bh(&priv->pduft_lock);
 
-    if (dst_addr == RL_ADDR_NULL) {
+    return ret;
+}
+EXPORT_SYMBOL(rl_pduft_is_mcast);
+
+static void
+pduft_entry_unlink(struct rl_normal *priv, struct pduft_entry *entry)
+{
+    list_del_init(&entry->fnode);
+    hash_del(&entry->node);
+    flow_put(entry->flow);
+    if (entry->backup) {
+        flow_put(entry->backup);
+    }
+    if (entry->flags & RL_PDUFT_F_MCAST) {
+        WRITE_ONCE(priv->pduft_mcast, priv->pduft_mcast - 1);
+    }
+    if (entry->qos_id) {
+        WRITE_ONCE(priv->pduft_qos, priv->pduft_qos - 1);
+    }
+}
+
+/* Remove all the entries for 'dst_addr' in the default table whose
+ * multicast flag matches 'flags'. Called under the PDUFT write lock. */
+static int
+pduft_purge_addr(struct rl_normal *priv, rlm_addr_t dst_addr, uint8_t flags)
+{
+    struct pduft_entry *entry;
+    struct hlist_node *tmp;
+    struct hlist_head *head;
+    int n = 0;
+
+    head = &priv->pdu_ft[hash_min(dst_addr, HASH_BITS(priv->pdu_ft))];
+    hlist_for_each_entry_safe (entry, tmp, head, node) {
+        if (entry->address == dst_addr && !entry->qos_id &&
+            (entry->flags & RL_PDUFT_F_MCAST) == flags) {
+            pduft_entry_unlink(priv, entry);
+            rl_free(entry, RL_MT_PDUFT);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* Called under the PDUFT write lock. On success, a reference to 'flow'
+ * is taken. */
+static int
+pduft_set_locked(struct rl_normal *priv, rlm_addr_t dst_addr,
+                 struct flow_entry *flow, uint8_t flags, rl_qosid_t qos_id)
+{
+    struct pduft_entry *entry;
+
+    flags &= RL_PDUFT_F_MCAST | RL_PDUFT_F_BACKUP;
+    if (flags == (RL_PDUFT_F_MCAST | RL_PDUFT_F_BACKUP)) {
+        return -EINVAL;
+    }
+
+    if (qos_id) {
+        /* QoS-specific unicast entry, with no backup. */
+        if (dst_addr == RL_ADDR_NULL || flags) {
+            return -EINVAL;
+        }
+        entry = pduft_lookup_internal(priv, dst_addr, qos_id);
+        if (!entry) {
+            entry = rl_alloc(sizeof(*entry), GFP_ATOMIC, RL_MT_PDUFT);
+            if (!entry) {
+                return -ENOMEM;
+            }
+
+            entry->flags   = 0;
+            entry->backup  = NULL;
+            entry->qos_id  = qos_id;
+            entry->address = dst_addr;
+            hash_add(priv->pdu_ft, &entry->node, dst_addr);
+            list_add_tail(&entry->fnode, &flow->pduft_entries);
+            WRITE_ONCE(priv->pduft_qos, priv->pduft_qos + 1);
+        } else {
+            list_del_init(&entry->fnode);
+            list_add_tail_safe(&entry->fnode, &flow->pduft_entries);
+            flow_put(entry->flow);
+        }
+        entry->flow = flow;
+    } else if (dst_addr == RL_ADDR_NULL) {
         /* Default entry. */
+        if (flags) {
+            return -EINVAL;
+        }
+        if (priv->pduft_dflt) {
+            flow_put(priv->pduft_dflt);
+        }
         priv->pduft_dflt = flow;
+    } else if (flags & RL_PDUFT_F_BACKUP) {
+        /* Set the backup flow of an existing unicast entry. */
+        entry = pduft_lookup_internal(priv, dst_addr, 0);
+        if (!entry || (entry->flags & RL_PDUFT_F_MCAST)) {
+            return -ENOENT;
+        }
+        if (entry->backup) {
+            flow_put(entry->backup);
+        }
+        entry->backup = flow;
+    } else if (flags) {
+        /* Add a member to a multicast group, replacing a unicast
+         * entry for the same address, if any. */
+        pduft_purge_addr(priv, dst_addr, 0);
+        if (pduft_lookup_member(priv, dst_addr, flow)) {
+            /* Already a member, nothing to do. */
+            return 0;
+        }
+
+        entry = rl_alloc(sizeof(*entry), GFP_ATOMIC, RL_MT_PDUFT);
+        if (!entry) {
+            return -ENOMEM;
+        }
+
+        entry->flow    = flow;
+        entry->backup  = NULL;
+        entry->address = dst_addr;
+        entry->flags   = RL_PDUFT_F_MCAST;
+        entry->qos_id  = 0;
+        hash_add(priv->pdu_ft, &entry->node, dst_addr);
+        list_add_tail(&entry->fnode, &flow->pduft_entries);
+        WRITE_ONCE(priv->pduft_mcast, priv->pduft_mcast + 1);
     } else {
-        entry = pduft_lookup_internal(priv, dst_addr);
+        /* A unicast entry replaces a multicast group, if any. */
+        pduft_purge_addr(priv, dst_addr, RL_PDUFT_F_MCAST);
+        entry = pduft_lookup_internal(priv, dst_addr, 0);
 
         if (!entry) {
             entry = rl_alloc(sizeof(*entry), GFP_ATOMIC, RL_MT_PDUFT);
             if (!entry) {
-                write_unlock_bh(&priv->pduft_lock);
                 return -ENOMEM;
             }
 
+            entry->flags  = 0;
+            entry->backup = NULL;
+            entry->qos_id = 0;
             hash_add(priv->pdu_ft, &entry->node, dst_addr);
             list_add_tail(&entry->fnode, &flow->pduft_entries);
         } else {
@@ -177,21 +568,26 @@ rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
         entry->flow    = flow;
         entry->address = dst_addr;
     }
-    write_unlock_bh(&priv->pduft_lock);
 
     flow_get_ref(flow);
 
     return 0;
 }
-EXPORT_SYMBOL(rl_pduft_set);
 
-static void
-pduft_entry_unlink(struct pduft_entry *entry)
+int
+rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
+             struct flow_entry *flow, uint8_t flags)
 {
-    list_del_init(&entry->fnode);
-    hash_del(&entry->node);
-    flow_put(entry->flow);
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    int ret;
+
+    write_lock_bh(&priv->pduft_lock);
+    ret = pduft_set_locked(priv, dst_addr, flow, flags, 0);
+    write_unlock_bh(&priv->pduft_lock);
+
+    return ret;
 }
+EXPORT_SYMBOL(rl_pduft_set);
 
 int
 rl_pduft_flush(struct ipcp_entry *ipcp)
@@ -209,7 +605,7 @@ rl_pduft_flush(struct ipcp_entry *ipcp)
     }
     hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
     {
-        pduft_entry_unlink(entry);
+        pduft_entry_unlink(priv, entry);
         rl_free(entry, RL_MT_PDUFT);
     }
 
@@ -225,7 +621,7 @@ rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
     write_lock_bh(&priv->pduft_lock);
-    pduft_entry_unlink(entry);
+    pduft_entry_unlink(priv, entry);
     write_unlock_bh(&priv->pduft_lock);
 
     rl_free(entry, RL_MT_PDUFT);
@@ -234,34 +630,100 @@ rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
 }
 EXPORT_SYMBOL(rl_pduft_del);
 
-int
-rl_pduft_del_addr(struct ipcp_entry *ipcp, rlm_addr_t dst_addr)
+/* Remove the entry for 'dst_addr'. With RL_PDUFT_F_MCAST only the
+ * 'flow' member of the group is removed, with RL_PDUFT_F_BACKUP only
+ * the 'flow' backup is removed, otherwise 'flow' is ignored and the
+ * address is removed altogether from the default table. A non-zero
+ * 'qos_id' only removes the corresponding QoS-specific entry.
+ * Called under the PDUFT write lock. */
+static int
+pduft_del_addr_locked(struct rl_normal *priv, rlm_addr_t dst_addr,
+                      struct flow_entry *flow, uint8_t flags,
+                      rl_qosid_t qos_id)
 {
-    struct rl_normal *priv    = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry = NULL;
-    int ret                   = -1;
+    struct pduft_entry *entry;
 
-    write_lock_bh(&priv->pduft_lock);
-    if (dst_addr == RL_ADDR_NULL) {
+    if (qos_id) {
+        entry = pduft_lookup_internal(priv, dst_addr, qos_id);
+        if (entry) {
+            pduft_entry_unlink(priv, entry);
+            rl_free(entry, RL_MT_PDUFT);
+            return 0;
+        }
+    } else if (dst_addr == RL_ADDR_NULL) {
         /* Default entry. */
         if (priv->pduft_dflt) {
             flow_put(priv->pduft_dflt);
             priv->pduft_dflt = NULL;
-            ret              = 0;
+            return 0;
         }
-    } else {
-        entry = pduft_lookup_internal(priv, dst_addr);
+    } else if (flags & RL_PDUFT_F_BACKUP) {
+        entry = pduft_lookup_internal(priv, dst_addr, 0);
+        if (entry && entry->backup == flow) {
+            flow_put(entry->backup);
+            entry->backup = NULL;
+            return 0;
+        }
+    } else if (flags & RL_PDUFT_F_MCAST) {
+        entry = pduft_lookup_member(priv, dst_addr, flow);
         if (entry) {
-            pduft_entry_unlink(entry);
-            ret = 0;
+            pduft_entry_unlink(priv, entry);
+            rl_free(entry, RL_MT_PDUFT);
+            return 0;
         }
+    } else if (pduft_purge_addr(priv, dst_addr, 0) ||
+               pduft_purge_addr(priv, dst_addr, RL_PDUFT_F_MCAST)) {
+        return 0;
     }
+
+    return -1;
+}
+
+int
+rl_pduft_del_addr(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
+                  struct flow_entry *flow, uint8_t flags)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    int ret;
+
+    write_lock_bh(&priv->pduft_lock);
+    ret = pduft_del_addr_locked(priv, dst_addr, flow, flags, 0);
     write_unlock_bh(&priv->pduft_lock);
 
-    if (entry) {
-        rl_free(entry, RL_MT_PDUFT);
+    return ret;
+}
+EXPORT_SYMBOL(rl_pduft_del_addr);
+
+/* Apply a batch of modifications under a single acquisition of the
+ * PDUFT lock, so that the datapath never sees a partially updated
+ * table. All the modifications are attempted, and the first error
+ * (if any) is returned; the ones that succeeded are not rolled back. */
+int
+rl_pduft_mod_batch(struct ipcp_entry *ipcp, const struct pduft_mod *mods,
+                   unsigned int num_mods)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    unsigned int i;
+    int ret = 0;
+
+    write_lock_bh(&priv->pduft_lock);
+    for (i = 0; i < num_mods; i++) {
+        const struct pduft_mod *mod = mods + i;
+        int r;
+
+        if (mod->op == RL_PDUFT_OP_SET) {
+            r = pduft_set_locked(priv, mod->dst_addr, mod->flow, mod->flags,
+                                 mod->qos_id);
+        } else {
+            r = pduft_del_addr_locked(priv, mod->dst_addr, mod->flow,
+                                      mod->flags, mod->qos_id);
+        }
+        if (r && !ret) {
+            ret = r;
+        }
     }
+    write_unlock_bh(&priv->pduft_lock);
 
     return ret;
 }
-EXPORT_SYMBOL(rl_pduft_del_addr);
+EXPORT_SYMBOL(rl_pduft_mod_batch);
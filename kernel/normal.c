@@ -35,6 +35,8 @@
 #include <linux/ktime.h>
 #include <linux/spinlock.h>
 #include <linux/delay.h>
+#include <linux/jhash.h>
+#include <linux/cpumask.h>
 
 /* PCI header to be used for transfer PDUs.
  * The order of the fields is extremely important, because we only
@@ -126,16 +128,43 @@ rina_pci_dump(struct rina_pci *pci)
 
 #define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
 
+/* Workqueue used to process the receive backlogs. */
+static struct workqueue_struct *rl_normal_rx_wq;
+
+static void rx_steer_work(struct work_struct *w);
+static void pktgen_destroy(struct rl_normal *priv);
+
 static void *
 rl_normal_create(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv;
+    int cpu;
 
     priv = rl_alloc(sizeof(*priv), GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
     if (!priv) {
         return NULL;
     }
 
+    priv->rxqs = alloc_percpu(struct rl_normal_rxq);
+    if (!priv->rxqs) {
+        rl_free(priv, RL_MT_SHIM);
+        return NULL;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_normal_rxq *rxq = per_cpu_ptr(priv->rxqs, cpu);
+
+        rxq->priv = priv;
+        spin_lock_init(&rxq->lock);
+        rb_list_init(&rxq->q);
+        rxq->qlen = 0;
+        INIT_WORK(&rxq->work, rx_steer_work);
+    }
+    RCU_INIT_POINTER(priv->rx_cpumap, NULL); /* No steering by default. */
+    rl_tw_init(&priv->tw);
+    spin_lock_init(&priv->local_lock);
+
     /* Fill in data transfer constants */
     ipcp->pcisizes.addr   = sizeof(rl_addr_t);
     ipcp->pcisizes.seq    = sizeof(rl_seq_t);
@@ -150,7 +179,9 @@ rl_normal_create(struct ipcp_entry *ipcp)
 
     priv->ipcp = ipcp;
     hash_init(priv->pdu_ft);
-    priv->pduft_dflt = NULL;
+    priv->pduft_dflt  = NULL;
+    priv->pduft_mcast = 0;
+    priv->pduft_qos   = 0;
     rwlock_init(&priv->pduft_lock);
 
     PD("New IPC created [%p]\n", priv);
@@ -162,8 +193,36 @@ static void
 rl_normal_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = ipcp->priv;
+    struct rl_normal_cpumap *map;
+    int cpu;
+
+    /* Stop the PDU generator, which may be injecting PDUs into the
+     * receive path. */
+    pktgen_destroy(priv);
+
+    /* Stop steering and drain the receive backlogs. */
+    map = rcu_dereference_protected(priv->rx_cpumap, 1);
+    RCU_INIT_POINTER(priv->rx_cpumap, NULL);
+    synchronize_rcu();
+    if (map) {
+        rl_free(map, RL_MT_MISC);
+    }
+    for_each_possible_cpu(cpu)
+    {
+        struct rl_normal_rxq *rxq = per_cpu_ptr(priv->rxqs, cpu);
+        struct rl_buf *rb, *tmp;
+
+        cancel_work_sync(&rxq->work);
+        rb_list_foreach_safe (rb, tmp, &rxq->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        rxq->qlen = 0;
+    }
+    free_percpu(priv->rxqs);
 
     rl_pduft_flush(ipcp);
+    rl_tw_fini(&priv->tw);
     rl_free(priv, RL_MT_SHIM);
 
     PD("IPC [%p] destroyed\n", priv);
@@ -174,7 +233,7 @@ static void
 dtp_snd_reset(struct flow_entry *flow)
 {
     struct fc_config *fc = &flow->cfg.dtcp.fc;
-    struct dtp *dtp      = &flow->dtp;
+    struct dtp *dtp      = flow->dtp;
 
     dtp->flags |= DTP_F_DRF_SET;
     /* InitialSeqNumPolicy */
@@ -192,7 +251,7 @@ static void
 dtp_rcv_reset(struct flow_entry *flow)
 {
     struct fc_config *fc = &flow->cfg.dtcp.fc;
-    struct dtp *dtp      = &flow->dtp;
+    struct dtp *dtp      = flow->dtp;
 
     dtp->flags |= DTP_F_DRF_EXPECTED;
     dtp->rcv_lwe = dtp->rcv_lwe_priv = dtp->rcv_rwe = 0;
@@ -208,16 +267,14 @@ dtp_rcv_reset(struct flow_entry *flow)
     dtp->last_lwe_sent = 0;
 }
 
+/* Sender inactivity timer expired. To be called under DTP lock. */
 static void
-snd_inact_tmr_cb(long unsigned arg)
+dtp_snd_inact(struct flow_entry *flow)
 {
-    struct flow_entry *flow = (struct flow_entry *)arg;
-    struct dtp *dtp         = &flow->dtp;
+    struct dtp *dtp = flow->dtp;
     struct rl_buf *rb, *tmp;
 
-    spin_lock_bh(&dtp->lock);
-
-    del_timer(&dtp->rtx_tmr);
+    rl_tw_del(&dtp->rtx_tmr);
 
     dtp_dump(dtp);
 
@@ -245,23 +302,15 @@ snd_inact_tmr_cb(long unsigned arg)
     /* Send transfer PDU with zero length. */
 
     /* Notify user flow that there has been no activity for a while */
-
-    spin_unlock_bh(&dtp->lock);
-
-    /* Wake up processes sleeping on write(), since cwq and rtxq have been
-     * emptied. */
-    rl_write_restart_flow(flow);
 }
 
+/* Receiver inactivity timer expired. To be called under DTP lock. */
 static void
-rcv_inact_tmr_cb(long unsigned arg)
+dtp_rcv_inact(struct flow_entry *flow)
 {
-    struct flow_entry *flow = (struct flow_entry *)arg;
-    struct dtp *dtp         = &flow->dtp;
+    struct dtp *dtp = flow->dtp;
     struct rl_buf *rb, *tmp;
 
-    spin_lock_bh(&dtp->lock);
-
     /* Re-initialize receive-side state variables. */
     dtp_rcv_reset(flow);
 
@@ -272,8 +321,92 @@ rcv_inact_tmr_cb(long unsigned arg)
         rl_buf_free(rb);
         dtp->seqq_len--;
     }
+}
+
+/* Start the inactivity timer, if it is not going to expire before
+ * 'deadline'. To be called under DTP lock. */
+static inline void
+dtp_inact_arm(struct dtp *dtp, unsigned long deadline)
+{
+    if (!rl_tw_pending(&dtp->inact_tmr) ||
+        time_before(deadline, dtp->inact_tmr.expires)) {
+        rl_tw_mod(&dtp->inact_tmr, deadline);
+    }
+}
+
+/* Record sender activity. In the common case the sender inactivity
+ * timer is already running, and we only update the stamp. To be called
+ * under DTP lock. */
+static inline void
+dtp_snd_activity(struct dtp *dtp)
+{
+    dtp->snd_inact_stamp = jiffies;
+    if (!(dtp->flags & DTP_F_SND_INACT)) {
+        dtp->flags |= DTP_F_SND_INACT;
+        dtp_inact_arm(dtp, dtp->snd_inact_stamp + 3 * dtp->mpl_r_a);
+    }
+}
+
+/* Same as dtp_snd_activity(), for the receiver. */
+static inline void
+dtp_rcv_activity(struct dtp *dtp)
+{
+    dtp->rcv_inact_stamp = jiffies;
+    if (!(dtp->flags & DTP_F_RCV_INACT)) {
+        dtp->flags |= DTP_F_RCV_INACT;
+        dtp_inact_arm(dtp, dtp->rcv_inact_stamp + 2 * dtp->mpl_r_a);
+    }
+}
+
+/* Check the sender and receiver inactivity deadlines against the
+ * activity stamps, and rearm for the closest one still in the future. */
+static void
+inact_tmr_cb(long unsigned arg)
+{
+    struct flow_entry *flow = (struct flow_entry *)arg;
+    struct dtp *dtp         = flow->dtp;
+    unsigned long now       = jiffies;
+    unsigned long next      = 0;
+    bool snd_expired        = false;
+    bool rearm              = false;
+    unsigned long exp;
+
+    spin_lock_bh(&dtp->lock);
+
+    if (dtp->flags & DTP_F_SND_INACT) {
+        exp = dtp->snd_inact_stamp + 3 * dtp->mpl_r_a;
+        if (!time_before(now, exp)) {
+            dtp->flags &= ~DTP_F_SND_INACT;
+            dtp_snd_inact(flow);
+            snd_expired = true;
+        } else {
+            next  = exp;
+            rearm = true;
+        }
+    }
+
+    if (dtp->flags & DTP_F_RCV_INACT) {
+        exp = dtp->rcv_inact_stamp + 2 * dtp->mpl_r_a;
+        if (!time_before(now, exp)) {
+            dtp->flags &= ~DTP_F_RCV_INACT;
+            dtp_rcv_inact(flow);
+        } else if (!rearm || time_before(exp, next)) {
+            next  = exp;
+            rearm = true;
+        }
+    }
+
+    if (rearm) {
+        rl_tw_mod(&dtp->inact_tmr, next);
+    }
 
     spin_unlock_bh(&dtp->lock);
+
+    if (snd_expired) {
+        /* Wake up processes sleeping on write(), since cwq and rtxq
+         * have been emptied. */
+        rl_write_restart_flow(flow);
+    }
 }
 
 static int rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr,
@@ -288,7 +421,7 @@ a_tmr_cb(long unsigned arg)
 {
     struct flow_entry *flow = (struct flow_entry *)arg;
     struct ipcp_entry *ipcp = flow->txrx.ipcp;
-    struct dtp *dtp         = &flow->dtp;
+    struct dtp *dtp         = flow->dtp;
     struct rl_buf *crb;
 
     RPD(1, "A tmr callback\n");
@@ -311,7 +444,7 @@ a_tmr_cb(long unsigned arg)
 static inline unsigned long
 rtt_to_rtx(struct flow_entry *flow)
 {
-    struct dtp *dtp    = &flow->dtp;
+    struct dtp *dtp    = flow->dtp;
     unsigned long x    = dtp->rtt + (dtp->rtt_stddev << 1);
     unsigned int two_a = flow->cfg.dtcp.initial_a << 1;
 
@@ -322,7 +455,7 @@ static void
 rtx_tmr_cb(long unsigned arg)
 {
     struct flow_entry *flow = (struct flow_entry *)arg;
-    struct dtp *dtp         = &flow->dtp;
+    struct dtp *dtp         = flow->dtp;
     struct rl_buf *rb, *crb, *tmp;
     long unsigned next_exp = ~0U;
     bool next_exp_set      = false;
@@ -335,7 +468,7 @@ rtx_tmr_cb(long unsigned arg)
     /* Stop the sender inactivity timer, it will be restarted
      * at the end of the function, after the burst of
      * retransmissions. */
-    del_timer(&dtp->snd_inact_tmr);
+    dtp->flags &= ~DTP_F_SND_INACT;
 
     /* We scan all the elements in the retransmission list, since they are
      * sorted by ascending sequence number, and not by ascending expiration
@@ -364,7 +497,7 @@ rtx_tmr_cb(long unsigned arg)
 
     if (next_exp_set) {
         NPD("Forward rtx timer by %u\n", jiffies_to_msecs(next_exp - jiffies));
-        mod_timer(&dtp->rtx_tmr, next_exp);
+        rl_tw_mod(&dtp->rtx_tmr, next_exp);
     }
 
     spin_unlock_bh(&dtp->lock);
@@ -379,22 +512,202 @@ rtx_tmr_cb(long unsigned arg)
     }
 
     spin_lock_bh(&dtp->lock);
-    mod_timer(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
+    dtp_snd_activity(dtp);
     spin_unlock_bh(&dtp->lock);
 }
 
 static int rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum);
 
+/*
+ * Local flows, i.e. flows between two applications using the same IPCP,
+ * are paired when both ends have been initialized, as long as no PDU
+ * has gone through EFCP on either of them. SDUs written on one end are
+ * then queued directly to the receive queue of the other end, bypassing
+ * EFCP and the RMT. Local delivery is reliable and in order, so this is
+ * valid for any QoS but bandwidth shaping. The pairing is undone in
+ * rl_normal_flow_fini(), and the datapath accesses the peer under RCU.
+ */
+
+/* True if no PDU has been sent or received through EFCP on the flow,
+ * so that there is no state to be drained or acknowledged. To be called
+ * under DTP lock. */
+static bool
+dtp_pristine(struct dtp *dtp)
+{
+    return dtp->next_seq_num_to_send == 0 &&
+           dtp->max_seq_num_rcvd == (rlm_seq_t)-1 && dtp->cwq_len == 0 &&
+           rb_list_empty(&dtp->rtxq) && dtp->seqq_len == 0;
+}
+
+/* Wake up the writers of the peer flow, since we freed some space in
+ * our receive queue. Paired flows have no EFCP state, so there is
+ * nothing to acknowledge. */
+static int
+rl_normal_local_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum)
+{
+    struct flow_entry *peer;
+
+    rcu_read_lock();
+    peer = rcu_dereference(flow->dtp->local_peer);
+    if (peer) {
+        wake_up_interruptible_poll(peer->txrx.tx_wqh,
+                                   POLLOUT | POLLWRBAND | POLLWRNORM);
+    }
+    rcu_read_unlock();
+
+    if (!peer &&
+        (flow->cfg.dtcp.rtx_control || flow->cfg.dtcp.flow_control)) {
+        return rl_normal_sdu_rx_consumed(flow, seqnum);
+    }
+
+    return 0;
+}
+
+static void
+rl_normal_local_pair(struct ipcp_entry *ipcp, struct flow_entry *flow)
+{
+    struct rl_normal *priv = ipcp->priv;
+    struct flow_entry *peer;
+
+    if (flow->remote_addr != ipcp->addr || flow->cfg.dtcp.bandwidth ||
+        rcu_access_pointer(flow->dtp->local_peer)) {
+        return;
+    }
+
+    peer = flow_get_by_cep(flow->remote_cep);
+    if (!peer) {
+        /* The other end has not been created yet, it will pair
+         * when initialized. */
+        return;
+    }
+
+    spin_lock_bh(&priv->local_lock);
+    if (peer != flow && peer->txrx.ipcp == ipcp && peer->dtp &&
+        peer->remote_addr == ipcp->addr &&
+        peer->remote_cep == flow->local_cep && !peer->cfg.dtcp.bandwidth &&
+        !rcu_access_pointer(peer->dtp->local_peer)) {
+        /* The DTP locks are taken to check that EFCP has not been used
+         * yet: from now on the writers see the pairing once they get
+         * the lock (see rl_normal_sdu_write()). The local lock
+         * serializes the pairings, so the nesting is safe. */
+        spin_lock(&flow->dtp->lock);
+        spin_lock_nested(&peer->dtp->lock, SINGLE_DEPTH_NESTING);
+        if (dtp_pristine(flow->dtp) && dtp_pristine(peer->dtp)) {
+            flow->sdu_rx_consumed = rl_normal_local_rx_consumed;
+            peer->sdu_rx_consumed = rl_normal_local_rx_consumed;
+            rcu_assign_pointer(flow->dtp->local_peer, peer);
+            rcu_assign_pointer(peer->dtp->local_peer, flow);
+            PD("Local flows %u and %u paired\n", flow->local_port,
+               peer->local_port);
+        } else {
+            PD("Local flows %u and %u already used EFCP, not paired\n",
+               flow->local_port, peer->local_port);
+        }
+        spin_unlock(&peer->dtp->lock);
+        spin_unlock(&flow->dtp->lock);
+    }
+    spin_unlock_bh(&priv->local_lock);
+
+    flow_put(peer);
+}
+
+static void
+rl_normal_flow_fini(struct ipcp_entry *ipcp, struct flow_entry *flow)
+{
+    struct rl_normal *priv = ipcp->priv;
+    struct dtp *dtp        = flow->dtp;
+    struct flow_entry *peer;
+
+    if (!dtp || !rcu_access_pointer(dtp->local_peer)) {
+        return;
+    }
+
+    spin_lock_bh(&priv->local_lock);
+    peer = rcu_dereference_protected(dtp->local_peer,
+                                     lockdep_is_held(&priv->local_lock));
+    if (peer) {
+        RCU_INIT_POINTER(peer->dtp->local_peer, NULL);
+        RCU_INIT_POINTER(dtp->local_peer, NULL);
+    }
+    spin_unlock_bh(&priv->local_lock);
+
+    /* Wait for the writers on the peer flow to stop queueing to our
+     * receive queue, which is going to be flushed. */
+    synchronize_rcu();
+}
+
+/* Queue an SDU to the local peer flow. Returns -ENOTCONN if the flow
+ * is not paired (anymore), or the SDU must go through the IPCP. */
+static int
+rl_normal_local_write(struct flow_entry *flow, struct rl_buf *rb)
+{
+    struct dtp *dtp = flow->dtp;
+    size_t len      = rb->len;
+    struct flow_entry *peer;
+    struct txrx *txrx;
+    int ret = 0;
+
+    rcu_read_lock();
+    peer = rcu_dereference(dtp->local_peer);
+    if (unlikely(!peer || peer->upper.ipcp || flow->upper.ipcp)) {
+        rcu_read_unlock();
+        return -ENOTCONN;
+    }
+
+    txrx = &peer->txrx;
+    spin_lock_bh(&txrx->rx_lock);
+    if (txrx->rx_qsize > RL_RXQ_SIZE_MAX) {
+        /* Backpressure, the writer will be woken up by
+         * rl_normal_local_rx_consumed(). */
+        ret = -EAGAIN;
+    } else {
+        rb_list_enq(rb, &txrx->rx_q);
+        txrx->rx_qsize += rl_buf_truesize(rb);
+        peer->stats.rx_pkt++;
+        peer->stats.rx_byte += len;
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+    if (ret == 0) {
+        wake_up_interruptible_poll(&txrx->rx_wqh,
+                                   POLLIN | POLLRDNORM | POLLRDBAND);
+    }
+    rcu_read_unlock();
+
+    if (ret == 0) {
+        spin_lock_bh(&dtp->lock);
+        flow->stats.tx_pkt++;
+        flow->stats.tx_byte += len;
+        spin_unlock_bh(&dtp->lock);
+    }
+
+    return ret;
+}
+
 #define TKBK_INTVAL_MSEC 2
 
 static int
 rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 {
-    struct dtp *dtp      = &flow->dtp;
-    struct fc_config *fc = &flow->cfg.dtcp.fc;
-    unsigned long mpl    = 0;
+    struct rl_normal *priv = ipcp->priv;
+    struct dtp *dtp        = flow->dtp;
+    struct fc_config *fc   = &flow->cfg.dtcp.fc;
+    unsigned long mpl      = 0;
     unsigned long r;
 
+    if (!dtp) {
+        /* DTP state is only allocated for flows that need it, that
+         * is flows supported by a normal IPCP. The datapath ignores the
+         * flow until the pointer is set. */
+        dtp = rl_alloc(sizeof(*dtp), GFP_ATOMIC | __GFP_ZERO, RL_MT_DTP);
+        if (!dtp) {
+            PE("Out of memory\n");
+            return -ENOMEM;
+        }
+        dtp_init(dtp, &priv->tw);
+        smp_wmb();
+        flow->dtp = dtp;
+    }
+
     dtp_snd_reset(flow);
     dtp_rcv_reset(flow);
 
@@ -433,11 +746,8 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     dtp->mpl_r_a = mpl + r + msecs_to_jiffies(flow->cfg.dtcp.initial_a);
     PV("MPL+R+A = %u ms\n", jiffies_to_msecs(dtp->mpl_r_a));
 
-    dtp->snd_inact_tmr.function = snd_inact_tmr_cb;
-    dtp->snd_inact_tmr.data     = (unsigned long)flow;
-
-    dtp->rcv_inact_tmr.function = rcv_inact_tmr_cb;
-    dtp->rcv_inact_tmr.data     = (unsigned long)flow;
+    dtp->inact_tmr.function = inact_tmr_cb;
+    dtp->inact_tmr.data     = (unsigned long)flow;
 
     dtp->rtx_tmr.function = rtx_tmr_cb;
     dtp->rtx_tmr.data     = (unsigned long)flow;
@@ -481,38 +791,22 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
         dtp->tkbk.t_last_refill = ktime_get();
     }
 
+    rl_normal_local_pair(ipcp, flow);
+
     return 0;
 }
 
 #define RMTQ_MAX_SIZE (1 << 17)
 
+/* Push a PDU down to the N-1 flow 'lower_flow', sleeping or queueing
+ * in the RMT queue if the N-1 IPCP cannot take it right now. */
 static int
-rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
-       bool maysleep)
+rmt_tx_flow(struct flow_entry *lower_flow, struct rl_buf *rb, bool maysleep)
 {
     DECLARE_WAITQUEUE(wait, current);
-    struct flow_entry *lower_flow;
     struct ipcp_entry *lower_ipcp;
     int ret;
 
-    lower_flow = rl_pduft_lookup((struct rl_normal *)ipcp->priv, remote_addr);
-    if (unlikely(!lower_flow && remote_addr != ipcp->addr)) {
-        RPD(2, "No route to IPCP %lu, dropping packet\n",
-            (long unsigned)remote_addr);
-        rl_buf_free(rb);
-        return -EHOSTUNREACH;
-    }
-
-    if (!lower_flow) {
-        /* This SDU gets loopbacked to this IPCP, since this is a
-         * self flow (flow->remote_addr == ipcp->addr). */
-        rb = ipcp->ops.sdu_rx(ipcp, rb, NULL /* unused */);
-        BUG_ON(rb != NULL);
-        return 0;
-    }
-
-    /* This SDU will be sent to a remote IPCP, using an N-1 flow. */
-
     lower_ipcp = lower_flow->txrx.ipcp;
     BUG_ON(!lower_ipcp);
 
@@ -573,12 +867,113 @@ rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
     return ret;
 }
 
+/* Replicate a PDU to all the members of the multicast group
+ * 'remote_addr' except 'exclude', and transmit the clones. This does
+ * not take ownership of the rb. Returns -ENOENT if 'remote_addr' is
+ * not a multicast address. */
+static int
+rmt_tx_mcast(struct ipcp_entry *ipcp, rl_addr_t remote_addr,
+             struct rl_buf *rb, struct flow_entry *exclude, bool maysleep)
+{
+    struct rl_buf *crb, *tmp;
+    struct rb_list clones;
+    int ret;
+
+    rb_list_init(&clones);
+    ret = rl_pduft_mcast_clone((struct rl_normal *)ipcp->priv, remote_addr,
+                               rb, exclude, &clones);
+    if (ret) {
+        return ret;
+    }
+
+    rb_list_foreach_safe (crb, tmp, &clones) {
+        struct flow_entry *lower_flow = RL_BUF_RMT(crb).compl_flow;
+
+        rb_list_del(crb);
+        rmt_tx_flow(lower_flow, crb, maysleep);
+        flow_put(lower_flow);
+    }
+
+    return 0;
+}
+
+static int
+rmt_tx(struct ipcp_entry *ipcp, rl_addr_t remote_addr, struct rl_buf *rb,
+       bool maysleep)
+{
+    struct flow_entry *lower_flow;
+
+    lower_flow = rl_pduft_lookup((struct rl_normal *)ipcp->priv, remote_addr,
+                                 RL_BUF_PCI(rb)->qos_id);
+    if (unlikely(!lower_flow && remote_addr != ipcp->addr)) {
+        if (rmt_tx_mcast(ipcp, remote_addr, rb, NULL, maysleep) == 0) {
+            rl_buf_free(rb);
+            return 0;
+        }
+        RPD(2, "No route to IPCP %lu, dropping packet\n",
+            (long unsigned)remote_addr);
+        rl_buf_free(rb);
+        return -EHOSTUNREACH;
+    }
+
+    if (!lower_flow) {
+        /* This SDU gets loopbacked to this IPCP, since this is a
+         * self flow (flow->remote_addr == ipcp->addr). */
+        rb = ipcp->ops.sdu_rx(ipcp, rb, NULL /* unused */);
+        BUG_ON(rb != NULL);
+        return 0;
+    }
+
+    /* This SDU will be sent to a remote IPCP, using an N-1 flow. */
+    return rmt_tx_flow(lower_flow, rb, maysleep);
+}
+
+/* Transmit a list of PDUs directed to the same 'remote_addr' with the
+ * same QoS id, looking up the PDUFT only once and pushing the whole
+ * list down to the N-1 flow. What the N-1 IPCP cannot take right now
+ * goes through rmt_tx(), which knows how to wait or queue. The list is
+ * empty on return. */
+static int
+rmt_tx_batch(struct ipcp_entry *ipcp, rl_addr_t remote_addr,
+             struct rb_list *rbs, bool maysleep)
+{
+    struct flow_entry *lower_flow;
+    int ret = 0;
+
+    if (rb_list_empty(rbs)) {
+        return 0;
+    }
+
+    lower_flow = rl_pduft_lookup((struct rl_normal *)ipcp->priv, remote_addr,
+                                 RL_BUF_PCI(rb_list_front(rbs))->qos_id);
+    if (lower_flow) {
+        ret = rl_sdu_write_batch(lower_flow->txrx.ipcp, lower_flow, rbs,
+                                 maysleep);
+        if (ret == -EAGAIN) {
+            ret = 0;
+        }
+    }
+
+    while (!rb_list_empty(rbs)) {
+        struct rl_buf *rb = rb_list_front(rbs);
+        int err;
+
+        rb_list_del(rb);
+        err = rmt_tx(ipcp, remote_addr, rb, maysleep);
+        if (err && !ret) {
+            ret = err;
+        }
+    }
+
+    return ret;
+}
+
 /* Called under DTP lock */
 static int
 rl_rtxq_push(struct flow_entry *flow, struct rl_buf *rb)
 {
     struct rl_buf *crb = rl_buf_clone(rb, GFP_ATOMIC);
-    struct dtp *dtp    = &flow->dtp;
+    struct dtp *dtp    = flow->dtp;
 
     if (unlikely(!crb)) {
         RPD(1, "OOM\n");
@@ -593,10 +988,10 @@ rl_rtxq_push(struct flow_entry *flow, struct rl_buf *rb)
      * started. */
     rb_list_enq(crb, &dtp->rtxq);
     dtp->rtxq_len++;
-    if (!timer_pending(&dtp->rtx_tmr)) {
+    if (!rl_tw_pending(&dtp->rtx_tmr)) {
         NPD("Forward rtx timer by %u\n",
             jiffies_to_msecs(RL_BUF_RTX(crb).rtx_jiffies - jiffies));
-        mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(crb).rtx_jiffies);
+        rl_tw_mod(&dtp->rtx_tmr, RL_BUF_RTX(crb).rtx_jiffies);
     }
     NPD("cloning [%lu] into rtxq\n", (long unsigned)RL_BUF_PCI(crb)->seqnum);
 
@@ -615,69 +1010,55 @@ flow_blocked(struct rl_flow_config *cfg, struct dtp *dtp)
 static bool
 rl_normal_flow_writeable(struct flow_entry *flow)
 {
-    return !flow_blocked(&flow->cfg, &flow->dtp);
+    struct dtp *dtp = flow->dtp;
+    struct flow_entry *peer;
+    bool ret;
+
+    if (!dtp) {
+        return false;
+    }
+
+    if (rcu_access_pointer(dtp->local_peer)) {
+        rcu_read_lock();
+        peer = rcu_dereference(dtp->local_peer);
+        ret  = peer && peer->txrx.rx_qsize <= RL_RXQ_SIZE_MAX;
+        rcu_read_unlock();
+        if (peer) {
+            return ret;
+        }
+    }
+
+    return !flow_blocked(&flow->cfg, dtp);
 }
 
+/* Sender side of DTP, called under DTP lock. Returns -EAGAIN if the
+ * flow is blocked, without taking ownership of '*rbp'. On success, '*rbp'
+ * is the PDU to be transmitted, or NULL if the DTP retained it. */
 static int
-rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
-                    struct rl_buf *rb, bool maysleep)
+dtp_snd(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf **rbp)
 {
-    struct rina_pci *pci;
-    struct dtp *dtp      = &flow->dtp;
+    struct rl_buf *rb    = *rbp;
+    struct dtp *dtp      = flow->dtp;
     struct fc_config *fc = &flow->cfg.dtcp.fc;
-    bool dtcp_present    = flow->cfg.dtcp_present;
-
-    spin_lock_bh(&dtp->lock);
-
-    /* Token bucket traffic shaping. */
-    if (flow->cfg.dtcp.bandwidth) {
-        while (dtp->tkbk.bucket_size < rb->len) {
-            ktime_t now;
-            unsigned long us;
-
-            if (!maysleep) {
-                spin_unlock_bh(&dtp->lock);
-                return -EAGAIN;
-            }
-
-            /* We are going to sleep, stop the inactivity timer
-             * (see below). */
-            del_timer(&dtp->snd_inact_tmr);
-
-            spin_unlock_bh(&dtp->lock);
-            msleep(dtp->tkbk.intval_ms);
-            spin_lock_bh(&dtp->lock);
-
-            now = ktime_get();
-            us  = ktime_to_us(ktime_sub(now, dtp->tkbk.t_last_refill));
-            if (dtp->tkbk.bucket_size < rb->len &&
-                us >= dtp->tkbk.intval_ms * 1000) {
-                dtp->tkbk.bucket_size +=
-                    ((flow->cfg.dtcp.bandwidth / 8) * us) / 1000000;
-                dtp->tkbk.t_last_refill = now;
-            }
-        }
-        dtp->tkbk.bucket_size -= rb->len;
-    }
+    struct rina_pci *pci;
 
     if (unlikely(flow_blocked(&flow->cfg, dtp))) {
         /* POL: FlowControlOverrun */
 
         /* Stop the sender inactivity timer. It will be
          * started again when we will be invoked again. */
-        del_timer(&dtp->snd_inact_tmr);
-
-        spin_unlock_bh(&dtp->lock);
+        dtp->flags &= ~DTP_F_SND_INACT;
 
         /* Backpressure. Don't drop the PDU, we will be
          * invoked again. */
         return -EAGAIN;
     }
 
+    *rbp = NULL;
+
     if (unlikely(rl_buf_pci_push(rb))) {
         PE("pci_push() failed\n");
         flow->stats.tx_err++;
-        spin_unlock_bh(&dtp->lock);
         rl_buf_free(rb);
 
         return -ENOSPC;
@@ -686,7 +1067,7 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     pci            = RL_BUF_PCI(rb);
     pci->dst_addr  = flow->remote_addr;
     pci->src_addr  = ipcp->addr;
-    pci->qos_id    = 0;
+    pci->qos_id    = flow->cfg.qos_id;
     pci->dst_cep   = flow->remote_cep;
     pci->src_cep   = flow->local_cep;
     pci->pdu_type  = PDU_T_DT;
@@ -702,7 +1083,7 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pci->pdu_flags |= PDU_F_DRF;
     }
 
-    if (!dtcp_present) {
+    if (!flow->cfg.dtcp_present) {
         /* DTCP not present */
         dtp->snd_lwe           = dtp->next_seq_num_to_send; /* WFS */
         dtp->last_seq_num_sent = pci->seqnum;
@@ -728,93 +1109,716 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
             }
         }
 
-        if (rb && flow->cfg.dtcp.rtx_control) {
-            int ret = rl_rtxq_push(flow, rb);
+        if (rb && flow->cfg.dtcp.rtx_control) {
+            int ret = rl_rtxq_push(flow, rb);
+
+            if (unlikely(ret)) {
+                flow->stats.tx_pkt--;
+                flow->stats.tx_byte -= rb->len;
+                flow->stats.tx_err++;
+                rl_buf_free(rb);
+
+                return ret;
+            }
+        }
+
+        dtp_snd_activity(dtp);
+    }
+
+    *rbp = rb;
+
+    return 0;
+}
+
+static int
+rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                    struct rl_buf *rb, bool maysleep)
+{
+    struct dtp *dtp = flow->dtp;
+    bool local      = false;
+    int ret;
+
+    if (unlikely(!dtp)) {
+        /* The flow has not been configured yet. */
+        rl_buf_free(rb);
+        return -ENXIO;
+    }
+
+again:
+    if (rcu_access_pointer(dtp->local_peer)) {
+        local = true;
+        ret   = rl_normal_local_write(flow, rb);
+        if (ret != -ENOTCONN) {
+            return ret;
+        }
+    }
+
+    spin_lock_bh(&dtp->lock);
+
+    if (unlikely(!local && rcu_access_pointer(dtp->local_peer))) {
+        /* The flow has been paired in the meantime, and the first SDU
+         * must not go through EFCP. */
+        spin_unlock_bh(&dtp->lock);
+        goto again;
+    }
+
+    /* Token bucket traffic shaping. */
+    if (flow->cfg.dtcp.bandwidth) {
+        while (dtp->tkbk.bucket_size < rb->len) {
+            ktime_t now;
+            unsigned long us;
+
+            if (!maysleep) {
+                spin_unlock_bh(&dtp->lock);
+                return -EAGAIN;
+            }
+
+            /* We are going to sleep, stop the inactivity timer
+             * (see below). */
+            dtp->flags &= ~DTP_F_SND_INACT;
+
+            spin_unlock_bh(&dtp->lock);
+            msleep(dtp->tkbk.intval_ms);
+            spin_lock_bh(&dtp->lock);
+
+            now = ktime_get();
+            us  = ktime_to_us(ktime_sub(now, dtp->tkbk.t_last_refill));
+            if (dtp->tkbk.bucket_size < rb->len &&
+                us >= dtp->tkbk.intval_ms * 1000) {
+                dtp->tkbk.bucket_size +=
+                    ((flow->cfg.dtcp.bandwidth / 8) * us) / 1000000;
+                dtp->tkbk.t_last_refill = now;
+            }
+        }
+        dtp->tkbk.bucket_size -= rb->len;
+    }
+
+    ret = dtp_snd(ipcp, flow, &rb);
+
+    spin_unlock_bh(&dtp->lock);
+
+    if (ret || rb == NULL) {
+        return ret;
+    }
+
+    return rmt_tx(ipcp, flow->remote_addr, rb, maysleep);
+}
+
+static int
+rl_normal_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                          struct rb_list *rbs, bool maysleep)
+{
+    struct dtp *dtp = flow->dtp;
+    struct rb_list txq;
+    int ret = 0;
+    int err;
+
+    if (!dtp || flow->cfg.dtcp.bandwidth ||
+        rcu_access_pointer(dtp->local_peer)) {
+        /* Traffic shaping may need to sleep for each SDU, and local
+         * flows bypass DTP. */
+        return __rl_sdu_write_batch(ipcp, flow, rbs, maysleep);
+    }
+
+    rb_list_init(&txq);
+
+    spin_lock_bh(&dtp->lock);
+    if (unlikely(rcu_access_pointer(dtp->local_peer))) {
+        /* Paired in the meantime (see rl_normal_sdu_write()). */
+        spin_unlock_bh(&dtp->lock);
+        return __rl_sdu_write_batch(ipcp, flow, rbs, maysleep);
+    }
+    while (!rb_list_empty(rbs)) {
+        struct rl_buf *rb = rb_list_front(rbs);
+
+        rb_list_del(rb);
+        err = dtp_snd(ipcp, flow, &rb);
+        if (unlikely(err == -EAGAIN)) {
+            rb_list_push(rb, rbs);
+            ret = err;
+            break;
+        }
+        if (unlikely(err && !ret)) {
+            ret = err;
+        }
+        if (rb) {
+            rb_list_enq(rb, &txq);
+        }
+    }
+    spin_unlock_bh(&dtp->lock);
+
+    /* All the PDUs of a flow go to the same remote address. */
+    err = rmt_tx_batch(ipcp, flow->remote_addr, &txq, maysleep);
+
+    return ret ? ret : err;
+}
+
+static int
+rl_normal_mgmt_pci_push(struct ipcp_entry *ipcp, struct rl_buf *rb,
+                        rl_addr_t dst_addr)
+{
+    struct rina_pci *pci;
+
+    if (unlikely(rl_buf_pci_push(rb))) {
+        return -ENOSPC;
+    }
+
+    pci            = RL_BUF_PCI(rb);
+    pci->dst_addr  = dst_addr;
+    pci->src_addr  = ipcp->addr;
+    pci->qos_id    = 0; /* Not valid. */
+    pci->dst_cep   = 0; /* Not valid. */
+    pci->src_cep   = 0; /* Not valid. */
+    pci->pdu_type  = PDU_T_MGMT;
+    pci->pdu_flags = 0; /* Not valid. */
+    pci->pdu_len   = rb->len;
+    pci->seqnum    = 0; /* Not valid. */
+
+    return 0;
+}
+
+/* Replicate a mgmt PDU to the members of a multicast group, except for
+ * the N-1 flow specified by the local port (if valid). The replicas
+ * are addressed to the neighbors (null destination address), which
+ * consume them without forwarding. */
+static int
+rl_normal_mgmt_mcast(struct ipcp_entry *ipcp, const struct rl_mgmt_hdr *mhdr,
+                     struct rl_buf *rb, struct flow_entry **lower_flow)
+{
+    struct flow_entry *exclude = NULL;
+    int ret;
+
+    ret = rl_normal_mgmt_pci_push(ipcp, rb, RL_ADDR_NULL);
+    if (ret) {
+        return ret;
+    }
+
+    if (mhdr->local_port != RL_PORT_ID_NONE) {
+        exclude = flow_get(mhdr->local_port);
+    }
+
+    ret = rmt_tx_mcast(ipcp, mhdr->remote_addr, rb, exclude, false);
+    if (exclude) {
+        flow_put(exclude);
+    }
+    *lower_flow = NULL;
+
+    return ret;
+}
+
+/* Get N-1 flow and N-1 IPCP where the mgmt PDU should be
+ * written and prepare the mgmt SDU. This does not take ownership
+ * of the PDU, since it's not a transmission routine. The exception
+ * are PDUs directed to a multicast group, which are replicated and
+ * transmitted here: in that case '*lower_flow' is set to NULL and
+ * the caller only has to free the PDU. */
+static int
+rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
+                         const struct rl_mgmt_hdr *mhdr, struct rl_buf *rb,
+                         struct ipcp_entry **lower_ipcp,
+                         struct flow_entry **lower_flow)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    rl_addr_t dst_addr     = RL_ADDR_NULL; /* Not valid. */
+
+    if (mhdr->type == RLITE_MGMT_HDR_T_OUT_DST_ADDR) {
+        *lower_flow = rl_pduft_lookup(priv, mhdr->remote_addr, 0);
+        if (unlikely(!(*lower_flow))) {
+            if (rl_pduft_is_mcast(priv, mhdr->remote_addr)) {
+                return rl_normal_mgmt_mcast(ipcp, mhdr, rb, lower_flow);
+            }
+            RPD(2, "No route to IPCP %lu, dropping packet\n",
+                (long unsigned)mhdr->remote_addr);
+
+            return -EHOSTUNREACH;
+        }
+        dst_addr = mhdr->remote_addr;
+
+    } else if (mhdr->type == RLITE_MGMT_HDR_T_OUT_LOCAL_PORT) {
+        *lower_flow = flow_get(mhdr->local_port);
+        if (!(*lower_flow) || (*lower_flow)->upper.ipcp != ipcp) {
+            RPD(2,
+                "Invalid mgmt header local port %u, "
+                "dropping packet\n",
+                mhdr->local_port);
+
+            if (*lower_flow) {
+                flow_put(*lower_flow);
+            }
+
+            return -EINVAL;
+        }
+        flow_put(*lower_flow);
+
+    } else {
+        return -EINVAL;
+    }
+    *lower_ipcp = (*lower_flow)->txrx.ipcp;
+    BUG_ON(!(*lower_ipcp));
+
+    /* Caller can proceed and send the mgmt PDU. */
+    return rl_normal_mgmt_pci_push(ipcp, rb, dst_addr);
+}
+
+static void
+rx_cpumap_free_rcu(struct rcu_head *rcu)
+{
+    struct rl_normal_cpumap *map =
+        container_of(rcu, struct rl_normal_cpumap, rcu);
+
+    rl_free(map, RL_MT_MISC);
+}
+
+/* Set the CPUs used for receive-side flow steering, using an hex
+ * mask like the rps_cpus sysfs attribute. An empty mask disables
+ * steering. Called under the IPCP lock. */
+static int
+rl_normal_rx_cpumask_set(struct rl_normal *priv, const char *param_value)
+{
+    struct rl_normal_cpumap *map = NULL, *old;
+    cpumask_var_t mask;
+    int ret;
+    int cpu;
+
+    if (!alloc_cpumask_var(&mask, GFP_KERNEL)) {
+        return -ENOMEM;
+    }
+
+    ret = cpumask_parse(param_value, mask);
+    if (ret) {
+        goto out;
+    }
+    cpumask_and(mask, mask, cpu_online_mask);
+
+    if (!cpumask_empty(mask)) {
+        map = rl_alloc(sizeof(*map) +
+                           cpumask_weight(mask) * sizeof(map->cpus[0]),
+                       GFP_KERNEL | __GFP_ZERO, RL_MT_MISC);
+        if (!map) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        for_each_cpu(cpu, mask)
+        {
+            map->cpus[map->len++] = cpu;
+        }
+    }
+
+    old = rcu_dereference_protected(priv->rx_cpumap, 1);
+    rcu_assign_pointer(priv->rx_cpumap, map);
+    if (old) {
+        call_rcu(&old->rcu, rx_cpumap_free_rcu);
+    }
+    PI("IPCP %u receive steering on %u CPUs\n", priv->ipcp->id,
+       map ? map->len : 0);
+out:
+    free_cpumask_var(mask);
+
+    return ret;
+}
+
+/*
+ * In-kernel PDU generator and sink, to benchmark the datapath without
+ * the system call overhead. The generator injects data transfer PDUs
+ * either into the RMT, as if they were sent by a local flow, or into the
+ * receive path, as if they were received from an N-1 flow. The sink
+ * consumes the PDUs addressed to this IPCP on the RL_PKTGEN_CEP CEP-id,
+ * counting them and measuring their latency.
+ */
+
+#define RL_PKTGEN_BUDGET 1024 /* max PDUs per work invocation */
+
+/* Payload of the generated PDUs. */
+struct rl_pktgen_hdr {
+    uint64_t seqnum;
+    int64_t tstamp; /* in nanoseconds */
+} __attribute__((__packed__));
+
+struct rl_pktgen {
+    struct rl_normal *priv;
+
+    /* Generator configuration. */
+    rlm_addr_t dst_addr;
+    rl_cepid_t dst_cep;
+    rl_qosid_t qos_id;
+    unsigned int size;  /* SDU size, in bytes */
+    unsigned int rate;  /* PDUs per second, 0 means no limit */
+    uint64_t count;     /* PDUs to be sent, 0 means no limit */
+    bool rx;            /* inject into the receive path */
+
+    /* Generator state, only accessed by the work or after it has been
+     * cancelled. */
+    struct delayed_work work;
+    bool running;
+    ktime_t t_start;
+    uint64_t sent;
+    uint64_t errors;
+
+    /* Sink state. */
+    spinlock_t lock;
+    bool sink_on;
+    uint64_t rcvd;
+    uint64_t rcvd_bytes;
+    ktime_t t_first;
+    ktime_t t_last;
+    int64_t lat_min;
+    int64_t lat_max;
+    int64_t lat_sum;
+};
+
+static struct rl_buf *rl_normal_sdu_rx(struct ipcp_entry *ipcp,
+                                       struct rl_buf *rb,
+                                       struct flow_entry *lower_flow);
+
+static struct rl_buf *
+pktgen_pdu_build(struct ipcp_entry *ipcp, struct rl_pktgen *pg)
+{
+    struct rl_pktgen_hdr *hdr;
+    struct rina_pci *pci;
+    struct rl_buf *rb;
+
+    rb = rl_buf_alloc(pg->size, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+    if (unlikely(!rb)) {
+        return NULL;
+    }
+    rl_buf_append(rb, pg->size);
+    memset(RL_BUF_DATA(rb), 0, pg->size);
+    hdr         = (struct rl_pktgen_hdr *)RL_BUF_DATA(rb);
+    hdr->seqnum = pg->sent;
+    hdr->tstamp = ktime_to_ns(ktime_get());
+
+    if (unlikely(rl_buf_pci_push(rb))) {
+        rl_buf_free(rb);
+        return NULL;
+    }
+    pci            = RL_BUF_PCI(rb);
+    pci->dst_addr  = pg->dst_addr;
+    pci->src_addr  = ipcp->addr;
+    pci->qos_id    = pg->qos_id;
+    pci->dst_cep   = pg->dst_cep;
+    pci->src_cep   = RL_PKTGEN_CEP;
+    pci->pdu_type  = PDU_T_DT;
+    pci->pdu_flags = 0;
+    pci->pdu_len   = rb->len;
+    pci->seqnum    = pg->sent;
+
+    return rb;
+}
+
+static void
+pktgen_report(struct rl_pktgen *pg)
+{
+    uint64_t us = ktime_us_delta(ktime_get(), pg->t_start);
+
+    PI("pktgen: IPCP %u sent %llu PDUs (%llu errors) in %llu us, "
+       "%llu pps\n",
+       pg->priv->ipcp->id, (long long unsigned)pg->sent,
+       (long long unsigned)pg->errors, (long long unsigned)us,
+       (long long unsigned)(us ? div64_u64(pg->sent * 1000000, us) : 0));
+}
+
+static void
+pktgen_work(struct work_struct *w)
+{
+    struct rl_pktgen *pg =
+        container_of(to_delayed_work(w), struct rl_pktgen, work);
+    struct ipcp_entry *ipcp = pg->priv->ipcp;
+    unsigned int budget     = RL_PKTGEN_BUDGET;
+    uint64_t target         = ~0ULL;
+
+    if (pg->rate) {
+        /* Number of PDUs that should have been sent by now. */
+        target = div64_u64(
+            (uint64_t)ktime_us_delta(ktime_get(), pg->t_start) * pg->rate,
+            1000000);
+    }
+    if (pg->count && target > pg->count) {
+        target = pg->count;
+    }
+
+    while (pg->sent < target && budget--) {
+        struct rl_buf *rb = pktgen_pdu_build(ipcp, pg);
+
+        if (unlikely(!rb)) {
+            pg->errors++;
+            break;
+        }
+        pg->sent++;
+
+        if (pg->rx) {
+            /* The receive path normally runs in softirq context. */
+            local_bh_disable();
+            rb = rl_normal_sdu_rx(ipcp, rb, NULL);
+            local_bh_enable();
+            if (rb) {
+                rl_buf_free(rb);
+            }
+        } else if (rmt_tx(ipcp, pg->dst_addr, rb, false)) {
+            pg->errors++;
+        }
+    }
+
+    if (pg->count && pg->sent >= pg->count) {
+        pg->running = false;
+        pktgen_report(pg);
+        return;
+    }
+
+    /* Reschedule immediately if we ran out of budget, otherwise wait
+     * for the next tick to send the PDUs that will be due by then. */
+    schedule_delayed_work(&pg->work, pg->sent < target ? 0 : 1);
+}
+
+static void
+pktgen_stop(struct rl_pktgen *pg)
+{
+    cancel_delayed_work_sync(&pg->work);
+    if (pg->running) {
+        pg->running = false;
+        pktgen_report(pg);
+    }
+}
+
+static void
+pktgen_sink_report(struct rl_pktgen *pg)
+{
+    uint64_t us = ktime_us_delta(pg->t_last, pg->t_first);
+    uint64_t n  = pg->rcvd;
+
+    PI("pktgen: IPCP %u sink received %llu PDUs, %llu bytes in %llu us, "
+       "%llu pps, latency min/avg/max %lld/%lld/%lld ns\n",
+       pg->priv->ipcp->id, (long long unsigned)n,
+       (long long unsigned)pg->rcvd_bytes, (long long unsigned)us,
+       (long long unsigned)(us ? div64_u64(n * 1000000, us) : 0),
+       (long long)(n ? pg->lat_min : 0),
+       (long long)(n ? div64_s64(pg->lat_sum, n) : 0),
+       (long long)(n ? pg->lat_max : 0));
+}
+
+/* Consume a PDU for the sink, called in softirq context. */
+static void
+pktgen_sink_rx(struct rl_pktgen *pg, struct rl_buf *rb)
+{
+    ktime_t now = ktime_get();
+    struct rl_pktgen_hdr *hdr;
+    int64_t lat = -1;
+
+    if (rb->len >= sizeof(struct rina_pci) + sizeof(*hdr)) {
+        hdr = (struct rl_pktgen_hdr *)(RL_BUF_PCI(rb) + 1);
+        lat = ktime_to_ns(now) - hdr->tstamp;
+    }
+
+    spin_lock(&pg->lock);
+    if (pg->rcvd++ == 0) {
+        pg->t_first = now;
+        pg->lat_min = pg->lat_max = lat;
+    }
+    pg->t_last = now;
+    pg->rcvd_bytes += rb->len;
+    if (lat >= 0) {
+        pg->lat_sum += lat;
+        if (lat < pg->lat_min) {
+            pg->lat_min = lat;
+        }
+        if (lat > pg->lat_max) {
+            pg->lat_max = lat;
+        }
+    }
+    spin_unlock(&pg->lock);
+
+    rl_buf_free(rb);
+}
 
-            if (unlikely(ret)) {
-                flow->stats.tx_pkt--;
-                flow->stats.tx_byte -= rb->len;
-                flow->stats.tx_err++;
-                spin_unlock_bh(&dtp->lock);
-                rl_buf_free(rb);
+static inline bool
+pktgen_sink_match(struct rl_normal *priv, struct rina_pci *pci)
+{
+    struct rl_pktgen *pg = READ_ONCE(priv->pktgen);
 
-                return ret;
-            }
-        }
+    return unlikely(pg && READ_ONCE(pg->sink_on)) &&
+           pci->dst_cep == RL_PKTGEN_CEP;
+}
 
-        mod_timer(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
-    }
+/* Allocate the generator state on first use. It is only freed when the
+ * IPCP is destroyed, so that the receive path can access it without
+ * locking. Called under the IPCP lock. */
+static struct rl_pktgen *
+pktgen_get(struct rl_normal *priv)
+{
+    struct rl_pktgen *pg = priv->pktgen;
 
-    spin_unlock_bh(&dtp->lock);
+    if (pg) {
+        return pg;
+    }
 
-    if (unlikely(rb == NULL)) {
-        return 0;
+    pg = rl_alloc(sizeof(*pg), GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!pg) {
+        return NULL;
     }
+    pg->priv = priv;
+    INIT_DELAYED_WORK(&pg->work, pktgen_work);
+    spin_lock_init(&pg->lock);
+    smp_wmb();
+    WRITE_ONCE(priv->pktgen, pg);
 
-    return rmt_tx(ipcp, flow->remote_addr, rb, maysleep);
+    return pg;
 }
 
-/* Get N-1 flow and N-1 IPCP where the mgmt PDU should be
- * written and prepare the mgmt SDU. This does not take ownership
- * of the PDU, since it's not a transmission routine. */
+static void
+pktgen_destroy(struct rl_normal *priv)
+{
+    struct rl_pktgen *pg = priv->pktgen;
+
+    if (!pg) {
+        return;
+    }
+    pktgen_stop(pg);
+    WRITE_ONCE(priv->pktgen, NULL);
+    synchronize_rcu(); /* wait for the receive path to leave the sink */
+    rl_free(pg, RL_MT_SHIM);
+}
+
+/* Parse the generator configuration, e.g. "dst=7,size=1000,rate=100000",
+ * and start it. The keys not specified take default values. Called under
+ * the IPCP lock. */
 static int
-rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
-                         const struct rl_mgmt_hdr *mhdr, struct rl_buf *rb,
-                         struct ipcp_entry **lower_ipcp,
-                         struct flow_entry **lower_flow)
+pktgen_start(struct rl_normal *priv, const char *param_value)
 {
-    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct rina_pci *pci;
-    rl_addr_t dst_addr = RL_ADDR_NULL; /* Not valid. */
+    struct ipcp_entry *ipcp = priv->ipcp;
+    char *str, *pos, *tok;
+    struct rl_pktgen *pg;
+    int ret = 0;
 
-    if (mhdr->type == RLITE_MGMT_HDR_T_OUT_DST_ADDR) {
-        *lower_flow = rl_pduft_lookup(priv, mhdr->remote_addr);
-        if (unlikely(!(*lower_flow))) {
-            RPD(2, "No route to IPCP %lu, dropping packet\n",
-                (long unsigned)mhdr->remote_addr);
+    pg = pktgen_get(priv);
+    if (!pg) {
+        return -ENOMEM;
+    }
+    pktgen_stop(pg);
 
-            return -EHOSTUNREACH;
-        }
-        dst_addr = mhdr->remote_addr;
+    pg->dst_addr = ipcp->addr;
+    pg->dst_cep  = RL_PKTGEN_CEP;
+    pg->qos_id   = 0;
+    pg->size     = 64;
+    pg->rate     = 0;
+    pg->count    = 1000000;
+    pg->rx       = false;
 
-    } else if (mhdr->type == RLITE_MGMT_HDR_T_OUT_LOCAL_PORT) {
-        *lower_flow = flow_get(mhdr->local_port);
-        if (!(*lower_flow) || (*lower_flow)->upper.ipcp != ipcp) {
-            RPD(2,
-                "Invalid mgmt header local port %u, "
-                "dropping packet\n",
-                mhdr->local_port);
+    str = pos = kstrdup(param_value, GFP_KERNEL);
+    if (!str) {
+        return -ENOMEM;
+    }
 
-            if (*lower_flow) {
-                flow_put(*lower_flow);
-            }
+    while (ret == 0 && (tok = strsep(&pos, ",")) != NULL) {
+        char *val = strchr(tok, '=');
 
-            return -EINVAL;
+        if (!val) {
+            ret = -EINVAL;
+            break;
         }
-        flow_put(*lower_flow);
+        *val++ = '\0';
+
+        if (strcmp(tok, "dst") == 0) {
+            uint64_t addr;
+
+            ret          = kstrtou64(val, 10, &addr);
+            pg->dst_addr = addr;
+        } else if (strcmp(tok, "cep") == 0) {
+            uint16_t cep;
+
+            ret         = kstrtou16(val, 10, &cep);
+            pg->dst_cep = cep;
+        } else if (strcmp(tok, "qos") == 0) {
+            uint16_t qos;
+
+            ret        = kstrtou16(val, 10, &qos);
+            pg->qos_id = qos;
+        } else if (strcmp(tok, "size") == 0) {
+            ret = kstrtouint(val, 10, &pg->size);
+        } else if (strcmp(tok, "rate") == 0) {
+            ret = kstrtouint(val, 10, &pg->rate);
+        } else if (strcmp(tok, "count") == 0) {
+            ret = kstrtou64(val, 10, &pg->count);
+        } else if (strcmp(tok, "mode") == 0) {
+            if (strcmp(val, "tx") == 0) {
+                pg->rx = false;
+            } else if (strcmp(val, "rx") == 0) {
+                pg->rx = true;
+            } else {
+                ret = -EINVAL;
+            }
+        } else {
+            ret = -EINVAL;
+        }
+    }
+    kfree(str);
 
-    } else {
+    if (ret) {
+        return ret;
+    }
+
+    if (pg->size < sizeof(struct rl_pktgen_hdr) ||
+        pg->size > ipcp->max_sdu_size) {
+        PE("Invalid pktgen size %u\n", pg->size);
         return -EINVAL;
     }
-    *lower_ipcp = (*lower_flow)->txrx.ipcp;
-    BUG_ON(!(*lower_ipcp));
 
-    if (unlikely(rl_buf_pci_push(rb))) {
-        return -ENOSPC;
+    PI("pktgen: IPCP %u starts sending %llu PDUs of %u bytes to %llu:%u "
+       "(qos %u, rate %u pps, %s mode)\n",
+       ipcp->id, (long long unsigned)pg->count, pg->size,
+       (long long unsigned)pg->dst_addr, (unsigned)pg->dst_cep,
+       (unsigned)pg->qos_id, pg->rate, pg->rx ? "rx" : "tx");
+    pg->sent    = 0;
+    pg->errors  = 0;
+    pg->t_start = ktime_get();
+    pg->running = true;
+    schedule_delayed_work(&pg->work, 0);
+
+    return 0;
+}
+
+/* Start, stop or report the generator and the sink. Called under the
+ * IPCP lock. */
+static int
+rl_normal_pktgen_config(struct rl_normal *priv, const char *param_name,
+                        const char *param_value)
+{
+    struct rl_pktgen *pg;
+
+    if (strcmp(param_name, "pktgen") == 0) {
+        if (strcmp(param_value, "stop") == 0) {
+            if (priv->pktgen) {
+                pktgen_stop(priv->pktgen);
+            }
+            return 0;
+        }
+        return pktgen_start(priv, param_value);
     }
 
-    pci            = RL_BUF_PCI(rb);
-    pci->dst_addr  = dst_addr;
-    pci->src_addr  = ipcp->addr;
-    pci->qos_id    = 0; /* Not valid. */
-    pci->dst_cep   = 0; /* Not valid. */
-    pci->src_cep   = 0; /* Not valid. */
-    pci->pdu_type  = PDU_T_MGMT;
-    pci->pdu_flags = 0; /* Not valid. */
-    pci->pdu_len   = rb->len;
-    pci->seqnum    = 0; /* Not valid. */
+    /* pktgen_sink */
+    pg = pktgen_get(priv);
+    if (!pg) {
+        return -ENOMEM;
+    }
+
+    if (strcmp(param_value, "on") == 0) {
+        spin_lock_bh(&pg->lock);
+        pg->rcvd       = 0;
+        pg->rcvd_bytes = 0;
+        pg->lat_sum    = 0;
+        WRITE_ONCE(pg->sink_on, true);
+        spin_unlock_bh(&pg->lock);
+    } else if (strcmp(param_value, "off") == 0) {
+        spin_lock_bh(&pg->lock);
+        WRITE_ONCE(pg->sink_on, false);
+        pktgen_sink_report(pg);
+        spin_unlock_bh(&pg->lock);
+    } else if (strcmp(param_value, "show") == 0) {
+        spin_lock_bh(&pg->lock);
+        pktgen_sink_report(pg);
+        spin_unlock_bh(&pg->lock);
+    } else {
+        return -EINVAL;
+    }
 
-    /* Caller can proceed and send the mgmt PDU. */
     return 0;
 }
 
@@ -834,6 +1838,13 @@ rl_normal_config(struct ipcp_entry *ipcp, const char *param_name,
             *notify    = (ipcp->addr != address);
             ipcp->addr = address;
         }
+    } else if (strcmp(param_name, "rx_cpumask") == 0) {
+        ret = rl_normal_rx_cpumask_set((struct rl_normal *)ipcp->priv,
+                                       param_value);
+    } else if (strcmp(param_name, "pktgen") == 0 ||
+               strcmp(param_name, "pktgen_sink") == 0) {
+        ret = rl_normal_pktgen_config((struct rl_normal *)ipcp->priv,
+                                      param_name, param_value);
     }
 
     return ret;
@@ -868,13 +1879,13 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->base.pdu_type          = pdu_type;
         pcic->base.pdu_flags         = 0;
         pcic->base.pdu_len           = rb->len;
-        pcic->base.seqnum            = flow->dtp.next_snd_ctl_seq++;
-        pcic->last_ctrl_seq_num_rcvd = flow->dtp.last_ctrl_seq_num_rcvd;
+        pcic->base.seqnum            = flow->dtp->next_snd_ctl_seq++;
+        pcic->last_ctrl_seq_num_rcvd = flow->dtp->last_ctrl_seq_num_rcvd;
         pcic->ack_nack_seq_num       = ack_nack_seq_num;
-        pcic->new_rwe                = flow->dtp.rcv_rwe;
-        pcic->new_lwe = flow->dtp.last_lwe_sent = flow->dtp.rcv_lwe;
-        pcic->my_rwe                            = flow->dtp.snd_rwe;
-        pcic->my_lwe                            = flow->dtp.snd_lwe;
+        pcic->new_rwe                = flow->dtp->rcv_rwe;
+        pcic->new_lwe = flow->dtp->last_lwe_sent = flow->dtp->rcv_lwe;
+        pcic->my_rwe                            = flow->dtp->snd_rwe;
+        pcic->my_lwe                            = flow->dtp->snd_lwe;
     }
 
     return rb;
@@ -897,23 +1908,24 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
         if (cfg->fc.fc_type == RLITE_FC_T_WIN) {
             rl_seq_t win_size = cfg->fc.cfg.w.initial_credit;
 
-            NPD("rcv_rwe [%lu] --> [%lu]\n", (long unsigned)flow->dtp.rcv_rwe,
-                (long unsigned)(flow->dtp.rcv_lwe + win_size));
-            flow->dtp.rcv_rwe = flow->dtp.rcv_lwe + win_size;
+            NPD("rcv_rwe [%lu] --> [%lu]\n", (long unsigned)flow->dtp->rcv_rwe,
+                (long unsigned)(flow->dtp->rcv_lwe + win_size));
+            flow->dtp->rcv_rwe = flow->dtp->rcv_lwe + win_size;
 
-            if ((flow->dtp.rcv_lwe <
-                 flow->dtp.last_lwe_sent + (win_size >> 1)) &&
+            if ((flow->dtp->rcv_lwe <
+                 flow->dtp->last_lwe_sent + (win_size >> 1)) &&
                 !ack_immediate && a) {
                 NPD("ACK delayed %lu %lu %lu\n",
-                    (long unsigned)flow->dtp.last_lwe_sent,
-                    (long unsigned)flow->dtp.rcv_lwe,
-                    (long unsigned)(flow->dtp.last_lwe_sent + (win_size >> 1)));
+                    (long unsigned)flow->dtp->last_lwe_sent,
+                    (long unsigned)flow->dtp->rcv_lwe,
+                    (long unsigned)(flow->dtp->last_lwe_sent +
+                                    (win_size >> 1)));
                 goto no_ack;
             }
             NPD("ACK immediate %lu %lu %lu\n",
-                (long unsigned)flow->dtp.last_lwe_sent,
-                (long unsigned)flow->dtp.rcv_lwe,
-                (long unsigned)(flow->dtp.last_lwe_sent + (win_size >> 1)));
+                (long unsigned)flow->dtp->last_lwe_sent,
+                (long unsigned)flow->dtp->rcv_lwe,
+                (long unsigned)(flow->dtp->last_lwe_sent + (win_size >> 1)));
         }
     }
 
@@ -921,7 +1933,7 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
      * way policies are more visible. */
     if (cfg->rtx_control) {
         /* POL: RcvrAck */
-        ack_nack_seq_num = flow->dtp.rcv_lwe_priv;
+        ack_nack_seq_num = flow->dtp->rcv_lwe_priv;
         pdu_type         = PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK;
         if (cfg->flow_control) {
             pdu_type |= PDU_T_CTRL | PDU_T_FC_BIT;
@@ -935,7 +1947,7 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
 
     if (pdu_type) {
         /* Stop the A timer, we are going to send an ACK. */
-        del_timer(&flow->dtp.a_tmr);
+        rl_tw_del(&flow->dtp->a_tmr);
         return ctrl_pdu_alloc(ipcp, flow, pdu_type, ack_nack_seq_num);
     }
 
@@ -943,8 +1955,8 @@ no_ack:
     /* We are not sending an immediate ACK, so we need
      * to start the A timer (if it was not already
      * started) */
-    if (a && !timer_pending(&flow->dtp.a_tmr)) {
-        mod_timer(&flow->dtp.a_tmr, jiffies + msecs_to_jiffies(a));
+    if (a && !rl_tw_pending(&flow->dtp->a_tmr)) {
+        rl_tw_mod(&flow->dtp->a_tmr, jiffies + msecs_to_jiffies(a));
         RPD(1, "start A timer\n");
     }
 
@@ -1013,7 +2025,7 @@ static int
 sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
 {
     struct rina_pci_ctrl *pcic = RL_BUF_PCI_CTRL(rb);
-    struct dtp *dtp            = &flow->dtp;
+    struct dtp *dtp            = flow->dtp;
     struct rb_list qrbs;
     struct rl_buf *qrb, *tmp;
 
@@ -1129,14 +2141,14 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
                     NPD("Forward rtx timer by %u\n",
                         jiffies_to_msecs(RL_BUF_RTX(cur).rtx_jiffies -
                                          jiffies));
-                    mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(cur).rtx_jiffies);
+                    rl_tw_mod(&dtp->rtx_tmr, RL_BUF_RTX(cur).rtx_jiffies);
                     break;
                 }
             }
 
             if (rb_list_empty(&dtp->rtxq)) {
                 /* Everything has been acked, we can stop the rtx timer. */
-                del_timer(&dtp->rtx_tmr);
+                rl_tw_del(&dtp->rtx_tmr);
             }
 
             break;
@@ -1170,21 +2182,103 @@ out:
     return 0;
 }
 
+static void sdu_rx_local_batch(struct ipcp_entry *ipcp, struct rb_list *rbs);
+
+/* Max number of PDUs in a receive backlog. */
+#define RXQ_MAX_LEN 1024
+
+/* Try to steer a received PDU to the backlog of the CPU selected
+ * by hashing (dst_cep, src_addr), so that all the PDUs of the same
+ * flow are processed on the same CPU. As RPS does, the PDU goes
+ * through the backlog even if the selected CPU is the current one,
+ * since the backlog may still hold earlier PDUs of the same flow.
+ * Returns false if the PDU must be processed on the current CPU. */
+static bool
+rx_steer(struct rl_normal *priv, struct rl_buf *rb)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+    struct rl_normal_cpumap *map;
+    struct rl_normal_rxq *rxq;
+    bool steered = false;
+    u64 src_addr;
+    u32 hash;
+    int cpu;
+
+    rcu_read_lock();
+    map = rcu_dereference(priv->rx_cpumap);
+    if (!map) {
+        goto out;
+    }
+
+    src_addr = pci->src_addr;
+    hash =
+        jhash_3words(pci->dst_cep, (u32)src_addr, (u32)(src_addr >> 32), 0);
+    cpu = map->cpus[hash % map->len];
+    if (unlikely(!cpu_online(cpu))) {
+        goto out;
+    }
+
+    rxq = per_cpu_ptr(priv->rxqs, cpu);
+    spin_lock_bh(&rxq->lock);
+    if (unlikely(rxq->qlen >= RXQ_MAX_LEN)) {
+        spin_unlock_bh(&rxq->lock);
+        RPD(2, "backlog overrun on CPU %d: dropping PDU\n", cpu);
+        rl_buf_free(rb);
+        steered = true;
+        goto out;
+    }
+    rb_list_enq(rb, &rxq->q);
+    rxq->qlen++;
+    spin_unlock_bh(&rxq->lock);
+    queue_work_on(cpu, rl_normal_rx_wq, &rxq->work);
+    steered = true;
+out:
+    rcu_read_unlock();
+
+    return steered;
+}
+
+/* Process the PDUs in the backlog of the current CPU. */
+static void
+rx_steer_work(struct work_struct *w)
+{
+    struct rl_normal_rxq *rxq = container_of(w, struct rl_normal_rxq, work);
+
+    for (;;) {
+        struct rb_list rbs;
+        struct rl_buf *rb, *tmp;
+
+        /* Grab the whole backlog, and process it as a batch. */
+        rb_list_init(&rbs);
+        spin_lock_bh(&rxq->lock);
+        rb_list_foreach_safe (rb, tmp, &rxq->q) {
+            rb_list_del(rb);
+            rb_list_enq(rb, &rbs);
+        }
+        rxq->qlen = 0;
+        spin_unlock_bh(&rxq->lock);
+
+        if (rb_list_empty(&rbs)) {
+            break;
+        }
+
+        local_bh_disable();
+        sdu_rx_local_batch(rxq->priv->ipcp, &rbs);
+        local_bh_enable();
+    }
+}
+
+/* Validate a received PDU and check whether it is a management PDU for
+ * this IPCP. Returns NULL if the PDU was dropped. Otherwise returns the
+ * PDU, and sets '*mgmt' if it must be queued to userspace. */
 static struct rl_buf *
-rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
-                 struct flow_entry *lower_flow)
+sdu_rx_prepare(struct ipcp_entry *ipcp, struct rl_buf *rb,
+               struct flow_entry *lower_flow, bool *mgmt)
 {
     struct rina_pci *pci = RL_BUF_PCI(rb);
-    struct flow_entry *flow;
-    rl_seq_t seqnum    = pci->seqnum;
-    struct rl_buf *crb = NULL;
-    unsigned int a     = 0;
-    rl_seq_t gap;
-    struct dtp *dtp;
-    bool deliver;
-    bool drop;
-    bool qlimit;
-    int ret = 0;
+    int ret;
+
+    *mgmt = false;
 
     if (unlikely(rb->len < sizeof(struct rina_pci))) {
         RPD(2, "Dropping SDU shorter [%u] than PCI\n", (unsigned int)rb->len);
@@ -1205,6 +2299,8 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         struct rl_mgmt_hdr *mhdr;
         rlm_addr_t src_addr = pci->src_addr;
 
+        *mgmt = true;
+
         if (!lower_flow) {
             /* The caller is rl_sdu_rx_shortcut(): don't touch the
              * rb and return -ENOMSG to tell him the shortcut is not
@@ -1221,9 +2317,10 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         ret                       = rl_buf_pci_pop(rb);
         BUG_ON(ret); /* We already check bounds above. */
 
-        /* Push a management header using the room made available
-         * by rl_buf_pci_pop(), if possible. */
-        if (sizeof(*mhdr) > sizeof(struct rina_pci)) {
+        /* Push a management header in place of the PCI. The shims
+         * reserve enough headroom for this (see rl_rxhdroom()), so
+         * that we need to reallocate only if a lower layer did not. */
+        if (unlikely(!rl_buf_push_room(rb, sizeof(*mhdr)))) {
             struct rl_buf *nrb =
                 rl_buf_alloc(rb->len, sizeof(*mhdr), 0, GFP_ATOMIC);
 
@@ -1244,49 +2341,100 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         mhdr->type        = RLITE_MGMT_HDR_T_IN;
         mhdr->local_port  = lower_flow->local_port;
         mhdr->remote_addr = src_addr;
+    }
 
-        /* Tell the caller to queue this rb to userspace. */
-        return rb;
+    return rb;
+}
 
-    } else {
-        /* PDU which is not PDU_T_MGMT or it is to be forwarded. */
-    }
+static struct rl_buf *
+rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
+                 struct flow_entry *lower_flow)
+{
+    struct rb_list rbs;
+    bool mgmt;
 
-    if (pci->dst_addr != ipcp->addr) {
-        /* The PDU is not for this IPCP, forward it. Don't propagate the
-         * error code of rmt_tx(), since caller does not need it. */
-        rmt_tx(ipcp, pci->dst_addr, rb, false);
-        return NULL;
+    rb = sdu_rx_prepare(ipcp, rb, lower_flow, &mgmt);
+    if (!rb || mgmt) {
+        /* Dropped, or to be queued to userspace by the caller. */
+        return rb;
     }
 
-    flow = flow_get_by_cep(pci->dst_cep);
-    if (!flow) {
-        RPD(2, "No flow for cep-id %u: dropping PDU\n", pci->dst_cep);
-        rl_buf_free(rb);
-        return NULL;
+    if (!rx_steer((struct rl_normal *)ipcp->priv, rb)) {
+        rb_list_init(&rbs);
+        rb_list_enq(rb, &rbs);
+        sdu_rx_local_batch(ipcp, &rbs);
     }
 
-    if (pci->pdu_type != PDU_T_DT) {
-        /* This is a control PDU. */
-        sdu_rx_ctrl(ipcp, flow, rb);
-        flow_put(flow);
+    return NULL;
+}
+
+static void
+rl_normal_sdu_rx_batch(struct ipcp_entry *ipcp, struct rb_list *rbs,
+                       struct flow_entry *lower_flow)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct rb_list localq;
+    struct rb_list mgmtq;
+    struct rl_buf *rb, *tmp;
+
+    rb_list_init(&localq);
+    rb_list_init(&mgmtq);
 
-        return NULL; /* ret */
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        bool mgmt;
+
+        rb_list_del(rb);
+        rb = sdu_rx_prepare(ipcp, rb, lower_flow, &mgmt);
+        if (!rb) {
+            continue;
+        }
+        if (mgmt) {
+            rb_list_enq(rb, &mgmtq);
+        } else if (!rx_steer(priv, rb)) {
+            rb_list_enq(rb, &localq);
+        }
     }
 
-    /* This is data transfer PDU. */
+    sdu_rx_local_batch(ipcp, &localq);
 
-    dtp = &flow->dtp;
+    /* Give the management SDUs back to the caller. */
+    rb_list_foreach_safe (rb, tmp, &mgmtq) {
+        rb_list_del(rb);
+        rb_list_enq(rb, rbs);
+    }
+}
 
-    /* Ask rl_sdu_rx_flow() to limit the userspace queue only
-     * if this flow does not use flow control. If flow control
-     * is used, it will limit the userspace queue automatically. */
-    qlimit = (flow->cfg.dtcp.flow_control == 0);
+/* Append a PDU to the list of SDUs to be delivered to the upper layer,
+ * after removing its PCI. */
+static inline void
+sdu_rx_deliver(struct rl_buf *rb, rl_seq_t seqnum, struct rb_list *delq)
+{
+    RL_BUF_RX(rb).cons_seqnum = seqnum;
+    if (unlikely(rl_buf_pci_pop(rb))) {
+        rl_buf_free(rb);
+        return;
+    }
+    rb_list_enq(rb, delq);
+}
 
-    spin_lock_bh(&dtp->lock);
+/* Receiver side of DTP for a data transfer PDU, called under DTP lock.
+ * The SDUs ready to be delivered are appended to 'delq'. Returns a
+ * control PDU to be transmitted, if any. */
+static struct rl_buf *
+sdu_rx_dt(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb,
+          struct rb_list *delq)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+    struct dtp *dtp      = flow->dtp;
+    rl_seq_t seqnum      = pci->seqnum;
+    struct rl_buf *crb   = NULL;
+    unsigned int a       = 0;
+    rl_seq_t gap;
+    bool deliver;
+    bool drop;
 
     if (flow->cfg.dtcp_present) {
-        mod_timer(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
+        dtp_rcv_activity(dtp);
     }
 
     if (unlikely((dtp->flags & DTP_F_DRF_EXPECTED) ||
@@ -1326,18 +2474,9 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
                dtp->next_snd_ctl_seq);
         }
 
-        spin_unlock_bh(&dtp->lock);
-
-        RL_BUF_RX(rb).cons_seqnum = seqnum;
-        ret                       = rl_buf_pci_pop(rb);
-        if (unlikely(ret)) {
-            rl_buf_free(rb);
-            goto snd_crb;
-        }
-
-        ret = rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        sdu_rx_deliver(rb, seqnum, delq);
 
-        goto snd_crb;
+        return crb;
     }
 
     if (unlikely(seqnum < dtp->rcv_lwe_priv)) {
@@ -1359,9 +2498,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
             }
         }
 
-        spin_unlock_bh(&dtp->lock);
-
-        goto snd_crb;
+        return crb;
     }
 
     if (unlikely(dtp->rcv_lwe_priv < seqnum &&
@@ -1433,30 +2570,17 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         flow->stats.rx_pkt++;
         flow->stats.rx_byte += rb->len;
 
-        spin_unlock_bh(&dtp->lock);
-
-        RL_BUF_RX(rb).cons_seqnum = seqnum;
-        ret                       = rl_buf_pci_pop(rb);
-        if (unlikely(ret)) {
-            rl_buf_free(rb);
-            goto snd_crb;
-        }
-        ret = rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        sdu_rx_deliver(rb, seqnum, delq);
 
         /* Also deliver PDUs just extracted from the seqq. Note
          * that we must use the safe version of list scanning, since
-         * rl_sdu_rx_flow() will modify qrb->node. */
+         * sdu_rx_deliver() will modify qrb->node. */
         rb_list_foreach_safe (qrb, tmp, &qrbs) {
             rb_list_del(qrb);
-            RL_BUF_RX(qrb).cons_seqnum = seqnum;
-            if (unlikely(rl_buf_pci_pop(qrb))) {
-                rl_buf_free(qrb);
-                continue;
-            }
-            ret |= rl_sdu_rx_flow(ipcp, flow, qrb, qlimit);
+            sdu_rx_deliver(qrb, seqnum, delq);
         }
 
-        goto snd_crb;
+        return crb;
     }
 
     if (drop) {
@@ -1476,23 +2600,136 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         rb = NULL;
     }
 
-    spin_unlock_bh(&dtp->lock);
+    return crb;
+}
 
-snd_crb:
-    if (crb) {
-        rmt_tx(ipcp, flow->remote_addr, crb, false);
+/* Process a list of data transfer PDUs that belong to 'flow', taking
+ * the DTP lock only once. The list is empty on return. */
+static void
+sdu_rx_dt_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                struct rb_list *rbs)
+{
+    struct dtp *dtp = flow->dtp;
+    struct rb_list delq;
+    struct rb_list crbs;
+    bool qlimit;
+
+    if (rb_list_empty(rbs)) {
+        return;
+    }
+
+    rb_list_init(&delq);
+    rb_list_init(&crbs);
+
+    /* Ask rl_sdu_rx_flow_batch() to limit the userspace queue only
+     * if this flow does not use flow control. If flow control
+     * is used, it will limit the userspace queue automatically. */
+    qlimit = (flow->cfg.dtcp.flow_control == 0);
+
+    spin_lock_bh(&dtp->lock);
+    while (!rb_list_empty(rbs)) {
+        struct rl_buf *rb = rb_list_front(rbs);
+        struct rl_buf *crb;
+
+        rb_list_del(rb);
+        crb = sdu_rx_dt(ipcp, flow, rb, &delq);
+        if (crb) {
+            rb_list_enq(crb, &crbs);
+        }
     }
+    spin_unlock_bh(&dtp->lock);
+
+    rl_sdu_rx_flow_batch(ipcp, flow, &delq, qlimit);
+    rmt_tx_batch(ipcp, flow->remote_addr, &crbs, false);
+}
 
-    flow_put(flow);
+/* Process data transfer and control PDUs, or forward them. This may
+ * run on a CPU different from the one where the PDUs were received,
+ * if receive-side flow steering is enabled. Consecutive data transfer
+ * PDUs for the same flow and consecutive PDUs to be forwarded to the
+ * same address with the same QoS id are processed together. The list
+ * is empty on return. */
+static void
+sdu_rx_local_batch(struct ipcp_entry *ipcp, struct rb_list *rbs)
+{
+    struct rl_normal *priv  = (struct rl_normal *)ipcp->priv;
+    struct flow_entry *flow = NULL;
+    rl_addr_t fwd_addr      = RL_ADDR_NULL;
+    rl_qosid_t fwd_qos      = 0;
+    struct rb_list dtq;
+    struct rb_list fwdq;
+
+    rb_list_init(&dtq);
+    rb_list_init(&fwdq);
+
+    while (!rb_list_empty(rbs)) {
+        struct rl_buf *rb    = rb_list_front(rbs);
+        struct rina_pci *pci = RL_BUF_PCI(rb);
+
+        rb_list_del(rb);
+
+        if (pci->dst_addr != ipcp->addr &&
+            !rl_pduft_is_mcast(priv, pci->dst_addr)) {
+            /* The PDU is not for this IPCP, forward it. Don't propagate
+             * the error code of rmt_tx(), since caller does not need it.
+             * PDUs directed to a multicast group are replicated by the
+             * sender to the group members, which consume them. */
+            if (pci->dst_addr != fwd_addr || pci->qos_id != fwd_qos) {
+                rmt_tx_batch(ipcp, fwd_addr, &fwdq, false);
+                fwd_addr = pci->dst_addr;
+                fwd_qos  = pci->qos_id;
+            }
+            rb_list_enq(rb, &fwdq);
+            continue;
+        }
+
+        if (pktgen_sink_match(priv, pci)) {
+            pktgen_sink_rx(priv->pktgen, rb);
+            continue;
+        }
+
+        if (!flow || flow->local_cep != pci->dst_cep) {
+            if (flow) {
+                sdu_rx_dt_batch(ipcp, flow, &dtq);
+                flow_put(flow);
+            }
+            flow = flow_get_by_cep(pci->dst_cep);
+            if (flow && unlikely(!flow->dtp)) {
+                /* The flow has not been configured yet. */
+                flow_put(flow);
+                flow = NULL;
+            }
+            if (!flow) {
+                RPD(2, "No flow for cep-id %u: dropping PDU\n", pci->dst_cep);
+                rl_buf_free(rb);
+                continue;
+            }
+        }
+
+        if (pci->pdu_type != PDU_T_DT) {
+            /* This is a control PDU. Preserve the ordering with respect
+             * to the data transfer PDUs received before it. */
+            sdu_rx_dt_batch(ipcp, flow, &dtq);
+            sdu_rx_ctrl(ipcp, flow, rb);
+            continue;
+        }
 
-    return NULL; /* ret */
+        /* This is data transfer PDU. */
+        rb_list_enq(rb, &dtq);
+    }
+
+    if (flow) {
+        sdu_rx_dt_batch(ipcp, flow, &dtq);
+        flow_put(flow);
+    }
+    rmt_tx_batch(ipcp, fwd_addr, &fwdq, false);
 }
 
 static int
 rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum)
 {
     struct ipcp_entry *ipcp = flow->txrx.ipcp;
-    struct dtp *dtp         = &flow->dtp;
+    struct dtp *dtp         = flow->dtp;
     struct rl_buf *crb;
 
     spin_lock_bh(&dtp->lock);
@@ -1530,14 +2767,18 @@ static struct ipcp_factory normal_factory = {
     .ops.flow_allocate_req  = NULL, /* Reflect to userspace. */
     .ops.flow_allocate_resp = NULL, /* Reflect to userspace. */
     .ops.flow_init          = rl_normal_flow_init,
+    .ops.flow_fini          = rl_normal_flow_fini,
     .ops.sdu_write          = rl_normal_sdu_write,
+    .ops.sdu_write_batch    = rl_normal_sdu_write_batch,
     .ops.config             = rl_normal_config,
     .ops.pduft_set          = rl_pduft_set,
     .ops.pduft_flush        = rl_pduft_flush,
     .ops.pduft_del          = rl_pduft_del,
     .ops.pduft_del_addr     = rl_pduft_del_addr,
+    .ops.pduft_mod_batch    = rl_pduft_mod_batch,
     .ops.mgmt_sdu_build     = rl_normal_mgmt_sdu_build,
     .ops.sdu_rx             = rl_normal_sdu_rx,
+    .ops.sdu_rx_batch       = rl_normal_sdu_rx_batch,
     .ops.flow_get_stats     = flow_get_stats,
     .ops.flow_writeable     = rl_normal_flow_writeable,
     .ops.qos_supported      = rl_normal_qos_supported,
@@ -1546,6 +2787,8 @@ static struct ipcp_factory normal_factory = {
 static int __init
 rl_normal_init(void)
 {
+    int ret;
+
     /* Refuse to register this IPCP if the PCI layout is not supported by
      * our implementation. */
     if (RL_PCI_LEN != sizeof(struct rina_pci)) {
@@ -1564,13 +2807,25 @@ rl_normal_init(void)
        (unsigned)sizeof(struct rina_pci),
        (unsigned)sizeof(struct rina_pci_ctrl));
 
-    return rl_ipcp_factory_register(&normal_factory);
+    rl_normal_rx_wq = alloc_workqueue("rl_normal_rx", WQ_HIGHPRI, 0);
+    if (!rl_normal_rx_wq) {
+        return -ENOMEM;
+    }
+
+    ret = rl_ipcp_factory_register(&normal_factory);
+    if (ret) {
+        destroy_workqueue(rl_normal_rx_wq);
+    }
+
+    return ret;
 }
 
 static void __exit
 rl_normal_fini(void)
 {
     rl_ipcp_factory_unregister(SHIM_DIF_TYPE);
+    destroy_workqueue(rl_normal_rx_wq);
+    rcu_barrier(); /* wait for rx_cpumap_free_rcu() */
 }
 
 module_init(rl_normal_init);
@@ -42,6 +42,8 @@
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
 
 #include "kerconfig.h"
 
@@ -56,6 +58,19 @@
 #include <linux/socket.h> /* memcpy_{to,from}iovecend */
 #endif
 
+#ifdef RL_HAVE_REFCOUNT_T
+#include <linux/refcount.h>
+#else
+/* Kernels older than 4.11: plain atomics without saturation checks. */
+typedef atomic_t refcount_t;
+#define refcount_set(_r, _n) atomic_set(_r, _n)
+#define refcount_read(_r) atomic_read(_r)
+#define refcount_inc(_r) atomic_inc(_r)
+#define refcount_inc_not_zero(_r) atomic_inc_not_zero(_r)
+#define refcount_dec_not_one(_r) atomic_add_unless(_r, -1, 1)
+#define refcount_dec_and_test(_r) atomic_dec_and_test(_r)
+#endif
+
 /*
  * Logging support.
  */
@@ -222,6 +237,15 @@ rl_buf_custom_push(struct rl_buf *rb, size_t len)
     return 0;
 }
 
+/* True if 'len' bytes can be pushed in front of the data without
+ * touching buffers shared with clones. */
+static inline bool
+rl_buf_push_room(struct rl_buf *rb, size_t len)
+{
+    return (uint8_t *)(rb->pci) - len >= &rb->raw->buf[0] &&
+           atomic_read(&rb->raw->refcnt) == 1;
+}
+
 static inline void
 rl_buf_append(struct rl_buf *rb, size_t len)
 {
@@ -256,6 +280,7 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define rb_list list_head
 #define rb_list_init(l) INIT_LIST_HEAD((l))
 #define rb_list_enq(rb, q) list_add_tail_safe(&(rb)->node, q)
+#define rb_list_push(rb, q) list_add(&(rb)->node, q)
 #define rb_list_del(rb) list_del_init(&(rb)->node)
 #define rb_list_empty(l) list_empty(l)
 #define rb_list_front(l) list_first_entry(l, struct rl_buf, node)
@@ -307,6 +332,14 @@ rl_buf_custom_push(struct rl_buf *rb, size_t len)
     return 0;
 }
 
+/* True if 'len' bytes can be pushed in front of the data without
+ * touching buffers shared with clones. This may unshare the header. */
+static inline bool
+rl_buf_push_room(struct rl_buf *rb, size_t len)
+{
+    return skb_cow_head(rb, len) == 0;
+}
+
 #define rl_buf_append(_rb, _len) skb_put(_rb, _len)
 
 #ifdef RL_HAVE_CHRDEV_RW_ITER
@@ -363,6 +396,17 @@ rb_list_enq(struct rl_buf *elem, struct rb_list *list)
     list->prev       = elem;
 }
 
+/* Insert at the head of the list. */
+static inline void
+rb_list_push(struct rl_buf *elem, struct rb_list *list)
+{
+    BUG_ON(elem->prev != NULL || elem->next != NULL);
+    list->next->prev = elem;
+    elem->next       = list->next;
+    elem->prev       = (struct rl_buf *)list;
+    list->next       = elem;
+}
+
 static inline void
 rb_list_del(struct rl_buf *elem)
 {
@@ -397,6 +441,7 @@ struct ipcp_entry;
 struct flow_entry;
 struct rl_ctrl;
 struct pduft_entry;
+struct pduft_mod;
 
 struct ipcp_ops {
     bool (*flow_writeable)(struct flow_entry *flow);
@@ -415,6 +460,8 @@ struct ipcp_ops {
                               uint8_t response);
 
     int (*flow_init)(struct ipcp_entry *ipcp, struct flow_entry *flow);
+    /* Invoked by the core before releasing the flow state. */
+    void (*flow_fini)(struct ipcp_entry *ipcp, struct flow_entry *flow);
     int (*flow_cfg_update)(struct flow_entry *flow,
                            const struct rl_flow_config *cfg);
     int (*flow_deallocated)(struct ipcp_entry *ipcp, struct flow_entry *flow);
@@ -424,13 +471,28 @@ struct ipcp_ops {
                      struct rl_buf *rb, bool maysleep);
     struct rl_buf *(*sdu_rx)(struct ipcp_entry *ipcp, struct rl_buf *rb,
                              struct flow_entry *lower_flow);
+
+    /* Optional list-based versions of sdu_write and sdu_rx, to process
+     * a burst of PDUs with a single lock acquisition per flow. The
+     * SDUs that sdu_write_batch cannot write (-EAGAIN) are left in the
+     * list, like the management SDUs that sdu_rx_batch wants to be
+     * queued to userspace. Don't call these directly, but use
+     * rl_sdu_write_batch() and rl_sdu_rx_flow_batch(). */
+    int (*sdu_write_batch)(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                           struct rb_list *rbs, bool maysleep);
+    void (*sdu_rx_batch)(struct ipcp_entry *ipcp, struct rb_list *rbs,
+                         struct flow_entry *lower_flow);
     int (*config)(struct ipcp_entry *ipcp, const char *param_name,
                   const char *param_value, int *notify);
     int (*pduft_set)(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
-                     struct flow_entry *flow);
+                     struct flow_entry *flow, uint8_t flags);
     int (*pduft_del)(struct ipcp_entry *ipcp, struct pduft_entry *entry);
-    int (*pduft_del_addr)(struct ipcp_entry *ipcp, rlm_addr_t dst_addr);
+    int (*pduft_del_addr)(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
+                          struct flow_entry *flow, uint8_t flags);
     int (*pduft_flush)(struct ipcp_entry *ipcp);
+    int (*pduft_mod_batch)(struct ipcp_entry *ipcp,
+                           const struct pduft_mod *mods,
+                           unsigned int num_mods);
     int (*mgmt_sdu_build)(struct ipcp_entry *ipcp,
                           const struct rl_mgmt_hdr *hdr, struct rl_buf *rb,
                           struct ipcp_entry **lower_ipcp,
@@ -505,6 +567,11 @@ struct ipcp_entry {
     struct hlist_node node;
 };
 
+/* Headroom that shim IPCPs reserve for the SDUs they receive: what the
+ * upper layers need, plus the room to let the normal IPCP replace the
+ * PCI of an inbound management PDU with a struct rl_mgmt_hdr in place. */
+#define rl_rxhdroom(_ipcp) ((_ipcp)->rxhdroom + sizeof(struct rl_mgmt_hdr))
+
 struct ipcp_factory {
     /* The module providing this factory. */
     struct module *owner;
@@ -521,6 +588,48 @@ struct upper_ref {
     struct ipcp_entry *ipcp;
 };
 
+/* Hashed timer wheel, shared by all the DTP instances of a normal IPCP.
+ * A single kernel timer ticks once per jiffy while there are pending
+ * entries, and runs the expired ones. Entries are kept in the slot
+ * selected by their expiration time, so an entry that expires more than
+ * RL_TW_SIZE jiffies in the future is just skipped until its turn. */
+#define RL_TW_BITS 8
+#define RL_TW_SIZE (1 << RL_TW_BITS)
+#define RL_TW_MASK (RL_TW_SIZE - 1)
+
+struct rl_tw;
+
+struct rl_tw_entry {
+    struct list_head node;
+    unsigned long expires; /* absolute time in jiffies */
+    void (*function)(unsigned long);
+    unsigned long data;
+    struct rl_tw *tw;
+};
+
+struct rl_tw {
+    spinlock_t lock;
+    struct list_head slots[RL_TW_SIZE];
+    unsigned long clk;           /* next slot to be processed */
+    unsigned int count;          /* number of pending entries */
+    bool armed;                  /* the kernel timer is ticking */
+    struct rl_tw_entry *running; /* entry whose callback is running */
+    struct timer_list tmr;
+};
+
+void rl_tw_init(struct rl_tw *tw);
+void rl_tw_fini(struct rl_tw *tw);
+void rl_tw_entry_init(struct rl_tw_entry *e, struct rl_tw *tw);
+void rl_tw_mod(struct rl_tw_entry *e, unsigned long expires);
+void rl_tw_del(struct rl_tw_entry *e);
+void rl_tw_del_sync(struct rl_tw_entry *e);
+
+static inline bool
+rl_tw_pending(const struct rl_tw_entry *e)
+{
+    return !list_empty(&e->node);
+}
+
 /* Support for token bucket traffic shaping. */
 struct tkbk {
     ktime_t t_last_refill;
@@ -542,11 +651,11 @@ struct dtp {
     struct rb_list cwq;
     unsigned int cwq_len;
     unsigned int max_cwq_len;
-    struct timer_list snd_inact_tmr;
+    unsigned long snd_inact_stamp; /* last sender activity, in jiffies */
     struct rb_list rtxq;
     unsigned int rtxq_len;
     unsigned int max_rtxq_len;
-    struct timer_list rtx_tmr;
+    struct rl_tw_entry rtx_tmr;
     struct rl_buf *rtx_tmr_next; /* the packet is going to expire next */
     unsigned rtt;                /* estimated round trip time, in jiffies. */
     unsigned rtt_stddev;
@@ -560,13 +669,24 @@ struct dtp {
     rlm_seq_t last_snd_data_ack; /* almost unused */
     rlm_seq_t next_snd_ctl_seq;
     rlm_seq_t last_lwe_sent;
-    struct timer_list rcv_inact_tmr;
+    unsigned long rcv_inact_stamp; /* last receiver activity, in jiffies */
     struct rb_list seqq;
     unsigned int seqq_len;
-    struct timer_list a_tmr;
+    struct rl_tw_entry a_tmr;
+
+    /* The sender and receiver inactivity timers are lazy: the datapath
+     * only updates the activity stamps, and a single wheel entry checks
+     * the deadlines when it expires. */
+    struct rl_tw_entry inact_tmr;
+
+    /* Flow on the same IPCP at the other end of a local flow, which
+     * receives the SDUs directly, bypassing EFCP. */
+    struct flow_entry __rcu *local_peer;
 
 #define DTP_F_DRF_SET (1 << 0)
 #define DTP_F_DRF_EXPECTED (1 << 1)
+#define DTP_F_SND_INACT (1 << 2) /* sender inactivity timer is running */
+#define DTP_F_RCV_INACT (1 << 3) /* receiver inactivity timer is running */
     uint8_t flags;
 };
 
@@ -581,7 +701,7 @@ struct flow_entry {
     struct upper_ref upper;
     uint32_t event_id; /* requestor event id */
     struct txrx txrx;
-    struct dtp dtp;
+    struct dtp *dtp; /* allocated by the IPCP, if needed */
     struct rl_flow_config cfg;
     struct rina_flow_spec spec;
 
@@ -589,13 +709,17 @@ struct flow_entry {
 
     struct list_head pduft_entries;
 
+    /* Set by the supporting IPCP while the flow cannot transmit (e.g.
+     * link down), so that upper IPCPs can use backup routes. */
+    bool down;
+
     void *priv;
 
     struct rl_flow_stats stats;
     uint32_t uid;             /* unique id */
     struct list_head node_rm; /* for flows_removeq */
     unsigned long expires;    /* absolute time in jiffies */
-    unsigned int refcnt;
+    refcount_t refcnt;
 #define RL_FLOW_NEVER_BOUND (1 << 0)   /* flow was never bound with ioctl */
 #define RL_FLOW_PENDING (1 << 1)       /* flow allocation is pending */
 #define RL_FLOW_ALLOCATED (1 << 2)     /* flow has been allocated */
@@ -603,15 +727,28 @@ struct flow_entry {
 #define RL_FLOW_DEL_POSTPONED (1 << 4) /* flow removal has been postponed */
 #define RL_FLOW_INITIATOR (1 << 5)     /* local node initiated this flow */
     uint8_t flags;
-    struct hlist_node node;
-    struct hlist_node node_cep;
+
+    /* Flow tables are looked up under RCU. */
+    struct rcu_head rcu;
 };
 
 struct pduft_entry {
     rlm_addr_t address; /* pdu_ft key */
     struct flow_entry *flow;
-    struct hlist_node node; /* for the pdu_ft hash table */
-    struct list_head fnode; /* for the flow->pduft_entries list */
+    struct flow_entry *backup; /* used while 'flow' is down */
+    struct hlist_node node;    /* for the pdu_ft hash table */
+    struct list_head fnode;    /* for the flow->pduft_entries list */
+    uint8_t flags;             /* RL_PDUFT_F_* */
+    rl_qosid_t qos_id;         /* 0 for the default table */
+};
+
+/* A PDUFT modification, part of a batch. */
+struct pduft_mod {
+    rlm_addr_t dst_addr;
+    struct flow_entry *flow;
+    uint8_t op;    /* RL_PDUFT_OP_* */
+    uint8_t flags; /* RL_PDUFT_F_* */
+    rl_qosid_t qos_id;
 };
 
 int __ipcp_put(struct ipcp_entry *entry);
@@ -657,8 +794,17 @@ int rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port);
 int rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                    struct rl_buf *rb, bool qlimit);
 
+int rl_sdu_rx_flow_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                         struct rb_list *rbs, bool qlimit);
+
 struct rl_buf *rl_sdu_rx_shortcut(struct ipcp_entry *ipcp, struct rl_buf *rb);
 
+int rl_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                       struct rb_list *rbs, bool maysleep);
+
+int __rl_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                         struct rb_list *rbs, bool maysleep);
+
 void rl_write_restart_port(rl_port_t local_port);
 
 void rl_write_restart_flow(struct flow_entry *flow);
@@ -672,7 +818,8 @@ void __flow_put(struct flow_entry *flow, bool lock);
 #define flow_put(_f)                                                           \
     do {                                                                       \
         if (_f)                                                                \
-            PV("FLOWREFCNT %u --: %u\n", (_f)->local_port, (_f)->refcnt - 1);  \
+            PV("FLOWREFCNT %u --: %u\n", (_f)->local_port,                     \
+               refcount_read(&(_f)->refcnt) - 1);                              \
         __flow_put(_f, true);                                                  \
     } while (0)
 
@@ -682,6 +829,13 @@ struct flow_entry *flow_get(rl_port_t port_id);
 
 struct flow_entry *flow_get_by_cep(unsigned int cep_id);
 
+/* CEP-id reserved to the in-kernel PDU generator and sink of the normal
+ * IPCP, never assigned to a flow. */
+#define RL_PKTGEN_CEP 0xffff
+
+/* Userspace queue threshold in bytes. */
+#define RL_RXQ_SIZE_MAX (1 << 20)
+
 void flow_get_ref(struct flow_entry *flow);
 
 void flow_make_mortal(struct flow_entry *flow);
@@ -707,6 +861,23 @@ txrx_init(struct txrx *txrx, struct ipcp_entry *ipcp)
     txrx->flags  = 0;
 }
 
+/* Per-CPU backlog used for receive-side flow steering. */
+struct rl_normal_rxq {
+    struct rl_normal *priv;
+    spinlock_t lock;
+    struct rb_list q;
+    unsigned int qlen;
+    struct work_struct work;
+};
+
+/* Set of CPUs used for receive-side flow steering, replaced
+ * as a whole under RCU. */
+struct rl_normal_cpumap {
+    unsigned int len;
+    struct rcu_head rcu;
+    u16 cpus[0];
+};
+
 /* Implementation of the normal IPCP. */
 struct rl_normal {
     struct ipcp_entry *ipcp;
@@ -717,18 +888,46 @@ struct rl_normal {
     DECLARE_HASHTABLE(pdu_ft, PDUFT_HASHTABLE_BITS);
     struct flow_entry *pduft_dflt;
     rwlock_t pduft_lock;
+    /* Number of multicast entries in pdu_ft. */
+    unsigned int pduft_mcast;
+    /* Number of QoS-specific entries in pdu_ft. These override the
+     * default table for the PDUs with a matching qos_id. */
+    unsigned int pduft_qos;
+
+    /* Receive-side flow steering. If rx_cpumap is not NULL, received
+     * PDUs are processed on the CPU selected by hashing (dst_cep,
+     * src_addr), using the per-CPU backlogs. */
+    struct rl_normal_cpumap __rcu *rx_cpumap;
+    struct rl_normal_rxq __percpu *rxqs;
+
+    /* Timers of the DTP instances. */
+    struct rl_tw tw;
+
+    /* PDU generator and sink, allocated on first use. */
+    struct rl_pktgen *pktgen;
+
+    /* Protects the pairing of local flows. */
+    spinlock_t local_lock;
 };
 
-void dtp_init(struct dtp *dtp);
+void dtp_init(struct dtp *dtp, struct rl_tw *tw);
 void dtp_fini(struct dtp *dtp);
 void dtp_dump(struct dtp *dtp);
 int flow_get_stats(struct flow_entry *flow, struct rl_flow_stats *stats);
-int rl_pduft_del_addr(struct ipcp_entry *ipcp, rlm_addr_t dst_addr);
+int rl_pduft_del_addr(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
+                      struct flow_entry *flow, uint8_t flags);
 int rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry);
 int rl_pduft_flush(struct ipcp_entry *ipcp);
 int rl_pduft_set(struct ipcp_entry *ipcp, rlm_addr_t dst_addr,
-                 struct flow_entry *flow);
-struct flow_entry *rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr);
+                 struct flow_entry *flow, uint8_t flags);
+int rl_pduft_mod_batch(struct ipcp_entry *ipcp, const struct pduft_mod *mods,
+                       unsigned int num_mods);
+struct flow_entry *rl_pduft_lookup(struct rl_normal *priv, rlm_addr_t dst_addr,
+                                   rl_qosid_t qos_id);
+int rl_pduft_mcast_clone(struct rl_normal *priv, rlm_addr_t dst_addr,
+                         struct rl_buf *rb, struct flow_entry *exclude,
+                         struct rb_list *out);
+bool rl_pduft_is_mcast(struct rl_normal *priv, rlm_addr_t dst_addr);
 
 #define RL_UNBOUND_FLOW_TO (msecs_to_jiffies(15000))
 
@@ -751,6 +950,7 @@ typedef enum {
     RL_MT_IPCP,
     RL_MT_REGAPP,
     RL_MT_FLOW,
+    RL_MT_DTP,
     RL_MT_CTLDEV,
     RL_MT_IODEV,
     RL_MT_MISC,
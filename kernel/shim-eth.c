@@ -39,6 +39,7 @@
 #include <linux/rtnetlink.h>
 #include <linux/spinlock.h>
 #include <linux/if_ether.h>
+#include <linux/jhash.h>
 
 #define ETH_P_RLITE 0xD1F0
 
@@ -48,6 +49,7 @@ struct arpt_entry {
 
     /* Targed Protocol Address, represented as a serialized string. */
     char *tpa;
+    size_t tpa_len;
 
     /* Sender Protocol Address, represented as a serialized string. */
     char *spa;
@@ -66,7 +68,10 @@ struct arpt_entry {
     /* Statistics. */
     struct rl_flow_stats stats;
 
-    struct list_head node;
+    struct list_head node;         /* for the arp_table list */
+    struct hlist_node node_name;   /* for the arpt_by_name hash table */
+    struct hlist_node node_mac;    /* for the arpt_by_mac hash table */
+    struct list_head node_pending; /* for the arp_pending list */
 };
 
 struct rl_shim_eth {
@@ -78,12 +83,35 @@ struct rl_shim_eth {
 
 #define ETH_UPPER_NAMES 4
     char *upper_names[ETH_UPPER_NAMES];
+
+    /* The ARP table. All the entries are linked in a list, and
+     * indexed by TPA name and (for complete entries) by THA. Incomplete
+     * entries are also linked in the pending list, which is the only
+     * thing scanned by the resolver timer. */
     struct list_head arp_table;
+#define ARPT_HASHTABLE_BITS 7
+    DECLARE_HASHTABLE(arpt_by_name, ARPT_HASHTABLE_BITS);
+    DECLARE_HASHTABLE(arpt_by_mac, ARPT_HASHTABLE_BITS);
+    struct list_head arp_pending;
     spinlock_t arpt_lock;
     spinlock_t tx_lock;
     struct timer_list arp_resolver_tmr;
     bool arp_tmr_shutdown;
     struct list_head node;
+
+#ifdef RL_PACKET_TYPE_LIST_FUNC
+    /* Data PDUs are received through this packet type rather than
+     * through the rx handler, so that the lists of frames built by the
+     * NAPI drivers reach shim_eth_pdu_rcv_list(). */
+    struct packet_type pdu_pt;
+#endif /* RL_PACKET_TYPE_LIST_FUNC */
+};
+
+/* PDUs received on the same flow, to be handed to the upper layer all
+ * together. */
+struct shim_eth_rx_burst {
+    struct flow_entry *flow;
+    struct rb_list rbs;
 };
 
 static LIST_HEAD(shims);
@@ -105,6 +133,9 @@ rl_shim_eth_create(struct ipcp_entry *ipcp)
     priv->netdev = NULL;
     priv->ntu = priv->ntp = 0;
     INIT_LIST_HEAD(&priv->arp_table);
+    hash_init(priv->arpt_by_name);
+    hash_init(priv->arpt_by_mac);
+    INIT_LIST_HEAD(&priv->arp_pending);
     spin_lock_init(&priv->arpt_lock);
     spin_lock_init(&priv->tx_lock);
     init_timer(&priv->arp_resolver_tmr);
@@ -149,6 +180,9 @@ rl_shim_eth_destroy(struct ipcp_entry *ipcp)
     del_timer_sync(&priv->arp_resolver_tmr);
 
     if (priv->netdev) {
+#ifdef RL_PACKET_TYPE_LIST_FUNC
+        dev_remove_pack(&priv->pdu_pt);
+#endif /* RL_PACKET_TYPE_LIST_FUNC */
         rtnl_lock();
         netdev_rx_handler_unregister(priv->netdev);
         rtnl_unlock();
@@ -213,16 +247,40 @@ rl_shim_eth_register(struct ipcp_entry *ipcp, char *appl, int reg)
     return 0;
 }
 
-/* To be called under arpt_lock. */
+static size_t
+arp_name_len(const char *buf, size_t buflen)
+{
+    size_t j = 0;
+
+    while (j < buflen && buf[j] != 0) {
+        j++;
+    }
+
+    return j;
+}
+
+#define arp_name_hash(_name, _len) jhash(_name, _len, 0)
+#define arp_mac_hash(_mac) jhash(_mac, 6, 0)
+
+/* Fast MAC comparison. */
+#define mac_equal(m1, m2)                                                      \
+    (*((uint16_t *)(m1) + 2) == *((uint16_t *)(m2) + 2) &&                     \
+     *((uint32_t *)m1) == *((uint32_t *)m2))
+
+/* Lookup an ARP table entry by TPA. The name in 'dst_app' may be
+ * zero-padded up to 'dst_app_len' bytes, as it happens in ARP messages.
+ * To be called under arpt_lock. */
 static struct arpt_entry *
 arp_lookup_direct_b(struct rl_shim_eth *priv, const char *dst_app,
                     int dst_app_len)
 {
+    size_t len = arp_name_len(dst_app, dst_app_len);
     struct arpt_entry *entry;
 
-    list_for_each_entry (entry, &priv->arp_table, node) {
-        if (dst_app_len >= strlen(entry->tpa) &&
-            strncmp(entry->tpa, dst_app, dst_app_len) == 0) {
+    hash_for_each_possible(priv->arpt_by_name, entry, node_name,
+                           arp_name_hash(dst_app, len))
+    {
+        if (entry->tpa_len == len && memcmp(entry->tpa, dst_app, len) == 0) {
             return entry;
         }
     }
@@ -230,6 +288,62 @@ arp_lookup_direct_b(struct rl_shim_eth *priv, const char *dst_app,
     return NULL;
 }
 
+/* Lookup a complete ARP table entry by THA. To be called under arpt_lock. */
+static struct arpt_entry *
+arp_lookup_mac_b(struct rl_shim_eth *priv, const uint8_t *mac)
+{
+    struct arpt_entry *entry;
+
+    hash_for_each_possible(priv->arpt_by_mac, entry, node_mac,
+                           arp_mac_hash(mac))
+    {
+        if (mac_equal(mac, entry->tha)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Insert a new entry into the ARP table. The entry is indexed by THA
+ * if complete, or linked to the pending list otherwise. To be called
+ * under arpt_lock. */
+static void
+arpt_entry_insert(struct rl_shim_eth *priv, struct arpt_entry *entry)
+{
+    entry->tpa_len = strlen(entry->tpa);
+    list_add_tail(&entry->node, &priv->arp_table);
+    hash_add(priv->arpt_by_name, &entry->node_name,
+             arp_name_hash(entry->tpa, entry->tpa_len));
+    if (entry->complete) {
+        INIT_LIST_HEAD(&entry->node_pending);
+        hash_add(priv->arpt_by_mac, &entry->node_mac,
+                 arp_mac_hash(entry->tha));
+    } else {
+        list_add_tail(&entry->node_pending, &priv->arp_pending);
+    }
+}
+
+/* Fill in (or update) the THA of an entry, moving it out of the pending
+ * list if necessary. To be called under arpt_lock. */
+static void
+arpt_entry_complete(struct rl_shim_eth *priv, struct arpt_entry *entry,
+                    const void *tha)
+{
+    if (entry->complete) {
+        hash_del(&entry->node_mac);
+    } else {
+        list_del_init(&entry->node_pending);
+    }
+    memcpy(entry->tha, tha, sizeof(entry->tha));
+    entry->complete = true;
+    hash_add(priv->arpt_by_mac, &entry->node_mac, arp_mac_hash(entry->tha));
+
+    PD("ARP entry %s --> %02X%02X%02X%02X%02X%02X completed\n", entry->tpa,
+       entry->tha[0], entry->tha[1], entry->tha[2], entry->tha[3],
+       entry->tha[4], entry->tha[5]);
+}
+
 /* This function is taken after net/ipv4/arp.c:arp_create() */
 static struct sk_buff *
 arp_create(struct rl_shim_eth *priv, uint16_t op, const char *spa, int spa_len,
@@ -305,38 +419,33 @@ arp_resolver_cb(unsigned long arg)
 {
     struct rl_shim_eth *priv = (struct rl_shim_eth *)arg;
     struct arpt_entry *entry;
-    bool some_incomplete = false;
     struct sk_buff_head skbq;
 
     skb_queue_head_init(&skbq);
 
     spin_lock_bh(&priv->arpt_lock);
 
-    /* Scan the ARP table looking for incomplete entries. For each
-     * incomplete entry found, generate a corresponding ARP request message.
-     * The generated messages are put into a temporary list, since
-     * dev_queue_xmit() cannot be called with irq disabled or in hard
-     * interrupt context. */
-    list_for_each_entry (entry, &priv->arp_table, node) {
-        if (!entry->complete) {
-            struct sk_buff *skb;
-
-            some_incomplete = true;
-
-            BUG_ON(!entry->spa);
-            BUG_ON(!entry->tpa);
-            PD("Trying again to resolve %s\n", entry->tpa);
-            skb =
-                arp_create(priv, ARPOP_REQUEST, entry->spa, strlen(entry->spa),
-                           entry->tpa, strlen(entry->tpa), NULL, GFP_ATOMIC);
-
-            if (skb) {
-                __skb_queue_tail(&skbq, skb);
-            }
+    /* Scan the list of incomplete entries. For each one, generate a
+     * corresponding ARP request message. All the pending retransmissions
+     * are served by this single timer. The generated messages are put
+     * into a temporary list, since dev_queue_xmit() cannot be called with
+     * irq disabled or in hard interrupt context. */
+    list_for_each_entry (entry, &priv->arp_pending, node_pending) {
+        struct sk_buff *skb;
+
+        BUG_ON(entry->complete);
+        BUG_ON(!entry->spa);
+        BUG_ON(!entry->tpa);
+        PD("Trying again to resolve %s\n", entry->tpa);
+        skb = arp_create(priv, ARPOP_REQUEST, entry->spa, strlen(entry->spa),
+                         entry->tpa, entry->tpa_len, NULL, GFP_ATOMIC);
+
+        if (skb) {
+            __skb_queue_tail(&skbq, skb);
         }
     }
 
-    if (some_incomplete && !priv->arp_tmr_shutdown) {
+    if (!list_empty(&priv->arp_pending) && !priv->arp_tmr_shutdown) {
         /* Reschedule itself only if necessary, and never when the IPCP process
          * is going to be destroyed. */
         mod_timer(&priv->arp_resolver_tmr,
@@ -425,25 +534,27 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
         goto nomem;
     }
 
-    entry->complete       = false; /* Not meaningful. */
+    entry->complete       = false;
     entry->fa_req_arrived = false;
     rb_list_init(&entry->rx_tmpq);
     entry->rx_tmpq_len = 0;
     arpt_flow_bind(entry, flow);
     rl_flow_stats_init(&entry->stats);
-    list_add_tail(&entry->node, &priv->arp_table);
+    arpt_entry_insert(priv, entry);
 
     spin_unlock_bh(&priv->arpt_lock);
 
     skb = arp_create(priv, ARPOP_REQUEST, flow->local_appl,
                      strlen(flow->local_appl), flow->remote_appl,
                      strlen(flow->remote_appl), NULL, GFP_KERNEL);
-    if (!skb) {
-        goto nomem;
+    if (skb) {
+        dev_queue_xmit(skb);
+    } else {
+        /* The entry is already pending, the resolver timer will
+         * retry later. */
+        PD("Out of memory\n");
     }
 
-    dev_queue_xmit(skb);
-
     spin_lock_bh(&priv->arpt_lock);
     if (!timer_pending(&priv->arp_resolver_tmr)) {
         mod_timer(&priv->arp_resolver_tmr,
@@ -457,7 +568,6 @@ nomem:
     PE("Out of memory\n");
 
     if (entry) {
-        list_del_init(&entry->node);
         if (entry->tpa) {
             rl_free(entry->tpa, RL_MT_SHIMDATA);
         }
@@ -476,7 +586,6 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
 {
     struct rl_shim_eth *priv = ipcp->priv;
     struct arpt_entry *entry;
-    struct rl_buf *rb, *tmp;
     int ret = -ENXIO;
 
     spin_lock_bh(&priv->arpt_lock);
@@ -494,12 +603,10 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
          * reordering. It is true that shim-eth does not need to guarantee
          * in order delivery, but the reordering happening at the very
          * initial phase of the data exchange is quite problematic, so it
-         * is better to avoid it. */
+         * is better to avoid it. The queue is handed over as a single
+         * burst. */
         PD("Popping %u PDUs from rx_tmpq\n", entry->rx_tmpq_len);
-        rb_list_foreach_safe (rb, tmp, &entry->rx_tmpq) {
-            rb_list_del(rb);
-            rl_sdu_rx_flow(ipcp, flow, rb, true);
-        }
+        rl_sdu_rx_flow_batch(ipcp, flow, &entry->rx_tmpq, true);
         entry->rx_tmpq_len = 0;
         arpt_flow_bind(entry, flow);
         ret = 0;
@@ -510,18 +617,6 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
     return ret;
 }
 
-static size_t
-arp_name_len(const char *buf, size_t buflen)
-{
-    size_t j = 0;
-
-    while (j < buflen && buf[j] != 0) {
-        j++;
-    }
-
-    return j;
-}
-
 static void
 shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
 {
@@ -558,11 +653,29 @@ shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
             goto out;
         }
 
+        if (arp->ar_hln != sizeof(entry->tha)) {
+            /* Malformed request, don't reply. */
+            PI("Dropped ARP request with SHA/THA len of %d\n", arp->ar_hln);
+            goto out;
+        }
+
         /* Send an ARP reply. */
         skb = arp_create(priv, ARPOP_REPLY, priv->upper_names[i],
                          strlen(priv->upper_names[i]), spa, arp->ar_pln, sha,
                          GFP_ATOMIC);
 
+        entry = arp_lookup_direct_b(priv, spa, arp->ar_pln);
+        if (entry) {
+            /* We already know the requestor, just refresh its THA. If
+             * we were trying to resolve it, the request completes our
+             * pending flow allocation like a reply would do. */
+            if (!entry->complete) {
+                flow = entry->flow;
+            }
+            arpt_entry_complete(priv, entry, sha);
+            goto out;
+        }
+
         entry =
             rl_alloc(sizeof(*entry), GFP_ATOMIC | __GFP_ZERO, RL_MT_SHIMDATA);
         if (entry) {
@@ -582,7 +695,7 @@ shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
                 entry->rx_tmpq_len = 0;
                 entry->flow        = NULL;
                 memcpy(entry->tha, sha, sizeof(entry->tha));
-                list_add_tail(&entry->node, &priv->arp_table);
+                arpt_entry_insert(priv, entry);
 
                 PD("ARP entry %s --> %02X%02X%02X%02X%02X%02X completed\n",
                    entry->tpa, entry->tha[0], entry->tha[1], entry->tha[2],
@@ -611,13 +724,8 @@ shim_eth_arp_rx(struct rl_shim_eth *priv, struct arphdr *arp, int len)
             goto out;
         }
 
-        memcpy(entry->tha, sha, arp->ar_hln);
-        entry->complete = true;
-        flow            = entry->flow;
-
-        PD("ARP entry %s --> %02X%02X%02X%02X%02X%02X completed\n", entry->tpa,
-           entry->tha[0], entry->tha[1], entry->tha[2], entry->tha[3],
-           entry->tha[4], entry->tha[5]);
+        arpt_entry_complete(priv, entry, sha);
+        flow = entry->flow;
 
     } else {
         PI("Unknown RLITE ARP operation %04X\n", ntohs(arp->ar_op));
@@ -639,27 +747,33 @@ out:
     }
 }
 
-/* Fast MAC comparison. */
-#define mac_equal(m1, m2)                                                      \
-    (*((uint16_t *)(m1) + 2) == *((uint16_t *)(m2) + 2) &&                     \
-     *((uint32_t *)m1) == *((uint32_t *)m2))
+static void
+shim_eth_rx_burst_flush(struct ipcp_entry *ipcp, struct shim_eth_rx_burst *b)
+{
+    if (b->flow) {
+        rl_sdu_rx_flow_batch(ipcp, b->flow, &b->rbs, true);
+        b->flow = NULL;
+    }
+}
 
+/* Receive a PDU. If 'burst' is not NULL, the PDUs for a bound flow are
+ * accumulated there, and the caller is in charge of flushing it. */
 static void
-shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
+shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb,
+                struct shim_eth_rx_burst *burst)
 {
     struct ipcp_entry *ipcp = priv->ipcp;
     struct rl_buf *rb;
     struct ethhdr *hh = eth_hdr(skb);
     struct arpt_entry *entry;
     struct flow_entry *flow = NULL;
-    bool match              = false;
 
     NPD("SHIM ETH PDU from %02X:%02X:%02X:%02X:%02X:%02X [%d]\n",
         hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
         hh->h_source[4], hh->h_source[5], skb->len);
 
 #ifndef RL_SKB
-    rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom, GFP_ATOMIC);
+    rb = rl_buf_alloc(skb->len, rl_rxhdroom(ipcp), ipcp->tailroom, GFP_ATOMIC);
     if (unlikely(!rb)) {
         PD("Out of memory\n");
         return;
@@ -670,6 +784,11 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
     rb = skb;
 #endif
 
+    if (burst && ipcp->shortcut) {
+        /* Keep the order with the PDUs accumulated so far. */
+        shim_eth_rx_burst_flush(ipcp, burst);
+    }
+
     /* Try to shortcut the packet to the upper IPCP. */
     if ((rb = rl_sdu_rx_shortcut(ipcp, rb)) == NULL) {
         entry->stats.rx_pkt++;
@@ -682,12 +801,9 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
 
     spin_lock_bh(&priv->arpt_lock);
 
-    list_for_each_entry (entry, &priv->arp_table, node) {
-        if (entry->complete && mac_equal(hh->h_source, entry->tha)) {
-            match = true;
-            flow  = entry->flow;
-            break;
-        }
+    entry = arp_lookup_mac_b(priv, hh->h_source);
+    if (entry) {
+        flow = entry->flow;
     }
 
     if (likely(flow)) {
@@ -695,7 +811,15 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
         entry->stats.rx_byte += rb->len;
         spin_unlock_bh(&priv->arpt_lock);
 
-        rl_sdu_rx_flow(ipcp, flow, rb, true);
+        if (burst) {
+            if (burst->flow != flow) {
+                shim_eth_rx_burst_flush(ipcp, burst);
+                burst->flow = flow;
+            }
+            rb_list_enq(rb, &burst->rbs);
+        } else {
+            rl_sdu_rx_flow(ipcp, flow, rb, true);
+        }
 
         return;
     }
@@ -703,7 +827,7 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
     /* Here we are the flow allocation slave, we cannot be the flow
      * allocation initiator. */
 
-    if (!match) {
+    if (!entry) {
         RPD(2,
             "PDU from unknown source MAC "
             "%02X:%02X:%02X:%02X:%02X:%02X\n",
@@ -763,7 +887,9 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
     return;
 
 drop:
-    entry->stats.rx_err++;
+    if (entry) {
+        entry->stats.rx_err++;
+    }
     spin_unlock_bh(&priv->arpt_lock);
     rl_buf_free(rb);
 }
@@ -793,8 +919,14 @@ shim_eth_rx_handler(struct sk_buff **skbp)
         }
 
     } else if (ethertype == ETH_P_RLITE) {
+#ifdef RL_PACKET_TYPE_LIST_FUNC
+        /* This is a RLITE shim-eth PDU, which goes to our packet type
+         * (as part of a list, if the driver supports that). */
+        return RX_HANDLER_PASS;
+#else  /* !RL_PACKET_TYPE_LIST_FUNC */
         /* This is a RLITE shim-eth PDU. */
-        shim_eth_pdu_rx(priv, skb);
+        shim_eth_pdu_rx(priv, skb, NULL);
+#endif /* !RL_PACKET_TYPE_LIST_FUNC */
 
 #ifndef RL_SKB
         /* We should use dev_consume_skb_any(),
@@ -811,6 +943,56 @@ shim_eth_rx_handler(struct sk_buff **skbp)
     return RX_HANDLER_CONSUMED;
 }
 
+#ifdef RL_PACKET_TYPE_LIST_FUNC
+static void
+shim_eth_pdu_rcv_one(struct rl_shim_eth *priv, struct sk_buff *skb,
+                     struct shim_eth_rx_burst *burst)
+{
+    skb = skb_share_check(skb, GFP_ATOMIC);
+    if (unlikely(!skb)) {
+        return;
+    }
+
+    shim_eth_pdu_rx(priv, skb, burst);
+#ifndef RL_SKB
+    dev_kfree_skb_any(skb);
+#endif /* !RL_SKB */
+}
+
+static int
+shim_eth_pdu_rcv(struct sk_buff *skb, struct net_device *dev,
+                 struct packet_type *pt, struct net_device *orig_dev)
+{
+    struct rl_shim_eth *priv = container_of(pt, struct rl_shim_eth, pdu_pt);
+
+    shim_eth_pdu_rcv_one(priv, skb, NULL);
+
+    return NET_RX_SUCCESS;
+}
+
+/* Receive a list of frames from the driver. Consecutive PDUs for the
+ * same flow are handed to the upper layer with a single call. */
+static void
+shim_eth_pdu_rcv_list(struct list_head *head, struct packet_type *pt,
+                      struct net_device *orig_dev)
+{
+    struct rl_shim_eth *priv = container_of(pt, struct rl_shim_eth, pdu_pt);
+    struct shim_eth_rx_burst burst;
+    struct sk_buff *skb, *next;
+
+    burst.flow = NULL;
+    rb_list_init(&burst.rbs);
+
+    list_for_each_entry_safe (skb, next, head, list) {
+        skb_list_del_init(skb);
+        skb->prev = NULL; /* unlinked, as rb_list_enq() expects */
+        shim_eth_pdu_rcv_one(priv, skb, &burst);
+    }
+
+    shim_eth_rx_burst_flush(priv->ipcp, &burst);
+}
+#endif /* RL_PACKET_TYPE_LIST_FUNC */
+
 #define flow_can_write(_p) ((_p)->ntu != (_p)->ntp)
 
 static void
@@ -845,55 +1027,24 @@ rl_shim_eth_flow_writeable(struct flow_entry *flow)
     return ret;
 }
 
-static int
-rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
-                      struct rl_buf *rb, bool maysleep)
+/* Build the Ethernet frame for 'rb' and send it to the device. A TX
+ * slot must have been reserved by the caller. */
+static void
+shim_eth_xmit(struct rl_shim_eth *priv, struct flow_entry *flow,
+              struct arpt_entry *entry, struct rl_buf *rb)
 {
-    struct rl_shim_eth *priv  = ipcp->priv;
     struct net_device *netdev = priv->netdev;
     struct sk_buff *skb       = NULL;
-    struct arpt_entry *entry  = flow->priv;
     int hhlen;
     int ret;
 
-    if (unlikely(!entry)) {
-        rl_buf_free(rb);
-        RPD(2, "called on deallocated entry\n");
-        return -ENXIO;
-    }
-
-    if (unlikely(rb->len > ETH_DATA_LEN)) {
-        rl_buf_free(rb);
-        RPD(2, "Exceeding maximum ethernet payload (%d)\n", ETH_DATA_LEN);
-        return -EMSGSIZE;
-    }
-
-    spin_lock_bh(&priv->tx_lock);
-
-    if (unlikely(!flow_can_write(priv))) {
-        /* Double-check not necessary here, we are using locks,
-         * not memory barriers. */
-        spin_unlock_bh(&priv->tx_lock);
-
-        /* Backpressure: We will be called again. */
-        return -EAGAIN;
-    }
-
-    priv->ntu++;
-
-    /* Also per-flow TX statistics are protected by the tx_lock. */
-    entry->stats.tx_pkt++;
-    entry->stats.tx_byte += rb->len;
-
-    spin_unlock_bh(&priv->tx_lock);
-
 #ifndef RL_SKB
     hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length. */
     skb   = alloc_skb(hhlen + rb->len + netdev->needed_tailroom, GFP_KERNEL);
     if (!skb) {
         rl_buf_free(rb);
         PD("Out of memory\n");
-        return -ENOMEM;
+        return;
     }
 
     skb_reserve(skb, hhlen); /* needed by dev_hard_header */
@@ -913,7 +1064,7 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
         rl_buf_free(rb);
         kfree_skb(skb);
 
-        return ret;
+        return;
     }
 
     skb->destructor                 = &shim_eth_skb_destructor;
@@ -939,10 +1090,98 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
 #ifndef RL_SKB
     rl_buf_free(rb);
 #endif /* !RL_SKB */
+}
+
+static int
+rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                      struct rl_buf *rb, bool maysleep)
+{
+    struct rl_shim_eth *priv = ipcp->priv;
+    struct arpt_entry *entry = flow->priv;
+
+    if (unlikely(!entry)) {
+        rl_buf_free(rb);
+        RPD(2, "called on deallocated entry\n");
+        return -ENXIO;
+    }
+
+    if (unlikely(rb->len > ETH_DATA_LEN)) {
+        rl_buf_free(rb);
+        RPD(2, "Exceeding maximum ethernet payload (%d)\n", ETH_DATA_LEN);
+        return -EMSGSIZE;
+    }
+
+    spin_lock_bh(&priv->tx_lock);
+
+    if (unlikely(!flow_can_write(priv))) {
+        /* Double-check not necessary here, we are using locks,
+         * not memory barriers. */
+        spin_unlock_bh(&priv->tx_lock);
+
+        /* Backpressure: We will be called again. */
+        return -EAGAIN;
+    }
+
+    priv->ntu++;
+
+    /* Also per-flow TX statistics are protected by the tx_lock. */
+    entry->stats.tx_pkt++;
+    entry->stats.tx_byte += rb->len;
+
+    spin_unlock_bh(&priv->tx_lock);
+
+    shim_eth_xmit(priv, flow, entry, rb);
 
     return 0;
 }
 
+static int
+rl_shim_eth_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                            struct rb_list *rbs, bool maysleep)
+{
+    struct rl_shim_eth *priv = ipcp->priv;
+    struct arpt_entry *entry = flow->priv;
+    struct rb_list txq;
+    struct rl_buf *rb, *tmp;
+    int ret = 0;
+
+    if (unlikely(!entry)) {
+        return __rl_sdu_write_batch(ipcp, flow, rbs, maysleep);
+    }
+
+    rb_list_init(&txq);
+
+    /* Reserve TX slots for as many SDUs as possible with a single
+     * acquisition of the tx_lock. */
+    spin_lock_bh(&priv->tx_lock);
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        if (unlikely(rb->len > ETH_DATA_LEN)) {
+            RPD(2, "Exceeding maximum ethernet payload (%d)\n", ETH_DATA_LEN);
+            rb_list_del(rb);
+            rl_buf_free(rb);
+            ret = -EMSGSIZE;
+            continue;
+        }
+        if (unlikely(!flow_can_write(priv))) {
+            ret = -EAGAIN;
+            break;
+        }
+        priv->ntu++;
+        entry->stats.tx_pkt++;
+        entry->stats.tx_byte += rb->len;
+        rb_list_del(rb);
+        rb_list_enq(rb, &txq);
+    }
+    spin_unlock_bh(&priv->tx_lock);
+
+    rb_list_foreach_safe (rb, tmp, &txq) {
+        rb_list_del(rb);
+        shim_eth_xmit(priv, flow, entry, rb);
+    }
+
+    return ret;
+}
+
 static int
 rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
                    const char *param_value, int *notify)
@@ -965,6 +1204,9 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
         spin_unlock_bh(&priv->tx_lock);
 
         if (netdev) {
+#ifdef RL_PACKET_TYPE_LIST_FUNC
+            dev_remove_pack(&priv->pdu_pt);
+#endif /* RL_PACKET_TYPE_LIST_FUNC */
             rtnl_lock();
             netdev_rx_handler_unregister(netdev);
             rtnl_unlock();
@@ -987,6 +1229,15 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
             return ret;
         }
 
+#ifdef RL_PACKET_TYPE_LIST_FUNC
+        memset(&priv->pdu_pt, 0, sizeof(priv->pdu_pt));
+        priv->pdu_pt.type      = htons(ETH_P_RLITE);
+        priv->pdu_pt.dev       = netdev;
+        priv->pdu_pt.func      = shim_eth_pdu_rcv;
+        priv->pdu_pt.list_func = shim_eth_pdu_rcv_list;
+        dev_add_pack(&priv->pdu_pt);
+#endif /* RL_PACKET_TYPE_LIST_FUNC */
+
         spin_lock_bh(&priv->tx_lock);
 
         priv->netdev = netdev;
@@ -1037,21 +1288,21 @@ rl_shim_eth_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
 
     spin_lock_bh(&priv->arpt_lock);
 
-    list_for_each_entry (entry, &priv->arp_table, node) {
-        if (entry->flow == flow) {
-            struct rl_buf *rb, *tmp;
-
-            /* Unbind the flow from this ARP table entry. */
-            PD("Unbinding from flow %p\n", entry->flow);
-            flow->priv            = NULL;
-            entry->flow           = NULL;
-            entry->fa_req_arrived = false;
-            rb_list_foreach_safe (rb, tmp, &entry->rx_tmpq) {
-                rb_list_del(rb);
-                rl_buf_free(rb);
-            }
-            entry->rx_tmpq_len = 0;
+    /* A bound flow points to its ARP table entry, no need to scan. */
+    entry = flow->priv;
+    if (entry && entry->flow == flow) {
+        struct rl_buf *rb, *tmp;
+
+        /* Unbind the flow from this ARP table entry. */
+        PD("Unbinding from flow %p\n", entry->flow);
+        flow->priv            = NULL;
+        entry->flow           = NULL;
+        entry->fa_req_arrived = false;
+        rb_list_foreach_safe (rb, tmp, &entry->rx_tmpq) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
         }
+        entry->rx_tmpq_len = 0;
     }
 
     spin_unlock_bh(&priv->arpt_lock);
@@ -1119,11 +1370,15 @@ shim_eth_netdev_notify(struct notifier_block *nb, unsigned long event,
                 switch (event) {
                 case NETDEV_UP:
                     ntfy.flow_state = RL_FLOW_STATE_UP;
+                    WRITE_ONCE(flow->down, false);
                     PD("flow %u goes up\n", flow->local_port);
                     break;
 
                 case NETDEV_DOWN:
                     ntfy.flow_state = RL_FLOW_STATE_DOWN;
+                    /* Let the upper IPCP switch to backup routes right
+                     * away, without waiting for the uipcp. */
+                    WRITE_ONCE(flow->down, true);
                     PD("flow %u goes down\n", flow->local_port);
                     break;
 
@@ -1165,6 +1420,7 @@ static struct ipcp_factory shim_eth_factory = {
     .ops.flow_allocate_req  = rl_shim_eth_fa_req,
     .ops.flow_allocate_resp = rl_shim_eth_fa_resp,
     .ops.sdu_write          = rl_shim_eth_sdu_write,
+    .ops.sdu_write_batch    = rl_shim_eth_sdu_write_batch,
     .ops.config             = rl_shim_eth_config,
     .ops.appl_register      = rl_shim_eth_register,
     .ops.flow_deallocated   = rl_shim_eth_flow_deallocated,
@@ -35,32 +35,74 @@
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/workqueue.h>
+#include <linux/random.h>
 
 struct rx_entry {
     struct rl_buf *rb;
     struct flow_entry *tx_flow;
     struct flow_entry *rx_flow;
+    ktime_t tts; /* time to send */
+    struct list_head node;
 };
 
 #define RX_POW 8
 #define RX_ENTRIES (1 << RX_POW)
 
+/* Link emulation parameters, all configurable with ipcp-config. */
+struct loopback_emu {
+    unsigned int delay_us;        /* one-way delay */
+    unsigned int jitter_us;       /* uniform jitter around delay_us */
+    unsigned int loss_ppm;        /* random loss (in the good state) */
+    unsigned int ge_p_ppm;        /* Gilbert-Elliott good --> bad */
+    unsigned int ge_r_ppm;        /* Gilbert-Elliott bad --> good */
+    unsigned int ge_bad_loss_ppm; /* random loss in the bad state */
+    unsigned int reorder_ppm;     /* probability to skip the delay */
+    unsigned int rate_kbps;       /* bandwidth cap */
+    unsigned int limit;           /* max number of queued SDUs */
+};
+
 struct rl_shim_loopback {
     struct ipcp_entry *ipcp;
 
     unsigned int drop_fract;
     unsigned int drop_cdown;
 
-    /* Queuing data structures. */
+    /* Link emulation state. */
+    struct loopback_emu emu;
+    bool emulate;      /* true if SDUs must be delayed or rate limited */
+    bool ge_bad;       /* Gilbert-Elliott state */
+    ktime_t rate_next; /* when the emulated link becomes idle */
+
+    /* Queuing data structures. Queued SDUs are kept in 'rxq', sorted
+     * by time to send; unused entries are kept in 'freeq'. */
     bool queued;
-    struct rx_entry rxr[RX_ENTRIES];
-    unsigned int rdh;
-    unsigned int rdt;
+    struct rx_entry rxe[RX_ENTRIES];
+    struct list_head rxq;
+    struct list_head freeq;
+    unsigned int rxq_len;
+    bool shutdown;
 
     spinlock_t lock;
     struct work_struct rcv;
+    struct hrtimer rcv_tmr;
 };
 
+static enum hrtimer_restart
+rcv_tmr_cb(struct hrtimer *tmr)
+{
+    struct rl_shim_loopback *priv =
+        container_of(tmr, struct rl_shim_loopback, rcv_tmr);
+
+    /* We cannot call rl_sdu_rx_flow() in hard interrupt context, so
+     * we defer to the receive work. */
+    schedule_work(&priv->rcv);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Max number of SDUs delivered to the upper layer in a single batch. */
+#define RCV_BATCH 64
+
 static void
 rcv_work(struct work_struct *w)
 {
@@ -68,40 +110,64 @@ rcv_work(struct work_struct *w)
         container_of(w, struct rl_shim_loopback, rcv);
 
     for (;;) {
-        struct rl_buf *rb = NULL;
-        struct flow_entry *rx_flow;
-        struct flow_entry *tx_flow;
+        struct flow_entry *rx_flow = NULL;
+        struct flow_entry *tx_flow = NULL;
+        struct rb_list rbs;
+        unsigned int n = 0;
+        ktime_t now    = ktime_get();
         int ret;
 
+        /* Extract the SDUs that are due, as long as they belong
+         * to the same flow, so that they can be delivered as a batch. */
+        rb_list_init(&rbs);
         spin_lock_bh(&priv->lock);
-        if (priv->rdh != priv->rdt) {
-            rb        = priv->rxr[priv->rdh].rb;
-            rx_flow   = priv->rxr[priv->rdh].rx_flow;
-            tx_flow   = priv->rxr[priv->rdh].tx_flow;
-            priv->rdh = (priv->rdh + 1) & (RX_ENTRIES - 1);
+        while (!list_empty(&priv->rxq) && n < RCV_BATCH) {
+            struct rx_entry *e =
+                list_first_entry(&priv->rxq, struct rx_entry, node);
+
+            if (ktime_compare(e->tts, now) > 0) {
+                if (!n && !priv->shutdown) {
+                    /* Come back when the next SDU is due. */
+                    hrtimer_start(&priv->rcv_tmr, e->tts, HRTIMER_MODE_ABS);
+                }
+                break;
+            }
+            if (n && (e->rx_flow != rx_flow || e->tx_flow != tx_flow)) {
+                break;
+            }
+            rx_flow = e->rx_flow;
+            tx_flow = e->tx_flow;
+            rb_list_enq(e->rb, &rbs);
+            list_move_tail(&e->node, &priv->freeq);
+            priv->rxq_len--;
+            n++;
 
             tx_flow->stats.tx_pkt++;
-            tx_flow->stats.tx_byte += rb->len;
+            tx_flow->stats.tx_byte += e->rb->len;
             rx_flow->stats.rx_pkt++;
-            rx_flow->stats.rx_byte += rb->len;
+            rx_flow->stats.rx_byte += e->rb->len;
         }
         spin_unlock_bh(&priv->lock);
 
-        if (!rb) {
+        if (!n) {
             break;
         }
 
-        ret = rl_sdu_rx_flow(priv->ipcp, rx_flow, rb, true);
+        ret = rl_sdu_rx_flow_batch(priv->ipcp, rx_flow, &rbs, true);
         if (unlikely(ret)) {
             spin_lock_bh(&priv->lock);
             tx_flow->stats.tx_err++;
             rx_flow->stats.rx_err++;
             spin_unlock_bh(&priv->lock);
         }
-        flow_put(rx_flow);
 
         rl_write_restart_flows(priv->ipcp);
-        flow_put(tx_flow);
+
+        /* Each entry held a reference to both flows. */
+        while (n--) {
+            flow_put(rx_flow);
+            flow_put(tx_flow);
+        }
     }
 }
 
@@ -109,6 +175,7 @@ static void *
 rl_shim_loopback_create(struct ipcp_entry *ipcp)
 {
     struct rl_shim_loopback *priv;
+    unsigned int i;
 
     priv = rl_alloc(sizeof(*priv), GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
     if (!priv) {
@@ -118,9 +185,21 @@ rl_shim_loopback_create(struct ipcp_entry *ipcp)
     priv->ipcp       = ipcp;
     priv->drop_fract = 0; /* No drops by default. */
     priv->queued     = 0; /* No queue by default. */
+    priv->emu.limit  = RX_ENTRIES; /* No link emulation by default. */
+    priv->emulate    = false;
+    priv->ge_bad     = false;
+    priv->rate_next  = ktime_get();
+    INIT_LIST_HEAD(&priv->rxq);
+    INIT_LIST_HEAD(&priv->freeq);
+    for (i = 0; i < RX_ENTRIES; i++) {
+        list_add_tail(&priv->rxe[i].node, &priv->freeq);
+    }
+    priv->rxq_len  = 0;
+    priv->shutdown = false;
     INIT_WORK(&priv->rcv, rcv_work);
+    hrtimer_init(&priv->rcv_tmr, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    priv->rcv_tmr.function = rcv_tmr_cb;
     spin_lock_init(&priv->lock);
-    priv->rdt = priv->rdh = 0;
 
     PD("New IPC created [%p]\n", priv);
 
@@ -131,12 +210,18 @@ static void
 rl_shim_loopback_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_shim_loopback *priv = ipcp->priv;
+    struct rx_entry *e, *tmp;
 
+    spin_lock_bh(&priv->lock);
+    priv->shutdown = true;
+    spin_unlock_bh(&priv->lock);
+
+    hrtimer_cancel(&priv->rcv_tmr);
     cancel_work_sync(&priv->rcv);
 
-    while (priv->rdh != priv->rdt) {
-        rl_buf_free(priv->rxr[priv->rdh].rb);
-        priv->rdh = (priv->rdh + 1) & (RX_ENTRIES - 1);
+    list_for_each_entry_safe (e, tmp, &priv->rxq, node) {
+        list_del_init(&e->node);
+        rl_buf_free(e->rb);
     }
 
     rl_free(priv, RL_MT_SHIM);
@@ -275,15 +360,84 @@ rl_shim_loopback_flow_writeable(struct flow_entry *flow)
     struct rl_shim_loopback *priv = flow->txrx.ipcp->priv;
     bool ret                      = true;
 
-    if (priv->queued) {
+    if (priv->queued || priv->emulate) {
         spin_lock_bh(&priv->lock);
-        ret = (((priv->rdt + 1) & (RX_ENTRIES - 1)) != priv->rdh);
+        ret = !list_empty(&priv->freeq);
         spin_unlock_bh(&priv->lock);
     }
 
     return ret;
 }
 
+/* Returns true with probability ppm / 10^6. */
+static inline bool
+emu_rand_ppm(unsigned int ppm)
+{
+    return (prandom_u32() % 1000000U) < ppm;
+}
+
+/* Decide whether to drop the next SDU, according to the Bernoulli
+ * or Gilbert-Elliott loss model. To be called under priv->lock. */
+static bool
+loopback_emu_lose(struct rl_shim_loopback *priv)
+{
+    unsigned int ppm = priv->emu.loss_ppm;
+
+    if (priv->emu.ge_p_ppm) {
+        if (priv->ge_bad) {
+            priv->ge_bad = !emu_rand_ppm(priv->emu.ge_r_ppm);
+        } else {
+            priv->ge_bad = emu_rand_ppm(priv->emu.ge_p_ppm);
+        }
+        if (priv->ge_bad) {
+            ppm = priv->emu.ge_bad_loss_ppm;
+        }
+    }
+
+    return ppm && emu_rand_ppm(ppm);
+}
+
+/* Compute the time at which an SDU of 'len' bytes written now is
+ * going to be received, accounting for the bandwidth cap, delay,
+ * jitter and reordering. To be called under priv->lock. */
+static ktime_t
+loopback_emu_tts(struct rl_shim_loopback *priv, size_t len)
+{
+    ktime_t now = ktime_get();
+    ktime_t tts = now;
+    s64 delay_ns;
+
+    if (priv->emu.rate_kbps) {
+        /* Serialization time, in nanoseconds. */
+        u64 tx_ns = div_u64((u64)len * 8ULL * 1000000ULL, priv->emu.rate_kbps);
+
+        if (ktime_compare(priv->rate_next, now) < 0) {
+            priv->rate_next = now;
+        }
+        priv->rate_next = ktime_add_ns(priv->rate_next, tx_ns);
+        tts             = priv->rate_next;
+    }
+
+    if (priv->emu.reorder_ppm && emu_rand_ppm(priv->emu.reorder_ppm)) {
+        /* Skip the delay, so that this SDU overtakes the ones
+         * already in flight. */
+        return tts;
+    }
+
+    delay_ns = (s64)priv->emu.delay_us * NSEC_PER_USEC;
+    if (priv->emu.jitter_us) {
+        u32 j = priv->emu.jitter_us;
+
+        delay_ns +=
+            ((s64)(prandom_u32() % (2 * j + 1)) - (s64)j) * NSEC_PER_USEC;
+    }
+    if (delay_ns > 0) {
+        tts = ktime_add_ns(tts, delay_ns);
+    }
+
+    return tts;
+}
+
 static int
 rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
                            struct rl_buf *rb, bool maysleep)
@@ -308,28 +462,62 @@ rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
         }
     }
 
+    if (unlikely(priv->emu.loss_ppm || priv->emu.ge_p_ppm)) {
+        bool drop;
+
+        spin_lock_bh(&priv->lock);
+        drop = loopback_emu_lose(priv);
+        spin_unlock_bh(&priv->lock);
+
+        if (drop) {
+            rl_buf_free(rb);
+            return 0;
+        }
+    }
+
     rx_flow = flow_get(tx_flow->remote_port);
     if (!rx_flow) {
         rl_buf_free(rb);
         return -ENXIO;
     }
 
-    if (priv->queued) {
-        unsigned int next;
+    if (priv->queued || priv->emulate) {
+        bool overflow = false;
+        struct rx_entry *e, *pos;
 
         spin_lock_bh(&priv->lock);
-        next = (priv->rdt + 1) & (RX_ENTRIES - 1);
-        if (unlikely(next == priv->rdh)) {
+        if (unlikely(list_empty(&priv->freeq))) {
             ret = -EAGAIN;
+        } else if (unlikely(priv->rxq_len >= priv->emu.limit)) {
+            /* Emulated queue is full: tail drop. */
+            overflow = true;
+            tx_flow->stats.tx_err++;
         } else {
             flow_get_ref(tx_flow);
-            priv->rxr[priv->rdt].rb      = rb;
-            priv->rxr[priv->rdt].tx_flow = tx_flow;
-            priv->rxr[priv->rdt].rx_flow = rx_flow;
-            priv->rdt                    = next;
+            e          = list_first_entry(&priv->freeq, struct rx_entry, node);
+            e->rb      = rb;
+            e->tx_flow = tx_flow;
+            e->rx_flow = rx_flow;
+            e->tts     = priv->emulate ? loopback_emu_tts(priv, rb->len)
+                                       : ktime_get();
+            /* Keep rxq sorted by time to send. In the common case
+             * the new entry goes at the tail. */
+            list_for_each_entry_reverse(pos, &priv->rxq, node)
+            {
+                if (ktime_compare(pos->tts, e->tts) <= 0) {
+                    break;
+                }
+            }
+            list_move(&e->node, &pos->node);
+            priv->rxq_len++;
         }
         spin_unlock_bh(&priv->lock);
 
+        if (overflow) {
+            rl_buf_free(rb);
+            flow_put(rx_flow);
+            return 0;
+        }
         if (ret) {
             flow_put(rx_flow);
             return ret;
@@ -360,6 +548,120 @@ rl_shim_loopback_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *tx_flow,
     return ret;
 }
 
+static int
+rl_shim_loopback_sdu_write_batch(struct ipcp_entry *ipcp,
+                                 struct flow_entry *tx_flow,
+                                 struct rb_list *rbs, bool maysleep)
+{
+    struct rl_shim_loopback *priv = ipcp->priv;
+    struct flow_entry *rx_flow;
+    unsigned int pkts = 0;
+    u64 bytes         = 0;
+    struct rl_buf *rb;
+    int ret;
+
+    if (priv->drop_fract || priv->emu.loss_ppm || priv->emu.ge_p_ppm ||
+        priv->queued || priv->emulate) {
+        /* Losses and queues are emulated per SDU. */
+        return __rl_sdu_write_batch(ipcp, tx_flow, rbs, maysleep);
+    }
+
+    rx_flow = flow_get(tx_flow->remote_port);
+    if (!rx_flow) {
+        struct rl_buf *tmp;
+
+        rb_list_foreach_safe (rb, tmp, rbs) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        return -ENXIO;
+    }
+
+    rb_list_foreach (rb, rbs) {
+        pkts++;
+        bytes += rb->len;
+    }
+
+    ret = rl_sdu_rx_flow_batch(ipcp, rx_flow, rbs, true);
+
+    spin_lock_bh(&priv->lock);
+    if (unlikely(ret)) {
+        tx_flow->stats.tx_err++;
+        rx_flow->stats.rx_err++;
+
+    } else {
+        tx_flow->stats.tx_pkt += pkts;
+        tx_flow->stats.tx_byte += bytes;
+        rx_flow->stats.rx_pkt += pkts;
+        rx_flow->stats.rx_byte += bytes;
+    }
+    spin_unlock_bh(&priv->lock);
+
+    flow_put(rx_flow);
+
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    size_t ofs;
+    unsigned int min;
+    unsigned int max;
+} emu_params[] = {
+    {"delay_us", offsetof(struct loopback_emu, delay_us), 0, UINT_MAX / 2},
+    {"jitter_us", offsetof(struct loopback_emu, jitter_us), 0, UINT_MAX / 2},
+    {"loss_ppm", offsetof(struct loopback_emu, loss_ppm), 0, 1000000},
+    {"ge_p_ppm", offsetof(struct loopback_emu, ge_p_ppm), 0, 1000000},
+    {"ge_r_ppm", offsetof(struct loopback_emu, ge_r_ppm), 0, 1000000},
+    {"ge_bad_loss_ppm", offsetof(struct loopback_emu, ge_bad_loss_ppm), 0,
+     1000000},
+    {"reorder_ppm", offsetof(struct loopback_emu, reorder_ppm), 0, 1000000},
+    {"rate_kbps", offsetof(struct loopback_emu, rate_kbps), 0, UINT_MAX},
+    {"limit", offsetof(struct loopback_emu, limit), 1, RX_ENTRIES},
+};
+
+static int
+loopback_emu_config(struct rl_shim_loopback *priv, const char *param_name,
+                    const char *param_value)
+{
+    struct loopback_emu *emu = &priv->emu;
+    unsigned int val;
+    int i;
+    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(emu_params); i++) {
+        if (strcmp(param_name, emu_params[i].name) == 0) {
+            break;
+        }
+    }
+
+    if (i == ARRAY_SIZE(emu_params)) {
+        return -ENOSYS;
+    }
+
+    ret = kstrtouint(param_value, 10, &val);
+    if (ret) {
+        return ret;
+    }
+
+    if (val < emu_params[i].min || val > emu_params[i].max) {
+        return -EINVAL;
+    }
+
+    spin_lock_bh(&priv->lock);
+    *(unsigned int *)(((uint8_t *)emu) + emu_params[i].ofs) = val;
+    priv->emulate = emu->delay_us || emu->jitter_us || emu->reorder_ppm ||
+                    emu->rate_kbps || emu->limit < RX_ENTRIES;
+    if (!emu->ge_p_ppm) {
+        priv->ge_bad = false;
+    }
+    spin_unlock_bh(&priv->lock);
+
+    PD("%s set to %u\n", param_name, val);
+
+    return 0;
+}
+
 static int
 rl_shim_loopback_config(struct ipcp_entry *ipcp, const char *param_name,
                         const char *param_value, int *notify)
@@ -394,6 +696,9 @@ rl_shim_loopback_config(struct ipcp_entry *ipcp, const char *param_name,
         if (ret == 0) {
             PD("drop_fract set to %u\n", priv->drop_fract);
         }
+
+    } else {
+        ret = loopback_emu_config(priv, param_name, param_value);
     }
 
     return ret;
@@ -424,6 +729,7 @@ static struct ipcp_factory shim_loopback_factory = {
     .ops.flow_allocate_resp = rl_shim_loopback_fa_resp,
     .ops.flow_deallocated   = rl_shim_loopback_flow_deallocated,
     .ops.sdu_write          = rl_shim_loopback_sdu_write,
+    .ops.sdu_write_batch    = rl_shim_loopback_sdu_write_batch,
     .ops.config             = rl_shim_loopback_config,
     .ops.flow_get_stats     = rl_shim_loopback_flow_get_stats,
     .ops.flow_writeable     = rl_shim_loopback_flow_writeable,
@@ -72,6 +72,9 @@ struct shim_tcp4_flow {
 
 #define INET4_MAX_TXQ_LEN 64
 
+/* Max number of received SDUs handed to the upper layer at once. */
+#define TCP4_RX_BATCH 32
+
 struct txq_entry {
     struct rl_buf *rb;
     struct shim_tcp4_flow *flow_priv;
@@ -125,9 +128,12 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
     struct flow_entry *flow = priv->flow;
     struct socket *sock     = priv->sock;
     struct msghdr msghdr;
+    struct rb_list rbs;
+    unsigned int n = 0;
     struct iovec iov;
     int ret;
 
+    rb_list_init(&rbs);
     mutex_lock(&priv->rxw_lock);
 
     for (;;) {
@@ -175,7 +181,7 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
             } else {
                 priv->cur_rx_hdr = false;
                 priv->cur_rx_rb  = rl_buf_alloc(
-                    priv->cur_rx_rblen, priv->flow->txrx.ipcp->rxhdroom,
+                    priv->cur_rx_rblen, rl_rxhdroom(priv->flow->txrx.ipcp),
                     priv->flow->txrx.ipcp->tailroom, GFP_ATOMIC);
                 if (unlikely(!priv->cur_rx_rb)) {
                     flow->stats.rx_err++;
@@ -189,8 +195,13 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
 
         } else if (!priv->cur_rx_hdr &&
                    priv->cur_rx_buflen == priv->cur_rx_rblen) {
-            /* We have completely read the SDU. */
-            rl_sdu_rx_flow(flow->txrx.ipcp, flow, priv->cur_rx_rb, true);
+            /* We have completely read the SDU. The SDUs drained are
+             * handed to the upper layer in bursts. */
+            rb_list_enq(priv->cur_rx_rb, &rbs);
+            if (++n >= TCP4_RX_BATCH) {
+                rl_sdu_rx_flow_batch(flow->txrx.ipcp, flow, &rbs, true);
+                n = 0;
+            }
 
             flow->stats.rx_pkt++;
             flow->stats.rx_byte += priv->cur_rx_rblen;
@@ -203,6 +214,7 @@ tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
         }
     }
 
+    rl_sdu_rx_flow_batch(flow->txrx.ipcp, flow, &rbs, true);
     mutex_unlock(&priv->rxw_lock);
 }
 
@@ -469,6 +481,148 @@ rl_shim_tcp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     return tcp4_xmit(flow_priv, rb);
 }
 
+/* Maximum number of SDUs written with a single kernel_sendmsg(). */
+#define TCP4_TX_BATCH 16
+
+/* Write 'n' SDUs on the stream with a single kernel_sendmsg(), each
+ * one preceded by its length header. The SDUs are consumed. */
+static void
+tcp4_xmit_batch(struct shim_tcp4_flow *flow_priv, struct rl_buf **rbv,
+                unsigned int n)
+{
+    struct kvec iov[2 * TCP4_TX_BATCH];
+    uint16_t lenhdr[TCP4_TX_BATCH];
+    struct msghdr msghdr;
+    uint64_t bytes = 0;
+    int totlen     = 0;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < n; i++) {
+        lenhdr[i]               = htons(rbv[i]->len);
+        iov[2 * i].iov_base     = &lenhdr[i];
+        iov[2 * i].iov_len      = sizeof(lenhdr[i]);
+        iov[2 * i + 1].iov_base = RL_BUF_DATA(rbv[i]);
+        iov[2 * i + 1].iov_len  = rbv[i]->len;
+        totlen += rbv[i]->len + sizeof(lenhdr[i]);
+        bytes += rbv[i]->len;
+    }
+
+    memset(&msghdr, 0, sizeof(msghdr));
+    msghdr.msg_flags = MSG_DONTWAIT;
+    ret = kernel_sendmsg(flow_priv->sock, &msghdr, iov, 2 * n, totlen);
+
+    spin_lock_bh(&flow_priv->txstats_lock);
+    if (unlikely(ret != totlen)) {
+        if (ret < 0) {
+            PE("kernel_sendmsg(): failed [%d]\n", ret);
+        } else {
+            PI("kernel_sendmsg(): partial write %d/%d\n", ret, totlen);
+        }
+        flow_priv->flow->stats.tx_err += n;
+    } else {
+        flow_priv->flow->stats.tx_pkt += n;
+        flow_priv->flow->stats.tx_byte += bytes;
+    }
+    spin_unlock_bh(&flow_priv->txstats_lock);
+
+    for (i = 0; i < n; i++) {
+        rl_buf_free(rbv[i]);
+    }
+}
+
+/* In process context, up to TCP4_TX_BATCH SDUs are gathered into a
+ * single kernel_sendmsg(), taking the socket lock only once. Otherwise
+ * the whole list is appended to the TX queue with a single acquisition
+ * of the txq_lock. */
+static int
+rl_shim_tcp4_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                             struct rb_list *rbs, bool maysleep)
+{
+    struct shim_tcp4_flow *flow_priv = flow->priv;
+    struct rl_shim_tcp4 *shim        = ipcp->priv;
+    struct rl_buf *rbv[TCP4_TX_BATCH];
+    struct txq_entry *qe, *tmpqe;
+    struct rl_buf *rb, *tmp;
+    struct list_head qes;
+    unsigned int queued = 0;
+    unsigned int n      = 0;
+    int wspace;
+    int ret = 0;
+
+    wspace = sk_stream_wspace(flow_priv->sock->sk);
+    INIT_LIST_HEAD(&qes);
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        int totlen = rb->len + sizeof(uint16_t);
+
+        if (wspace < totlen + 2) {
+            /* Backpressure: We will be called again. */
+            ret = -EAGAIN;
+            break;
+        }
+        wspace -= totlen;
+        rb_list_del(rb);
+
+        if (maysleep) {
+            rbv[n++] = rb;
+            if (n == TCP4_TX_BATCH) {
+                tcp4_xmit_batch(flow_priv, rbv, n);
+                n = 0;
+            }
+            continue;
+        }
+
+        qe = rl_alloc(sizeof(*qe), GFP_ATOMIC, RL_MT_SHIMDATA);
+        if (unlikely(!qe)) {
+            rl_buf_free(rb);
+            PE("Out of memory, dropping packet\n");
+            ret = -ENOMEM;
+            continue;
+        }
+        qe->rb = rb;
+        flow_get_ref(flow);
+        qe->flow_priv = flow_priv;
+        list_add_tail(&qe->node, &qes);
+    }
+
+    if (maysleep) {
+        if (n) {
+            tcp4_xmit_batch(flow_priv, rbv, n);
+        }
+        return ret;
+    }
+
+    spin_lock_bh(&shim->txq_lock);
+    list_for_each_entry_safe (qe, tmpqe, &qes, node) {
+        if (shim->txq_len > INET4_MAX_TXQ_LEN) {
+            break;
+        }
+        list_del(&qe->node);
+        list_add_tail(&qe->node, &shim->txq);
+        shim->txq_len++;
+        queued++;
+    }
+    spin_unlock_bh(&shim->txq_lock);
+
+    /* Drop what does not fit in the TX queue. */
+    list_for_each_entry_safe (qe, tmpqe, &qes, node) {
+        list_del(&qe->node);
+        NPD(2, "Queue full, dropping PDU [len=%u]\n", qe->rb->len);
+        rl_buf_free(qe->rb);
+        flow_put(flow);
+        rl_free(qe, RL_MT_SHIMDATA);
+        if (!ret) {
+            ret = -ENOSPC;
+        }
+    }
+
+    if (queued) {
+        schedule_work(&shim->txw);
+    }
+
+    return ret;
+}
+
 static int
 rl_shim_tcp4_config(struct ipcp_entry *ipcp, const char *param_name,
                     const char *param_value, int *notify)
@@ -507,6 +661,7 @@ static struct ipcp_factory shim_tcp4_factory = {
     .ops.flow_init          = rl_shim_tcp4_flow_init,
     .ops.flow_deallocated   = rl_shim_tcp4_flow_deallocated,
     .ops.sdu_write          = rl_shim_tcp4_sdu_write,
+    .ops.sdu_write_batch    = rl_shim_tcp4_sdu_write_batch,
     .ops.config             = rl_shim_tcp4_config,
     .ops.flow_get_stats     = rl_shim_tcp4_flow_get_stats,
     .ops.flow_writeable     = rl_shim_tcp4_flow_writeable,
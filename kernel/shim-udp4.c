@@ -67,6 +67,9 @@ struct shim_udp4_flow {
 
 #define INET4_MAX_TXQ_LEN 64
 
+/* Max number of received PDUs handed to the upper layer at once. */
+#define UDP4_RX_BATCH 32
+
 struct txq_entry {
     struct rl_buf *rb;
     struct shim_udp4_flow *flow_priv;
@@ -143,7 +146,10 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
         .msg_namelen    = 0,
         .msg_flags      = MSG_DONTWAIT,
     };
+    struct rb_list rbs;
+    unsigned int n = 0;
 
+    rb_list_init(&rbs);
     mutex_lock(&priv->rxw_lock);
 
     for (;;) {
@@ -157,7 +163,7 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
             break;
         }
 
-        rb = rl_buf_alloc(ret, priv->flow->txrx.ipcp->rxhdroom,
+        rb = rl_buf_alloc(ret, rl_rxhdroom(priv->flow->txrx.ipcp),
                           priv->flow->txrx.ipcp->tailroom, GFP_ATOMIC);
         if (unlikely(!rb)) {
             flow->stats.rx_err++;
@@ -198,12 +204,18 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
 
         NPD("read %d bytes\n", ret);
         rb->len = ret;
-        rl_sdu_rx_flow(flow->txrx.ipcp, flow, rb, true);
-
         flow->stats.rx_pkt++;
         flow->stats.rx_byte += rb->len;
+
+        /* The PDUs drained are handed to the upper layer in bursts. */
+        rb_list_enq(rb, &rbs);
+        if (++n >= UDP4_RX_BATCH) {
+            rl_sdu_rx_flow_batch(flow->txrx.ipcp, flow, &rbs, true);
+            n = 0;
+        }
     }
 
+    rl_sdu_rx_flow_batch(flow->txrx.ipcp, flow, &rbs, true);
     mutex_unlock(&priv->rxw_lock);
 }
 
@@ -458,6 +470,81 @@ rl_shim_udp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     return udp4_xmit(flow_priv, rb);
 }
 
+/* Each SDU is a separate datagram, so only the deferred transmission
+ * benefits from batching: the whole list is appended to the TX queue
+ * with a single acquisition of the txq_lock, and the TX worker is
+ * scheduled once. */
+static int
+rl_shim_udp4_sdu_write_batch(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                             struct rb_list *rbs, bool maysleep)
+{
+    struct shim_udp4_flow *flow_priv = flow->priv;
+    struct rl_shim_udp4 *shim        = ipcp->priv;
+    struct txq_entry *qe, *tmpqe;
+    struct rl_buf *rb, *tmp;
+    struct list_head qes;
+    unsigned int queued = 0;
+    int wspace;
+    int ret = 0;
+
+    if (maysleep) {
+        return __rl_sdu_write_batch(ipcp, flow, rbs, maysleep);
+    }
+
+    INIT_LIST_HEAD(&qes);
+    wspace = sk_stream_wspace(flow_priv->sock->sk);
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        if (wspace < (int)rb->len) {
+            /* Backpressure: We will be called again. */
+            ret = -EAGAIN;
+            break;
+        }
+        rb_list_del(rb);
+        qe = rl_alloc(sizeof(*qe), GFP_ATOMIC, RL_MT_SHIMDATA);
+        if (unlikely(!qe)) {
+            rl_buf_free(rb);
+            PE("Out of memory, dropping packet\n");
+            ret = -ENOMEM;
+            continue;
+        }
+        wspace -= rb->len;
+        qe->rb = rb;
+        flow_get_ref(flow);
+        qe->flow_priv = flow_priv;
+        list_add_tail(&qe->node, &qes);
+    }
+
+    spin_lock_bh(&shim->txq_lock);
+    list_for_each_entry_safe (qe, tmpqe, &qes, node) {
+        if (shim->txq_len > INET4_MAX_TXQ_LEN) {
+            break;
+        }
+        list_del(&qe->node);
+        list_add_tail(&qe->node, &shim->txq);
+        shim->txq_len++;
+        queued++;
+    }
+    spin_unlock_bh(&shim->txq_lock);
+
+    /* Drop what does not fit in the TX queue. */
+    list_for_each_entry_safe (qe, tmpqe, &qes, node) {
+        list_del(&qe->node);
+        NPD(2, "Queue full, dropping PDU [len=%u]\n", qe->rb->len);
+        rl_buf_free(qe->rb);
+        flow_put(flow);
+        rl_free(qe, RL_MT_SHIMDATA);
+        if (!ret) {
+            ret = -ENOSPC;
+        }
+    }
+
+    if (queued) {
+        schedule_work(&shim->txw);
+    }
+
+    return ret;
+}
+
 static int
 rl_shim_udp4_config(struct ipcp_entry *ipcp, const char *param_name,
                     const char *param_value, int *notify)
@@ -491,6 +578,7 @@ static struct ipcp_factory shim_udp4_factory = {
     .ops.flow_init          = rl_shim_udp4_flow_init,
     .ops.flow_deallocated   = rl_shim_udp4_flow_deallocated,
     .ops.sdu_write          = rl_shim_udp4_sdu_write,
+    .ops.sdu_write_batch    = rl_shim_udp4_sdu_write_batch,
     .ops.config             = rl_shim_udp4_config,
     .ops.flow_get_stats     = rl_shim_udp4_flow_get_stats,
     .ops.flow_writeable     = rl_shim_udp4_flow_writeable,
@@ -6,13 +6,13 @@ rlite-ctl ipcp-enroller-enable x || exit 1
 
 # List per-component parameters, checking that the number of lines is correct
 rlite-ctl dif-policy-param-list dd
-rlite-ctl dif-policy-param-list dd | wc -l | grep -q "\<17\>" || exit 1
+rlite-ctl dif-policy-param-list dd | wc -l | grep -q "\<28\>" || exit 1
 rlite-ctl dif-policy-param-list dd address-allocator | wc -l | grep -q "\<1\>" || exit 1
-rlite-ctl dif-policy-param-list dd dft | wc -l | grep -q "\<1\>" || exit 1
+rlite-ctl dif-policy-param-list dd dft | wc -l | grep -q "\<6\>" || exit 1
 rlite-ctl dif-policy-param-list dd enrollment | wc -l | grep -q "\<3\>" || exit 1
 rlite-ctl dif-policy-param-list dd flow-allocator | wc -l | grep -q "\<6\>" || exit 1
 rlite-ctl dif-policy-param-list dd resource-allocator | wc -l | grep -q "\<3\>" || exit 1
-rlite-ctl dif-policy-param-list dd routing | wc -l | grep -q "\<2\>" || exit 1
+rlite-ctl dif-policy-param-list dd routing | wc -l | grep -q "\<8\>" || exit 1
 rlite-ctl dif-policy-param-list dd rib-daemon | wc -l | grep -q "\<1\>" || exit 1
 
 # Run a list of set operations followed by a correspondent get, checking
@@ -21,6 +21,16 @@ rlite-ctl dif-policy-param-mod dd address-allocator nack-wait-secs 76 || exit 1
 rlite-ctl dif-policy-param-list dd address-allocator nack-wait-secs | grep 76 || exit 1
 rlite-ctl dif-policy-param-mod dd dft replicas r1,r2,r3,r4,r5 || exit 1
 rlite-ctl dif-policy-param-list dd dft replicas | grep "r1,r2,r3,r4,r5" || exit 1
+rlite-ctl dif-policy-param-mod dd dft replication-factor 29 || exit 1
+rlite-ctl dif-policy-param-list dd dft replication-factor | grep 29 || exit 1
+rlite-ctl dif-policy-param-mod dd dft parallelism 11 || exit 1
+rlite-ctl dif-policy-param-list dd dft parallelism | grep 11 || exit 1
+rlite-ctl dif-policy-param-mod dd dft cache-size 4321 || exit 1
+rlite-ctl dif-policy-param-list dd dft cache-size | grep 4321 || exit 1
+rlite-ctl dif-policy-param-mod dd dft cache-ttl 1234 || exit 1
+rlite-ctl dif-policy-param-list dd dft cache-ttl | grep 1234 || exit 1
+rlite-ctl dif-policy-param-mod dd dft cache-negative-ttl 57 || exit 1
+rlite-ctl dif-policy-param-list dd dft cache-negative-ttl | grep 57 || exit 1
 rlite-ctl dif-policy-param-mod dd enrollment timeout 300 || exit 1
 rlite-ctl dif-policy-param-list dd enrollment timeout | grep 300 || exit 1
 rlite-ctl dif-policy-param-mod dd enrollment keepalive 478 || exit 1
@@ -51,6 +61,18 @@ rlite-ctl dif-policy-param-mod dd routing age-incr-intval 107 || exit 1
 rlite-ctl dif-policy-param-mod dd routing age-max 771 || exit 1
 rlite-ctl dif-policy-param-list dd routing age-incr-intval | grep 107 || exit 1
 rlite-ctl dif-policy-param-list dd routing age-max | grep 771 || exit 1
+rlite-ctl dif-policy-param-mod dd routing spf-initial-wait 137 || exit 1
+rlite-ctl dif-policy-param-mod dd routing spf-hold-time 2468 || exit 1
+rlite-ctl dif-policy-param-mod dd routing spf-max-hold-time 9731 || exit 1
+rlite-ctl dif-policy-param-list dd routing spf-initial-wait | grep 137 || exit 1
+rlite-ctl dif-policy-param-list dd routing spf-hold-time | grep 2468 || exit 1
+rlite-ctl dif-policy-param-list dd routing spf-max-hold-time | grep 9731 || exit 1
+rlite-ctl dif-policy-param-mod dd routing qos-routing true || exit 1
+rlite-ctl dif-policy-param-list dd routing qos-routing | grep true || exit 1
+rlite-ctl dif-policy-param-mod dd routing link-capacity 40000 || exit 1
+rlite-ctl dif-policy-param-list dd routing link-capacity | grep 40000 || exit 1
+rlite-ctl dif-policy-param-mod dd routing qos-min-bandwidth 2500 || exit 1
+rlite-ctl dif-policy-param-list dd routing qos-min-bandwidth | grep 2500 || exit 1
 
 # Expect failure on the following ones
 rlite-ctl dif-policy-param-list dd wrong-component timeout 300 && exit 1
@@ -1169,8 +1169,10 @@ CDAPConn::msg_deser(const char *serbuf, size_t serlen)
             return nullptr;
         }
 
-    } else {
-        /* CDAP request message (M_*). */
+    } else if (m->invoke_id != 0) {
+        /* CDAP request message (M_*). Requests with a null invoke id
+         * are not tracked, since no response is expected (e.g. those
+         * multicast to many connections at once). */
         if (invoke_id_mgr.get_invoke_id_remote(m->invoke_id)) {
             PE("Invoke id %d already used remotely\n", m->invoke_id);
             return nullptr;
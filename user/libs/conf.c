@@ -219,17 +219,10 @@ rl_conf_ipcp_config(rl_ipcp_id_t ipcp_id, const char *param_name,
 
 static int
 flow_fetch_append(struct list_head *flows,
-                  const struct rl_kmsg_flow_fetch_resp *resp)
+                  const struct rl_flow_fetch_entry *entry)
 {
     struct rl_flow *rl_flow, *scan;
 
-    if (resp->end) {
-        /* This response is just to say there are no
-         * more flows. */
-
-        return 0;
-    }
-
     rl_flow = rl_alloc(sizeof(*rl_flow), RL_MT_CONF);
     if (!rl_flow) {
         PE("Out of memory\n");
@@ -237,30 +230,38 @@ flow_fetch_append(struct list_head *flows,
         return -1;
     }
 
-    rl_flow->ipcp_id      = resp->ipcp_id;
-    rl_flow->local_port   = resp->local_port;
-    rl_flow->remote_port  = resp->remote_port;
-    rl_flow->local_addr   = resp->local_addr;
-    rl_flow->remote_addr  = resp->remote_addr;
-    rl_flow->spec         = resp->spec;
-    rl_flow->flow_control = resp->flow_control;
+    rl_flow->ipcp_id      = entry->ipcp_id;
+    rl_flow->local_port   = entry->local_port;
+    rl_flow->remote_port  = entry->remote_port;
+    rl_flow->local_addr   = entry->local_addr;
+    rl_flow->remote_addr  = entry->remote_addr;
+    rl_flow->spec         = entry->spec;
+    rl_flow->flow_control = entry->flow_control;
 
     /* Insert the flow into the list sorting by IPCP id first
-     * and then by local port id. */
-    list_for_each_entry (scan, flows, node) {
-        if (rl_flow->ipcp_id < scan->ipcp_id ||
+     * and then by local port id. Pages come in port id order,
+     * so start the scan from the tail. */
+    list_for_each_entry_reverse(scan, flows, node)
+    {
+        if (rl_flow->ipcp_id > scan->ipcp_id ||
             (rl_flow->ipcp_id == scan->ipcp_id &&
-             rl_flow->local_port < scan->local_port)) {
+             rl_flow->local_port > scan->local_port)) {
             break;
         }
     }
-    list_add_tail(&rl_flow->node, &scan->node);
+    list_add_front(&rl_flow->node, &scan->node);
 
     return 0;
 }
 
-int
-rl_conf_flows_fetch(struct list_head *flows, rl_ipcp_id_t ipcp_id)
+/* Issue a (paginated) fetch request to the kernel, calling @append for
+ * each page received, until the kernel reports that there are no more
+ * entries. */
+static int
+rl_conf_fetch(rl_msg_t msg_type, rl_ipcp_id_t ipcp_id,
+              int (*append)(struct list_head *,
+                            struct rl_kmsg_flow_fetch_resp *),
+              struct list_head *list)
 {
     struct rl_kmsg_flow_fetch_resp *resp;
     struct rl_kmsg_flow_fetch msg;
@@ -275,10 +276,9 @@ rl_conf_flows_fetch(struct list_head *flows, rl_ipcp_id_t ipcp_id)
     }
 
     memset(&msg, 0, sizeof(msg));
-    msg.msg_type = RLITE_KER_FLOW_FETCH;
+    msg.msg_type = msg_type;
     msg.ipcp_id  = ipcp_id;
-
-    /* Fill the flows list. */
+    msg.cursor   = 0;
 
     while (!end) {
         msg.event_id = event_id++;
@@ -291,17 +291,20 @@ rl_conf_flows_fetch(struct list_head *flows, rl_ipcp_id_t ipcp_id)
 
         resp = (struct rl_kmsg_flow_fetch_resp *)wait_for_next_msg(fd, 3000);
         if (!resp) {
-            end = 1;
-
-        } else {
-            assert(resp->event_id == msg.event_id);
-            /* Consume and free the response. */
-            flow_fetch_append(flows, resp);
+            ret = -1;
+            break;
+        }
 
-            end = resp->end;
-            rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(resp));
-            rl_free(resp, RL_MT_MSG);
+        assert(resp->event_id == msg.event_id);
+        /* Consume and free the response. */
+        ret        = append(list, resp);
+        end        = resp->end || ret;
+        msg.cursor = resp->cursor;
+        if (resp->entries.buf) {
+            rl_free(resp->entries.buf, RL_MT_UTILS);
         }
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(resp));
+        rl_free(resp, RL_MT_MSG);
     }
 
     rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&msg));
@@ -310,6 +313,34 @@ rl_conf_flows_fetch(struct list_head *flows, rl_ipcp_id_t ipcp_id)
     return ret;
 }
 
+static int
+flows_fetch_page(struct list_head *flows, struct rl_kmsg_flow_fetch_resp *resp)
+{
+    const struct rl_flow_fetch_entry *entry = resp->entries.buf;
+    int i;
+
+    if (resp->entries.len != resp->num_entries * sizeof(*entry)) {
+        PE("Invalid flow fetch response\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < resp->num_entries; i++, entry++) {
+        if (flow_fetch_append(flows, entry)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+rl_conf_flows_fetch(struct list_head *flows, rl_ipcp_id_t ipcp_id)
+{
+    return rl_conf_fetch(RLITE_KER_FLOW_FETCH, ipcp_id, flows_fetch_page,
+                         flows);
+}
+
 void
 rl_conf_flows_purge(struct list_head *flows)
 {
@@ -429,17 +460,10 @@ rl_conf_flows_print(struct list_head *flows)
 /* Support for fetching registration information in kernel space. */
 
 static int
-reg_fetch_append(struct list_head *regs, struct rl_kmsg_reg_fetch_resp *resp)
+reg_fetch_append(struct list_head *regs, const struct rl_reg_fetch_entry *entry)
 {
     struct rl_reg *rl_reg, *scan;
 
-    if (resp->end) {
-        /* This response is just to say there are no
-         * more registered applications. */
-
-        return 0;
-    }
-
     rl_reg = rl_alloc(sizeof(*rl_reg), RL_MT_CONF);
     if (!rl_reg) {
         PE("Out of memory\n");
@@ -447,10 +471,15 @@ reg_fetch_append(struct list_head *regs, struct rl_kmsg_reg_fetch_resp *resp)
         return -1;
     }
 
-    rl_reg->ipcp_id   = resp->ipcp_id;
-    rl_reg->pending   = resp->pending;
-    rl_reg->appl_name = resp->appl_name;
-    resp->appl_name   = NULL;
+    rl_reg->ipcp_id   = entry->ipcp_id;
+    rl_reg->pending   = entry->pending;
+    rl_reg->appl_name = rl_strdup((const char *)(entry + 1), RL_MT_UTILS);
+    if (!rl_reg->appl_name) {
+        rl_free(rl_reg, RL_MT_CONF);
+        PE("Out of memory\n");
+        errno = ENOMEM;
+        return -1;
+    }
 
     /* Insert the flow into the list sorting by IPCP id first
      * and then by application name. */
@@ -466,55 +495,42 @@ reg_fetch_append(struct list_head *regs, struct rl_kmsg_reg_fetch_resp *resp)
     return 0;
 }
 
-int
-rl_conf_regs_fetch(struct list_head *regs, rl_ipcp_id_t ipcp_id)
+static int
+regs_fetch_page(struct list_head *regs, struct rl_kmsg_reg_fetch_resp *resp)
 {
-    struct rl_kmsg_reg_fetch_resp *resp;
-    struct rl_kmsg_reg_fetch msg;
-    uint32_t event_id = 1;
-    int end           = 0;
-    int ret           = 0;
-    int fd;
-
-    fd = rina_open();
-    if (fd < 0) {
-        return fd;
-    }
-
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_type = RLITE_KER_REG_FETCH;
-    msg.ipcp_id  = ipcp_id;
-
-    /* Fill the regs list. */
-
-    while (!end) {
-        msg.event_id = event_id++;
-
-        ret = rl_write_msg(fd, RLITE_MB(&msg), 0);
-        if (ret < 0) {
-            PE("Failed to issue request to the kernel\n");
-            break;
+    const char *buf = resp->entries.buf;
+    uint32_t left   = resp->entries.len;
+    int i;
+
+    for (i = 0; i < resp->num_entries; i++) {
+        const struct rl_reg_fetch_entry *entry =
+            (const struct rl_reg_fetch_entry *)buf;
+        uint32_t entry_len;
+
+        if (left < sizeof(*entry) ||
+            left - sizeof(*entry) < entry->name_len || entry->name_len == 0 ||
+            buf[sizeof(*entry) + entry->name_len - 1] != '\0') {
+            PE("Invalid registration fetch response\n");
+            errno = EINVAL;
+            return -1;
         }
 
-        resp = (struct rl_kmsg_reg_fetch_resp *)wait_for_next_msg(fd, 3000);
-        if (!resp) {
-            end = 1;
-
-        } else {
-            assert(resp->event_id == msg.event_id);
-            /* Consume and free the response. */
-            reg_fetch_append(regs, resp);
-
-            end = resp->end;
-            rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(resp));
-            rl_free(resp, RL_MT_MSG);
+        if (reg_fetch_append(regs, entry)) {
+            return -1;
         }
+
+        entry_len = sizeof(*entry) + entry->name_len;
+        buf += entry_len;
+        left -= entry_len;
     }
 
-    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&msg));
-    close(fd);
+    return 0;
+}
 
-    return ret;
+int
+rl_conf_regs_fetch(struct list_head *regs, rl_ipcp_id_t ipcp_id)
+{
+    return rl_conf_fetch(RLITE_KER_REG_FETCH, ipcp_id, regs_fetch_page, regs);
 }
 
 void
@@ -85,19 +85,93 @@ rl_read_next_msg(int rfd, int quiet)
     return resp;
 }
 
+int
+rl_read_msgs(int rfd, int (*cb)(struct rl_msg_base *msg, void *opaque),
+             void *opaque, int quiet)
+{
+    unsigned int max_resp_size = rl_numtables_max_size(
+        rl_ker_numtables,
+        sizeof(rl_ker_numtables) / sizeof(struct rl_msg_layout));
+    struct rl_msg_base *resp;
+    char serbuf[1 << 14];
+    const char *p;
+    int count = 0;
+    int n;
+
+    n = read(rfd, serbuf, sizeof(serbuf));
+    if (n < 0) {
+        if (!quiet) {
+            perror("read(rfd)");
+        }
+        return -1;
+    }
+
+    /* All the messages in the batch are deserialized into the same
+     * buffer, one at a time. */
+    resp = RLITE_MB(rl_alloc(max_resp_size, RL_MT_MSG));
+    if (!resp) {
+        if (!quiet) {
+            PE("Out of memory\n");
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (p = serbuf; n > 0;) {
+        uint32_t serlen;
+        int ret;
+
+        if (n < sizeof(serlen)) {
+            break;
+        }
+        memcpy(&serlen, p, sizeof(serlen));
+        p += sizeof(serlen);
+        n -= sizeof(serlen);
+        if (serlen > n) {
+            break;
+        }
+
+        ret = deserialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, p,
+                                    serlen, (void *)resp, max_resp_size);
+        p += serlen;
+        n -= serlen;
+        if (ret) {
+            PE("Problems during deserialization [%s]\n", strerror(EPROTO));
+            continue;
+        }
+
+        cb(resp, opaque);
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, resp);
+        count++;
+    }
+
+    if (n) {
+        PE("Truncated message batch [%d bytes left]\n", n);
+    }
+
+    rl_free(resp, RL_MT_MSG);
+
+    return count;
+}
+
 int
 rl_write_msg(int rfd, struct rl_msg_base *msg, int quiet)
 {
-    char serbuf[4096];
+    char stackbuf[4096];
+    char *serbuf = stackbuf;
     unsigned int serlen;
     int ret;
 
-    /* Serialize the message. */
+    /* Serialize the message, using a heap buffer for the messages that
+     * do not fit the stack one (e.g. large PDUFT batches). */
     serlen = rl_msg_serlen(rl_ker_numtables, RLITE_KER_MSG_MAX, msg);
-    if (serlen > sizeof(serbuf)) {
-        PE("Serialized message would be too long [%u]\n", serlen);
-        errno = EINVAL;
-        return -1;
+    if (serlen > sizeof(stackbuf)) {
+        serbuf = rl_alloc(serlen, RL_MT_MISC);
+        if (!serbuf) {
+            PE("Out of memory\n");
+            errno = ENOMEM;
+            return -1;
+        }
     }
     serlen =
         serialize_rlite_msg(rl_ker_numtables, RLITE_KER_MSG_MAX, serbuf, msg);
@@ -120,6 +194,13 @@ rl_write_msg(int rfd, struct rl_msg_base *msg, int quiet)
         ret = 0;
     }
 
+    if (serbuf != stackbuf) {
+        int saved_errno = errno;
+
+        rl_free(serbuf, RL_MT_MISC);
+        errno = saved_errno;
+    }
+
     return ret;
 }
 
@@ -0,0 +1,317 @@
+/*
+ * Flow allocation/deallocation benchmark.
+ *
+ * Copyright (C) 2015-2017 Nextworks
+ *
+ * This file is part of rlite.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A client thread allocates flows towards a server thread in the same
+ * process, keeping up to W flows open at the same time: once W flows
+ * are open, the oldest one is deallocated before allocating a new one.
+ * This keeps the kernel flow tables populated, and measures the latency
+ * of each allocation and deallocation. Run it on a shim-loopback DIF to
+ * measure the local overhead only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <rina/api.h>
+
+#define PRINTF(FMT, ...)                                                       \
+    do {                                                                       \
+        printf(FMT, ##__VA_ARGS__);                                            \
+        fflush(stdout);                                                        \
+    } while (0)
+
+struct flowbench {
+    const char *dif_name;
+    const char *cli_appl_name;
+    const char *srv_appl_name;
+    unsigned int num_flows; /* total number of flows to allocate */
+    unsigned int window;    /* max number of flows open at the same time */
+    int cfd;                /* server control file descriptor */
+
+    /* Server side flows, closed in FIFO order. */
+    int *srv_fds;
+    unsigned int srv_head;
+
+    /* Per-operation latencies, in nanoseconds. */
+    uint64_t *alloc_ns;
+    uint64_t *dealloc_ns;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void *
+server_function(void *opaque)
+{
+    struct flowbench *fb = opaque;
+    unsigned int i;
+
+    for (i = 0; i < fb->num_flows; i++) {
+        unsigned int slot = fb->srv_head++ % fb->window;
+        int fd;
+
+        fd = rina_flow_accept(fb->cfd, NULL, NULL, 0);
+        if (fd < 0) {
+            perror("rina_flow_accept()");
+            break;
+        }
+
+        /* The client closes its side in the same order. */
+        if (fb->srv_fds[slot] >= 0) {
+            close(fb->srv_fds[slot]);
+        }
+        fb->srv_fds[slot] = fd;
+    }
+
+    return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : (x > y);
+}
+
+static void
+report(const char *name, uint64_t *v, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i;
+
+    if (n == 0) {
+        return;
+    }
+
+    qsort(v, n, sizeof(v[0]), cmp_u64);
+    for (i = 0; i < n; i++) {
+        sum += v[i];
+    }
+
+    PRINTF("%-10s %10u %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, n,
+           (double)v[0] / 1000.0, (double)sum / n / 1000.0,
+           (double)v[n / 2] / 1000.0, (double)v[(n * 99ULL) / 100] / 1000.0,
+           (double)v[n - 1] / 1000.0);
+}
+
+static void
+usage(void)
+{
+    PRINTF("rina-flowbench [OPTIONS]\n"
+           "   -h : show this help\n"
+           "   -d DIF : name of DIF where to allocate the flows\n"
+           "   -n NUM : total number of flows to allocate (default 200000)\n"
+           "   -w NUM : max number of flows open at the same time "
+           "(default 1000)\n"
+           "   -a APNAME : application name of the client\n"
+           "   -z APNAME : application name of the server\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct flowbench _fb, *fb = &_fb;
+    struct rina_flow_spec spec;
+    unsigned int ndealloc = 0;
+    unsigned int nalloc   = 0;
+    struct rlimit rlim;
+    pthread_t srv_th;
+    int *cli_fds;
+    unsigned int i;
+    int ret;
+    int opt;
+
+    memset(fb, 0, sizeof(*fb));
+    fb->cli_appl_name = "rina-flowbench|client";
+    fb->srv_appl_name = "rina-flowbench|server";
+    fb->num_flows     = 200000;
+    fb->window        = 1000;
+
+    while ((opt = getopt(argc, argv, "hd:n:w:a:z:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+
+        case 'd':
+            fb->dif_name = optarg;
+            break;
+
+        case 'n':
+            fb->num_flows = atoi(optarg);
+            break;
+
+        case 'w':
+            fb->window = atoi(optarg);
+            break;
+
+        case 'a':
+            fb->cli_appl_name = optarg;
+            break;
+
+        case 'z':
+            fb->srv_appl_name = optarg;
+            break;
+
+        default:
+            PRINTF("    Unrecognized option %c\n", opt);
+            usage();
+            return -1;
+        }
+    }
+
+    if (fb->num_flows == 0 || fb->window == 0) {
+        PRINTF("    Invalid number of flows or window\n");
+        return -1;
+    }
+
+    /* Both the client and the server side of each flow use a
+     * file descriptor. */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+        rlim.rlim_cur < 2 * fb->window + 64) {
+        rlim.rlim_cur = 2 * fb->window + 64;
+        if (rlim.rlim_max < rlim.rlim_cur) {
+            rlim.rlim_max = rlim.rlim_cur;
+        }
+        if (setrlimit(RLIMIT_NOFILE, &rlim)) {
+            perror("setrlimit(RLIMIT_NOFILE)");
+            return -1;
+        }
+    }
+
+    cli_fds       = malloc(fb->window * sizeof(cli_fds[0]));
+    fb->srv_fds   = malloc(fb->window * sizeof(fb->srv_fds[0]));
+    fb->alloc_ns  = malloc(fb->num_flows * sizeof(fb->alloc_ns[0]));
+    fb->dealloc_ns = malloc(fb->num_flows * sizeof(fb->dealloc_ns[0]));
+    if (!cli_fds || !fb->srv_fds || !fb->alloc_ns || !fb->dealloc_ns) {
+        PRINTF("Out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < fb->window; i++) {
+        cli_fds[i] = fb->srv_fds[i] = -1;
+    }
+
+    fb->cfd = rina_open();
+    if (fb->cfd < 0) {
+        perror("rina_open()");
+        return -1;
+    }
+
+    ret = rina_register(fb->cfd, fb->dif_name, fb->srv_appl_name, 0);
+    if (ret) {
+        perror("rina_register()");
+        return ret;
+    }
+
+    ret = pthread_create(&srv_th, NULL, server_function, fb);
+    if (ret) {
+        errno = ret;
+        perror("pthread_create()");
+        return -1;
+    }
+
+    rina_flow_spec_unreliable(&spec);
+
+    for (i = 0; i < fb->num_flows; i++) {
+        unsigned int slot = i % fb->window;
+        uint64_t t;
+
+        if (cli_fds[slot] >= 0) {
+            /* Deallocate the oldest flow. */
+            t = now_ns();
+            close(cli_fds[slot]);
+            fb->dealloc_ns[ndealloc++] = now_ns() - t;
+            cli_fds[slot]              = -1;
+        }
+
+        t             = now_ns();
+        cli_fds[slot] = rina_flow_alloc(fb->dif_name, fb->cli_appl_name,
+                                        fb->srv_appl_name, &spec, 0);
+        if (cli_fds[slot] < 0) {
+            perror("rina_flow_alloc()");
+            break;
+        }
+        fb->alloc_ns[nalloc++] = now_ns() - t;
+
+        if ((i + 1) % 10000 == 0) {
+            PRINTF("%u flows allocated\n", i + 1);
+        }
+    }
+
+    for (i = 0; i < fb->window; i++) {
+        if (cli_fds[i] >= 0) {
+            uint64_t t = now_ns();
+
+            close(cli_fds[i]);
+            fb->dealloc_ns[ndealloc++] = now_ns() - t;
+        }
+    }
+
+    if (nalloc < fb->num_flows) {
+        /* Unblock the server. */
+        pthread_cancel(srv_th);
+    }
+    pthread_join(srv_th, NULL);
+    for (i = 0; i < fb->window; i++) {
+        if (fb->srv_fds[i] >= 0) {
+            close(fb->srv_fds[i]);
+        }
+    }
+
+    PRINTF("%-10s %10s %10s %10s %10s %10s %10s\n", "Operation", "Count",
+           "Min(us)", "Avg(us)", "P50(us)", "P99(us)", "Max(us)");
+    report("alloc", fb->alloc_ns, nalloc);
+    report("dealloc", fb->dealloc_ns, ndealloc);
+
+    free(fb->dealloc_ns);
+    free(fb->alloc_ns);
+    free(fb->srv_fds);
+    free(cli_fds);
+    close(fb->cfd);
+
+    return nalloc == fb->num_flows ? 0 : -1;
+}
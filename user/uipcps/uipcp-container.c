@@ -29,6 +29,7 @@
 #include <sys/eventfd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/ioctl.h>
 
 #include "rlite/conf.h"
 #include "rlite/utils.h"
@@ -98,7 +99,7 @@ uipcp_appl_register_resp(struct uipcp *uipcp, uint8_t response,
 
 static int
 uipcp_pduft_mod(struct uipcp *uipcp, rlm_addr_t dst_addr, rl_port_t local_port,
-                rl_msg_t msg_type)
+                rl_msg_t msg_type, uint8_t flags)
 {
     struct rl_kmsg_ipcp_pduft_mod req;
     int ret;
@@ -110,6 +111,7 @@ uipcp_pduft_mod(struct uipcp *uipcp, rlm_addr_t dst_addr, rl_port_t local_port,
     req.ipcp_id    = uipcp->id;
     req.dst_addr   = dst_addr;
     req.local_port = local_port;
+    req.flags      = flags;
 
     ret = rl_write_msg(uipcp->cfd, RLITE_MB(&req), 1);
     if (ret) {
@@ -124,14 +126,82 @@ int
 uipcp_pduft_set(struct uipcp *uipcp, rlm_addr_t dst_addr, rl_port_t local_port)
 {
     return uipcp_pduft_mod(uipcp, dst_addr, local_port,
-                           RLITE_KER_IPCP_PDUFT_SET);
+                           RLITE_KER_IPCP_PDUFT_SET, 0);
 }
 
 int
 uipcp_pduft_del(struct uipcp *uipcp, rlm_addr_t dst_addr, rl_port_t local_port)
 {
     return uipcp_pduft_mod(uipcp, dst_addr, local_port,
-                           RLITE_KER_IPCP_PDUFT_DEL);
+                           RLITE_KER_IPCP_PDUFT_DEL, 0);
+}
+
+/* Use 'local_port' as a backup for the PDUFT entry of 'dst_addr'. */
+int
+uipcp_pduft_backup_set(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                       rl_port_t local_port)
+{
+    return uipcp_pduft_mod(uipcp, dst_addr, local_port,
+                           RLITE_KER_IPCP_PDUFT_SET, RL_PDUFT_F_BACKUP);
+}
+
+int
+uipcp_pduft_backup_del(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                       rl_port_t local_port)
+{
+    return uipcp_pduft_mod(uipcp, dst_addr, local_port,
+                           RLITE_KER_IPCP_PDUFT_DEL, RL_PDUFT_F_BACKUP);
+}
+
+/* Add 'local_port' to the members of the multicast group 'dst_addr'. */
+int
+uipcp_pduft_mcast_add(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                      rl_port_t local_port)
+{
+    return uipcp_pduft_mod(uipcp, dst_addr, local_port,
+                           RLITE_KER_IPCP_PDUFT_SET, RL_PDUFT_F_MCAST);
+}
+
+/* Remove 'local_port' from the members of the multicast group
+ * 'dst_addr'. */
+int
+uipcp_pduft_mcast_del(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                      rl_port_t local_port)
+{
+    return uipcp_pduft_mod(uipcp, dst_addr, local_port,
+                           RLITE_KER_IPCP_PDUFT_DEL, RL_PDUFT_F_MCAST);
+}
+
+/* Apply many PDUFT modifications, in order, with a single message, so
+ * that the kernel applies them all together. Returns -1 if any of the
+ * modifications failed. */
+int
+uipcp_pduft_batch(struct uipcp *uipcp,
+                  const struct rl_pduft_batch_entry *entries,
+                  unsigned int num_entries)
+{
+    struct rl_kmsg_ipcp_pduft_batch req;
+
+    if (num_entries == 0) {
+        return 0;
+    }
+
+    /* Create a request message. The entries are not owned by the
+     * message, so rl_msg_free() is not needed. */
+    memset(&req, 0, sizeof(req));
+    req.msg_type    = RLITE_KER_IPCP_PDUFT_BATCH;
+    req.event_id    = 1;
+    req.ipcp_id     = uipcp->id;
+    req.num_entries = num_entries;
+    req.entries.buf = (void *)entries;
+    req.entries.len = num_entries * sizeof(*entries);
+
+    if (rl_write_msg(uipcp->cfd, RLITE_MB(&req), 1)) {
+        UPE(uipcp, "rl_write_msg() failed [%s]\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
 }
 
 int
@@ -358,17 +428,61 @@ struct uipcp_loop_fdh {
     struct list_head tmpnode; /* private for the uipcp_loop */
 };
 
+/* Dispatch a message posted by the kernel to the uipcp. */
+static int
+uipcp_kmsg_dispatch(struct rl_msg_base *msg, void *opaque)
+{
+    struct uipcp *uipcp         = opaque;
+    uipcp_msg_handler_t handler = NULL;
+
+    assert(msg->msg_type < RLITE_KER_MSG_MAX);
+
+    switch (msg->msg_type) {
+    case RLITE_KER_FA_REQ:
+        handler = uipcp->ops.fa_req;
+        break;
+
+    case RLITE_KER_FA_RESP:
+        handler = uipcp->ops.fa_resp;
+        break;
+
+    case RLITE_KER_APPL_REGISTER:
+        handler = uipcp->ops.appl_register;
+        break;
+
+    case RLITE_KER_FLOW_DEALLOCATED:
+        handler = uipcp->ops.flow_deallocated;
+        break;
+
+    case RLITE_KER_FA_REQ_ARRIVED:
+        handler = uipcp->ops.neigh_fa_req_arrived;
+        break;
+
+    case RLITE_KER_FLOW_STATE:
+        handler = uipcp->ops.flow_state_update;
+        break;
+
+    default:
+        UPE(uipcp, "Message type %u not handled\n", msg->msg_type);
+        break;
+    }
+
+    if (handler) {
+        return handler(uipcp, msg);
+    }
+
+    return 0;
+}
+
 static void *
 uipcp_loop(void *opaque)
 {
     struct uipcp *uipcp = opaque;
 
     for (;;) {
-        int maxfd                   = MAX(uipcp->cfd, uipcp->eventfd);
-        uipcp_msg_handler_t handler = NULL;
+        int maxfd = MAX(uipcp->cfd, uipcp->eventfd);
         struct uipcp_loop_fdh *fdh;
         struct timeval *top = NULL;
-        struct rl_msg_base *msg;
         struct timeval to;
         fd_set rdfs;
         int ret;
@@ -502,50 +616,8 @@ uipcp_loop(void *opaque)
             continue;
         }
 
-        /* Read the next message posted by the kernel. */
-        msg = rl_read_next_msg(uipcp->cfd, 0);
-        if (!msg) {
-            continue;
-        }
-
-        assert(msg->msg_type < RLITE_KER_MSG_MAX);
-
-        switch (msg->msg_type) {
-        case RLITE_KER_FA_REQ:
-            handler = uipcp->ops.fa_req;
-            break;
-
-        case RLITE_KER_FA_RESP:
-            handler = uipcp->ops.fa_resp;
-            break;
-
-        case RLITE_KER_APPL_REGISTER:
-            handler = uipcp->ops.appl_register;
-            break;
-
-        case RLITE_KER_FLOW_DEALLOCATED:
-            handler = uipcp->ops.flow_deallocated;
-            break;
-
-        case RLITE_KER_FA_REQ_ARRIVED:
-            handler = uipcp->ops.neigh_fa_req_arrived;
-            break;
-
-        case RLITE_KER_FLOW_STATE:
-            handler = uipcp->ops.flow_state_update;
-            break;
-
-        default:
-            UPE(uipcp, "Message type %u not handled\n", msg->msg_type);
-            break;
-        }
-
-        if (handler) {
-            handler(uipcp, msg);
-        }
-
-        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(msg));
-        rl_free(msg, RL_MT_MSG);
+        /* Read and process all the messages posted by the kernel. */
+        rl_read_msgs(uipcp->cfd, uipcp_kmsg_dispatch, uipcp, 0);
     }
 
     return NULL;
@@ -920,6 +992,14 @@ uipcp_add(struct uipcps *uipcps, struct rl_kmsg_ipcp_update *upd)
         goto err3;
     }
 
+    /* Kernel notifications may come in bursts (e.g. many flows going
+     * down at once), so consume them in batches. */
+    ret = ioctl(uipcp->cfd, RLITE_IOCTL_CHFLAGS, RL_F_BATCH);
+    if (ret) {
+        PE("ioctl(CHFLAGS) failed [%s]\n", strerror(errno));
+        goto err3;
+    }
+
     uipcp->eventfd = eventfd(0, 0);
     if (uipcp->eventfd < 0) {
         PE("eventfd() failed [%s]\n", strerror(errno));
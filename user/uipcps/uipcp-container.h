@@ -274,6 +274,22 @@ int uipcp_pduft_set(struct uipcp *uipcp, rlm_addr_t dst_addr,
 int uipcp_pduft_del(struct uipcp *uipcp, rlm_addr_t dst_addr,
                     rl_port_t local_port);
 
+int uipcp_pduft_backup_set(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                           rl_port_t local_port);
+
+int uipcp_pduft_backup_del(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                           rl_port_t local_port);
+
+int uipcp_pduft_mcast_add(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                          rl_port_t local_port);
+
+int uipcp_pduft_mcast_del(struct uipcp *uipcp, rlm_addr_t dst_addr,
+                          rl_port_t local_port);
+
+int uipcp_pduft_batch(struct uipcp *uipcp,
+                      const struct rl_pduft_batch_entry *entries,
+                      unsigned int num_entries);
+
 int uipcp_pduft_flush(struct uipcp *uipcp);
 
 int uipcp_issue_fa_req_arrived(struct uipcp *uipcp, uint32_t kevent_id,
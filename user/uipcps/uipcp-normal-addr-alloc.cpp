@@ -11,6 +11,21 @@ class DistributedAddrAllocator : public AddrAllocator {
      * It maps (address allocated) --> (requestor address). */
     std::unordered_map<rlm_addr_t, AddrAllocRequest> addr_alloc_table;
 
+    /* Digest of the table, updated by table_set() and table_erase(). */
+    DigestTree dtree;
+    void table_set(const AddrAllocRequest &r);
+    void table_erase(rlm_addr_t addr);
+
+    /* Deleted entries, keyed by (address, requestor). Entries are not
+     * versioned, so a deleted entry can only come back with a new
+     * allocation request. */
+    Tombstones<std::pair<rlm_addr_t, rlm_addr_t>> tombstones;
+    void tombstone_add(const AddrAllocRequest &r)
+    {
+        tombstones.add(make_pair(r.address, r.requestor), 0,
+                       uipcp_rib::kTombstoneLifetime);
+    }
+
 public:
     RL_NODEFAULT_NONCOPIABLE(DistributedAddrAllocator);
     DistributedAddrAllocator(struct uipcp_rib *_ur) : AddrAllocator(_ur) {}
@@ -20,7 +35,9 @@ public:
     rlm_addr_t allocate() override;
     int rib_handler(const CDAPMessage *rm, NeighFlow *nf,
                     rlm_addr_t src_addr) override;
-    int sync_neigh(NeighFlow *nf, unsigned int limit) const override;
+    void digest(DigestTree &dt) const override;
+    int sync_neigh(NeighFlow *nf, unsigned int limit,
+                   const DigestTree::BucketMask *buckets) const override;
 };
 
 void
@@ -35,8 +52,39 @@ DistributedAddrAllocator::dump(std::stringstream &ss) const
     ss << endl;
 }
 
+void
+DistributedAddrAllocator::table_set(const AddrAllocRequest &r)
+{
+    auto mit = addr_alloc_table.find(r.address);
+
+    if (mit != addr_alloc_table.end()) {
+        dtree.del(to_string(r.address), to_string(mit->second.requestor));
+    }
+    addr_alloc_table[r.address] = r;
+    dtree.add(to_string(r.address), to_string(r.requestor));
+}
+
+void
+DistributedAddrAllocator::table_erase(rlm_addr_t addr)
+{
+    auto mit = addr_alloc_table.find(addr);
+
+    if (mit != addr_alloc_table.end()) {
+        dtree.del(to_string(addr), to_string(mit->second.requestor));
+        addr_alloc_table.erase(mit);
+    }
+}
+
+void
+DistributedAddrAllocator::digest(DigestTree &dt) const
+{
+    dt = dtree;
+}
+
 int
-DistributedAddrAllocator::sync_neigh(NeighFlow *nf, unsigned int limit) const
+DistributedAddrAllocator::sync_neigh(
+    NeighFlow *nf, unsigned int limit,
+    const DigestTree::BucketMask *buckets) const
 {
     int ret = 0;
 
@@ -44,12 +92,41 @@ DistributedAddrAllocator::sync_neigh(NeighFlow *nf, unsigned int limit) const
         AddrAllocEntries l;
 
         while (l.entries.size() < limit && ati != addr_alloc_table.end()) {
-            l.entries.push_back(ati->second);
+            string key = to_string(ati->first);
+
+            if (!buckets || (*buckets)[DigestTree::bucket(key)]) {
+                l.entries.push_back(ati->second);
+            }
             ati++;
         }
 
-        ret |= nf->neigh->neigh_sync_obj(nf, true, obj_class::addr_alloc_table,
-                                         obj_name::addr_alloc_table, &l);
+        if (l.entries.size()) {
+            ret |= nf->neigh->neigh_sync_obj(nf, true,
+                                             obj_class::addr_alloc_table,
+                                             obj_name::addr_alloc_table, &l);
+        }
+    }
+
+    /* Also push the deletions, so that a neighbor which missed them
+     * removes its stale entries instead of pushing them back. */
+    AddrAllocEntries dl;
+    tombstones.for_each([&](const pair<rlm_addr_t, rlm_addr_t> &key,
+                            uint64_t version) {
+        if (buckets && !(*buckets)[DigestTree::bucket(to_string(key.first))]) {
+            return;
+        }
+        dl.entries.emplace_back(key.first, key.second);
+        if (dl.entries.size() >= limit) {
+            ret |= nf->neigh->neigh_sync_obj(nf, false,
+                                             obj_class::addr_alloc_table,
+                                             obj_name::addr_alloc_table, &dl);
+            dl.entries.clear();
+        }
+    });
+
+    if (dl.entries.size()) {
+        ret |= nf->neigh->neigh_sync_obj(nf, false, obj_class::addr_alloc_table,
+                                         obj_name::addr_alloc_table, &dl);
     }
 
     return ret;
@@ -85,7 +162,8 @@ DistributedAddrAllocator::allocate()
         }
 
         UPD(rib->uipcp, "Trying with address %lu\n", (unsigned long)addr);
-        addr_alloc_table[addr] = AddrAllocRequest(addr, rib->myaddr);
+        table_set(AddrAllocRequest(addr, rib->myaddr));
+        tombstones.erase(make_pair(addr, rib->myaddr));
 
         for (const auto &kvn : rib->neighbors) {
             if (kvn.second->enrollment_complete()) {
@@ -177,7 +255,8 @@ DistributedAddrAllocator::rib_handler(const CDAPMessage *rm, NeighFlow *nf,
         case gpb::M_CREATE:
             if (!cand_neigh_conflict && mit == addr_alloc_table.end()) {
                 /* New address allocation request, no conflicts. */
-                addr_alloc_table[aar.address] = aar;
+                table_set(aar);
+                tombstones.erase(make_pair(aar.address, aar.requestor));
                 UPD(rib->uipcp,
                     "Address allocation request ok, (addr=%lu,"
                     "requestor=%lu)\n",
@@ -210,7 +289,8 @@ DistributedAddrAllocator::rib_handler(const CDAPMessage *rm, NeighFlow *nf,
             if (mit != addr_alloc_table.end()) {
                 if (mit->second.pending) {
                     /* Negative feedback on a flow allocation request. */
-                    addr_alloc_table.erase(aar.address);
+                    tombstone_add(mit->second);
+                    table_erase(aar.address);
                     propagate = true;
                     UPI(rib->uipcp,
                         "Address allocation request deleted, "
@@ -251,9 +331,13 @@ DistributedAddrAllocator::rib_handler(const CDAPMessage *rm, NeighFlow *nf,
             auto mit = addr_alloc_table.find(r.address);
 
             if (rm->op_code == gpb::M_CREATE) {
+                if (tombstones.deleted(make_pair(r.address, r.requestor), 0)) {
+                    /* Pushed by someone who missed the deletion. */
+                    continue;
+                }
                 if (mit == addr_alloc_table.end() ||
                     mit->second.requestor != r.requestor) {
-                    addr_alloc_table[r.address] = r; /* overwrite */
+                    table_set(r); /* overwrite */
                     prop_aal.entries.push_back(r);
                     UPD(rib->uipcp,
                         "Address allocation entry created (addr=%lu,"
@@ -261,9 +345,10 @@ DistributedAddrAllocator::rib_handler(const CDAPMessage *rm, NeighFlow *nf,
                         (long unsigned)r.address, (long unsigned)r.requestor);
                 }
             } else { /* M_DELETE */
+                tombstone_add(r);
                 if (mit != addr_alloc_table.end() &&
                     mit->second.requestor == r.requestor) {
-                    addr_alloc_table.erase(r.address);
+                    table_erase(r.address);
                     prop_aal.entries.push_back(r);
                     UPD(rib->uipcp,
                         "Address allocation entry deleted (addr=%lu,"
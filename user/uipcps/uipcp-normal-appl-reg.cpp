@@ -26,6 +26,7 @@
 #include <cstdlib>
 
 #include "uipcp-normal.hpp"
+#include "uipcp-normal-kademlia.hpp"
 
 using namespace std;
 
@@ -49,6 +50,17 @@ class FullyReplicatedDFT : public DFT {
      * equivalent. */
     std::multimap<std::string, DFTEntry> dft_table;
 
+    /* Digest of the table, updated by table_insert() and table_erase(). */
+    DigestTree dtree;
+    static std::string digest_content(const DFTEntry &e);
+    void table_insert(const std::string &key, const DFTEntry &e);
+    void table_erase(std::multimap<std::string, DFTEntry>::iterator mit);
+
+    /* Deleted entries, keyed by (application name, address). The entry
+     * timestamps are used as versions. */
+    Tombstones<std::pair<std::string, rlm_addr_t>> tombstones;
+    void tombstone_add(const DFTEntry &e);
+
 public:
     RL_NODEFAULT_NONCOPIABLE(FullyReplicatedDFT);
     FullyReplicatedDFT(struct uipcp_rib *_ur) : DFT(_ur) {}
@@ -62,8 +74,9 @@ public:
     void update_address(rlm_addr_t new_addr) override;
     int rib_handler(const CDAPMessage *rm, NeighFlow *nf,
                     rlm_addr_t src_addr) override;
-    int sync_neigh(NeighFlow *nf, unsigned int limit) const override;
-    int neighs_refresh(size_t limit) override;
+    void digest(DigestTree &dt) const override;
+    int sync_neigh(NeighFlow *nf, unsigned int limit,
+                   const DigestTree::BucketMask *buckets) const override;
 
     /* Helper function shared with CentralizedFaultTolerantDFT::Replica. */
     void mod_table(const DFTEntry &e, bool add, DFTSlice *added,
@@ -158,7 +171,7 @@ FullyReplicatedDFT::appl_register(const struct rl_kmsg_appl_register *req)
         }
 
         /* Insert the object into the RIB. */
-        dft_table.insert(make_pair(appl_name, dft_entry));
+        table_insert(appl_name, dft_entry);
     } else {
         if (mit == range.second) {
             UPE(uipcp, "Application %s was not registered here\n",
@@ -167,7 +180,8 @@ FullyReplicatedDFT::appl_register(const struct rl_kmsg_appl_register *req)
         }
 
         /* Remove from the RIB. */
-        dft_table.erase(mit);
+        table_erase(mit);
+        tombstone_add(dft_entry);
     }
 
     dft_slice.entries.push_back(dft_entry);
@@ -181,6 +195,13 @@ FullyReplicatedDFT::appl_register(const struct rl_kmsg_appl_register *req)
     return 0;
 }
 
+void
+FullyReplicatedDFT::tombstone_add(const DFTEntry &e)
+{
+    tombstones.add(make_pair(static_cast<string>(e.appl_name), e.address),
+                   e.timestamp, uipcp_rib::kTombstoneLifetime);
+}
+
 /* Tries ot add or remove an entry 'e' from the DFT multimap. If not nullptr,
  * the entries added and/or removed are appended to 'added' and 'removed'
  * respectively. */
@@ -193,6 +214,8 @@ FullyReplicatedDFT::mod_table(const DFTEntry &e, bool add, DFTSlice *added,
     multimap<string, DFTEntry>::iterator mit;
     struct uipcp *uipcp = rib->uipcp;
 
+    rib->dft_cache.invalidate(key);
+
     for (mit = range.first; mit != range.second; mit++) {
         if (mit->second.address == e.address) {
             break;
@@ -202,15 +225,22 @@ FullyReplicatedDFT::mod_table(const DFTEntry &e, bool add, DFTSlice *added,
     if (add) {
         bool collision = (mit != range.second);
 
+        if (tombstones.deleted(make_pair(key, e.address), e.timestamp)) {
+            /* Pushed by someone who missed the deletion. */
+            UPV(uipcp, "DFT entry %s --> %lu already deleted\n", key.c_str(),
+                e.address);
+            return;
+        }
+
         if (!collision || e.timestamp > mit->second.timestamp) {
             if (collision) {
                 /* Remove the collided entry. */
                 if (removed) {
                     removed->entries.push_back(mit->second);
                 }
-                dft_table.erase(mit);
+                table_erase(mit);
             }
-            dft_table.insert(make_pair(key, e));
+            table_insert(key, e);
             if (added) {
                 added->entries.push_back(e);
             }
@@ -219,10 +249,15 @@ FullyReplicatedDFT::mod_table(const DFTEntry &e, bool add, DFTSlice *added,
         }
 
     } else {
+        if (mit != range.second && mit->second.timestamp > e.timestamp) {
+            /* The entry was created again after this deletion. */
+            return;
+        }
+        tombstone_add(e);
         if (mit == range.second) {
-            UPI(uipcp, "DFT entry does not exist\n");
+            UPV(uipcp, "DFT entry does not exist\n");
         } else {
-            dft_table.erase(mit);
+            table_erase(mit);
             if (removed) {
                 removed->entries.push_back(e);
             }
@@ -290,8 +325,11 @@ FullyReplicatedDFT::update_address(rlm_addr_t new_addr)
     for (auto &kve : dft_table) {
         if (kve.second.local && kve.second.address == rib->myaddr) {
             del_dft.entries.push_back(kve.second);
+            tombstone_add(kve.second);
+            dtree.del(kve.first, digest_content(kve.second));
             kve.second.address   = new_addr;
             kve.second.timestamp = time64();
+            dtree.add(kve.first, digest_content(kve.second));
             prop_dft.entries.push_back(kve.second);
             UPD(rib->uipcp, "Updated address for DFT entry %s\n",
                 kve.first.c_str());
@@ -325,30 +363,39 @@ FullyReplicatedDFT::dump(stringstream &ss) const
     ss << endl;
 }
 
-int
-FullyReplicatedDFT::sync_neigh(NeighFlow *nf, unsigned int limit) const
+string
+FullyReplicatedDFT::digest_content(const DFTEntry &e)
 {
-    int ret = 0;
+    stringstream ss;
 
-    for (auto eit = dft_table.begin(); eit != dft_table.end();) {
-        DFTSlice dft_slice;
+    ss << e.address << " " << e.timestamp;
 
-        while (dft_slice.entries.size() < limit && eit != dft_table.end()) {
-            dft_slice.entries.push_back(eit->second);
-            eit++;
-        }
+    return ss.str();
+}
 
-        ret |= nf->neigh->neigh_sync_obj(nf, true, obj_class::dft,
-                                         obj_name::dft, &dft_slice);
-    }
+void
+FullyReplicatedDFT::table_insert(const string &key, const DFTEntry &e)
+{
+    dft_table.insert(make_pair(key, e));
+    dtree.add(key, digest_content(e));
+}
 
-    return ret;
+void
+FullyReplicatedDFT::table_erase(multimap<string, DFTEntry>::iterator mit)
+{
+    dtree.del(mit->first, digest_content(mit->second));
+    dft_table.erase(mit);
+}
+
+void
+FullyReplicatedDFT::digest(DigestTree &dt) const
+{
+    dt = dtree;
 }
 
-/* Propagate local entries (i.e. the ones corresponding to locally
- * registered applications) to all our neighbors. */
 int
-FullyReplicatedDFT::neighs_refresh(size_t limit)
+FullyReplicatedDFT::sync_neigh(NeighFlow *nf, unsigned int limit,
+                               const DigestTree::BucketMask *buckets) const
 {
     int ret = 0;
 
@@ -356,18 +403,44 @@ FullyReplicatedDFT::neighs_refresh(size_t limit)
         DFTSlice dft_slice;
 
         while (dft_slice.entries.size() < limit && eit != dft_table.end()) {
-            if (eit->second.local) {
+            if (!buckets || (*buckets)[DigestTree::bucket(eit->first)]) {
                 dft_slice.entries.push_back(eit->second);
             }
             eit++;
         }
 
         if (dft_slice.entries.size()) {
-            ret |= rib->neighs_sync_obj_all(true, obj_class::dft, obj_name::dft,
-                                            &dft_slice);
+            ret |= nf->neigh->neigh_sync_obj(nf, true, obj_class::dft,
+                                             obj_name::dft, &dft_slice);
         }
     }
 
+    /* Also push the deletions, so that a neighbor which missed them
+     * removes its stale entries instead of pushing them back. */
+    DFTSlice del_slice;
+    tombstones.for_each([&](const pair<string, rlm_addr_t> &key,
+                            uint64_t version) {
+        DFTEntry e;
+
+        if (buckets && !(*buckets)[DigestTree::bucket(key.first)]) {
+            return;
+        }
+        e.appl_name = RinaName(key.first);
+        e.address   = key.second;
+        e.timestamp = version;
+        del_slice.entries.push_back(e);
+        if (del_slice.entries.size() >= limit) {
+            ret |= nf->neigh->neigh_sync_obj(nf, false, obj_class::dft,
+                                             obj_name::dft, &del_slice);
+            del_slice.entries.clear();
+        }
+    });
+
+    if (del_slice.entries.size()) {
+        ret |= nf->neigh->neigh_sync_obj(nf, false, obj_class::dft,
+                                         obj_name::dft, &del_slice);
+    }
+
     return ret;
 }
 
@@ -788,20 +861,25 @@ CentralizedFaultTolerantDFT::Client::rib_handler(const CDAPMessage *rm,
             rm->result ? "failed" : "was successful");
         break;
     case gpb::M_READ_R: {
-        rlm_addr_t remote_addr = RL_ADDR_NULL;
+        vector<rlm_addr_t> addrs;
 
         if (rm->result) {
             UPD(uipcp, "Lookup of name '%s' failed remotely [%s]\n",
                 pi->second.appl_name.c_str(), rm->result_reason.c_str());
         } else {
+            rlm_addr_t remote_addr;
             int64_t a;
 
             rm->get_obj_value(a);
             remote_addr = static_cast<rlm_addr_t>(a);
+            addrs.push_back(remote_addr);
             UPD(uipcp, "Lookup of name '%s' resolved into address '%lu'\n",
                 pi->second.appl_name.c_str(), remote_addr);
         }
-        parent->rib->dft_lookup_resolved(pi->second.appl_name, remote_addr);
+        /* Clients are not notified about the DFT changes, and so they
+         * cannot cache the result. */
+        parent->rib->dft_lookup_resolved(pi->second.appl_name, addrs,
+                                         /*cacheable=*/false);
         break;
     }
     default:
@@ -1113,6 +1191,697 @@ CentralizedFaultTolerantDFT::Replica::rib_handler(const CDAPMessage *rm,
     return process_sm_output(std::move(out));
 }
 
+/* Distributed Hash Table implementation of the DFT, based on Kademlia.
+ * Each DFT entry is stored by the k nodes whose identifiers are the
+ * closest to the identifier of the application name. Lookups and
+ * registrations iteratively query nodes closer and closer to the key,
+ * with up to alpha queries in flight. Contacts are learned from the
+ * candidate neighbors and from the DHT traffic. Local registrations are
+ * republished at each refresh interval, so that they reach new nodes,
+ * while the stored entries expire if not republished. */
+class KademliaDFT : public DFT {
+    /* An ongoing iterative lookup, to resolve a name or to find the
+     * nodes where an entry has to be stored (or removed). */
+    struct Op {
+        enum class Type { Resolve, Register, Unregister };
+
+        Type type;
+        DFTEntry entry;
+        KadLookup lookup;
+        std::chrono::steady_clock::time_point start;
+
+        Op(Type t, const DFTEntry &e, KadLookup lk)
+            : type(t),
+              entry(e),
+              lookup(std::move(lk)),
+              start(std::chrono::steady_clock::now())
+        {
+        }
+    };
+
+    /* A query sent to a contact, waiting for the response. */
+    struct PendingReq {
+        unsigned int op_id;
+        KadContact contact;
+        std::chrono::steady_clock::time_point t;
+    };
+
+    /* An entry stored on behalf of the node that registered it. */
+    struct StoredEntry {
+        DFTEntry entry;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    unsigned int k;
+    unsigned int alpha;
+    KadRoutingTable rt;
+
+    std::multimap<std::string, StoredEntry> store;
+    std::map<std::string, DFTEntry> registered;
+
+    std::unordered_map<unsigned int, std::unique_ptr<Op>> ops;
+    unsigned int op_id_next = 1;
+    std::unordered_map</*invoke_id*/ int, PendingReq> pending;
+    std::unique_ptr<TimeoutEvent> timer;
+    std::chrono::steady_clock::time_point timer_deadline;
+    std::unique_ptr<TimeoutEvent> republish_timer;
+
+    /* Statistics about the name resolutions that went to the DHT. */
+    unsigned long num_lookups  = 0;
+    unsigned long num_resolved = 0;
+    unsigned long hops_total   = 0;
+    double latency_total       = 0; /* milliseconds */
+
+    /* Time to wait for the response to a query, in milliseconds. */
+    static constexpr int kReqTimeout = 2000;
+
+    /* Stored entries expire after this number of refresh intervals
+     * without being republished. */
+    static constexpr int kExpireIntvals = 4;
+
+    void contacts_refresh();
+    void republish();
+    void republish_tmr_restart();
+    void pending_timer_update();
+
+    unsigned int op_start(Op::Type type, const DFTEntry &entry);
+    void op_progress(unsigned int op_id);
+    void op_complete(unsigned int op_id,
+                     const std::vector<rlm_addr_t> &resolved, unsigned hops);
+    int find_send(unsigned int op_id, const KadContact &c);
+    void store_send(const DFTEntry &entry, bool add,
+                    const std::vector<KadContact> &storers);
+    void store_mod(const DFTEntry &entry, bool add);
+
+    int find_handler(const CDAPMessage *rm, rlm_addr_t src_addr);
+    int find_resp_handler(const CDAPMessage *rm);
+
+public:
+    RL_NODEFAULT_NONCOPIABLE(KademliaDFT);
+    KademliaDFT(struct uipcp_rib *_ur)
+        : DFT(_ur),
+          k(_ur->get_param_value<int>("dft", "replication-factor")),
+          alpha(_ur->get_param_value<int>("dft", "parallelism")),
+          rt(KadRoutingTable::id_of(_ur->myname), k)
+    {
+        republish_tmr_restart();
+    }
+    ~KademliaDFT() {}
+
+    int param_changed(const std::string &param_name) override;
+    void dump(std::stringstream &ss) const override;
+    int lookup_req(const std::string &appl_name, rlm_addr_t *dstaddr,
+                   const rlm_addr_t preferred, uint32_t cookie) override;
+    int appl_register(const struct rl_kmsg_appl_register *req) override;
+    void update_address(rlm_addr_t new_addr) override;
+    int rib_handler(const CDAPMessage *rm, NeighFlow *nf,
+                    rlm_addr_t src_addr) override;
+};
+
+constexpr int KademliaDFT::kReqTimeout;
+constexpr int KademliaDFT::kExpireIntvals;
+
+int
+KademliaDFT::param_changed(const std::string &param_name)
+{
+    if (param_name == "replication-factor") {
+        k = rib->get_param_value<int>("dft", "replication-factor");
+        rt.set_k(k);
+    } else if (param_name == "parallelism") {
+        alpha = rib->get_param_value<int>("dft", "parallelism");
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+KademliaDFT::dump(stringstream &ss) const
+{
+    ss << "Directory Forwarding Table (DHT, k=" << k << ", alpha=" << alpha
+       << ", " << rt.size() << " contacts):" << endl;
+    for (const auto &kve : registered) {
+        ss << "    Application: " << kve.first
+           << ", Address: " << kve.second.address << " (local)" << endl;
+    }
+    for (const auto &kve : store) {
+        const DFTEntry &entry = kve.second.entry;
+
+        ss << "    Application: " << kve.first << ", Address: " << entry.address
+           << ", Timestamp: " << entry.timestamp << endl;
+    }
+    if (num_lookups) {
+        ss << "    Lookups: " << num_lookups << ", resolved: " << num_resolved
+           << ", average hops: " << (double)hops_total / num_lookups
+           << ", average latency: " << latency_total / num_lookups << " ms"
+           << endl;
+    }
+
+    ss << endl;
+}
+
+/* Learn contacts from the candidate neighbors, which are known
+ * through the neighbors RIB subtree. */
+void
+KademliaDFT::contacts_refresh()
+{
+    for (const auto &kvn : rib->neighbors_seen) {
+        rt.update(KadContact(kvn.first, kvn.second.address));
+    }
+}
+
+void
+KademliaDFT::republish()
+{
+    auto now = std::chrono::steady_clock::now();
+
+    for (auto mit = store.begin(); mit != store.end();) {
+        if (mit->second.expiry <= now) {
+            UPD(rib->uipcp, "DHT entry %s --> %lu expired\n",
+                mit->first.c_str(), mit->second.entry.address);
+            mit = store.erase(mit);
+        } else {
+            ++mit;
+        }
+    }
+
+    contacts_refresh();
+    for (const auto &kve : registered) {
+        op_start(Op::Type::Register, kve.second);
+    }
+    pending_timer_update();
+}
+
+void
+KademliaDFT::republish_tmr_restart()
+{
+    republish_timer = make_unique<TimeoutEvent>(
+        std::chrono::seconds(
+            rib->get_param_value<int>("rib-daemon", "refresh-intval")),
+        rib->uipcp, this, [](struct uipcp *uipcp, void *arg) {
+            KademliaDFT *dft = static_cast<KademliaDFT *>(arg);
+            std::lock_guard<std::mutex> guard(dft->rib->mutex);
+
+            dft->republish_timer->fired();
+            dft->republish();
+            dft->republish_tmr_restart();
+        });
+}
+
+/* Fail the queries that timed out, and rearm the timer according to the
+ * next query that is going to expire (or stop it). */
+void
+KademliaDFT::pending_timer_update()
+{
+    auto t_min = std::chrono::steady_clock::time_point::max();
+    auto now   = std::chrono::steady_clock::now();
+    vector<int> expired;
+
+    for (const auto &kvp : pending) {
+        if (kvp.second.t <= now) {
+            expired.push_back(kvp.first);
+        }
+    }
+
+    for (int invoke_id : expired) {
+        PendingReq pr = pending[invoke_id];
+
+        pending.erase(invoke_id);
+        rib->invoke_id_mgr.put_invoke_id(invoke_id);
+        UPD(rib->uipcp, "DHT query to %s timed out\n", pr.contact.name.c_str());
+
+        /* Forget about unresponsive contacts. */
+        rt.remove(pr.contact.id);
+        if (ops.count(pr.op_id)) {
+            ops[pr.op_id]->lookup.failure(pr.contact.id);
+            op_progress(pr.op_id);
+        }
+    }
+
+    for (const auto &kvp : pending) {
+        t_min = std::min(t_min, kvp.second.t);
+    }
+
+    if (t_min == std::chrono::steady_clock::time_point::max()) {
+        timer = nullptr;
+    } else if (!timer || t_min != timer_deadline) {
+        timer_deadline = t_min;
+        timer          = make_unique<TimeoutEvent>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(t_min - now),
+            rib->uipcp, this, [](struct uipcp *uipcp, void *arg) {
+                KademliaDFT *dft = static_cast<KademliaDFT *>(arg);
+                std::lock_guard<std::mutex> guard(dft->rib->mutex);
+
+                dft->timer->fired();
+                dft->timer = nullptr;
+                dft->pending_timer_update();
+            });
+    }
+}
+
+unsigned int
+KademliaDFT::op_start(Op::Type type, const DFTEntry &entry)
+{
+    KadId key          = KadRoutingTable::id_of(entry.appl_name);
+    unsigned int op_id = op_id_next++;
+
+    if (rt.size() == 0) {
+        contacts_refresh();
+    }
+
+    KadLookup lookup(key, rt.self_id(), k, alpha, rt.closest(key, k));
+
+    ops[op_id] = make_unique<Op>(type, entry, std::move(lookup));
+    op_progress(op_id);
+
+    return op_id;
+}
+
+void
+KademliaDFT::op_progress(unsigned int op_id)
+{
+    Op *op = ops[op_id].get();
+
+    for (;;) {
+        vector<KadContact> contacts = op->lookup.next();
+
+        if (contacts.empty()) {
+            break;
+        }
+        for (const KadContact &c : contacts) {
+            if (find_send(op_id, c)) {
+                op->lookup.failure(c.id);
+            }
+        }
+    }
+
+    if (op->lookup.done()) {
+        op_complete(op_id, vector<rlm_addr_t>(), op->lookup.hops());
+    }
+}
+
+/* Complete an operation, either because a name has been resolved or
+ * because the lookup has converged. */
+void
+KademliaDFT::op_complete(unsigned int op_id,
+                         const vector<rlm_addr_t> &resolved, unsigned int hops)
+{
+    std::unique_ptr<Op> op = std::move(ops[op_id]);
+    string appl_name       = op->entry.appl_name;
+
+    ops.erase(op_id);
+
+    if (op->type == Op::Type::Resolve) {
+        num_lookups++;
+        num_resolved += !resolved.empty();
+        hops_total += hops;
+        latency_total += std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - op->start)
+                             .count();
+        UPD(rib->uipcp, "DHT lookup of '%s' completed in %u hops\n",
+            appl_name.c_str(), hops);
+        rib->dft_lookup_resolved(appl_name, resolved, /*cacheable=*/true);
+        return;
+    }
+
+    /* Store (or remove) the entry on the k closest nodes found,
+     * possibly including ourselves. */
+    vector<KadContact> storers = op->lookup.closest();
+    KadId key                  = op->lookup.key();
+
+    storers.push_back(KadContact(rib->myname, rib->myaddr));
+    sort(storers.begin(), storers.end(),
+         [key](const KadContact &a, const KadContact &b) {
+             return (a.id ^ key) < (b.id ^ key);
+         });
+    if (storers.size() > k) {
+        storers.resize(k);
+    }
+    store_send(op->entry, op->type == Op::Type::Register, storers);
+}
+
+int
+KademliaDFT::find_send(unsigned int op_id, const KadContact &c)
+{
+    auto m = make_unique<CDAPMessage>();
+    const Op *op = ops[op_id].get();
+    DHTFindReq req;
+    int invoke_id;
+    int ret;
+
+    req.appl_name  = op->entry.appl_name;
+    req.find_value = (op->type == Op::Type::Resolve);
+    req.sender     = rib->myname;
+
+    m->m_read(obj_class::dht_find, obj_name::dft);
+    m->invoke_id = invoke_id = rib->invoke_id_mgr.get_invoke_id();
+    pending[invoke_id] =
+        PendingReq{op_id, c,
+                   std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(kReqTimeout)};
+
+    ret = rib->send_to_dst_addr(std::move(m), c.address, &req);
+    if (ret) {
+        pending.erase(invoke_id);
+        rib->invoke_id_mgr.put_invoke_id(invoke_id);
+    }
+
+    return ret;
+}
+
+void
+KademliaDFT::store_send(const DFTEntry &entry, bool add,
+                        const vector<KadContact> &storers)
+{
+    DFTSlice dft_slice;
+
+    dft_slice.entries.push_back(entry);
+
+    for (const KadContact &c : storers) {
+        auto m = make_unique<CDAPMessage>();
+
+        if (c.id == rt.self_id()) {
+            store_mod(entry, add);
+            continue;
+        }
+
+        if (add) {
+            m->m_create(obj_class::dft, obj_name::dft);
+        } else {
+            m->m_delete(obj_class::dft, obj_name::dft);
+        }
+        if (rib->send_to_dst_addr(std::move(m), c.address, &dft_slice)) {
+            UPE(rib->uipcp, "Failed to send DHT entry %s to %s\n",
+                static_cast<string>(entry.appl_name).c_str(), c.name.c_str());
+        }
+    }
+}
+
+void
+KademliaDFT::store_mod(const DFTEntry &entry, bool add)
+{
+    string key = static_cast<string>(entry.appl_name);
+    auto range = store.equal_range(key);
+    auto mit   = range.first;
+
+    rib->dft_cache.invalidate(key);
+
+    for (; mit != range.second; mit++) {
+        if (mit->second.entry.address == entry.address) {
+            break;
+        }
+    }
+
+    if (!add) {
+        if (mit != range.second) {
+            store.erase(mit);
+            UPD(rib->uipcp, "DHT entry %s --> %lu removed\n", key.c_str(),
+                entry.address);
+        }
+        return;
+    }
+
+    if (mit != range.second) {
+        if (entry.timestamp < mit->second.entry.timestamp) {
+            return; /* stale */
+        }
+        store.erase(mit);
+    }
+
+    StoredEntry se;
+
+    se.entry       = entry;
+    se.entry.local = false;
+    se.expiry      = std::chrono::steady_clock::now() +
+                std::chrono::seconds(
+                    kExpireIntvals *
+                    rib->get_param_value<int>("rib-daemon", "refresh-intval"));
+    store.insert(make_pair(key, se));
+}
+
+int
+KademliaDFT::lookup_req(const std::string &appl_name, rlm_addr_t *dstaddr,
+                        const rlm_addr_t preferred, uint32_t cookie)
+{
+    vector<rlm_addr_t> addrs;
+    DFTEntry entry;
+
+    /* Names registered here, or stored here, are resolved right away. */
+    if (registered.count(appl_name)) {
+        addrs.push_back(rib->myaddr);
+    }
+    auto range = store.equal_range(appl_name);
+    for (auto mit = range.first; mit != range.second; mit++) {
+        if (mit->second.expiry > std::chrono::steady_clock::now()) {
+            addrs.push_back(mit->second.entry.address);
+        }
+    }
+
+    if (!addrs.empty()) {
+        *dstaddr = addrs[cookie % addrs.size()];
+        for (rlm_addr_t addr : addrs) {
+            if (addr == preferred) {
+                *dstaddr = addr;
+            }
+        }
+        return 0;
+    }
+
+    *dstaddr = RL_ADDR_NULL;
+
+    /* An ongoing lookup for the same name will take care of this request
+     * too, see uipcp_rib::dft_lookup_resolved(). */
+    for (const auto &kvo : ops) {
+        if (kvo.second->type == Op::Type::Resolve &&
+            static_cast<string>(kvo.second->entry.appl_name) == appl_name) {
+            return 0;
+        }
+    }
+
+    entry.appl_name = RinaName(appl_name);
+    if (!ops.count(op_start(Op::Type::Resolve, entry))) {
+        /* Nobody to ask. */
+        return -1;
+    }
+    pending_timer_update();
+
+    return 0;
+}
+
+int
+KademliaDFT::appl_register(const struct rl_kmsg_appl_register *req)
+{
+    string appl_name(req->appl_name);
+    struct uipcp *uipcp = rib->uipcp;
+    DFTEntry entry;
+
+    if (req->reg) {
+        int ret;
+
+        if (registered.count(appl_name)) {
+            UPE(uipcp, "Application %s already registered on this uipcp\n",
+                appl_name.c_str());
+            return uipcp_appl_register_resp(uipcp, RLITE_ERR, req->event_id,
+                                            req->appl_name);
+        }
+
+        /* Respond before starting to store the entry, because the
+         * response may fail. */
+        ret = uipcp_appl_register_resp(uipcp, RLITE_SUCC, req->event_id,
+                                       req->appl_name);
+        if (ret) {
+            return ret;
+        }
+
+        entry.address         = rib->myaddr;
+        entry.appl_name       = RinaName(appl_name);
+        entry.timestamp       = time64();
+        entry.local           = true;
+        registered[appl_name] = entry;
+    } else {
+        auto mit = registered.find(appl_name);
+
+        if (mit == registered.end()) {
+            UPE(uipcp, "Application %s was not registered here\n",
+                appl_name.c_str());
+            return 0;
+        }
+        entry = mit->second;
+        registered.erase(mit);
+    }
+
+    UPD(uipcp, "Application %s %sregistered\n", appl_name.c_str(),
+        req->reg ? "" : "un");
+
+    op_start(req->reg ? Op::Type::Register : Op::Type::Unregister, entry);
+    pending_timer_update();
+
+    return 0;
+}
+
+/* Republish the local entries with the new address. Entries with the old
+ * address will expire on the storing nodes. */
+void
+KademliaDFT::update_address(rlm_addr_t new_addr)
+{
+    for (auto &kve : registered) {
+        kve.second.address   = new_addr;
+        kve.second.timestamp = time64();
+        op_start(Op::Type::Register, kve.second);
+    }
+    pending_timer_update();
+}
+
+/* A node is looking for the contacts closest to an application name (or
+ * for the entries of that name). */
+int
+KademliaDFT::find_handler(const CDAPMessage *rm, rlm_addr_t src_addr)
+{
+    auto m = make_unique<CDAPMessage>();
+    const char *objbuf;
+    DHTFindResp resp;
+    size_t objlen;
+
+    rm->get_obj_value(objbuf, objlen);
+    if (!objbuf) {
+        UPE(rib->uipcp, "No object value found\n");
+        return 0;
+    }
+
+    DHTFindReq req(objbuf, objlen);
+
+    rt.update(KadContact(req.sender, src_addr));
+
+    if (req.find_value) {
+        auto range = store.equal_range(req.appl_name);
+        auto now   = std::chrono::steady_clock::now();
+
+        for (auto mit = range.first; mit != range.second; mit++) {
+            if (mit->second.expiry > now) {
+                resp.entries.push_back(mit->second.entry);
+            }
+        }
+        if (registered.count(req.appl_name)) {
+            resp.entries.push_back(registered[req.appl_name]);
+        }
+    }
+
+    if (resp.entries.empty()) {
+        for (const KadContact &c :
+             rt.closest(KadRoutingTable::id_of(req.appl_name), k)) {
+            DHTContact dc;
+
+            dc.name    = c.name;
+            dc.address = c.address;
+            resp.contacts.push_back(dc);
+        }
+    }
+
+    m->m_read_r(obj_class::dht_find, obj_name::dft);
+    m->invoke_id = rm->invoke_id;
+
+    return rib->send_to_dst_addr(std::move(m), src_addr, &resp);
+}
+
+int
+KademliaDFT::find_resp_handler(const CDAPMessage *rm)
+{
+    auto pi = pending.find(rm->invoke_id);
+    vector<KadContact> contacts;
+    const char *objbuf;
+    size_t objlen;
+
+    if (pi == pending.end()) {
+        UPV(rib->uipcp, "Late DHT response (invoke_id=%d)\n", rm->invoke_id);
+        return 0;
+    }
+
+    PendingReq pr = pi->second;
+
+    pending.erase(pi);
+    rib->invoke_id_mgr.put_invoke_id(rm->invoke_id);
+    rt.update(pr.contact);
+
+    auto oit = ops.find(pr.op_id);
+    if (oit == ops.end()) {
+        return 0; /* operation already completed */
+    }
+
+    Op *op = oit->second.get();
+
+    rm->get_obj_value(objbuf, objlen);
+    DHTFindResp resp(objbuf, objbuf ? objlen : 0);
+
+    if (op->type == Op::Type::Resolve && !resp.entries.empty()) {
+        vector<rlm_addr_t> addrs;
+
+        for (const DFTEntry &e : resp.entries) {
+            addrs.push_back(e.address);
+        }
+        op_complete(pr.op_id, addrs, op->lookup.hops(pr.contact.id));
+        return 0;
+    }
+
+    for (const DHTContact &c : resp.contacts) {
+        contacts.push_back(KadContact(c.name, c.address));
+    }
+    op->lookup.response(pr.contact.id, contacts);
+    op_progress(pr.op_id);
+
+    return 0;
+}
+
+int
+KademliaDFT::rib_handler(const CDAPMessage *rm, NeighFlow *nf,
+                         rlm_addr_t src_addr)
+{
+    struct uipcp *uipcp = rib->uipcp;
+
+    if (src_addr == RL_ADDR_NULL) {
+        UPE(uipcp, "Source address not set\n");
+        return 0;
+    }
+
+    if (rm->obj_class == obj_class::dht_find) {
+        if (rm->op_code == gpb::M_READ) {
+            find_handler(rm, src_addr);
+        } else if (rm->op_code == gpb::M_READ_R) {
+            find_resp_handler(rm);
+        } else {
+            UPE(uipcp, "M_READ or M_READ_R expected\n");
+        }
+
+    } else if (rm->obj_class == obj_class::dft) {
+        const char *objbuf;
+        size_t objlen;
+
+        if (rm->op_code != gpb::M_CREATE && rm->op_code != gpb::M_DELETE) {
+            UPE(uipcp, "M_CREATE or M_DELETE expected\n");
+            return 0;
+        }
+
+        rm->get_obj_value(objbuf, objlen);
+        if (!objbuf) {
+            UPE(uipcp, "No object value found\n");
+            return 0;
+        }
+
+        DFTSlice dft_slice(objbuf, objlen);
+
+        for (const DFTEntry &e : dft_slice.entries) {
+            store_mod(e, rm->op_code == gpb::M_CREATE);
+        }
+
+    } else {
+        UPE(uipcp, "Unexpected object class '%s'\n", rm->obj_class.c_str());
+    }
+
+    pending_timer_update();
+
+    return 0;
+}
+
 void
 uipcp_rib::dft_lib_init()
 {
@@ -1124,4 +1893,8 @@ uipcp_rib::dft_lib_init()
         PolicyBuilder("centralized-fault-tolerant", [](uipcp_rib *rib) {
             rib->dft = make_unique<CentralizedFaultTolerantDFT>(rib);
         }));
+    available_policies["dft"].insert(
+        PolicyBuilder("dht", [](uipcp_rib *rib) {
+            rib->dft = make_unique<KademliaDFT>(rib);
+        }));
 }
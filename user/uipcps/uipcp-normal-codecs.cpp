@@ -48,6 +48,8 @@
 #include "FlowMessage.pb.h"
 #include "AddressAllocation.pb.h"
 #include "Raft.pb.h"
+#include "RIBDigest.pb.h"
+#include "Kademlia.pb.h"
 
 using namespace std;
 
@@ -358,6 +360,8 @@ gpb2LowerFlow(LowerFlow &lf, const gpb::flowStateObject_t &gm)
     lf.seqnum      = gm.sequence_number();
     lf.state       = gm.state();
     lf.age         = gm.age();
+    lf.delay       = gm.delay();
+    lf.bandwidth   = gm.bandwidth();
 }
 
 static int
@@ -369,6 +373,8 @@ LowerFlow2gpb(const LowerFlow &lf, gpb::flowStateObject_t &gm)
     gm.set_sequence_number(lf.seqnum);
     gm.set_state(lf.state);
     gm.set_age(lf.age);
+    gm.set_delay(lf.delay);
+    gm.set_bandwidth(lf.bandwidth);
 
     return 0;
 }
@@ -1292,3 +1298,142 @@ RaftAppendEntriesResp::serialize(char *buf, unsigned int size) const
 
     return ser_common(gm, buf, size);
 }
+
+static void
+gpb2SubtreeDigest(SubtreeDigest &d, const gpb::SubtreeDigest &gm)
+{
+    d.name = gm.name();
+    d.root = gm.root();
+    for (int i = 0; i < gm.buckets_size(); i++) {
+        d.buckets.push_back(gm.buckets(i));
+    }
+}
+
+static int
+SubtreeDigest2gpb(const SubtreeDigest &d, gpb::SubtreeDigest &gm)
+{
+    gm.set_name(d.name);
+    gm.set_root(d.root);
+    for (uint64_t b : d.buckets) {
+        gm.add_buckets(b);
+    }
+
+    return 0;
+}
+
+SubtreeDigest::SubtreeDigest(const char *buf, unsigned int size)
+{
+    gpb::SubtreeDigest gm;
+
+    gm.ParseFromArray(buf, size);
+
+    gpb2SubtreeDigest(*this, gm);
+}
+
+int
+SubtreeDigest::serialize(char *buf, unsigned int size) const
+{
+    gpb::SubtreeDigest gm;
+
+    SubtreeDigest2gpb(*this, gm);
+
+    return ser_common(gm, buf, size);
+}
+
+SubtreeDigestList::SubtreeDigestList(const char *buf, unsigned int size)
+{
+    gpb::SubtreeDigestList gm;
+
+    gm.ParseFromArray(buf, size);
+
+    for (int i = 0; i < gm.subtrees_size(); i++) {
+        subtrees.emplace_back();
+        gpb2SubtreeDigest(subtrees.back(), gm.subtrees(i));
+    }
+}
+
+int
+SubtreeDigestList::serialize(char *buf, unsigned int size) const
+{
+    gpb::SubtreeDigestList gm;
+
+    for (const SubtreeDigest &d : subtrees) {
+        gpb::SubtreeDigest *gd;
+        int ret;
+
+        gd  = gm.add_subtrees();
+        ret = SubtreeDigest2gpb(d, *gd);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return ser_common(gm, buf, size);
+}
+
+DHTFindReq::DHTFindReq(const char *buf, unsigned int size)
+{
+    gpb::DHTFindReq gm;
+
+    gm.ParseFromArray(buf, size);
+
+    appl_name  = gm.appl_name();
+    find_value = gm.find_value();
+    sender     = gm.sender();
+}
+
+int
+DHTFindReq::serialize(char *buf, unsigned int size) const
+{
+    gpb::DHTFindReq gm;
+
+    gm.set_appl_name(appl_name);
+    gm.set_find_value(find_value);
+    gm.set_sender(sender);
+
+    return ser_common(gm, buf, size);
+}
+
+DHTFindResp::DHTFindResp(const char *buf, unsigned int size)
+{
+    gpb::DHTFindResp gm;
+
+    gm.ParseFromArray(buf, size);
+
+    for (int i = 0; i < gm.contacts_size(); i++) {
+        contacts.emplace_back();
+        contacts.back().name    = gm.contacts(i).name();
+        contacts.back().address = gm.contacts(i).address();
+    }
+
+    for (int i = 0; i < gm.entries_size(); i++) {
+        entries.emplace_back();
+        gpb2DFTEntry(entries.back(), gm.entries(i));
+    }
+}
+
+int
+DHTFindResp::serialize(char *buf, unsigned int size) const
+{
+    gpb::DHTFindResp gm;
+
+    for (const DHTContact &c : contacts) {
+        gpb::DHTContact *gc = gm.add_contacts();
+
+        gc->set_name(c.name);
+        gc->set_address(c.address);
+    }
+
+    for (const DFTEntry &e : entries) {
+        gpb::directoryForwardingTableEntry_t *gentry;
+        int ret;
+
+        gentry = gm.add_entries();
+        ret    = DFTEntry2gpb(e, *gentry);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return ser_common(gm, buf, size);
+}
@@ -25,9 +25,11 @@
 #define __UIPCP_CODECS_H__
 
 #include <stdint.h>
+#include <chrono>
 #include <list>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include "rlite/common.h"
 #include "rina/cdap.hpp"
@@ -147,6 +149,16 @@ struct LowerFlow : public UipcpObject {
     bool state          = false;
     unsigned int age    = 0;
 
+    /* Link metrics measured by the local node, zero if unknown: one-way
+     * delay in microseconds and available bandwidth in bits per
+     * second. */
+    unsigned int delay = 0;
+    uint64_t bandwidth = 0;
+
+    /* When a remote entry is to be discarded, if not refreshed. Only
+     * meaningful within the local LFDB, not serialized. */
+    std::chrono::steady_clock::time_point expiry;
+
     LowerFlow() = default;
     RL_COPIABLE_MOVABLE(LowerFlow);
     LowerFlow(const char *buf, unsigned int size);
@@ -155,7 +167,7 @@ struct LowerFlow : public UipcpObject {
     {
         /* Don't use seqnum and age for the comparison. */
         return local_node == o.local_node && remote_node == o.remote_node &&
-               cost == o.cost;
+               cost == o.cost && delay == o.delay && bandwidth == o.bandwidth;
     }
     bool operator!=(const LowerFlow &o) { return !(*this == o); }
 
@@ -416,4 +428,46 @@ struct RaftAppendEntriesResp : public UipcpObject {
     int serialize(char *buf, unsigned int size) const override;
 };
 
+struct SubtreeDigest : public UipcpObject {
+    std::string name;
+    uint64_t root = 0;
+    std::vector<uint64_t> buckets; /* empty if only the root is sent */
+
+    SubtreeDigest() = default;
+    SubtreeDigest(const char *buf, unsigned int size);
+    int serialize(char *buf, unsigned int size) const override;
+};
+
+struct SubtreeDigestList : public UipcpObject {
+    std::list<SubtreeDigest> subtrees;
+
+    SubtreeDigestList() = default;
+    SubtreeDigestList(const char *buf, unsigned int size);
+    int serialize(char *buf, unsigned int size) const override;
+};
+
+struct DHTContact {
+    std::string name;
+    rlm_addr_t address = RL_ADDR_NULL;
+};
+
+struct DHTFindReq : public UipcpObject {
+    std::string appl_name;
+    bool find_value = false;
+    std::string sender;
+
+    DHTFindReq() = default;
+    DHTFindReq(const char *buf, unsigned int size);
+    int serialize(char *buf, unsigned int size) const override;
+};
+
+struct DHTFindResp : public UipcpObject {
+    std::list<DHTContact> contacts;
+    std::list<DFTEntry> entries;
+
+    DHTFindResp() = default;
+    DHTFindResp(const char *buf, unsigned int size);
+    int serialize(char *buf, unsigned int size) const override;
+};
+
 #endif /* __UIPCP_CODECS_H__ */
@@ -0,0 +1,123 @@
+/*
+ * Digests of the fully replicated RIB subtrees of normal uipcps.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "uipcp-normal-digest.hpp"
+
+using namespace std;
+
+constexpr unsigned int DigestTree::kNumBuckets;
+
+/* 64-bit FNV-1a. */
+static uint64_t
+fnv1a(const void *data, size_t len, uint64_t h = 14695981039346656037ULL)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/* Final mixing, so that the sum of the object hashes does not
+ * preserve the weak structure of FNV in the low order bits. */
+static uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+unsigned int
+DigestTree::bucket(const string &key)
+{
+    return mix(fnv1a(key.data(), key.size())) % kNumBuckets;
+}
+
+uint64_t
+DigestTree::hash(const string &key, const string &content)
+{
+    uint64_t h = fnv1a(key.data(), key.size());
+
+    /* The separator avoids ambiguities between key and content. */
+    h = fnv1a("", 1, h);
+    h = fnv1a(content.data(), content.size(), h);
+
+    return mix(h);
+}
+
+void
+DigestTree::add(const string &key, const string &content)
+{
+    /* Objects are combined with a sum, which does not depend on the
+     * order and (unlike xor) does not cancel out duplicates. */
+    digests[bucket(key)] += hash(key, content);
+}
+
+void
+DigestTree::del(const string &key, const string &content)
+{
+    digests[bucket(key)] -= hash(key, content);
+}
+
+uint64_t
+DigestTree::root() const
+{
+    uint64_t h = fnv1a(nullptr, 0);
+
+    for (uint64_t d : digests) {
+        unsigned char bytes[8];
+
+        /* Fixed byte order, the root is compared across hosts. */
+        for (int i = 0; i < 8; i++) {
+            bytes[i] = (d >> (8 * i)) & 0xff;
+        }
+        h = fnv1a(bytes, sizeof(bytes), h);
+    }
+
+    return mix(h);
+}
+
+DigestTree::BucketMask
+DigestTree::diff(const vector<uint64_t> &remote) const
+{
+    BucketMask mask(kNumBuckets, true);
+
+    if (remote.size() != kNumBuckets) {
+        /* Different tree layout, everything needs to be synchronized. */
+        return mask;
+    }
+
+    for (unsigned int i = 0; i < kNumBuckets; i++) {
+        mask[i] = digests[i] != remote[i];
+    }
+
+    return mask;
+}
@@ -0,0 +1,132 @@
+/*
+ * Digests of the fully replicated RIB subtrees of normal uipcps.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __UIPCP_DIGEST_H__
+#define __UIPCP_DIGEST_H__
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Two-level (Merkle-style) hash tree over the objects of a fully
+ * replicated RIB subtree, used for anti-entropy synchronization with
+ * the neighbors. Each object is identified by a key, which selects one
+ * of kNumBuckets buckets. The digest of a bucket combines the hashes of
+ * its objects (in any order), and the root digest combines the digests
+ * of all the buckets. Two replicas with the same root digest are in
+ * sync (with high probability); otherwise they only need to exchange
+ * the objects contained in the buckets whose digests differ. The tree
+ * is kept up to date as the objects are added and removed, since the
+ * combination of the object hashes can be inverted. */
+class DigestTree {
+public:
+    static constexpr unsigned int kNumBuckets = 32;
+
+    /* For each bucket, true if it has to be synchronized. */
+    using BucketMask = std::vector<bool>;
+
+    /* Bucket selected by an object key. Objects that must be
+     * synchronized together have to share the same key. */
+    static unsigned int bucket(const std::string &key);
+
+    /* Add an object with the given key, described by 'content'. The
+     * content must only include the information that is the same on
+     * all the replicas. */
+    void add(const std::string &key, const std::string &content);
+
+    /* Remove an object previously added with the same key and content. */
+    void del(const std::string &key, const std::string &content);
+
+    uint64_t root() const;
+    const std::vector<uint64_t> &buckets() const { return digests; }
+
+    /* Buckets whose digests differ from the 'remote' ones. */
+    BucketMask diff(const std::vector<uint64_t> &remote) const;
+
+private:
+    static uint64_t hash(const std::string &key, const std::string &content);
+
+    std::vector<uint64_t> digests = std::vector<uint64_t>(kNumBuckets, 0);
+};
+
+/* Objects deleted from a fully replicated RIB subtree, remembered for a
+ * while so that the anti-entropy synchronization can tell a deleted
+ * object from a missing one. Each tombstone records the version of the
+ * deletion (zero if the objects are not versioned): objects pushed by a
+ * neighbor that missed the deletion are rejected unless they are newer,
+ * and the tombstones are pushed to the neighbor in their place. */
+template <class Key>
+class Tombstones {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /* Record the deletion of 'key', valid for 'lifetime' seconds. */
+    void add(const Key &key, uint64_t version, int lifetime)
+    {
+        auto now = Clock::now();
+
+        for (auto it = tombs.begin(); it != tombs.end();) {
+            it = it->second.expiry <= now ? tombs.erase(it) : ++it;
+        }
+
+        Tomb &t   = tombs[key];
+        t.version = std::max(t.version, version);
+        t.expiry  = now + std::chrono::seconds(lifetime);
+    }
+
+    /* True if the object 'key' with the given version has been deleted. */
+    bool deleted(const Key &key, uint64_t version) const
+    {
+        auto it = tombs.find(key);
+
+        return it != tombs.end() && it->second.expiry > Clock::now() &&
+               version <= it->second.version;
+    }
+
+    void erase(const Key &key) { tombs.erase(key); }
+
+    /* Call f(key, version) for each valid tombstone. */
+    template <class F>
+    void for_each(F f) const
+    {
+        auto now = Clock::now();
+
+        for (const auto &kvt : tombs) {
+            if (kvt.second.expiry > now) {
+                f(kvt.first, kvt.second.version);
+            }
+        }
+    }
+
+private:
+    struct Tomb {
+        uint64_t version = 0;
+        Clock::time_point expiry;
+    };
+    std::map<Key, Tomb> tombs;
+};
+
+#endif /* __UIPCP_DIGEST_H__ */
@@ -74,6 +74,8 @@ NeighFlow::~NeighFlow()
 
     if (!reliable) {
         topo_lower_flow_removed(uipcp->uipcps, uipcp->id, lower_ipcp_id);
+        /* The kernel removed the flow from the neighbors group. */
+        neigh->rib->neighs_mcast_ports.erase(port_id);
     }
 }
 
@@ -151,21 +153,28 @@ NeighFlow::send_to_port_id(CDAPMessage *m, int invoke_id,
     }
 
     if (ret >= 0) {
-        const int neighFlowStatsPeriod = uipcp_rib::kNeighFlowStatsPeriod;
-
-        last_activity = std::chrono::system_clock::now();
-        stats.win[0].bytes_sent += ret;
-        if (last_activity - stats.t_last >=
-            std::chrono::seconds(neighFlowStatsPeriod)) {
-            stats.win[1]            = stats.win[0];
-            stats.win[0].bytes_sent = stats.win[0].bytes_recvd = 0;
-            stats.t_last                                       = last_activity;
-        }
+        tx_account(ret);
     }
 
     return ret >= 0 ? 0 : ret;
 }
 
+/* Account for a management message sent on this flow. */
+void
+NeighFlow::tx_account(unsigned int bytes)
+{
+    const int neighFlowStatsPeriod = uipcp_rib::kNeighFlowStatsPeriod;
+
+    last_activity = std::chrono::system_clock::now();
+    stats.win[0].bytes_sent += bytes;
+    if (last_activity - stats.t_last >=
+        std::chrono::seconds(neighFlowStatsPeriod)) {
+        stats.win[1]            = stats.win[0];
+        stats.win[0].bytes_sent = stats.win[0].bytes_recvd = 0;
+        stats.t_last                                       = last_activity;
+    }
+}
+
 void
 NeighFlow::enrollment_abort()
 {
@@ -232,11 +241,16 @@ NeighFlow::keepalive_timeout()
 
     m.m_read(obj_class::keepalive, obj_name::keepalive);
 
+    if (pending_keepalive_reqs == 0) {
+        /* Only unambiguous responses are used as RTT samples. */
+        keepalive_sent = std::chrono::steady_clock::now();
+    }
     ret = send_to_port_id(&m, 0, nullptr);
     if (ret) {
         UPE(rib->uipcp, "send_to_port_id() failed [%s]\n", strerror(errno));
     }
     pending_keepalive_reqs++;
+    neigh->bandwidth_measure();
 
     if (pending_keepalive_reqs >
         neigh->rib->get_param_value<int>("enrollment", "keepalive-thresh")) {
@@ -298,6 +312,77 @@ Neighbor::~Neighbor()
     n_flow_set(nullptr);
 }
 
+void
+Neighbor::rtt_sample(std::chrono::microseconds rtt)
+{
+    unsigned int sample = std::max<long>(rtt.count(), 1);
+
+    /* Exponentially weighted moving average, as TCP does. */
+    srtt_us = srtt_us ? (7 * (uint64_t)srtt_us + sample) / 8 : sample;
+    link_metrics_update();
+}
+
+void
+Neighbor::bandwidth_measure()
+{
+    auto now          = std::chrono::steady_clock::now();
+    uint64_t tx_bytes = 0;
+    uint64_t capacity;
+    double secs;
+
+    if (flows.empty()) {
+        return;
+    }
+
+    /* The parameter is in Mbps. */
+    capacity = rib->get_param_value<int>("routing", "link-capacity");
+    capacity *= 1000000;
+
+    for (const auto &kvf : flows) {
+        struct rl_flow_stats stats;
+
+        if (rl_conf_flow_get_stats(kvf.second->port_id, &stats) == 0) {
+            tx_bytes += stats.tx_byte;
+        }
+    }
+
+    secs = std::chrono::duration<double>(now - tx_last).count();
+    if (tx_bytes_last && tx_bytes >= tx_bytes_last && secs > 0) {
+        uint64_t rate = (tx_bytes - tx_bytes_last) * 8 / secs;
+
+        /* Zero means unknown, a saturated link keeps a tiny bandwidth. */
+        avail_bw = rate < capacity ? capacity - rate : 1;
+    }
+    tx_bytes_last = tx_bytes;
+    tx_last       = now;
+    link_metrics_update();
+}
+
+static bool
+link_metric_changed(uint64_t old_val, uint64_t new_val)
+{
+    uint64_t diff = old_val > new_val ? old_val - new_val : new_val - old_val;
+
+    return diff * 100 > old_val * uipcp_rib::kLinkMetricsThreshold;
+}
+
+/* Advertise the link metrics again only if they changed significantly,
+ * to avoid flooding the DIF with small fluctuations. */
+void
+Neighbor::link_metrics_update()
+{
+    const LowerFlow *lf = rib->lfdb->find(rib->myname, ipcp_name);
+
+    if (lf == nullptr) {
+        return; /* not advertised yet */
+    }
+
+    if (link_metric_changed(lf->delay, srtt_us / 2) ||
+        link_metric_changed(lf->bandwidth, avail_bw)) {
+        rib->lfdb->update_local(ipcp_name);
+    }
+}
+
 void
 Neighbor::mgmt_only_set(std::shared_ptr<NeighFlow> nf)
 {
@@ -409,8 +494,9 @@ NeighFlow::enrollment_commit()
         er->msgs.pop_front();
     }
 
-    /* Sync with the neighbor. */
-    neigh->neigh_sync_rib(this);
+    /* Sync with the neighbor. We send our digests, so that the neighbor
+     * can send us the RIB objects that we are missing (and vice versa). */
+    neigh->neigh_sync_digests(this, /*buckets=*/true);
     er->stopped.notify_all();
 
     if (neigh->initiator) {
@@ -1012,7 +1098,9 @@ Neighbor::neigh_sync_obj(const NeighFlow *nf, bool create,
 }
 
 int
-Neighbor::neigh_sync_rib(NeighFlow *nf) const
+Neighbor::neigh_sync_rib(
+    NeighFlow *nf,
+    const std::map<std::string, DigestTree::BucketMask> &masks) const
 {
     unsigned int limit = 10; /* Hardwired for now, but at least we limit. */
     int ret            = 0;
@@ -1021,9 +1109,11 @@ Neighbor::neigh_sync_rib(NeighFlow *nf) const
         static_cast<string>(ipcp_name).c_str());
 
     /* Synchronize neighbors first. */
-    {
-        NeighborCandidate cand = rib->neighbor_cand_get();
-        string my_name         = rib->myname;
+    auto mit = masks.find(obj_class::neighbors);
+    if (mit != masks.end()) {
+        const DigestTree::BucketMask &buckets = mit->second;
+        NeighborCandidate cand                = rib->neighbor_cand_get();
+        string my_name                        = rib->myname;
 
         /* Temporarily insert a neighbor representing myself,
          * to simplify the loop below. */
@@ -1036,12 +1126,16 @@ Neighbor::neigh_sync_rib(NeighFlow *nf) const
 
             while (ncl.candidates.size() < limit &&
                    cit != rib->neighbors_seen.end()) {
-                ncl.candidates.push_back(cit->second);
+                if (buckets[DigestTree::bucket(cit->first)]) {
+                    ncl.candidates.push_back(cit->second);
+                }
                 cit++;
             }
 
-            ret |= neigh_sync_obj(nf, true, obj_class::neighbors,
-                                  obj_name::neighbors, &ncl);
+            if (ncl.candidates.size()) {
+                ret |= neigh_sync_obj(nf, true, obj_class::neighbors,
+                                      obj_name::neighbors, &ncl);
+            }
         }
 
         /* Remove myself. */
@@ -1049,13 +1143,22 @@ Neighbor::neigh_sync_rib(NeighFlow *nf) const
     }
 
     /* Synchronize lower flow database. */
-    ret |= rib->lfdb->sync_neigh(nf, limit);
+    mit = masks.find(obj_class::lfdb);
+    if (mit != masks.end()) {
+        ret |= rib->lfdb->sync_neigh(nf, limit, &mit->second);
+    }
 
     /* Synchronize Directory Forwarding Table. */
-    ret |= rib->dft->sync_neigh(nf, limit);
+    mit = masks.find(obj_class::dft);
+    if (mit != masks.end()) {
+        ret |= rib->dft->sync_neigh(nf, limit, &mit->second);
+    }
 
     /* Synchronize address allocation table. */
-    ret |= rib->addra->sync_neigh(nf, limit);
+    mit = masks.find(obj_class::addr_alloc_table);
+    if (mit != masks.end()) {
+        ret |= rib->addra->sync_neigh(nf, limit, &mit->second);
+    }
 
     UPD(rib->uipcp, "Finished RIB sync with neighbor '%s'\n",
         static_cast<string>(ipcp_name).c_str());
@@ -1063,6 +1166,24 @@ Neighbor::neigh_sync_rib(NeighFlow *nf) const
     return ret;
 }
 
+int
+Neighbor::neigh_sync_digests(NeighFlow *nf, bool buckets) const
+{
+    SubtreeDigestList sdl;
+
+    for (const auto &kvd : rib->digests_compute()) {
+        sdl.subtrees.emplace_back();
+        sdl.subtrees.back().name = kvd.first;
+        sdl.subtrees.back().root = kvd.second.root();
+        if (buckets) {
+            sdl.subtrees.back().buckets = kvd.second.buckets();
+        }
+    }
+
+    return neigh_sync_obj(nf, true, obj_class::digests, obj_name::digests,
+                          &sdl);
+}
+
 void
 uipcp_rib::neighs_refresh_tmr_restart()
 {
@@ -1084,15 +1205,22 @@ uipcp_rib::neighs_refresh()
 
     UPV(uipcp, "Refreshing neighbors RIB\n");
 
-    lfdb->neighs_refresh(limit);
-    dft->neighs_refresh(limit);
+    /* Anti-entropy: only the root digests are sent. A neighbor that finds
+     * a difference replies with its bucket digests, and we send back
+     * the objects contained in the buckets that differ. */
     {
-        NeighborCandidateList ncl;
+        SubtreeDigestList sdl;
 
-        ncl.candidates.push_back(neighbor_cand_get());
-        neighs_sync_obj_all(true, obj_class::neighbors, obj_name::neighbors,
-                            &ncl);
+        for (const auto &kvd : digests_compute()) {
+            sdl.subtrees.emplace_back();
+            sdl.subtrees.back().name = kvd.first;
+            sdl.subtrees.back().root = kvd.second.root();
+        }
+        neighs_sync_obj_all(true, obj_class::digests, obj_name::digests,
+                            &sdl);
     }
+
+    lfdb->neighs_refresh(limit);
     neighs_refresh_tmr_restart();
 }
 
@@ -1168,6 +1296,20 @@ common_lower_dif(const list<string> l1, const list<string> l2)
     return string();
 }
 
+/* Content of a neighbor candidate in the neighbors digest. */
+static string
+neighbor_digest_content(const NeighborCandidate &nc)
+{
+    stringstream ss;
+
+    ss << nc.address;
+    for (const string &dif : nc.lower_difs) {
+        ss << " " << dif;
+    }
+
+    return ss.str();
+}
+
 int
 uipcp_rib::neighbors_handler(const CDAPMessage *rm, NeighFlow *nf,
                              rlm_addr_t src_addr)
@@ -1212,7 +1354,12 @@ uipcp_rib::neighbors_handler(const CDAPMessage *rm, NeighFlow *nf,
                 continue;
             }
 
+            if (mit != neighbors_seen.end()) {
+                neighbors_dt.del(neigh_name,
+                                 neighbor_digest_content(mit->second));
+            }
             neighbors_seen[neigh_name] = nc;
+            neighbors_dt.add(neigh_name, neighbor_digest_content(nc));
             prop_ncl.candidates.push_back(nc);
             propagate = true;
 
@@ -1240,6 +1387,7 @@ uipcp_rib::neighbors_handler(const CDAPMessage *rm, NeighFlow *nf,
             }
 
             /* Let's forget about this neighbor. */
+            neighbors_dt.del(neigh_name, neighbor_digest_content(mit->second));
             neighbors_seen.erase(mit);
             prop_ncl.candidates.push_back(nc);
             propagate = true;
@@ -1277,6 +1425,12 @@ uipcp_rib::keepalive_handler(const CDAPMessage *rm, NeighFlow *nf,
     }
 
     if (rm->op_code == gpb::M_READ_R) {
+        if (nf->pending_keepalive_reqs == 1) {
+            nf->neigh->rtt_sample(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - nf->keepalive_sent));
+        }
+
         /* Reset the keepalive request counter, we know the neighbor
          * is alive on this flow. */
         nf->pending_keepalive_reqs = 0;
@@ -1324,6 +1478,96 @@ uipcp_rib::neighbor_cand_get() const
     return cand;
 }
 
+/* All the candidates seen, plus ourselves. */
+void
+uipcp_rib::neighbors_digest(DigestTree &dt) const
+{
+    dt = neighbors_dt;
+    dt.add(myname, neighbor_digest_content(neighbor_cand_get()));
+}
+
+std::map<std::string, DigestTree>
+uipcp_rib::digests_compute() const
+{
+    std::map<std::string, DigestTree> dts;
+
+    neighbors_digest(dts[obj_class::neighbors]);
+    lfdb->digest(dts[obj_class::lfdb]);
+    dft->digest(dts[obj_class::dft]);
+    addra->digest(dts[obj_class::addr_alloc_table]);
+
+    return dts;
+}
+
+int
+uipcp_rib::digests_handler(const CDAPMessage *rm, NeighFlow *nf,
+                           rlm_addr_t src_addr)
+{
+    std::map<std::string, DigestTree::BucketMask> masks;
+    std::map<std::string, DigestTree> dts;
+    SubtreeDigestList reply;
+    const char *objbuf;
+    size_t objlen;
+
+    if (rm->op_code != gpb::M_CREATE) {
+        UPE(uipcp, "M_CREATE expected\n");
+        return 0;
+    }
+
+    if (!nf) {
+        UPE(uipcp, "Digests can only be received from a neighbor\n");
+        return 0;
+    }
+
+    rm->get_obj_value(objbuf, objlen);
+    if (!objbuf) {
+        UPE(uipcp, "M_CREATE does not contain a nested message\n");
+        return 0;
+    }
+
+    SubtreeDigestList sdl(objbuf, objlen);
+
+    dts = digests_compute();
+    for (const SubtreeDigest &sd : sdl.subtrees) {
+        auto dit = dts.find(sd.name);
+
+        if (dit == dts.end() || dit->second.root() == sd.root) {
+            /* Unknown subtree, or already in sync. */
+            continue;
+        }
+
+        if (sd.buckets.empty()) {
+            /* The neighbor only sent the root: tell it which buckets
+             * we have, so that it can send us what differs. */
+            reply.subtrees.emplace_back();
+            reply.subtrees.back().name    = sd.name;
+            reply.subtrees.back().root    = dit->second.root();
+            reply.subtrees.back().buckets = dit->second.buckets();
+        } else {
+            /* Send the objects in the buckets that differ. The neighbor
+             * will do the same, when it finds out about the differences,
+             * so that both the replicas converge to the newest
+             * objects. */
+            masks[sd.name] = dit->second.diff(sd.buckets);
+        }
+    }
+
+    UPV(uipcp, "Digests from neighbor %s: %u subtrees out of sync\n",
+        nf->neigh->ipcp_name.c_str(),
+        (unsigned)(reply.subtrees.size() + masks.size()));
+
+    if (reply.subtrees.size()) {
+        nf->neigh->neigh_sync_obj(nf, true, obj_class::digests,
+                                  obj_name::digests, &reply);
+    }
+
+    if (masks.size()) {
+        nf->neigh->neigh_sync_rib(nf, masks);
+    }
+
+    return 0;
+}
+
 /* Reuse internal flow allocation functionalities from the API
  * implementation, in order to specify an upper IPCP id and get the port
  * id. These functionalities are not exposed through api.h */
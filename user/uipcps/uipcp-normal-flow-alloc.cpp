@@ -27,6 +27,26 @@
 
 using namespace std;
 
+/* Select one of the addresses of a name, as the DFT lookups do: the
+ * preferred one if present, otherwise one based on the cookie, so that
+ * the flows are balanced across the addresses. */
+static rlm_addr_t
+dft_addr_select(const vector<rlm_addr_t> &addrs, rlm_addr_t preferred,
+                uint32_t cookie)
+{
+    if (addrs.empty()) {
+        return RL_ADDR_NULL;
+    }
+
+    for (rlm_addr_t addr : addrs) {
+        if (addr == preferred) {
+            return addr;
+        }
+    }
+
+    return addrs[cookie % addrs.size()];
+}
+
 int
 uipcp_rib::fa_req(struct rl_kmsg_fa_req *req)
 {
@@ -41,9 +61,15 @@ uipcp_rib::fa_req(struct rl_kmsg_fa_req *req)
 
     appl_name = string(req->remote_appl);
 
-    /* Lookup the DFT. */
-    ret = dft->lookup_req(appl_name, &remote_addr,
-                          /* no preference */ 0, req->cookie);
+    /* Lookup the DFT, unless a previous asynchronous lookup for the
+     * same name is still in the cache. */
+    if (dft_cache.lookup(appl_name, /* no preference */ 0, req->cookie,
+                         &remote_addr)) {
+        ret = (remote_addr == RL_ADDR_NULL) ? -1 : 0;
+    } else {
+        ret = dft->lookup_req(appl_name, &remote_addr,
+                              /* no preference */ 0, req->cookie);
+    }
     if (ret) {
         /* Return a negative flow allocation response immediately. */
         UPI(uipcp, "No DFT matching entry for destination %s\n",
@@ -76,10 +102,15 @@ uipcp_rib::fa_req(struct rl_kmsg_fa_req *req)
 
 void
 uipcp_rib::dft_lookup_resolved(const std::string &appl_name,
-                               rlm_addr_t remote_addr)
+                               const std::vector<rlm_addr_t> &addrs,
+                               bool cacheable)
 {
     auto mit = pending_fa_reqs.find(appl_name);
 
+    if (cacheable) {
+        dft_cache.insert(appl_name, addrs);
+    }
+
     if (mit == pending_fa_reqs.end()) {
         UPV(uipcp, "DFT lookup for '%s' resolved, but no pending requests\n",
             appl_name.c_str());
@@ -88,11 +119,14 @@ uipcp_rib::dft_lookup_resolved(const std::string &appl_name,
 
     /* Go ahead with all the flow allocation requests that were pending
      * waiting for the DFT to resolve this name. */
-    if (remote_addr == RL_ADDR_NULL) {
+    if (addrs.empty()) {
         UPI(uipcp, "No DFT matching entry for destination %s\n",
             appl_name.c_str());
     }
     for (auto &fr : mit->second) {
+        rlm_addr_t remote_addr =
+            dft_addr_select(addrs, /* no preference */ 0, fr->cookie);
+
         if (remote_addr == RL_ADDR_NULL) {
             /* Return a negative flow allocation response. */
             uipcp_issue_fa_resp_arrived(uipcp, fr->local_port,
@@ -106,6 +140,125 @@ uipcp_rib::dft_lookup_resolved(const std::string &appl_name,
     pending_fa_reqs.erase(mit);
 }
 
+void
+uipcp_rib::dft_cache_configure()
+{
+    dft_cache.configure(get_param_value<int>("dft", "cache-size"),
+                        get_param_value<int>("dft", "cache-ttl"),
+                        get_param_value<int>("dft", "cache-negative-ttl"));
+}
+
+void
+DFTCache::configure(size_t size, int ttl_secs, int negative_ttl_secs)
+{
+    max_entries  = size;
+    ttl          = std::chrono::seconds(ttl_secs);
+    negative_ttl = std::chrono::seconds(negative_ttl_secs);
+
+    while (lru.size() > max_entries) {
+        entries.erase(lru.back().appl_name);
+        lru.pop_back();
+    }
+}
+
+bool
+DFTCache::lookup(const std::string &appl_name, rlm_addr_t preferred,
+                 uint32_t cookie, rlm_addr_t *dstaddr)
+{
+    auto mit = entries.find(appl_name);
+
+    if (mit == entries.end()) {
+        misses++;
+        return false;
+    }
+
+    if (mit->second->expiry <= std::chrono::steady_clock::now()) {
+        lru.erase(mit->second);
+        entries.erase(mit);
+        misses++;
+        return false;
+    }
+
+    /* Move to the front of the LRU list. */
+    lru.splice(lru.begin(), lru, mit->second);
+    *dstaddr = dft_addr_select(mit->second->addrs, preferred, cookie);
+    if (*dstaddr == RL_ADDR_NULL) {
+        neg_hits++;
+    } else {
+        hits++;
+    }
+
+    return true;
+}
+
+void
+DFTCache::insert(const std::string &appl_name,
+                 const std::vector<rlm_addr_t> &addrs)
+{
+    auto lifetime = addrs.empty() ? negative_ttl : ttl;
+    Entry e;
+
+    invalidate(appl_name);
+    if (max_entries == 0 || lifetime.count() == 0) {
+        return;
+    }
+
+    if (lru.size() >= max_entries) {
+        /* Evict the least recently used entry. */
+        entries.erase(lru.back().appl_name);
+        lru.pop_back();
+    }
+
+    e.appl_name = appl_name;
+    e.addrs     = addrs;
+    e.expiry    = std::chrono::steady_clock::now() + lifetime;
+    lru.push_front(e);
+    entries[appl_name] = lru.begin();
+}
+
+void
+DFTCache::invalidate(const std::string &appl_name)
+{
+    auto mit = entries.find(appl_name);
+
+    if (mit != entries.end()) {
+        lru.erase(mit->second);
+        entries.erase(mit);
+    }
+}
+
+void
+DFTCache::clear()
+{
+    lru.clear();
+    entries.clear();
+}
+
+void
+DFTCache::dump(std::stringstream &ss) const
+{
+    auto now = std::chrono::steady_clock::now();
+
+    ss << "DFT lookup cache (" << lru.size() << "/" << max_entries
+       << " entries, hits: " << hits << ", negative hits: " << neg_hits
+       << ", misses: " << misses << "):" << endl;
+    for (const Entry &e : lru) {
+        ss << "    Application: " << e.appl_name << ", Addresses: ";
+        if (e.addrs.empty()) {
+            ss << "unresolved";
+        }
+        for (size_t i = 0; i < e.addrs.size(); i++) {
+            ss << (i ? " " : "") << e.addrs[i];
+        }
+        ss << ", Expires in: "
+           << std::chrono::duration_cast<std::chrono::seconds>(e.expiry - now)
+                  .count()
+           << "s" << endl;
+    }
+
+    ss << endl;
+}
+
 class LocalFlowAllocator : public FlowAllocator {
 public:
     RL_NODEFAULT_NONCOPIABLE(LocalFlowAllocator);
@@ -242,8 +395,16 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
         cfg->dtcp.initial_a = initial_a;
     }
 
-    /* Delay, loss and jitter ignored for now. */
-    (void)spec->max_delay;
+    /* Select the forwarding table: delay bounds are served by the
+     * low-delay table, bandwidth requirements by the high-bandwidth
+     * one. Loss and jitter ignored for now. */
+    if (spec->max_delay) {
+        cfg->qos_id = uipcp_rib::kQosIdLowDelay;
+    } else if (spec->avg_bandwidth) {
+        cfg->qos_id = uipcp_rib::kQosIdHighBandwidth;
+    } else {
+        cfg->qos_id = uipcp_rib::kQosIdDefault;
+    }
     (void)spec->max_loss;
     (void)spec->max_jitter;
 
@@ -317,6 +478,8 @@ LocalFlowAllocator::fa_req(struct rl_kmsg_fa_req *req, rlm_addr_t remote_addr)
     }
 #endif /* RL_USE_QOS_CUBES */
 
+    /* The slave will use the same forwarding table. */
+    freq.connections.front().qos_id = flowcfg.qos_id;
     flowcfg2policies(&flowcfg, freq.qos, freq.policies);
 
     freq.flowcfg                 = flowcfg;
@@ -419,6 +582,7 @@ LocalFlowAllocator::flows_handler_create(const CDAPMessage *rm)
     local_appl  = freq.dst_app;
     remote_appl = freq.src_app;
     policies2flowcfg(&flowcfg, freq.qos, freq.policies);
+    flowcfg.qos_id = freq.connections.front().qos_id;
 
     freq.invoke_id = rm->invoke_id;
     freq.flags     = RL_FLOWREQ_SEND_DEL;
@@ -459,6 +623,12 @@ LocalFlowAllocator::flows_handler_create_r(const CDAPMessage *rm)
 
     FlowRequest &freq = f->second;
 
+    if (rm->result) {
+        /* The destination refused the flow, it may not hold the name
+         * anymore: don't use a cached resolution next time. */
+        rib->dft_cache.invalidate(static_cast<string>(freq.dst_app));
+    }
+
     /* Update the local freq object with the remote one. */
     freq.dst_port                    = remote_freq.dst_port;
     freq.connections.front().dst_cep = remote_freq.connections.front().dst_cep;
@@ -0,0 +1,233 @@
+/*
+ * Simulation of the Kademlia lookups used by the DHT-based DFT.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "uipcp-normal-kademlia.hpp"
+
+using namespace std;
+
+/* A simulated event: the response to a query (or its timeout). */
+struct SimEvent {
+    double t; /* milliseconds */
+    KadId from;
+    bool timeout;
+
+    bool operator>(const SimEvent &o) const { return t > o.t; }
+};
+
+using SimQueue = priority_queue<SimEvent, vector<SimEvent>, greater<SimEvent>>;
+
+static NodeId
+node_name(unsigned int i)
+{
+    return "n" + to_string(i) + ".IPCP";
+}
+
+static void
+usage(void)
+{
+    printf("rlite-kad-bench [OPTIONS]\n"
+           "   -h : show this help\n"
+           "   -n NUM : number of nodes (default 1000)\n"
+           "   -k NUM : replication factor (default 20)\n"
+           "   -a NUM : parallelism (default 3)\n"
+           "   -r NUM : number of lookups (default 1000)\n"
+           "   -m NUM : average one-way latency in milliseconds "
+           "(default 10)\n"
+           "   -t NUM : query timeout in milliseconds (default 2000)\n"
+           "   -d NUM : percentage of dead nodes (default 0)\n"
+           "   -s NUM : random seed (default 1)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int n = 1000, k = 20, alpha = 3, reps = 1000, seed = 1;
+    unsigned int latency = 10, timeout = 2000, dead_pct = 0;
+    unsigned long hops_total = 0, queries_total = 0;
+    unsigned int hops_max = 0, found = 0;
+    double lat_total = 0, lat_max = 0;
+    unordered_map<KadId, unsigned int> nodes;
+    vector<KadRoutingTable> rts;
+    vector<KadContact> contacts;
+    vector<bool> dead;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:k:a:r:m:t:d:s:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'k':
+            k = atoi(optarg);
+            break;
+        case 'a':
+            alpha = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'm':
+            latency = atoi(optarg);
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        case 'd':
+            dead_pct = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            printf("    Unrecognized option %c\n", opt);
+            usage();
+            return -1;
+        }
+    }
+
+    if (n < 2 || k < 1 || alpha < 1 || reps < 1 || dead_pct >= 100) {
+        printf("Invalid arguments\n");
+        return -1;
+    }
+
+    mt19937 rng(seed);
+    uniform_real_distribution<double> lat(latency * 0.5, latency * 1.5);
+    uniform_int_distribution<unsigned int> pct(0, 99);
+
+    for (unsigned int i = 0; i < n; i++) {
+        contacts.push_back(KadContact(node_name(i), i + 1));
+        nodes[contacts.back().id] = i;
+        dead.push_back(i > 0 && pct(rng) < dead_pct);
+    }
+
+    /* Each node learns about all the others, in random order, so that
+     * the buckets keep the first k contacts they see. */
+    for (unsigned int i = 0; i < n; i++) {
+        vector<KadContact> others = contacts;
+
+        rts.emplace_back(contacts[i].id, k);
+        shuffle(others.begin(), others.end(), rng);
+        for (const KadContact &c : others) {
+            if (c.id != contacts[i].id) {
+                rts[i].update(c);
+            }
+        }
+    }
+
+    uniform_int_distribution<unsigned int> node(0, n - 1);
+
+    for (unsigned int r = 0; r < reps; r++) {
+        KadId key = KadRoutingTable::id_of("app" + to_string(r) + ".DIF");
+        unordered_set<KadId> storers;
+        vector<KadContact> sorted = contacts;
+        unsigned int src;
+        SimQueue events;
+        double t = 0;
+
+        /* The value is stored at the k nodes closest to the key. */
+        sort(sorted.begin(), sorted.end(),
+             [key](const KadContact &a, const KadContact &b) {
+                 return (a.id ^ key) < (b.id ^ key);
+             });
+        for (unsigned int i = 0; i < k && i < n; i++) {
+            storers.insert(sorted[i].id);
+        }
+
+        do {
+            src = node(rng);
+        } while (dead[src]);
+
+        if (storers.count(contacts[src].id)) {
+            found++;
+            continue; /* resolved locally */
+        }
+
+        KadLookup lookup(key, contacts[src].id, k, alpha,
+                         rts[src].closest(key, k));
+        bool resolved = false;
+
+        for (;;) {
+            for (const KadContact &c : lookup.next()) {
+                bool d = dead[nodes[c.id]];
+
+                queries_total++;
+                events.push({t + (d ? timeout : lat(rng) + lat(rng)), c.id, d});
+            }
+            if (events.empty()) {
+                break;
+            }
+
+            SimEvent ev = events.top();
+
+            events.pop();
+            t = ev.t;
+            if (ev.timeout) {
+                lookup.failure(ev.from);
+            } else if (storers.count(ev.from)) {
+                unsigned int hops = lookup.hops(ev.from);
+
+                hops_total += hops;
+                hops_max = max(hops_max, hops);
+                resolved = true;
+                break;
+            } else {
+                lookup.response(ev.from,
+                                rts[nodes[ev.from]].closest(key, k));
+            }
+        }
+
+        if (resolved) {
+            found++;
+            lat_total += t;
+            lat_max = max(lat_max, t);
+        }
+    }
+
+    printf("Nodes: %u (%u%% dead), k: %u, alpha: %u\n", n, dead_pct, k,
+           alpha);
+    printf("Lookups: %u, resolved: %u, %.1f queries per lookup\n", reps,
+           found, (double)queries_total / reps);
+    if (found) {
+        printf("Hops: %.2f average, %u max\n", (double)hops_total / found,
+               hops_max);
+        printf("Latency: %.1f ms average, %.1f ms max\n", lat_total / found,
+               lat_max);
+    }
+
+    return 0;
+}
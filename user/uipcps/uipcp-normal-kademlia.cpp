@@ -0,0 +1,277 @@
+/*
+ * Kademlia routing table and lookups, used by the DHT-based DFT.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <algorithm>
+#include <cassert>
+
+#include "uipcp-normal-kademlia.hpp"
+
+using namespace std;
+
+constexpr unsigned int KadRoutingTable::kIdBits;
+
+/* 64-bit FNV-1a, followed by a final mixing to spread the identifiers
+ * over the whole space. The identifiers must be the same on all the
+ * nodes, so std::hash cannot be used. */
+KadId
+KadRoutingTable::id_of(const string &name)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (unsigned char c : name) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+KadContact::KadContact(const NodeId &n, rlm_addr_t a)
+    : id(KadRoutingTable::id_of(n)), name(n), address(a)
+{
+}
+
+KadRoutingTable::KadRoutingTable(KadId s, unsigned int _k)
+    : self(s), k(_k), buckets(kIdBits)
+{
+}
+
+unsigned int
+KadRoutingTable::bucket_index(KadId id) const
+{
+    assert(id != self);
+    return kIdBits - 1 - __builtin_clzll(id ^ self);
+}
+
+void
+KadRoutingTable::set_k(unsigned int _k)
+{
+    k = _k;
+    for (auto &bucket : buckets) {
+        while (bucket.size() > k) {
+            /* Keep the least recently seen contacts. */
+            bucket.pop_back();
+            count--;
+        }
+    }
+}
+
+void
+KadRoutingTable::update(const KadContact &c)
+{
+    if (c.id == self) {
+        return;
+    }
+
+    list<KadContact> &bucket = buckets[bucket_index(c.id)];
+
+    for (auto it = bucket.begin(); it != bucket.end(); it++) {
+        if (it->id == c.id) {
+            bucket.erase(it);
+            bucket.push_back(c);
+            return;
+        }
+    }
+
+    if (bucket.size() < k) {
+        bucket.push_back(c);
+        count++;
+    }
+}
+
+void
+KadRoutingTable::remove(KadId id)
+{
+    if (id == self) {
+        return;
+    }
+
+    list<KadContact> &bucket = buckets[bucket_index(id)];
+
+    for (auto it = bucket.begin(); it != bucket.end(); it++) {
+        if (it->id == id) {
+            bucket.erase(it);
+            count--;
+            return;
+        }
+    }
+}
+
+vector<KadContact>
+KadRoutingTable::closest(KadId key, unsigned int n) const
+{
+    vector<KadContact> v;
+
+    v.reserve(count);
+    for (const auto &bucket : buckets) {
+        v.insert(v.end(), bucket.begin(), bucket.end());
+    }
+
+    auto cmp = [key](const KadContact &a, const KadContact &b) {
+        return (a.id ^ key) < (b.id ^ key);
+    };
+
+    if (v.size() > n) {
+        partial_sort(v.begin(), v.begin() + n, v.end(), cmp);
+        v.resize(n);
+    } else {
+        sort(v.begin(), v.end(), cmp);
+    }
+
+    return v;
+}
+
+KadLookup::KadLookup(KadId _key, KadId _self, unsigned int _k,
+                     unsigned int _alpha, const vector<KadContact> &seeds)
+    : key_(_key), self(_self), k(_k), alpha(_alpha)
+{
+    for (const KadContact &c : seeds) {
+        add(c, 1);
+    }
+}
+
+void
+KadLookup::add(const KadContact &c, unsigned int hop)
+{
+    if (c.id != self && !shortlist.count(c.id ^ key_)) {
+        shortlist[c.id ^ key_] = Candidate{c, State::New, hop};
+    }
+}
+
+vector<KadContact>
+KadLookup::next()
+{
+    vector<KadContact> out;
+    unsigned int seen = 0;
+
+    /* Only the k closest live candidates are worth a query. */
+    for (auto &kv : shortlist) {
+        Candidate &cd = kv.second;
+
+        if (inflight >= alpha || seen >= k) {
+            break;
+        }
+        if (cd.state == State::Failed) {
+            continue;
+        }
+        seen++;
+        if (cd.state == State::New) {
+            cd.state = State::InFlight;
+            inflight++;
+            out.push_back(cd.c);
+        }
+    }
+
+    return out;
+}
+
+void
+KadLookup::response(KadId from, const vector<KadContact> &contacts)
+{
+    auto it = shortlist.find(from ^ key_);
+
+    if (it == shortlist.end() || it->second.state != State::InFlight) {
+        return;
+    }
+    it->second.state = State::Answered;
+    inflight--;
+
+    for (const KadContact &c : contacts) {
+        add(c, it->second.hop + 1);
+    }
+}
+
+void
+KadLookup::failure(KadId from)
+{
+    auto it = shortlist.find(from ^ key_);
+
+    if (it == shortlist.end() || it->second.state != State::InFlight) {
+        return;
+    }
+    it->second.state = State::Failed;
+    inflight--;
+}
+
+bool
+KadLookup::done() const
+{
+    unsigned int seen = 0;
+
+    for (const auto &kv : shortlist) {
+        if (seen >= k) {
+            break;
+        }
+        if (kv.second.state == State::Failed) {
+            continue;
+        }
+        if (kv.second.state != State::Answered) {
+            return false;
+        }
+        seen++;
+    }
+
+    return true;
+}
+
+vector<KadContact>
+KadLookup::closest() const
+{
+    vector<KadContact> v;
+
+    for (const auto &kv : shortlist) {
+        if (v.size() >= k) {
+            break;
+        }
+        if (kv.second.state == State::Answered) {
+            v.push_back(kv.second.c);
+        }
+    }
+
+    return v;
+}
+
+unsigned int
+KadLookup::hops(KadId from) const
+{
+    auto it = shortlist.find(from ^ key_);
+
+    return it == shortlist.end() ? 0 : it->second.hop;
+}
+
+unsigned int
+KadLookup::hops() const
+{
+    unsigned int h = 0;
+
+    for (const KadContact &c : closest()) {
+        h = max(h, hops(c.id));
+    }
+
+    return h;
+}
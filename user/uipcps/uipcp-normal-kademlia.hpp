@@ -0,0 +1,136 @@
+/*
+ * Kademlia routing table and lookups, used by the DHT-based DFT.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __UIPCP_KADEMLIA_H__
+#define __UIPCP_KADEMLIA_H__
+
+#include <map>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "rlite/cpputils.hpp"
+#include "uipcp-normal-codecs.hpp"
+
+/* Kademlia identifiers are 64 bits wide, and are obtained by hashing
+ * node names and application names. The distance between two
+ * identifiers is their xor. */
+using KadId = uint64_t;
+
+struct KadContact {
+    KadId id = 0;
+    NodeId name;
+    rlm_addr_t address = RL_ADDR_NULL;
+
+    KadContact() = default;
+    KadContact(const NodeId &n, rlm_addr_t a);
+};
+
+/* The routing table of a node: the i-th k-bucket contains up to k
+ * contacts whose distance from the node is in [2^i, 2^(i+1)), in least
+ * recently seen order. */
+class KadRoutingTable {
+public:
+    static constexpr unsigned int kIdBits = 64;
+
+    static KadId id_of(const std::string &name);
+
+    KadRoutingTable(KadId self, unsigned int k);
+
+    KadId self_id() const { return self; }
+    size_t size() const { return count; }
+    void set_k(unsigned int k);
+
+    /* Learn about a contact (or refresh it), moving it to the tail of
+     * its bucket. A full bucket does not accept new contacts, as long
+     * lived contacts are more likely to stay alive; unresponsive
+     * contacts are removed with remove(). */
+    void update(const KadContact &c);
+    void remove(KadId id);
+
+    /* The (up to) n contacts closest to 'key'. */
+    std::vector<KadContact> closest(KadId key, unsigned int n) const;
+
+private:
+    unsigned int bucket_index(KadId id) const;
+
+    KadId self;
+    unsigned int k;
+    size_t count = 0;
+    std::vector<std::list<KadContact>> buckets;
+};
+
+/* State of an iterative lookup for the k nodes closest to a key. The
+ * caller sends a query to the contacts returned by next() (at most
+ * alpha of them are in flight at any time), and reports the outcome
+ * with response() or failure(), until done() is true. */
+class KadLookup {
+public:
+    KadLookup(KadId key, KadId self, unsigned int k, unsigned int alpha,
+              const std::vector<KadContact> &seeds);
+
+    KadId key() const { return key_; }
+
+    /* Contacts to be queried now, marked as in flight. */
+    std::vector<KadContact> next();
+
+    /* The contact 'from' answered with the contacts it knows closest to
+     * the key. Late answers (e.g. after a failure) are ignored. */
+    void response(KadId from, const std::vector<KadContact> &contacts);
+    void failure(KadId from);
+
+    /* True when the k closest contacts known have all answered (or
+     * there is nobody else to query). */
+    bool done() const;
+
+    /* The (up to) k closest contacts that answered. */
+    std::vector<KadContact> closest() const;
+
+    /* Number of sequential queries needed to reach the contact 'from'
+     * (1 for the contacts in our routing table), or the maximum over
+     * the closest contacts if 'from' is not specified. */
+    unsigned int hops(KadId from) const;
+    unsigned int hops() const;
+
+private:
+    enum class State { New, InFlight, Answered, Failed };
+
+    struct Candidate {
+        KadContact c;
+        State state;
+        unsigned int hop;
+    };
+
+    void add(const KadContact &c, unsigned int hop);
+
+    KadId key_;
+    KadId self;
+    unsigned int k;
+    unsigned int alpha;
+    unsigned int inflight = 0;
+
+    /* Candidates sorted by distance from the key. */
+    std::map<KadId, Candidate> shortlist;
+};
+
+#endif /* __UIPCP_KADEMLIA_H__ */
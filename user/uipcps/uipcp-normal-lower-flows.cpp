@@ -21,23 +21,44 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <algorithm>
 #include <climits>
 #include <cerrno>
+#include <ctime>
+#include <queue>
 #include <sstream>
 #include <iostream>
 
 #include "uipcp-normal.hpp"
+#include "uipcp-normal-spf.hpp"
 
 using namespace std;
 
+/* Lower flows, indexed by local node and remote node. */
+using LowerFlowDB =
+    std::unordered_map<NodeId, std::unordered_map<NodeId, LowerFlow>>;
+
 class RoutingEngine {
 public:
     RL_NODEFAULT_NONCOPIABLE(RoutingEngine);
-    RoutingEngine(struct uipcp_rib *r) : lfa_enabled(false), rib(r) {}
+    RoutingEngine(struct uipcp_rib *r) : lfa_enabled(false), rib(r)
+    {
+        planes.resize(2);
+        planes[0].qos_id = uipcp_rib::kQosIdLowDelay;
+        planes[1].qos_id = uipcp_rib::kQosIdHighBandwidth;
+    }
+
+    /* Keep the graph in sync with the Lower Flow Database. The changes
+     * are accumulated, and consumed by the next route computation. */
+    void lower_flow_set(const LowerFlow &lf);
+    void lower_flow_del(const NodeId &local_node, const NodeId &remote_node);
+
+    /* Set the parameters of the QoS-aware routing (bandwidths in Mbps). */
+    void qos_params_set(bool enabled, int min_bw, int link_capacity);
 
     /* Recompute routing and forwarding table and possibly
      * update kernel forwarding data structures. */
-    void update_kernel_routing(const NodeId &);
+    void update_kernel_routing(const NodeId &, const LowerFlowDB &db);
 
     void flow_state_update(struct rl_kmsg_flow_state *upd);
 
@@ -48,26 +69,67 @@ public:
     void dump(std::stringstream &ss) const;
 
 private:
-    struct Edge {
-        NodeId to;
-        unsigned int cost;
-
-        Edge(const NodeId &to_, unsigned int cost_) : to(to_), cost(cost_) {}
-        Edge(Edge &&) = default;
-    };
-
-    struct Info {
-        unsigned int dist;
-        NodeId nhop;
-        bool visited;
-    };
-
     /* Step 1. Shortest Path algorithm. */
-    void compute_shortest_paths(
-        const NodeId &source_node,
-        const std::unordered_map<NodeId, std::list<Edge>> &graph,
-        std::unordered_map<NodeId, Info> &info);
     int compute_next_hops(const NodeId &);
+    void compute_node_next_hops(SPFGraph::NodeIdx v);
+
+    /* The graph built from the Lower Flow Database. */
+    SPFGraph graph;
+
+    /* Edge changes not yet applied to the shortest path trees. */
+    std::vector<SPFGraph::EdgeChange> pending;
+
+    /* Shortest path tree rooted at the local node, and the ones rooted at
+     * each of its neighbors (only used by LFA). The trees are kept across
+     * runs, so that they can be updated incrementally. */
+    SPFGraph::Tree tree;
+    std::vector<SPFGraph::NodeIdx> neighs;
+    std::vector<SPFGraph::Tree> neigh_trees;
+    bool lfa_computed = false;
+
+    /* Step 2. QoS-aware routing. Besides the default tree, which uses
+     * the lower flow costs, a shortest path tree is computed for each
+     * QoS cube: the low-delay cube uses the measured delays as weights,
+     * while the high-bandwidth cube uses weights inversely proportional
+     * to the available bandwidth, leaving out the links with less than
+     * 'qos-min-bandwidth' available. Like the default one, the graphs
+     * of the planes are kept in sync by lower_flow_set() and
+     * lower_flow_del(), and the trees are updated incrementally. They
+     * are only rebuilt from the Lower Flow Database when the parameters
+     * change. The kernel PDUFT only gets QoS-specific entries for the
+     * destinations whose next hop differs from the default one. */
+    struct QosPlane {
+        rl_qosid_t qos_id;
+        SPFGraph graph;
+        SPFGraph::Tree tree;
+        std::vector<SPFGraph::EdgeChange> pending;
+
+        /* Next hop for each destination. */
+        std::unordered_map<NodeId, NodeId> next_hops;
+
+        /* QoS-specific entries installed in the kernel PDUFT. */
+        std::unordered_map<rlm_addr_t, rl_port_t> ports;
+    };
+    std::vector<QosPlane> planes;
+    void compute_qos_next_hops(const NodeId &, const LowerFlowDB &db);
+    unsigned int qos_weight(const QosPlane &p, const LowerFlow &lf) const;
+    void qos_edge_set(QosPlane &p, SPFGraph::NodeIdx from,
+                      SPFGraph::NodeIdx to, unsigned int weight);
+
+    /* Cached values of the QoS routing parameters (bandwidths in bits
+     * per second). The planes must be rebuilt when they change. */
+    bool qos_enabled     = false;
+    uint64_t qos_min_bw  = 0;
+    uint64_t qos_dflt_bw = 0;
+    bool qos_rebuild     = true;
+
+    /* Weight of links with unknown delay (in microseconds), reference
+     * bandwidth for the high-bandwidth weights (in bits per second), and
+     * upper bound for the weights, so that path lengths cannot
+     * overflow. */
+    static constexpr unsigned int kDelayUnknown = 1000;
+    static constexpr uint64_t kRefBandwidth     = 100000000000ULL;
+    static constexpr unsigned int kMaxWeight    = 1000000;
 
     /* Step 3. Forwarding table computation and kernel update. */
     int compute_fwd_table();
@@ -80,6 +142,11 @@ private:
      * It maps a NodeId --> (dst_addr, local_port). */
     std::unordered_map<rlm_addr_t, std::pair<NodeId, rl_port_t>> next_ports;
 
+    /* Backup ports installed in the kernel PDUFT, taken from the loop-free
+     * alternates. The kernel switches to the backup port of an entry as
+     * soon as the primary port goes down. */
+    std::unordered_map<rlm_addr_t, rl_port_t> backup_ports;
+
     /* Set of ports that are currently down. */
     std::unordered_set<rl_port_t> ports_down;
 
@@ -88,17 +155,78 @@ private:
 
 class FullyReplicatedLFDB : public LFDB {
     /* Lower Flow Database. */
-    std::unordered_map<NodeId, std::unordered_map<NodeId, LowerFlow>> db;
+    LowerFlowDB db;
     friend class RoutingEngine;
 
+    /* The lower flows of an originator are always advertised all
+     * together, with a per-originator sequence number: a newer
+     * advertisement replaces the whole set, while old and duplicate ones
+     * are neither applied nor flooded further. The local counter starts
+     * from the wall clock, so that it is likely to move forward across
+     * restarts. */
+    unsigned int local_seqnum;
+    std::unordered_map<NodeId, unsigned int> orig_seqnums;
+
+    /* Forget an originator once its last lower flow is gone. */
+    void orig_forget(LowerFlowDB::iterator it);
+
+    /* Digest of the database, updated whenever a lower flow is added,
+     * updated or removed. Expired lower flows are only removed from
+     * the digest when age_incr() discards them. */
+    DigestTree dtree;
+    static std::string digest_content(const LowerFlow &lf);
+
+    /* The local lower flows are advertised again only when the remote
+     * copies are about to age out, that is 'age-max' / 2 seconds after
+     * the last advertisement. Everything else is left to the anti-entropy
+     * synchronization. */
+    std::chrono::steady_clock::time_point last_originated;
+    int originate();
+
+    /* Min-heap of the expiration times of the remote entries, so that
+     * aging only touches the expired ones. Items are removed lazily: an
+     * item is stale if its entry has been refreshed or removed in the
+     * meantime. */
+    using ExpiryItem = std::pair<std::chrono::steady_clock::time_point,
+                                 std::pair<NodeId, NodeId>>;
+    std::priority_queue<ExpiryItem, std::vector<ExpiryItem>,
+                        std::greater<ExpiryItem>>
+        expiry_heap;
+
+    /* Cached values of the "routing" policy parameters. */
+    int age_max;
+    int spf_initial_wait;
+    int spf_hold_time;
+    int spf_max_hold_time;
+    bool qos_routing;
+    int qos_min_bandwidth;
+    int link_capacity;
+    void params_load();
+
 public:
     /* Routing engine. */
     RoutingEngine re;
 
+    /* Route computation throttling. The first change schedules a
+     * computation after 'spf-initial-wait' milliseconds; changes arriving
+     * while a computation is scheduled are coalesced into it. A change
+     * arriving within the hold-down window following a computation is
+     * delayed until the end of the window, and the window doubles (up
+     * to 'spf-max-hold-time'). The window goes back to 'spf-hold-time'
+     * after a quiet period twice as long. */
+    std::unique_ptr<TimeoutEvent> spf_timer;
+    std::chrono::steady_clock::time_point spf_last;
+    int spf_hold = 0;
+
     RL_NODEFAULT_NONCOPIABLE(FullyReplicatedLFDB);
-    FullyReplicatedLFDB(struct uipcp_rib *_ur) : LFDB(_ur), re(_ur) {}
+    FullyReplicatedLFDB(struct uipcp_rib *_ur)
+        : LFDB(_ur), local_seqnum(time(nullptr)), re(_ur)
+    {
+        params_load();
+    }
     ~FullyReplicatedLFDB() {}
 
+    int param_changed(const std::string &param_name) override;
     void dump(std::stringstream &ss) const override;
     void dump_routing(std::stringstream &ss) const override;
 
@@ -121,9 +249,14 @@ public:
     int rib_handler(const CDAPMessage *rm, NeighFlow *nf,
                     rlm_addr_t src_addr) override;
 
-    int sync_neigh(NeighFlow *nf, unsigned int limit) const override;
+    void digest(DigestTree &dt) const override;
+    int sync_neigh(NeighFlow *nf, unsigned int limit,
+                   const DigestTree::BucketMask *buckets) const override;
     int neighs_refresh(size_t limit) override;
     void age_incr() override;
+
+    void routing_schedule();
+    void routing_run();
 };
 
 LowerFlow *
@@ -145,8 +278,14 @@ FullyReplicatedLFDB::_find(const NodeId &local_node,
     }
 
     jt = it->second.find(remote_node);
+    if (jt == it->second.end() ||
+        jt->second.expiry <= std::chrono::steady_clock::now()) {
+        /* Expired entries are ignored, even if age_incr() did not
+         * discard them yet. */
+        return nullptr;
+    }
 
-    return jt == it->second.end() ? nullptr : &jt->second;
+    return &jt->second;
 }
 
 /* The add method has overwrite semantic, and possibly resets the age.
@@ -160,10 +299,23 @@ FullyReplicatedLFDB::add(const LowerFlow &lf)
     bool local_entry;
 
     lfz.age = 0;
+    local_entry = (lfz.local_node == rib->myname);
+    if (local_entry) {
+        lfz.expiry = std::chrono::steady_clock::time_point::max();
+    } else {
+        lfz.expiry = std::chrono::steady_clock::now() +
+                     std::chrono::seconds(age_max);
+    }
 
     if (it == db.end() || it->second.count(lf.remote_node) == 0) {
         /* Not there, we need to add the entry. */
+        if (!local_entry) {
+            expiry_heap.emplace(lfz.expiry,
+                                make_pair(lfz.local_node, lfz.remote_node));
+        }
+        dtree.add(lfz.local_node, digest_content(lfz));
         db[lf.local_node][lf.remote_node] = lfz;
+        re.lower_flow_set(lfz);
         UPD(rib->uipcp, "Lower flow %s added\n", repr.c_str());
         return true;
     }
@@ -171,9 +323,16 @@ FullyReplicatedLFDB::add(const LowerFlow &lf)
     /* Entry is already there. Update if needed (this expression
      * was obtained by means of a Karnaugh map on three variables:
      * local, newer, equal). */
-    local_entry = (lfz.local_node == rib->myname);
     if ((!local_entry && lfz.seqnum > it->second[lfz.remote_node].seqnum) ||
         (local_entry && lfz != it->second[lfz.remote_node])) {
+        if (!local_entry) {
+            expiry_heap.emplace(lfz.expiry,
+                                make_pair(lfz.local_node, lfz.remote_node));
+        }
+        re.lower_flow_set(lfz);
+        dtree.del(lfz.local_node,
+                  digest_content(it->second[lfz.remote_node]));
+        dtree.add(lfz.local_node, digest_content(lfz));
         it->second[lfz.remote_node] = std::move(lfz); /* Update the entry */
         UPV(rib->uipcp, "Lower flow %s updated\n", repr.c_str());
         return true;
@@ -182,6 +341,15 @@ FullyReplicatedLFDB::add(const LowerFlow &lf)
     return false;
 }
 
+void
+FullyReplicatedLFDB::orig_forget(LowerFlowDB::iterator it)
+{
+    if (it->second.empty()) {
+        orig_seqnums.erase(it->first);
+        db.erase(it);
+    }
+}
+
 /* Returns true if something changed. */
 bool
 FullyReplicatedLFDB::del(const NodeId &local_node, const NodeId &remote_node)
@@ -201,7 +369,10 @@ FullyReplicatedLFDB::del(const NodeId &local_node, const NodeId &remote_node)
     }
     repr = static_cast<string>(jt->second);
 
+    dtree.del(it->first, digest_content(jt->second));
     it->second.erase(jt);
+    re.lower_flow_del(local_node, remote_node);
+    orig_forget(it);
 
     UPD(rib->uipcp, "Lower flow %s removed\n", repr.c_str());
 
@@ -211,11 +382,12 @@ FullyReplicatedLFDB::del(const NodeId &local_node, const NodeId &remote_node)
 void
 FullyReplicatedLFDB::update_local(const string &node_name)
 {
+    std::shared_ptr<Neighbor> neigh = rib->get_neighbor(node_name, false);
     LowerFlowList lfl;
     LowerFlow lf;
     std::unique_ptr<CDAPMessage> sm;
 
-    if (rib->get_neighbor(node_name, false) == nullptr) {
+    if (neigh == nullptr) {
         return; /* Not our neighbor. */
     }
 
@@ -225,6 +397,8 @@ FullyReplicatedLFDB::update_local(const string &node_name)
     lf.seqnum      = 1; /* not meaningful */
     lf.state       = true;
     lf.age         = 0;
+    lf.delay       = neigh->srtt_us / 2;
+    lf.bandwidth   = neigh->avail_bw;
     lfl.flows.push_back(std::move(lf));
 
     sm = make_unique<CDAPMessage>();
@@ -258,21 +432,85 @@ FullyReplicatedLFDB::rib_handler(const CDAPMessage *rm, NeighFlow *nf,
 
     LowerFlowList lfl(objbuf, objlen);
     LowerFlowList prop_lfl;
-    bool modified = false;
+    bool modified    = false;
+    bool reoriginate = false;
 
-    for (const LowerFlow &f : lfl.flows) {
-        if (add_f) {
-            if (add(f)) {
-                modified = true;
-                prop_lfl.flows.push_back(f);
-            }
+    vector<NodeId> origs;
+    unordered_map<NodeId, vector<const LowerFlow *>> groups;
 
-        } else {
+    if (!add_f) {
+        for (const LowerFlow &f : lfl.flows) {
             if (del(f.local_node, f.remote_node)) {
                 modified = true;
                 prop_lfl.flows.push_back(f);
             }
         }
+        lfl.flows.clear();
+    }
+
+    /* Group the advertised lower flows by originator. */
+    for (const LowerFlow &f : lfl.flows) {
+        if (!groups.count(f.local_node)) {
+            origs.push_back(f.local_node);
+        }
+        groups[f.local_node].push_back(&f);
+    }
+
+    for (const NodeId &orig : origs) {
+        const vector<const LowerFlow *> &flows = groups[orig];
+        unordered_set<NodeId> remotes;
+        unsigned int seqnum = 0;
+
+        for (const LowerFlow *f : flows) {
+            seqnum = std::max(seqnum, f->seqnum);
+        }
+
+        if (orig == rib->myname) {
+            if (nf == nullptr && src_addr == rib->myaddr) {
+                /* Local change from update_local(). */
+                for (const LowerFlow *f : flows) {
+                    reoriginate |= add(*f);
+                }
+            } else if (seqnum > local_seqnum) {
+                /* Our own flows, advertised by a previous incarnation
+                 * of this IPCP. Move past them. */
+                local_seqnum = seqnum;
+                reoriginate  = true;
+            }
+            continue;
+        }
+
+        auto so = orig_seqnums.find(orig);
+        if (so != orig_seqnums.end() && seqnum <= so->second) {
+            /* Old or duplicate advertisement. */
+            continue;
+        }
+        orig_seqnums[orig] = seqnum;
+
+        /* Replace all the lower flows of the originator. */
+        for (const LowerFlow *f : flows) {
+            LowerFlow lf = *f;
+
+            lf.seqnum = seqnum;
+            add(lf);
+            remotes.insert(lf.remote_node);
+            prop_lfl.flows.push_back(std::move(lf));
+        }
+
+        auto it = db.find(orig);
+        if (it != db.end()) {
+            vector<NodeId> stale;
+
+            for (const auto &kvj : it->second) {
+                if (!remotes.count(kvj.first)) {
+                    stale.push_back(kvj.first);
+                }
+            }
+            for (const NodeId &remote : stale) {
+                del(orig, remote);
+            }
+        }
+        modified = true;
     }
 
     if (modified) {
@@ -280,19 +518,107 @@ FullyReplicatedLFDB::rib_handler(const CDAPMessage *rm, NeighFlow *nf,
         rib->neighs_sync_obj_excluding(nf ? nf->neigh : nullptr, add_f,
                                        obj_class::lfdb, obj_name::lfdb,
                                        &prop_lfl);
+    }
 
+    if (reoriginate) {
+        originate();
+    }
+
+    if (modified || reoriginate) {
         /* Update the routing table. */
-        re.update_kernel_routing(rib->myname);
+        routing_schedule();
     }
 
     return 0;
 }
 
+/* Advertise all the local lower flows to the neighbors, with a new
+ * sequence number. */
+int
+FullyReplicatedLFDB::originate()
+{
+    LowerFlowList lfl;
+
+    auto it = db.find(rib->myname);
+    if (it == db.end()) {
+        return 0;
+    }
+
+    local_seqnum++;
+    last_originated = std::chrono::steady_clock::now();
+    for (auto &kvj : it->second) {
+        dtree.del(it->first, digest_content(kvj.second));
+        kvj.second.seqnum = local_seqnum;
+        dtree.add(it->first, digest_content(kvj.second));
+        lfl.flows.push_back(kvj.second);
+    }
+
+    return rib->neighs_sync_obj_all(true, obj_class::lfdb, obj_name::lfdb,
+                                    &lfl);
+}
+
 void
 FullyReplicatedLFDB::update_routing()
 {
     /* Update the routing table. */
-    re.update_kernel_routing(rib->myname);
+    routing_schedule();
+}
+
+void
+FullyReplicatedLFDB::routing_schedule()
+{
+    int initial_wait, hold, max_hold, wait;
+    long since;
+
+    if (spf_timer && spf_timer->is_pending()) {
+        /* A computation is already scheduled, it will take this change
+         * into account. */
+        return;
+    }
+
+    initial_wait = spf_initial_wait;
+    hold         = spf_hold_time;
+    max_hold     = spf_max_hold_time;
+    since        = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - spf_last)
+                .count();
+
+    if (spf_hold < hold || since >= 2L * spf_hold) {
+        /* No recent churn, restart from the initial hold-down window. */
+        spf_hold = hold;
+    }
+
+    if (since >= spf_hold) {
+        wait = initial_wait;
+    } else {
+        /* Still within the hold-down window of the last computation,
+         * wait for the window to expire and back off. */
+        wait     = spf_hold - since;
+        spf_hold = std::min(2 * spf_hold, std::max(max_hold, hold));
+    }
+
+    if (wait == 0) {
+        routing_run();
+        return;
+    }
+
+    UPV(rib->uipcp, "Route computation scheduled in %d ms\n", wait);
+    spf_timer = make_unique<TimeoutEvent>(
+        std::chrono::milliseconds(wait), rib->uipcp, this,
+        [](struct uipcp *uipcp, void *arg) {
+            FullyReplicatedLFDB *lfdb = (FullyReplicatedLFDB *)arg;
+            std::lock_guard<std::mutex> guard(lfdb->rib->mutex);
+
+            lfdb->spf_timer->fired();
+            lfdb->routing_run();
+        });
+}
+
+void
+FullyReplicatedLFDB::routing_run()
+{
+    spf_last = std::chrono::steady_clock::now();
+    re.update_kernel_routing(rib->myname, db);
 }
 
 int
@@ -309,15 +635,33 @@ FullyReplicatedLFDB::flow_state_update(struct rl_kmsg_flow_state *upd)
 void
 FullyReplicatedLFDB::dump(std::stringstream &ss) const
 {
+    auto now = std::chrono::steady_clock::now();
+
     ss << "Lower Flow Database:" << endl;
     for (const auto &kvi : db) {
         for (const auto &kvj : kvi.second) {
             const LowerFlow &flow = kvj.second;
+            long age              = 0;
+
+            if (kvi.first != rib->myname) {
+                /* The age is implied by the expiration time. */
+                age = age_max -
+                      std::chrono::duration_cast<std::chrono::seconds>(
+                          flow.expiry - now)
+                          .count();
+            }
 
             ss << "    Local: " << flow.local_node
                << ", Remote: " << flow.remote_node << ", Cost: " << flow.cost
                << ", Seqnum: " << flow.seqnum << ", State: " << flow.state
-               << ", Age: " << flow.age << endl;
+               << ", Age: " << age;
+            if (flow.delay) {
+                ss << ", Delay: " << flow.delay << " us";
+            }
+            if (flow.bandwidth) {
+                ss << ", Bandwidth: " << flow.bandwidth / 1000 << " kbps";
+            }
+            ss << endl;
         }
     }
 
@@ -330,70 +674,74 @@ FullyReplicatedLFDB::dump_routing(std::stringstream &ss) const
     re.dump(ss);
 }
 
-int
-FullyReplicatedLFDB::sync_neigh(NeighFlow *nf, unsigned int limit) const
+/* The originator is used as a key, so that its lower flows are always
+ * synchronized together. The age is not part of the digest, as it is
+ * different on each replica. */
+string
+FullyReplicatedLFDB::digest_content(const LowerFlow &lf)
 {
-    LowerFlowList lfl;
-    int ret = 0;
-
-    if (db.size() > 0) {
-        auto it = db.begin();
-        auto jt = it->second.begin();
-        for (;;) {
-            if (jt == it->second.end()) {
-                if (++it != db.end()) {
-                    jt = it->second.begin();
-                }
-            }
+    stringstream ss;
 
-            if (lfl.flows.size() >= limit || it == db.end()) {
-                ret |= nf->neigh->neigh_sync_obj(nf, true, obj_class::lfdb,
-                                                 obj_name::lfdb, &lfl);
-                lfl.flows.clear();
-                if (it == db.end()) {
-                    break;
-                }
-            }
+    ss << lf.remote_node << " " << lf.cost << " " << lf.seqnum << " "
+       << lf.state << " " << lf.delay << " " << lf.bandwidth;
 
-            lfl.flows.push_back(jt->second);
-            jt++;
-        }
-    }
+    return ss.str();
+}
 
-    return ret;
+void
+FullyReplicatedLFDB::digest(DigestTree &dt) const
+{
+    dt = dtree;
 }
 
 int
-FullyReplicatedLFDB::neighs_refresh(size_t limit)
+FullyReplicatedLFDB::sync_neigh(NeighFlow *nf, unsigned int limit,
+                                const DigestTree::BucketMask *buckets) const
 {
-    unordered_map<NodeId, LowerFlow>::iterator jt;
+    auto now = std::chrono::steady_clock::now();
+    LowerFlowList lfl;
     int ret = 0;
 
-    if (db.size() == 0) {
-        /* Still not enrolled to anyone, nothing to do. */
-        return 0;
-    }
-
-    /* Fetch the map containing all the LFDB entries with the local
-     * address corresponding to me. */
-    auto it = db.find(rib->myname);
-    assert(it != db.end());
+    /* The lower flows of an originator are never split across different
+     * messages, as the receiver replaces them all together. */
+    for (const auto &kvi : db) {
+        if (buckets && !(*buckets)[DigestTree::bucket(kvi.first)]) {
+            continue;
+        }
 
-    for (auto jt = it->second.begin(); jt != it->second.end();) {
-        LowerFlowList lfl;
+        if (!lfl.flows.empty() &&
+            lfl.flows.size() + kvi.second.size() > limit) {
+            ret |= nf->neigh->neigh_sync_obj(nf, true, obj_class::lfdb,
+                                             obj_name::lfdb, &lfl);
+            lfl.flows.clear();
+        }
 
-        while (lfl.flows.size() < limit && jt != it->second.end()) {
-            jt->second.seqnum++;
-            lfl.flows.push_back(jt->second);
-            jt++;
+        for (const auto &kvj : kvi.second) {
+            if (kvj.second.expiry <= now) {
+                /* Expired, about to be discarded by age_incr(). */
+                continue;
+            }
+            lfl.flows.push_back(kvj.second);
         }
-        ret |= rib->neighs_sync_obj_all(true, obj_class::lfdb, obj_name::lfdb,
-                                        &lfl);
+    }
+
+    if (!lfl.flows.empty()) {
+        ret |= nf->neigh->neigh_sync_obj(nf, true, obj_class::lfdb,
+                                         obj_name::lfdb, &lfl);
     }
 
     return ret;
 }
 
+/* Nothing to do on the periodic RIB refresh, since the digests exchange
+ * already takes care of the differences. The local lower flows are
+ * reoriginated by age_incr(), when needed. */
+int
+FullyReplicatedLFDB::neighs_refresh(size_t limit)
+{
+    return 0;
+}
+
 void
 uipcp_rib::age_incr_tmr_restart()
 {
@@ -411,40 +759,43 @@ void
 FullyReplicatedLFDB::age_incr()
 {
     std::lock_guard<std::mutex> guard(rib->mutex);
+    auto now       = std::chrono::steady_clock::now();
     bool discarded = false;
 
-    for (auto &kvi : db) {
-        list<unordered_map<NodeId, LowerFlow>::iterator> discard_list;
+    /* Local entries are never pushed to the heap, as we pretend they are
+     * always refreshed. */
+    while (!expiry_heap.empty() && expiry_heap.top().first <= now) {
+        ExpiryItem item = expiry_heap.top();
+
+        expiry_heap.pop();
 
-        if (kvi.first == rib->myname) {
-            /* Don't age local entries, we pretend they
-             * are always refreshed. */
+        auto it = db.find(item.second.first);
+        if (it == db.end()) {
             continue;
         }
-
-        unsigned int age_inc_intval =
-            rib->get_param_value<int>("routing", "age-incr-intval");
-        unsigned int age_max = rib->get_param_value<int>("routing", "age-max");
-        for (auto jt = kvi.second.begin(); jt != kvi.second.end(); jt++) {
-            jt->second.age += age_inc_intval;
-
-            if (jt->second.age > age_max) {
-                /* Insert this into the list of entries to be discarded. */
-                discard_list.push_back(jt);
-                discarded = true;
-            }
+        auto jt = it->second.find(item.second.second);
+        if (jt == it->second.end() || jt->second.expiry != item.first) {
+            /* Stale item. */
+            continue;
         }
 
-        for (const auto &dit : discard_list) {
-            UPI(rib->uipcp, "Discarded lower-flow %s\n",
-                static_cast<string>(dit->second).c_str());
-            kvi.second.erase(dit);
-        }
+        UPI(rib->uipcp, "Discarded lower-flow %s\n",
+            static_cast<string>(jt->second).c_str());
+        re.lower_flow_del(it->first, jt->first);
+        dtree.del(it->first, digest_content(jt->second));
+        it->second.erase(jt);
+        orig_forget(it);
+        discarded = true;
     }
 
     if (discarded) {
         /* Update the routing table. */
-        re.update_kernel_routing(rib->myname);
+        routing_schedule();
+    }
+
+    if (now - last_originated >= std::chrono::seconds(age_max / 2)) {
+        /* Refresh the remote copies of the local lower flows. */
+        originate();
     }
 
     /* Reschedule */
@@ -452,164 +803,229 @@ FullyReplicatedLFDB::age_incr()
 }
 
 void
-RoutingEngine::compute_shortest_paths(
-    const NodeId &source_addr,
-    const std::unordered_map<NodeId, std::list<Edge>> &graph,
-    std::unordered_map<NodeId, Info> &info)
+FullyReplicatedLFDB::params_load()
 {
-    /* Initialize the per-node info map. */
-    for (const auto &kvg : graph) {
-        struct Info inf;
+    age_max       = rib->get_param_value<int>("routing", "age-max");
+    spf_hold_time = rib->get_param_value<int>("routing", "spf-hold-time");
+    spf_initial_wait =
+        rib->get_param_value<int>("routing", "spf-initial-wait");
+    spf_max_hold_time =
+        rib->get_param_value<int>("routing", "spf-max-hold-time");
+    qos_routing   = rib->get_param_value<bool>("routing", "qos-routing");
+    link_capacity = rib->get_param_value<int>("routing", "link-capacity");
+    qos_min_bandwidth =
+        rib->get_param_value<int>("routing", "qos-min-bandwidth");
+    re.qos_params_set(qos_routing, qos_min_bandwidth, link_capacity);
+}
 
-        inf.dist    = UINT_MAX;
-        inf.visited = false;
+int
+FullyReplicatedLFDB::param_changed(const std::string &param_name)
+{
+    int old_age_max = age_max;
 
-        info[kvg.first] = inf;
+    params_load();
+
+    if (param_name == "qos-routing" || param_name == "link-capacity" ||
+        param_name == "qos-min-bandwidth") {
+        /* The QoS-specific forwarding tables must be recomputed. */
+        routing_schedule();
     }
-    info[source_addr].dist = 0;
 
-    for (;;) {
-        NodeId min_addr;
-        unsigned int min_dist = UINT_MAX;
+    if (age_max != old_age_max) {
+        /* Move all the expiration times, rebuilding the heap. */
+        decltype(expiry_heap) heap;
+        auto delta = std::chrono::seconds(age_max - old_age_max);
 
-        /* Select the closest node from the ones in the frontier. */
-        for (auto &kvi : info) {
-            if (!kvi.second.visited && kvi.second.dist < min_dist) {
-                min_addr = kvi.first;
-                min_dist = kvi.second.dist;
+        for (auto &kvi : db) {
+            if (kvi.first == rib->myname) {
+                continue;
+            }
+            for (auto &kvj : kvi.second) {
+                kvj.second.expiry += delta;
+                heap.emplace(kvj.second.expiry,
+                             make_pair(kvi.first, kvj.first));
             }
         }
+        expiry_heap.swap(heap);
+    }
 
-        if (min_dist == UINT_MAX) {
-            break;
-        }
-
-        assert(min_addr.size() > 0);
+    return 0;
+}
 
-        PV_S("Selecting node %s\n", min_addr.c_str());
+void
+RoutingEngine::lower_flow_set(const LowerFlow &lf)
+{
+    SPFGraph::NodeIdx from = graph.intern(lf.local_node);
+    SPFGraph::NodeIdx to   = graph.intern(lf.remote_node);
+    unsigned int old_cost  = graph.set_edge(from, to, lf.cost);
 
-        if (!graph.count(min_addr)) {
-            continue; /* nothing to do */
-        }
+    if (old_cost != lf.cost) {
+        pending.push_back({from, to, old_cost, lf.cost});
+    }
 
-        const list<Edge> &edges = graph.at(min_addr);
-        Info &info_min          = info[min_addr];
+    if (!qos_enabled || qos_rebuild) {
+        return;
+    }
+    for (QosPlane &p : planes) {
+        qos_edge_set(p, p.graph.intern(lf.local_node),
+                     p.graph.intern(lf.remote_node), qos_weight(p, lf));
+    }
+}
 
-        info_min.visited = true;
+void
+RoutingEngine::lower_flow_del(const NodeId &local_node,
+                              const NodeId &remote_node)
+{
+    SPFGraph::NodeIdx from = graph.index(local_node);
+    SPFGraph::NodeIdx to   = graph.index(remote_node);
+    unsigned int old_cost;
 
-        for (const Edge &edge : edges) {
-            Info &info_to = info[edge.to];
+    if (from == SPFGraph::kNone || to == SPFGraph::kNone) {
+        return;
+    }
 
-            if (info_to.dist > info_min.dist + edge.cost) {
-                info_to.dist = info_min.dist + edge.cost;
-                info_to.nhop =
-                    (min_addr == source_addr) ? edge.to : info_min.nhop;
-            }
-        }
+    old_cost = graph.del_edge(from, to);
+    if (old_cost != SPFGraph::kInf) {
+        pending.push_back({from, to, old_cost, SPFGraph::kInf});
     }
 
-    PV_S("Dijkstra result:\n");
-    for (const auto &kvi : info) {
-        PV_S("    Node: %s, Dist: %u, Visited %u\n", kvi.first.c_str(),
-             kvi.second.dist, (kvi.second.visited));
+    if (!qos_enabled || qos_rebuild) {
+        return;
+    }
+    for (QosPlane &p : planes) {
+        from = p.graph.index(local_node);
+        to   = p.graph.index(remote_node);
+        if (from != SPFGraph::kNone && to != SPFGraph::kNone) {
+            qos_edge_set(p, from, to, SPFGraph::kInf);
+        }
     }
 }
 
-int
-RoutingEngine::compute_next_hops(const NodeId &local_node)
+/* Fill in the next_hops entry for node 'v', using the current shortest
+ * path trees. */
+void
+RoutingEngine::compute_node_next_hops(SPFGraph::NodeIdx v)
 {
-    std::unordered_map<NodeId, std::unordered_map<NodeId, Info>> neigh_infos;
-    std::unordered_map<NodeId, std::list<Edge>> graph;
-    std::unordered_map<NodeId, Info> info;
+    SPFGraph::NodeIdx src = tree.source;
+    std::list<NodeId> *lfas;
 
-    /* Clean up state left from the previous run. */
-    next_hops.clear();
+    if (v == src || tree.dist[v] == SPFGraph::kInf) {
+        /* I don't need a next hop for myself. */
+        return;
+    }
 
-    FullyReplicatedLFDB *lfdb =
-        dynamic_cast<FullyReplicatedLFDB *>(rib->lfdb.get());
+    lfas = &next_hops[graph.name(v)];
+    lfas->push_back(graph.name(tree.nhop[v]));
 
-    /* Build the graph from the Lower Flow Database. */
-    graph[local_node] = list<Edge>();
-    for (const auto &kvi : lfdb->db) {
-        for (const auto &kvj : kvi.second) {
-            const LowerFlow *revlf;
+    if (!lfa_enabled) {
+        return;
+    }
 
-            revlf =
-                rib->lfdb->find(kvj.second.local_node, kvj.second.remote_node);
+    /* For each neighbor U of the local node, excluding V ... */
+    for (size_t i = 0; i < neighs.size(); i++) {
+        const std::vector<unsigned int> &udist = neigh_trees[i].dist;
+        SPFGraph::NodeIdx u                    = neighs[i];
 
-            if (revlf == nullptr || revlf->cost != kvj.second.cost) {
-                /* Something is wrong, this could be malicious or erroneous. */
-                continue;
-            }
+        if (u == v || u == tree.nhop[v] || udist[v] == SPFGraph::kInf) {
+            continue;
+        }
 
-            graph[kvj.second.local_node].emplace_back(kvj.second.remote_node,
-                                                      kvj.second.cost);
-            if (!graph.count(kvj.second.remote_node)) {
-                /* Make sure graph contains all the nodes, even if with
-                 * empty lists. */
-                graph[kvj.second.remote_node] = list<Edge>();
-            }
+        /* dist(U, V) < dist(U, local) + dist(local, V) */
+        if ((unsigned long)udist[v] <
+            (unsigned long)udist[src] + tree.dist[v]) {
+            lfas->push_back(graph.name(u));
         }
     }
+}
+
+int
+RoutingEngine::compute_next_hops(const NodeId &local_node)
+{
+    SPFGraph::NodeIdx src = graph.intern(local_node);
+    std::vector<SPFGraph::NodeIdx> dirty;
+    bool all = false;
 
-    PV_S("Graph [%lu nodes]:\n", lfdb->db.size());
-    for (const auto &kvg : graph) {
-        PV_S("%s: {", kvg.first.c_str());
-        for (const Edge &edge : kvg.second) {
-            PV_S("(%s, %u), ", edge.to.c_str(), edge.cost);
+    if (rl_verbosity >= RL_VERB_VERY) {
+        PV_S("Graph [%lu nodes, %lu edges]:\n",
+             (long unsigned)graph.num_nodes(),
+             (long unsigned)graph.num_edges());
+        for (SPFGraph::NodeIdx i = 0; i < graph.num_nodes(); i++) {
+            PV_S("%s: {", graph.name(i).c_str());
+            for (size_t e = graph.edges_begin(i); e < graph.edges_end(i); e++) {
+                PV_S("(%s, %u), ", graph.name(graph.edge_to(e)).c_str(),
+                     graph.edge_cost(e));
+            }
+            PV_S("}\n");
         }
-        PV_S("}\n");
     }
 
-    /* Compute shortest paths rooted at the local node, and use the
-     * result to fill in the next_hops routing table. */
-    compute_shortest_paths(local_node, graph, info);
-    for (const auto &kvi : info) {
-        if (kvi.first == local_node || !kvi.second.visited) {
-            /* I don't need a next hop for myself. */
-            continue;
-        }
-        next_hops[kvi.first].push_back(kvi.second.nhop);
+    /* Compute the shortest paths rooted at the local node. After the
+     * first run, only the nodes affected by the pending changes are
+     * visited, and collected into the dirty list. */
+    if (tree.source != src) {
+        graph.shortest_paths(src, tree);
+        all = true;
+    } else {
+        graph.update_shortest_paths(tree, pending, dirty);
     }
 
     if (lfa_enabled) {
-        /* Compute the shortest paths rooted at each neighbor of the local
-         * node, storing the results into neigh_infos. */
-        for (const Edge &edge : graph[local_node]) {
-            compute_shortest_paths(edge.to, graph, neigh_infos[edge.to]);
+        std::vector<SPFGraph::NodeIdx> cur_neighs;
+
+        for (size_t e = graph.edges_begin(src); e < graph.edges_end(src);
+             e++) {
+            SPFGraph::NodeIdx u = graph.edge_to(e);
+
+            if (u != src && std::find(cur_neighs.begin(), cur_neighs.end(),
+                                      u) == cur_neighs.end()) {
+                cur_neighs.push_back(u);
+            }
         }
 
-        /* For each node V other than the local node ... */
-        for (const auto &kvv : graph) {
-            if (kvv.first == local_node) {
-                continue;
+        if (all || !lfa_computed || cur_neighs != neighs) {
+            /* Neighborhood changed, start over with the shortest paths
+             * rooted at each neighbor of the local node. */
+            neighs = std::move(cur_neighs);
+            neigh_trees.assign(neighs.size(), SPFGraph::Tree());
+            for (size_t i = 0; i < neighs.size(); i++) {
+                graph.shortest_paths(neighs[i], neigh_trees[i]);
             }
+            lfa_computed = true;
+            all          = true;
+        } else {
+            for (SPFGraph::Tree &ut : neigh_trees) {
+                unsigned int old_dist = ut.dist[src];
 
-            /* For each neighbor U of the local node, excluding U ... */
-            for (const auto &kvu : neigh_infos) {
-                if (kvu.first == kvv.first) {
-                    continue;
-                }
-
-                /* dist(U, V) < dist(U, local) + dist(local, V) */
-                if (neigh_infos[kvu.first][kvv.first].dist <
-                    neigh_infos[kvu.first][local_node].dist +
-                        info[kvv.first].dist) {
-                    bool dupl = false;
-
-                    for (const NodeId &lfa : next_hops[kvv.first]) {
-                        if (lfa == kvu.first) {
-                            dupl = true;
-                            break;
-                        }
-                    }
-
-                    if (!dupl) {
-                        next_hops[kvv.first].push_back(kvu.first);
-                    }
+                graph.update_shortest_paths(ut, pending, dirty);
+                if (ut.dist[src] != old_dist) {
+                    /* The LFA condition changes for any destination. */
+                    all = true;
                 }
             }
         }
+    } else if (lfa_computed) {
+        neighs.clear();
+        neigh_trees.clear();
+        lfa_computed = false;
+        all          = true;
+    }
+    pending.clear();
+
+    /* Refresh the next_hops routing table, only for the dirty nodes if
+     * possible. The default entry is added back by compute_fwd_table(). */
+    if (all) {
+        next_hops.clear();
+        for (SPFGraph::NodeIdx v = 0; v < graph.num_nodes(); v++) {
+            compute_node_next_hops(v);
+        }
+    } else {
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        next_hops.erase(string());
+        for (SPFGraph::NodeIdx v : dirty) {
+            next_hops.erase(graph.name(v));
+            compute_node_next_hops(v);
+        }
     }
 
     if (rl_verbosity >= RL_VERB_VERY) {
@@ -639,12 +1055,154 @@ RoutingEngine::flow_state_update(struct rl_kmsg_flow_state *upd)
     compute_fwd_table();
 }
 
+constexpr unsigned int RoutingEngine::kDelayUnknown;
+constexpr uint64_t RoutingEngine::kRefBandwidth;
+constexpr unsigned int RoutingEngine::kMaxWeight;
+
+void
+RoutingEngine::qos_params_set(bool enabled, int min_bw, int link_capacity)
+{
+    uint64_t min_bps  = static_cast<uint64_t>(min_bw) * 1000000;
+    uint64_t dflt_bps = static_cast<uint64_t>(link_capacity) * 1000000;
+
+    if (enabled != qos_enabled || min_bps != qos_min_bw ||
+        dflt_bps != qos_dflt_bw) {
+        qos_enabled = enabled;
+        qos_min_bw  = min_bps;
+        qos_dflt_bw = dflt_bps;
+        qos_rebuild = true;
+    }
+}
+
+/* Weight of a lower flow in the graph of plane 'p', or kInf if the lower
+ * flow does not satisfy the constraints of the plane. */
+unsigned int
+RoutingEngine::qos_weight(const QosPlane &p, const LowerFlow &lf) const
+{
+    uint64_t weight;
+
+    if (p.qos_id == uipcp_rib::kQosIdLowDelay) {
+        weight = lf.delay ? lf.delay : kDelayUnknown;
+    } else {
+        uint64_t bw = lf.bandwidth ? lf.bandwidth : qos_dflt_bw;
+
+        if (bw < qos_min_bw) {
+            return SPFGraph::kInf; /* constraint not satisfied */
+        }
+        weight = std::max<uint64_t>(kRefBandwidth / bw, 1);
+    }
+
+    return std::min<uint64_t>(weight, kMaxWeight);
+}
+
+void
+RoutingEngine::qos_edge_set(QosPlane &p, SPFGraph::NodeIdx from,
+                            SPFGraph::NodeIdx to, unsigned int weight)
+{
+    unsigned int old_weight;
+
+    if (weight == SPFGraph::kInf) {
+        old_weight = p.graph.del_edge(from, to);
+    } else {
+        old_weight = p.graph.set_edge(from, to, weight);
+    }
+    if (old_weight != weight) {
+        p.pending.push_back({from, to, old_weight, weight});
+    }
+}
+
+void
+RoutingEngine::compute_qos_next_hops(const NodeId &local_node,
+                                     const LowerFlowDB &db)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    for (QosPlane &p : planes) {
+        std::vector<SPFGraph::NodeIdx> dirty;
+        SPFGraph::NodeIdx src;
+        bool all = false;
+
+        if (!qos_enabled) {
+            p.next_hops.clear();
+            continue;
+        }
+
+        if (qos_rebuild) {
+            /* Start over from the Lower Flow Database. */
+            p.graph.clear_edges();
+            for (const auto &kvi : db) {
+                SPFGraph::NodeIdx from = p.graph.intern(kvi.first);
+
+                for (const auto &kvj : kvi.second) {
+                    const LowerFlow &lf = kvj.second;
+                    unsigned int weight;
+
+                    if (lf.expiry <= now) {
+                        continue;
+                    }
+                    weight = qos_weight(p, lf);
+                    if (weight != SPFGraph::kInf) {
+                        p.graph.add_edge(from, p.graph.intern(kvj.first),
+                                         weight);
+                    }
+                }
+            }
+            p.graph.build();
+            p.tree = SPFGraph::Tree();
+        }
+
+        src = p.graph.intern(local_node);
+        if (p.tree.source != src) {
+            p.graph.shortest_paths(src, p.tree);
+            all = true;
+        } else {
+            p.graph.update_shortest_paths(p.tree, p.pending, dirty);
+        }
+        p.pending.clear();
+
+        if (all) {
+            p.next_hops.clear();
+            for (SPFGraph::NodeIdx v = 0; v < p.graph.num_nodes(); v++) {
+                dirty.push_back(v);
+            }
+        }
+        for (SPFGraph::NodeIdx v : dirty) {
+            p.next_hops.erase(p.graph.name(v));
+            if (v != src && p.tree.nhop[v] != SPFGraph::kNone) {
+                p.next_hops[p.graph.name(v)] = p.graph.name(p.tree.nhop[v]);
+            }
+        }
+    }
+
+    if (qos_enabled) {
+        qos_rebuild = false;
+    }
+}
+
+static void
+pduft_batch_add(vector<struct rl_pduft_batch_entry> &batch,
+                rlm_addr_t dst_addr, rl_port_t local_port, uint8_t op,
+                uint8_t flags, rl_qosid_t qos_id = 0)
+{
+    struct rl_pduft_batch_entry e;
+
+    e.dst_addr   = dst_addr;
+    e.local_port = local_port;
+    e.op         = op;
+    e.flags      = flags;
+    e.qos_id     = qos_id;
+    batch.push_back(e);
+}
+
 int
 RoutingEngine::compute_fwd_table()
 {
     unordered_map<rlm_addr_t, pair<NodeId, rl_port_t>> next_ports_new_,
         next_ports_new;
+    unordered_map<rlm_addr_t, rl_port_t> backup_ports_new;
+    vector<struct rl_pduft_batch_entry> batch;
     struct uipcp *uipcp = rib->uipcp;
+    vector<rlm_addr_t> added;
     unordered_map<rl_port_t, int> port_hits;
     rl_port_t dflt_port;
     int dflt_hits = 0;
@@ -652,6 +1210,8 @@ RoutingEngine::compute_fwd_table()
     /* Compute the forwarding table by translating the next-hop address
      * into a port-id towards the next-hop. */
     for (const auto &kvr : next_hops) {
+        bool found = false;
+
         for (const NodeId &lfa : kvr.second) {
             auto neigh = rib->neighbors.find(lfa);
             rlm_addr_t dst_addr;
@@ -685,15 +1245,28 @@ RoutingEngine::compute_fwd_table()
                 continue;
             }
 
+            if (found) {
+                /* A loop-free alternate through a different port can be
+                 * used as a backup. */
+                if (port_id != next_ports_new_[dst_addr].second) {
+                    backup_ports_new[dst_addr] = port_id;
+                    break;
+                }
+                continue;
+            }
+
             /* We have found a suitable port for the destination, we can
-             * stop searching. */
+             * stop searching, unless we are looking for a backup. */
             next_ports_new_[dst_addr] = make_pair(kvr.first, port_id);
             if (++port_hits[port_id] > dflt_hits) {
                 dflt_hits = port_hits[port_id];
                 dflt_port = port_id;
                 dflt_nhop = lfa;
             }
-            break;
+            found = true;
+            if (!lfa_enabled) {
+                break;
+            }
         }
     }
 
@@ -702,9 +1275,11 @@ RoutingEngine::compute_fwd_table()
         string any = "";
 
         /* Prune out those entries corresponding to the default port, and
-         * replace them with the default entry. */
+         * replace them with the default entry. Entries with a backup port
+         * are kept, since the default entry has no backup. */
         for (const auto &kve : next_ports_new_) {
-            if (kve.second.second != dflt_port) {
+            if (kve.second.second != dflt_port ||
+                backup_ports_new.count(kve.first)) {
                 next_ports_new[kve.first] = kve.second;
             }
         }
@@ -715,13 +1290,29 @@ RoutingEngine::compute_fwd_table()
     next_ports_new = next_ports_new_;
 #endif
 
+    /* Remove stale backup ports, while their entries still exist. A backup
+     * goes away with its entry when the primary port changes. */
+    for (auto it = backup_ports.begin(); it != backup_ports.end();) {
+        auto nb = backup_ports_new.find(it->first);
+        auto np = next_ports_new.find(it->first);
+        auto op = next_ports.find(it->first);
+
+        if (nb != backup_ports_new.end() && nb->second == it->second &&
+            np != next_ports_new.end() && op != next_ports.end() &&
+            np->second.second == op->second.second) {
+            ++it;
+            continue;
+        }
+
+        pduft_batch_add(batch, it->first, it->second, RL_PDUFT_OP_DEL,
+                        RL_PDUFT_F_BACKUP);
+        UPD(uipcp, "Delete PDUFT backup %lu --> %u\n",
+            (long unsigned)it->first, it->second);
+        it = backup_ports.erase(it);
+    }
+
     /* Remove old PDUFT entries first. */
     for (const auto &kve : next_ports) {
-        rlm_addr_t dst_addr;
-        rl_port_t port_id;
-        NodeId dst_node;
-        int ret;
-
         auto nf = next_ports_new.find(kve.first);
         if (nf != next_ports_new.end() &&
             kve.second.second == nf->second.second) {
@@ -730,30 +1321,15 @@ RoutingEngine::compute_fwd_table()
         }
 
         /* Delete the old one. */
-        dst_addr = kve.first;
-        dst_node = kve.second.first;
-        port_id  = kve.second.second;
-        ret      = uipcp_pduft_del(uipcp, dst_addr, port_id);
-        if (ret) {
-            UPE(uipcp,
-                "Failed to delete PDUFT entry for %s(%lu) "
-                "(port=%u) [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                port_id, strerror(errno));
-        } else {
-            UPD(uipcp, "Delete PDUFT entry for %s(%lu) (port=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                port_id);
-        }
+        pduft_batch_add(batch, kve.first, kve.second.second, RL_PDUFT_OP_DEL,
+                        0);
+        UPD(uipcp, "Delete PDUFT entry for %s(%lu) (port=%u)\n",
+            node_id_pretty(kve.second.first).c_str(),
+            (long unsigned)kve.first, kve.second.second);
     }
 
     /* Generate new PDUFT entries. */
-    for (auto &kve : next_ports_new) {
-        rlm_addr_t dst_addr;
-        rl_port_t port_id;
-        NodeId dst_node;
-        int ret;
-
+    for (const auto &kve : next_ports_new) {
         auto of = next_ports.find(kve.first);
         if (of != next_ports.end() && of->second.second == kve.second.second) {
             /* This entry is already in place. */
@@ -761,32 +1337,116 @@ RoutingEngine::compute_fwd_table()
         }
 
         /* Add the new one. */
-        dst_addr = kve.first;
-        dst_node = kve.second.first;
-        port_id  = kve.second.second;
-        ret      = uipcp_pduft_set(uipcp, dst_addr, port_id);
-        if (ret) {
-            UPE(uipcp,
-                "Failed to insert %s(%lu) --> %s (port=%u) PDUFT "
-                "entry [%s]\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                next_hops[dst_node].front().c_str(), port_id, strerror(errno));
-            /* Trigger re insertion next time. */
-            kve.second = make_pair(NodeId(), 0);
-        } else {
-            UPD(uipcp, "Set PDUFT entry %s(%lu) --> %s (port=%u)\n",
-                node_id_pretty(dst_node).c_str(), (long unsigned)dst_addr,
-                next_hops[dst_node].front().c_str(), port_id);
+        pduft_batch_add(batch, kve.first, kve.second.second, RL_PDUFT_OP_SET,
+                        0);
+        added.push_back(kve.first);
+        UPD(uipcp, "Set PDUFT entry %s(%lu) --> %s (port=%u)\n",
+            node_id_pretty(kve.second.first).c_str(),
+            (long unsigned)kve.first,
+            next_hops[kve.second.first].front().c_str(), kve.second.second);
+    }
+
+    /* Install the new backup ports. */
+    for (const auto &kvb : backup_ports_new) {
+        if (backup_ports.count(kvb.first)) {
+            /* Already in place. */
+            continue;
         }
+
+        pduft_batch_add(batch, kvb.first, kvb.second, RL_PDUFT_OP_SET,
+                        RL_PDUFT_F_BACKUP);
+        UPD(uipcp, "Set PDUFT backup %lu --> %u\n", (long unsigned)kvb.first,
+            kvb.second);
+    }
+
+    /* QoS-specific entries, for the destinations whose next hop port
+     * differs from the default one. */
+    vector<pair<QosPlane *, rlm_addr_t>> qos_added;
+    for (QosPlane &p : planes) {
+        unordered_map<rlm_addr_t, rl_port_t> ports_new;
+
+        for (const auto &kvh : p.next_hops) {
+            auto neigh = rib->neighbors.find(kvh.second);
+            rlm_addr_t dst_addr;
+            rl_port_t port_id;
+
+            if (neigh == rib->neighbors.end() ||
+                !neigh->second->has_flows()) {
+                continue;
+            }
+            port_id = neigh->second->flows.begin()->second->port_id;
+            if (ports_down.count(port_id)) {
+                continue;
+            }
+            dst_addr = rib->lookup_node_address(kvh.first);
+            if (dst_addr == RL_ADDR_NULL) {
+                continue;
+            }
+
+            auto dp = next_ports_new_.find(dst_addr);
+            if (dp == next_ports_new_.end() || dp->second.second != port_id) {
+                ports_new[dst_addr] = port_id;
+            }
+        }
+
+        for (const auto &kvp : p.ports) {
+            auto np = ports_new.find(kvp.first);
+
+            if (np == ports_new.end() || np->second != kvp.second) {
+                pduft_batch_add(batch, kvp.first, kvp.second, RL_PDUFT_OP_DEL,
+                                0, p.qos_id);
+                UPD(uipcp, "Delete PDUFT entry %lu (qos=%u, port=%u)\n",
+                    (long unsigned)kvp.first, p.qos_id, kvp.second);
+            }
+        }
+
+        for (const auto &kvp : ports_new) {
+            auto op = p.ports.find(kvp.first);
+
+            if (op == p.ports.end() || op->second != kvp.second) {
+                pduft_batch_add(batch, kvp.first, kvp.second, RL_PDUFT_OP_SET,
+                                0, p.qos_id);
+                qos_added.push_back(make_pair(&p, kvp.first));
+                UPD(uipcp, "Set PDUFT entry %lu (qos=%u) --> port %u\n",
+                    (long unsigned)kvp.first, p.qos_id, kvp.second);
+            }
+        }
+
+        p.ports = std::move(ports_new);
     }
 
     next_ports = next_ports_new;
 
+    if (batch.empty()) {
+        return 0;
+    }
+
+    /* Push all the modifications to the kernel at once. */
+    if (uipcp_pduft_batch(uipcp, batch.data(), batch.size())) {
+        UPE(uipcp, "Failed to apply %lu PDUFT modifications [%s]\n",
+            (long unsigned)batch.size(), strerror(errno));
+        /* We don't know which modifications failed: trigger re-insertion
+         * of the new entries and backups next time. */
+        for (rlm_addr_t dst_addr : added) {
+            next_ports.erase(dst_addr);
+        }
+        for (const auto &qa : qos_added) {
+            qa.first->ports.erase(qa.second);
+        }
+        return -1;
+    }
+
+    UPV(uipcp, "Applied %lu PDUFT modifications\n",
+        (long unsigned)batch.size());
+    for (const auto &kvb : backup_ports_new) {
+        backup_ports[kvb.first] = kvb.second;
+    }
+
     return 0;
 }
 
 void
-RoutingEngine::update_kernel_routing(const NodeId &addr)
+RoutingEngine::update_kernel_routing(const NodeId &addr, const LowerFlowDB &db)
 {
     assert(rib != nullptr);
 
@@ -795,6 +1455,7 @@ RoutingEngine::update_kernel_routing(const NodeId &addr)
     /* Step 1: Run a shortest path algorithm. This phase produces the
      * 'next_hops' routing table. */
     compute_next_hops(addr);
+    compute_qos_next_hops(addr, db);
 
     /* Step 2: Using the 'next_hops' routing table, compute forwarding table
      * (in userspace) and update the corresponding kernel data structure. */
@@ -820,6 +1481,21 @@ RoutingEngine::dump(std::stringstream &ss) const
         }
         ss << endl;
     }
+
+    for (const QosPlane &p : planes) {
+        for (const auto &kvh : p.next_hops) {
+            auto nh = next_hops.find(kvh.first);
+
+            if (nh != next_hops.end() && !nh->second.empty() &&
+                nh->second.front() == kvh.second) {
+                /* Hide this entry, as it is the same as the default. */
+                continue;
+            }
+            ss << "    Remote: " << node_id_pretty(kvh.first)
+               << ", QoS: " << p.qos_id << ", Next hop: " << kvh.second
+               << endl;
+        }
+    }
 }
 
 void
@@ -0,0 +1,375 @@
+/*
+ * Benchmark for the shortest path computation of normal uipcps.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "uipcp-normal-spf.hpp"
+
+using namespace std;
+
+struct Link {
+    unsigned int a;
+    unsigned int b;
+    unsigned int cost;
+};
+
+/* Ring with random chords, so that the graph is always connected. */
+static vector<Link>
+topo_random(unsigned int n, unsigned int degree, unsigned int maxcost,
+            mt19937 &rng)
+{
+    uniform_int_distribution<unsigned int> node(0, n - 1);
+    uniform_int_distribution<unsigned int> cost(1, maxcost);
+    vector<Link> links;
+
+    for (unsigned int i = 0; i < n; i++) {
+        links.push_back({i, (i + 1) % n, cost(rng)});
+    }
+    for (unsigned long i = n; i < (unsigned long)n * degree / 2; i++) {
+        unsigned int a = node(rng), b = node(rng);
+
+        if (a != b) {
+            links.push_back({a, b, cost(rng)});
+        }
+    }
+
+    return links;
+}
+
+/* Square grid, as close as possible to 'n' nodes. */
+static vector<Link>
+topo_grid(unsigned int n, unsigned int maxcost, mt19937 &rng)
+{
+    uniform_int_distribution<unsigned int> cost(1, maxcost);
+    unsigned int side = 1;
+    vector<Link> links;
+
+    while ((side + 1) * (side + 1) <= n) {
+        side++;
+    }
+    for (unsigned int r = 0; r < side; r++) {
+        for (unsigned int c = 0; c < side; c++) {
+            unsigned int i = r * side + c;
+
+            if (c + 1 < side) {
+                links.push_back({i, i + 1, cost(rng)});
+            }
+            if (r + 1 < side) {
+                links.push_back({i, i + side, cost(rng)});
+            }
+        }
+    }
+
+    return links;
+}
+
+static NodeId
+node_name(unsigned int i)
+{
+    return "n" + to_string(i) + ".IPCP";
+}
+
+/* The original algorithm, keyed by node names and selecting the next
+ * node with a linear scan. Used as a reference. */
+static void
+legacy_shortest_paths(
+    const NodeId &source,
+    const unordered_map<NodeId, list<pair<NodeId, unsigned int>>> &graph,
+    unordered_map<NodeId, unsigned int> &dist)
+{
+    unordered_map<NodeId, bool> visited;
+
+    for (const auto &kvg : graph) {
+        dist[kvg.first]    = SPFGraph::kInf;
+        visited[kvg.first] = false;
+    }
+    dist[source] = 0;
+
+    for (;;) {
+        unsigned int min_dist = SPFGraph::kInf;
+        NodeId min_node;
+
+        for (const auto &kvd : dist) {
+            if (!visited[kvd.first] && kvd.second < min_dist) {
+                min_node = kvd.first;
+                min_dist = kvd.second;
+            }
+        }
+        if (min_dist == SPFGraph::kInf) {
+            break;
+        }
+        visited[min_node] = true;
+        for (const auto &edge : graph.at(min_node)) {
+            if (dist[edge.first] > min_dist + edge.second) {
+                dist[edge.first] = min_dist + edge.second;
+            }
+        }
+    }
+}
+
+/* Check that parent pointers and next hops of 't' are consistent with
+ * its distances. */
+static bool
+tree_consistent(const SPFGraph &graph, const SPFGraph::Tree &t)
+{
+    for (SPFGraph::NodeIdx v = 0; v < graph.num_nodes(); v++) {
+        SPFGraph::NodeIdx p = t.parent[v];
+        bool found          = false;
+
+        if (v == t.source || t.dist[v] == SPFGraph::kInf) {
+            continue;
+        }
+        if (p == SPFGraph::kNone ||
+            t.nhop[v] != (p == t.source ? v : t.nhop[p])) {
+            return false;
+        }
+        for (size_t e = graph.edges_begin(p); e < graph.edges_end(p); e++) {
+            found = found || (graph.edge_to(e) == v &&
+                              t.dist[p] + graph.edge_cost(e) == t.dist[v]);
+        }
+        if (!found) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static double
+elapsed_ms(chrono::steady_clock::time_point t0)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0)
+        .count();
+}
+
+static void
+usage(void)
+{
+    printf("rlite-spf-bench [OPTIONS]\n"
+           "   -h : show this help\n"
+           "   -n NUM : number of nodes (default 2000)\n"
+           "   -d NUM : average node degree for random topologies "
+           "(default 4)\n"
+           "   -t TOPO : topology, 'random' or 'grid' (default random)\n"
+           "   -c NUM : maximum link cost (default 10)\n"
+           "   -r NUM : number of repetitions (default 10)\n"
+           "   -s NUM : random seed (default 1)\n"
+           "   -l : also compute the shortest paths rooted at each "
+           "neighbor, as LFA does\n"
+           "   -x : also run and check the legacy O(N^2) algorithm\n"
+           "   -i NUM : also apply NUM random link changes, updating the "
+           "shortest paths incrementally\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int n = 2000, degree = 4, maxcost = 10, reps = 10, seed = 1;
+    unsigned int incr = 0;
+    bool lfa = false, legacy = false;
+    const char *topo = "random";
+    double t_build = 0, t_spf = 0;
+    vector<Link> links;
+    SPFGraph graph;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:d:t:c:r:s:lxi:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'd':
+            degree = atoi(optarg);
+            break;
+        case 't':
+            topo = optarg;
+            break;
+        case 'c':
+            maxcost = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        case 'l':
+            lfa = true;
+            break;
+        case 'x':
+            legacy = true;
+            break;
+        case 'i':
+            incr = atoi(optarg);
+            break;
+        default:
+            printf("    Unrecognized option %c\n", opt);
+            usage();
+            return -1;
+        }
+    }
+
+    if (n < 2 || degree < 2 || maxcost < 1 || reps < 1) {
+        printf("Invalid arguments\n");
+        return -1;
+    }
+
+    mt19937 rng(seed);
+    if (!strcmp(topo, "random")) {
+        links = topo_random(n, degree, maxcost, rng);
+    } else if (!strcmp(topo, "grid")) {
+        links = topo_grid(n, maxcost, rng);
+    } else {
+        printf("Unknown topology '%s'\n", topo);
+        return -1;
+    }
+
+    for (unsigned int r = 0; r < reps; r++) {
+        SPFGraph::Tree tree, utree;
+        SPFGraph::NodeIdx src;
+
+        /* Rebuild the graph as the routing engine does on each LFDB
+         * change, going through node names. */
+        auto t0 = chrono::steady_clock::now();
+        graph.clear_edges();
+        for (const Link &l : links) {
+            SPFGraph::NodeIdx a = graph.intern(node_name(l.a));
+            SPFGraph::NodeIdx b = graph.intern(node_name(l.b));
+
+            graph.add_edge(a, b, l.cost);
+            graph.add_edge(b, a, l.cost);
+        }
+        graph.build();
+        t_build += elapsed_ms(t0);
+
+        t0  = chrono::steady_clock::now();
+        src = graph.index(node_name(r % n));
+        graph.shortest_paths(src, tree);
+        if (lfa) {
+            for (size_t e = graph.edges_begin(src); e < graph.edges_end(src);
+                 e++) {
+                graph.shortest_paths(graph.edge_to(e), utree);
+            }
+        }
+        t_spf += elapsed_ms(t0);
+    }
+
+    printf("Topology: %s, %lu nodes, %lu directed edges\n", topo,
+           (long unsigned)graph.num_nodes(), (long unsigned)graph.num_edges());
+    printf("Graph build: %.3f ms per run\n", t_build / reps);
+    printf("Shortest paths%s: %.3f ms per run\n", lfa ? " (with LFA)" : "",
+           t_spf / reps);
+
+    if (legacy) {
+        unordered_map<NodeId, list<pair<NodeId, unsigned int>>> lgraph;
+        unordered_map<NodeId, unsigned int> ldist;
+        SPFGraph::Tree tree;
+
+        for (const Link &l : links) {
+            lgraph[node_name(l.a)].emplace_back(node_name(l.b), l.cost);
+            lgraph[node_name(l.b)].emplace_back(node_name(l.a), l.cost);
+        }
+
+        auto t0 = chrono::steady_clock::now();
+        legacy_shortest_paths(node_name(0), lgraph, ldist);
+        printf("Legacy shortest paths: %.3f ms per run\n", elapsed_ms(t0));
+
+        graph.shortest_paths(graph.index(node_name(0)), tree);
+        for (const auto &kvd : ldist) {
+            if (tree.dist[graph.index(kvd.first)] != kvd.second) {
+                printf("Mismatch on node %s: %u != %u\n", kvd.first.c_str(),
+                       tree.dist[graph.index(kvd.first)], kvd.second);
+                return -1;
+            }
+        }
+        printf("Results match\n");
+    }
+
+    if (incr) {
+        uniform_int_distribution<size_t> link(0, links.size() - 1);
+        uniform_int_distribution<unsigned int> cost(1, maxcost);
+        SPFGraph::NodeIdx src = graph.index(node_name(0));
+        double t_incr = 0, t_full = 0;
+        SPFGraph::Tree tree, check;
+        size_t num_changed = 0;
+
+        graph.shortest_paths(src, tree);
+        for (unsigned int r = 0; r < incr; r++) {
+            vector<SPFGraph::EdgeChange> changes;
+            vector<SPFGraph::NodeIdx> changed;
+            Link &l = links[link(rng)];
+            SPFGraph::NodeIdx a = graph.index(node_name(l.a));
+            SPFGraph::NodeIdx b = graph.index(node_name(l.b));
+            unsigned int new_cost;
+
+            /* Alternatively remove links and give them a new cost. */
+            new_cost = (r % 4 == 0 && l.cost != SPFGraph::kInf)
+                           ? SPFGraph::kInf
+                           : cost(rng);
+            for (int k = 0; k < 2; k++) {
+                unsigned int old_cost;
+
+                if (new_cost == SPFGraph::kInf) {
+                    old_cost = graph.del_edge(a, b);
+                } else {
+                    old_cost = graph.set_edge(a, b, new_cost);
+                }
+                changes.push_back({a, b, old_cost, new_cost});
+                swap(a, b);
+            }
+            l.cost = new_cost;
+
+            auto t0 = chrono::steady_clock::now();
+            graph.update_shortest_paths(tree, changes, changed);
+            t_incr += elapsed_ms(t0);
+            num_changed += changed.size();
+
+            t0 = chrono::steady_clock::now();
+            graph.shortest_paths(src, check);
+            t_full += elapsed_ms(t0);
+
+            if (tree.dist != check.dist || !tree_consistent(graph, tree)) {
+                printf("Incremental update mismatch at change %u\n", r);
+                return -1;
+            }
+        }
+        printf("Incremental update: %.3f ms per change (full %.3f ms), "
+               "%.1f nodes changed on average\n",
+               t_incr / incr, t_full / incr, (double)num_changed / incr);
+        printf("Incremental results match\n");
+    }
+
+    return 0;
+}
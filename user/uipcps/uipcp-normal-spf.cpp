@@ -0,0 +1,382 @@
+/*
+ * Shortest path computation for the link-state routing of normal uipcps.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <cassert>
+#include <functional>
+#include <queue>
+#include <utility>
+
+#include "uipcp-normal-spf.hpp"
+
+using namespace std;
+
+constexpr unsigned int SPFGraph::kInf;
+constexpr SPFGraph::NodeIdx SPFGraph::kNone;
+
+void
+SPFGraph::Adjacency::assign(size_t num_nodes, const vector<StagedEdge> &edges,
+                            bool reverse)
+{
+    /* Counting sort of the edges by source (or destination) node. */
+    offsets.assign(num_nodes + 1, 0);
+    for (const StagedEdge &se : edges) {
+        offsets[(reverse ? se.to : se.from) + 1]++;
+    }
+    for (size_t i = 0; i < num_nodes; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+
+    vector<size_t> next(offsets.begin(), offsets.end() - 1);
+
+    nodes.resize(edges.size());
+    costs.resize(edges.size());
+    for (const StagedEdge &se : edges) {
+        size_t e = next[reverse ? se.to : se.from]++;
+
+        nodes[e] = reverse ? se.from : se.to;
+        costs[e] = se.cost;
+    }
+}
+
+void
+SPFGraph::Adjacency::grow(size_t num_nodes)
+{
+    offsets.resize(num_nodes + 1, offsets.back());
+}
+
+size_t
+SPFGraph::Adjacency::find(NodeIdx i, NodeIdx j) const
+{
+    for (size_t e = offsets[i]; e < offsets[i + 1]; e++) {
+        if (nodes[e] == j) {
+            return e;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+void
+SPFGraph::Adjacency::insert(NodeIdx i, NodeIdx j, unsigned int cost)
+{
+    size_t e = offsets[i + 1];
+
+    nodes.insert(nodes.begin() + e, j);
+    costs.insert(costs.begin() + e, cost);
+    for (size_t k = i + 1; k < offsets.size(); k++) {
+        offsets[k]++;
+    }
+}
+
+void
+SPFGraph::Adjacency::erase(NodeIdx i, size_t e)
+{
+    nodes.erase(nodes.begin() + e);
+    costs.erase(costs.begin() + e);
+    for (size_t k = i + 1; k < offsets.size(); k++) {
+        offsets[k]--;
+    }
+}
+
+SPFGraph::NodeIdx
+SPFGraph::intern(const NodeId &node)
+{
+    auto it = ids.find(node);
+
+    if (it != ids.end()) {
+        return it->second;
+    }
+
+    NodeIdx idx = names.size();
+
+    ids[node] = idx;
+    names.push_back(node);
+    out.grow(names.size());
+    in.grow(names.size());
+
+    return idx;
+}
+
+SPFGraph::NodeIdx
+SPFGraph::index(const NodeId &node) const
+{
+    auto it = ids.find(node);
+
+    return it == ids.end() ? kNone : it->second;
+}
+
+void
+SPFGraph::clear_edges()
+{
+    staged.clear();
+    out.assign(names.size(), staged, false);
+    in.assign(names.size(), staged, true);
+}
+
+void
+SPFGraph::add_edge(NodeIdx from, NodeIdx to, unsigned int cost)
+{
+    assert(from < names.size() && to < names.size());
+    staged.push_back({from, to, cost});
+}
+
+void
+SPFGraph::build()
+{
+    out.assign(names.size(), staged, false);
+    in.assign(names.size(), staged, true);
+    staged.clear();
+}
+
+unsigned int
+SPFGraph::set_edge(NodeIdx from, NodeIdx to, unsigned int cost)
+{
+    size_t e = out.find(from, to);
+    unsigned int old_cost;
+
+    assert(from < names.size() && to < names.size());
+    if (e == SIZE_MAX) {
+        out.insert(from, to, cost);
+        in.insert(to, from, cost);
+        return kInf;
+    }
+
+    old_cost     = out.costs[e];
+    out.costs[e] = cost;
+    e            = in.find(to, from);
+    in.costs[e]  = cost;
+
+    return old_cost;
+}
+
+unsigned int
+SPFGraph::del_edge(NodeIdx from, NodeIdx to)
+{
+    size_t e = out.find(from, to);
+    unsigned int old_cost;
+
+    if (e == SIZE_MAX) {
+        return kInf;
+    }
+
+    old_cost = out.costs[e];
+    out.erase(from, e);
+    in.erase(to, in.find(to, from));
+
+    return old_cost;
+}
+
+/* Min-heap of (distance, node) pairs, with lazy deletion. */
+using SPFHeapItem = pair<unsigned int, SPFGraph::NodeIdx>;
+using SPFHeap =
+    priority_queue<SPFHeapItem, vector<SPFHeapItem>, greater<SPFHeapItem>>;
+
+void
+SPFGraph::shortest_paths(NodeIdx source, Tree &t) const
+{
+    size_t n = names.size();
+    SPFHeap heap;
+
+    t.source = source;
+    t.dist.assign(n, kInf);
+    t.parent.assign(n, kNone);
+    t.nhop.assign(n, kNone);
+    if (source >= n) {
+        return;
+    }
+
+    t.dist[source] = 0;
+    heap.emplace(0, source);
+
+    while (!heap.empty()) {
+        SPFHeapItem top = heap.top();
+        NodeIdx u       = top.second;
+
+        heap.pop();
+        if (top.first != t.dist[u]) {
+            /* Stale heap item, a shorter path was found later. */
+            continue;
+        }
+
+        for (size_t e = out.offsets[u]; e < out.offsets[u + 1]; e++) {
+            NodeIdx v         = out.nodes[e];
+            unsigned long alt = (unsigned long)t.dist[u] + out.costs[e];
+
+            if (alt < t.dist[v]) {
+                t.dist[v]   = alt;
+                t.parent[v] = u;
+                t.nhop[v]   = (u == source) ? v : t.nhop[u];
+                heap.emplace(t.dist[v], v);
+            }
+        }
+    }
+}
+
+void
+SPFGraph::update_shortest_paths(Tree &t, const vector<EdgeChange> &changes,
+                                vector<NodeIdx> &changed) const
+{
+    unordered_map<NodeIdx, pair<unsigned int, NodeIdx>> saved;
+    NodeIdx src = t.source;
+    size_t n    = names.size();
+    vector<NodeIdx> affected;
+    SPFHeap heap;
+
+    /* Nodes interned after the last computation are unreachable so far,
+     * any edge towards them is in the list of changes. */
+    t.dist.resize(n, kInf);
+    t.parent.resize(n, kNone);
+    t.nhop.resize(n, kNone);
+
+    auto save = [&saved, &t](NodeIdx v) {
+        if (!saved.count(v)) {
+            saved[v] = make_pair(t.dist[v], t.nhop[v]);
+        }
+    };
+
+    /* Step 1: the subtrees hanging from tree edges that got more
+     * expensive (or disappeared) must be recomputed. */
+    for (const EdgeChange &ch : changes) {
+        if (ch.new_cost > ch.old_cost && ch.to != src &&
+            t.parent[ch.to] == ch.from) {
+            affected.push_back(ch.to);
+        }
+    }
+
+    if (!affected.empty()) {
+        vector<size_t> coffsets(n + 1, 0);
+        vector<NodeIdx> children;
+        vector<char> mark(n, 0);
+
+        /* Build the children lists of the tree, in CSR form. */
+        for (NodeIdx v = 0; v < n; v++) {
+            if (t.parent[v] != kNone) {
+                coffsets[t.parent[v] + 1]++;
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            coffsets[i + 1] += coffsets[i];
+        }
+        children.resize(coffsets[n]);
+        {
+            vector<size_t> next(coffsets.begin(), coffsets.end() - 1);
+
+            for (NodeIdx v = 0; v < n; v++) {
+                if (t.parent[v] != kNone) {
+                    children[next[t.parent[v]]++] = v;
+                }
+            }
+        }
+
+        /* Collect all the descendants of the subtree roots. */
+        for (size_t k = 0; k < affected.size(); k++) {
+            NodeIdx v = affected[k];
+
+            if (mark[v]) {
+                continue;
+            }
+            mark[v] = 1;
+            for (size_t c = coffsets[v]; c < coffsets[v + 1]; c++) {
+                affected.push_back(children[c]);
+            }
+        }
+
+        for (NodeIdx v : affected) {
+            if (mark[v] != 1) {
+                continue; /* duplicate */
+            }
+            mark[v] = 2;
+            save(v);
+            t.dist[v]   = kInf;
+            t.parent[v] = kNone;
+            t.nhop[v]   = kNone;
+        }
+
+        /* Restart the affected nodes from their best neighbor outside
+         * of the affected subtrees. */
+        for (NodeIdx v : affected) {
+            if (mark[v] != 2) {
+                continue;
+            }
+            mark[v] = 3;
+            for (size_t e = in.offsets[v]; e < in.offsets[v + 1]; e++) {
+                NodeIdx u = in.nodes[e];
+                unsigned long alt;
+
+                if (mark[u] || t.dist[u] == kInf) {
+                    continue;
+                }
+                alt = (unsigned long)t.dist[u] + in.costs[e];
+                if (alt < t.dist[v]) {
+                    t.dist[v]   = alt;
+                    t.parent[v] = u;
+                    t.nhop[v]   = (u == src) ? v : t.nhop[u];
+                }
+            }
+            if (t.dist[v] != kInf) {
+                heap.emplace(t.dist[v], v);
+            }
+        }
+    }
+
+    /* Step 2: edges that got cheaper (or appeared) may shorten the
+     * paths going through them. */
+    for (const EdgeChange &ch : changes) {
+        if (ch.new_cost < ch.old_cost && t.dist[ch.from] != kInf) {
+            heap.emplace(t.dist[ch.from], ch.from);
+        }
+    }
+
+    /* Step 3: propagate the new distances with Dijkstra, starting from
+     * the nodes in the heap. */
+    while (!heap.empty()) {
+        SPFHeapItem top = heap.top();
+        NodeIdx u       = top.second;
+
+        heap.pop();
+        if (top.first != t.dist[u]) {
+            continue;
+        }
+
+        for (size_t e = out.offsets[u]; e < out.offsets[u + 1]; e++) {
+            NodeIdx v         = out.nodes[e];
+            unsigned long alt = (unsigned long)t.dist[u] + out.costs[e];
+
+            if (alt < t.dist[v]) {
+                save(v);
+                t.dist[v]   = alt;
+                t.parent[v] = u;
+                t.nhop[v]   = (u == src) ? v : t.nhop[u];
+                heap.emplace(t.dist[v], v);
+            }
+        }
+    }
+
+    for (const auto &kvs : saved) {
+        NodeIdx v = kvs.first;
+
+        if (kvs.second.first != t.dist[v] || kvs.second.second != t.nhop[v]) {
+            changed.push_back(v);
+        }
+    }
+}
@@ -0,0 +1,148 @@
+/*
+ * Shortest path computation for the link-state routing of normal uipcps.
+ *
+ * Copyright (C) 2015-2016 Nextworks
+ * Author: Vincenzo Maffione <v.maffione@gmail.com>
+ *
+ * This file is part of rlite.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __UIPCP_SPF_H__
+#define __UIPCP_SPF_H__
+
+#include <climits>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "rlite/cpputils.hpp"
+#include "uipcp-normal-codecs.hpp"
+
+/* Directed graph of the DIF, as seen by the routing engine. Nodes are
+ * interned into dense integer indices, so that the shortest path
+ * computations only use vectors. Edges can be collected with
+ * add_edge() and packed all together by build(), or changed one by
+ * one with set_edge() and del_edge(). The adjacency is stored in
+ * Compressed Sparse Row (CSR) arrays, in both directions. Node indices
+ * are stable, so that the (costly) interning is only done for new
+ * nodes. */
+class SPFGraph {
+public:
+    using NodeIdx = unsigned int;
+
+    static constexpr unsigned int kInf = UINT_MAX;
+    static constexpr NodeIdx kNone     = UINT_MAX;
+
+    /* A shortest path tree rooted at 'source'. For each node i, dist[i]
+     * is the distance from the source (kInf if unreachable), parent[i]
+     * is the predecessor in the tree and nhop[i] is the neighbor of the
+     * source to be used to reach i (kNone for the source and for
+     * unreachable nodes). */
+    struct Tree {
+        NodeIdx source = kNone;
+        std::vector<unsigned int> dist;
+        std::vector<NodeIdx> parent;
+        std::vector<NodeIdx> nhop;
+    };
+
+    /* The cost of an edge changed from 'old_cost' to 'new_cost', where
+     * kInf stands for a missing edge. */
+    struct EdgeChange {
+        NodeIdx from;
+        NodeIdx to;
+        unsigned int old_cost;
+        unsigned int new_cost;
+    };
+
+    /* Get the index of 'node', allocating a new one if needed. */
+    NodeIdx intern(const NodeId &node);
+
+    /* Get the index of 'node', or kNone if unknown. */
+    NodeIdx index(const NodeId &node) const;
+
+    const NodeId &name(NodeIdx idx) const { return names[idx]; }
+    size_t num_nodes() const { return names.size(); }
+    size_t num_edges() const { return out.nodes.size(); }
+
+    /* Forget all the edges, but not the nodes. */
+    void clear_edges();
+
+    /* Add an edge, which will be visible after the next build(). */
+    void add_edge(NodeIdx from, NodeIdx to, unsigned int cost);
+
+    /* Pack the edges collected so far into the CSR arrays. */
+    void build();
+
+    /* Set or remove a single edge, returning its previous cost (kInf
+     * if it did not exist). */
+    unsigned int set_edge(NodeIdx from, NodeIdx to, unsigned int cost);
+    unsigned int del_edge(NodeIdx from, NodeIdx to);
+
+    /* Iterate over the edges leaving 'idx'. */
+    size_t edges_begin(NodeIdx idx) const { return out.offsets[idx]; }
+    size_t edges_end(NodeIdx idx) const { return out.offsets[idx + 1]; }
+    NodeIdx edge_to(size_t e) const { return out.nodes[e]; }
+    unsigned int edge_cost(size_t e) const { return out.costs[e]; }
+
+    /* Dijkstra algorithm rooted at 'source', using a binary heap. */
+    void shortest_paths(NodeIdx source, Tree &t) const;
+
+    /* Bring 't' up to date after the edge 'changes' have been applied
+     * to the graph, in the order they were applied. Only the subtrees
+     * hanging from edges whose cost increased are recomputed, and only
+     * the nodes reachable through cheaper paths are visited.
+     * The nodes whose distance or next hop changed are appended to
+     * 'changed'. */
+    void update_shortest_paths(Tree &t, const std::vector<EdgeChange> &changes,
+                               std::vector<NodeIdx> &changed) const;
+
+private:
+    struct StagedEdge {
+        NodeIdx from;
+        NodeIdx to;
+        unsigned int cost;
+    };
+
+    /* CSR adjacency: the edges of node i are those in the range
+     * [offsets[i], offsets[i+1]) of 'nodes' and 'costs'. Single edges
+     * are inserted and removed by shifting the arrays, which is cheap
+     * compared to a full rebuild. */
+    struct Adjacency {
+        std::vector<size_t> offsets = std::vector<size_t>(1, 0);
+        std::vector<NodeIdx> nodes;
+        std::vector<unsigned int> costs;
+
+        void assign(size_t num_nodes, const std::vector<StagedEdge> &edges,
+                    bool reverse);
+        void grow(size_t num_nodes);
+        size_t find(NodeIdx i, NodeIdx j) const;
+        void insert(NodeIdx i, NodeIdx j, unsigned int cost);
+        void erase(NodeIdx i, size_t e);
+    };
+
+    std::unordered_map<NodeId, NodeIdx> ids;
+    std::vector<NodeId> names;
+
+    /* Edges added since the last clear_edges(). */
+    std::vector<StagedEdge> staged;
+
+    /* Outgoing and incoming edges. */
+    Adjacency out;
+    Adjacency in;
+};
+
+#endif /* __UIPCP_SPF_H__ */
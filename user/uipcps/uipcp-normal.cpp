@@ -62,6 +62,8 @@ string raft_req_vote            = "raft_rv";
 string raft_req_vote_resp       = "raft_rv_r";
 string raft_append_entries      = "raft_ae";
 string raft_append_entries_resp = "raft_ae_r";
+string digests                  = "digests";
+string dht_find                 = "dht_find";
 }; // namespace obj_class
 
 namespace obj_name {
@@ -77,6 +79,7 @@ string flows            = "/dif/ra/fa/" + obj_class::flows;
 string keepalive        = "/daf/mgmt/" + obj_class::keepalive;
 string lowerflow        = "/daf/mgmt/" + obj_class::lowerflow;
 string addr_alloc_table = "/dif/ra/aa/" + obj_class::addr_alloc_table;
+string digests          = "/daf/mgmt/" + obj_class::digests;
 }; // namespace obj_name
 
 std::unordered_map<std::string, std::set<PolicyBuilder>>
@@ -386,6 +389,16 @@ uipcp_rib::uipcp_rib(struct uipcp *_u)
         PolicyParam(kAddrAllocDistrNackWaitSecs, kAddrAllocDistrNackWaitSecsMin,
                     kAddrAllocDistrNackWaitSecsMax);
     params_map["dft"]["replicas"]         = PolicyParam(string());
+    params_map["dft"]["replication-factor"] =
+        PolicyParam(kDHTReplicationFactor, 1, kDHTReplicationFactorMax);
+    params_map["dft"]["parallelism"] =
+        PolicyParam(kDHTParallelism, 1, kDHTParallelismMax);
+    params_map["dft"]["cache-size"] =
+        PolicyParam(kDFTCacheSize, 0, kDFTCacheSizeMax);
+    params_map["dft"]["cache-ttl"] =
+        PolicyParam(kDFTCacheTTL, 1, kDFTCacheTTLMax);
+    params_map["dft"]["cache-negative-ttl"] =
+        PolicyParam(kDFTCacheNegativeTTL, 0, kDFTCacheTTLMax);
     params_map["enrollment"]["timeout"]   = PolicyParam(kEnrollTimeout);
     params_map["enrollment"]["keepalive"] = PolicyParam(kKeepaliveTimeout);
     params_map["enrollment"]["keepalive-thresh"] =
@@ -405,6 +418,19 @@ uipcp_rib::uipcp_rib(struct uipcp *_u)
     params_map["rib-daemon"]["refresh-intval"] = PolicyParam(kRIBRefreshIntval);
     params_map["routing"]["age-incr-intval"]   = PolicyParam(kAgeIncrIntval);
     params_map["routing"]["age-max"]           = PolicyParam(kAgeMax);
+    params_map["routing"]["spf-initial-wait"] =
+        PolicyParam(kSPFInitialWait, 0, kSPFWaitMax);
+    params_map["routing"]["spf-hold-time"] =
+        PolicyParam(kSPFHoldTime, 0, kSPFWaitMax);
+    params_map["routing"]["spf-max-hold-time"] =
+        PolicyParam(kSPFMaxHoldTime, 0, kSPFWaitMax);
+    params_map["routing"]["qos-routing"] = PolicyParam(false);
+    params_map["routing"]["link-capacity"] =
+        PolicyParam(kLinkCapacity, 1, kLinkCapacityMax);
+    params_map["routing"]["qos-min-bandwidth"] =
+        PolicyParam(0, 0, kLinkCapacityMax);
+
+    dft_cache_configure();
 
     policy_mod("flow-allocator", "local");
     policy_mod("address-allocator", "distributed");
@@ -422,6 +448,7 @@ uipcp_rib::uipcp_rib(struct uipcp *_u)
     handlers.insert(make_pair(obj_name::status, &uipcp_rib::status_handler));
     handlers.insert(make_pair(obj_name::addr_alloc_table,
                               &uipcp_rib::addr_alloc_table_handler));
+    handlers.insert(make_pair(obj_name::digests, &uipcp_rib::digests_handler));
 
     /* Start timers for periodic tasks. */
     age_incr_tmr_restart();
@@ -576,6 +603,7 @@ uipcp_rib::dump() const
     ss << endl;
 
     dft->dump(ss);
+    dft_cache.dump(ss);
     lfdb->dump(ss);
     addra->dump(ss);
     fa->dump(ss);
@@ -917,16 +945,77 @@ string2int(const string &s, int &ret)
     return 0;
 }
 
+/* Make the kNeighsMcastAddr group in the kernel PDUFT contain exactly
+ * the kernel-bound flows in 'members' plus 'exclude_port' (if valid).
+ * Flows that could not be added are moved from 'members' to
+ * 'leftover'. */
+void
+uipcp_rib::neighs_mcast_update(std::vector<NeighFlow *> &members,
+                               std::vector<NeighFlow *> &leftover,
+                               rl_port_t exclude_port) const
+{
+    std::unordered_set<rl_port_t> ports;
+
+    for (const NeighFlow *nf : members) {
+        ports.insert(nf->port_id);
+    }
+    if (exclude_port != RL_PORT_ID_NONE) {
+        ports.insert(exclude_port);
+    }
+
+    for (auto it = neighs_mcast_ports.begin();
+         it != neighs_mcast_ports.end();) {
+        if (ports.count(*it)) {
+            ++it;
+            continue;
+        }
+        uipcp_pduft_mcast_del(uipcp, kNeighsMcastAddr, *it);
+        it = neighs_mcast_ports.erase(it);
+    }
+
+    for (rl_port_t port : ports) {
+        if (neighs_mcast_ports.count(port)) {
+            continue;
+        }
+        if (uipcp_pduft_mcast_add(uipcp, kNeighsMcastAddr, port)) {
+            UPW(uipcp, "Cannot add port %u to the neighbors group\n", port);
+            continue;
+        }
+        neighs_mcast_ports.insert(port);
+    }
+
+    for (auto it = members.begin(); it != members.end();) {
+        if (neighs_mcast_ports.count((*it)->port_id)) {
+            ++it;
+            continue;
+        }
+        leftover.push_back(*it);
+        it = members.erase(it);
+    }
+}
+
+/* Send a M_CREATE or M_DELETE to all the enrolled neighbors but
+ * 'exclude'. Neighbors reached through kernel-bound flows get the
+ * same management PDU, so it is serialized once and written once,
+ * letting the kernel replicate it through the neighbors group. */
 int
 uipcp_rib::neighs_sync_obj_excluding(const Neighbor *exclude, bool create,
                                      const string &obj_class,
                                      const string &obj_name,
                                      const UipcpObject *obj_value) const
 {
+    rl_port_t exclude_port = RL_PORT_ID_NONE;
+    std::vector<NeighFlow *> members;
+    std::vector<NeighFlow *> leftover;
+    struct rl_mgmt_hdr mhdr;
+    char objbuf[4096];
+    char *serbuf  = nullptr;
+    size_t serlen = 0;
+    CDAPMessage m;
+    int ret;
+
     for (const auto &kvn : neighbors) {
-        if (exclude && kvn.second.get() == exclude) {
-            continue;
-        }
+        NeighFlow *nf;
 
         if (!kvn.second->has_flows() || kvn.second->mgmt_conn()->enroll_state !=
                                             EnrollState::NEIGH_ENROLLED) {
@@ -936,11 +1025,91 @@ uipcp_rib::neighs_sync_obj_excluding(const Neighbor *exclude, bool create,
             continue;
         }
 
-        kvn.second->neigh_sync_obj(nullptr, create, obj_class, obj_name,
-                                   obj_value);
+        nf = kvn.second->mgmt_conn();
+        if (exclude && kvn.second.get() == exclude) {
+            if (!nf->reliable) {
+                /* Keep it in the group, but skip it for this PDU. */
+                exclude_port = nf->port_id;
+            }
+            continue;
+        }
+
+        if (nf->reliable) {
+            /* Management-only flow, no kernel replication. */
+            kvn.second->neigh_sync_obj(nf, create, obj_class, obj_name,
+                                       obj_value);
+            continue;
+        }
+
+        members.push_back(nf);
     }
 
-    return 0;
+    if (members.size() < 2) {
+        /* Not worth using the group. */
+        leftover.swap(members);
+    } else {
+        neighs_mcast_update(members, leftover, exclude_port);
+    }
+
+    for (NeighFlow *nf : leftover) {
+        nf->neigh->neigh_sync_obj(nf, create, obj_class, obj_name, obj_value);
+    }
+
+    if (members.empty()) {
+        return 0;
+    }
+
+    if (create) {
+        m.m_create(obj_class, obj_name);
+    } else {
+        m.m_delete(obj_class, obj_name);
+    }
+
+    if (obj_value) {
+        int objlen = obj_value->serialize(objbuf, sizeof(objbuf));
+
+        if (objlen < 0) {
+            UPE(uipcp, "serialization failed\n");
+            return objlen;
+        }
+        m.set_obj_value(objbuf, objlen);
+    }
+
+    /* No response is expected, so the message does not need an invoke
+     * id from the (per-neighbor) CDAP connections. */
+    m.version   = 1;
+    m.invoke_id = 0;
+
+    try {
+        ret = msg_ser_stateless(&m, &serbuf, &serlen);
+    } catch (std::bad_alloc) {
+        ret = -1;
+    }
+    if (ret) {
+        UPE(uipcp, "message serialization failed\n");
+        if (serbuf) {
+            delete[] serbuf;
+        }
+        return -1;
+    }
+
+    memset(&mhdr, 0, sizeof(mhdr));
+    mhdr.type        = RLITE_MGMT_HDR_T_OUT_DST_ADDR;
+    mhdr.remote_addr = kNeighsMcastAddr;
+    mhdr.local_port  = exclude_port;
+
+    ret = const_cast<uipcp_rib *>(this)->mgmt_bound_flow_write(&mhdr, serbuf,
+                                                                serlen);
+    if (ret) {
+        UPE(uipcp, "mgmt_bound_flow_write() failed [%s]\n", strerror(errno));
+    } else {
+        for (NeighFlow *nf : members) {
+            nf->tx_account(serlen);
+        }
+    }
+    delete[] serbuf;
+
+    return ret;
 }
 
 int
@@ -1000,6 +1169,10 @@ uipcp_rib::policy_mod(const std::string &component,
     policies[component] = policy_name;
     UPD(uipcp, "set %s policy to %s\n", component.c_str(), policy_name.c_str());
     policy_builder->builder(this);
+    if (component == "dft") {
+        /* Resolutions made by the old DFT are not valid anymore. */
+        dft_cache.clear();
+    }
 
     return ret;
 }
@@ -1062,7 +1235,13 @@ uipcp_rib::policy_param_mod(const std::string &component,
 
         /* Invoke the param_changed() method if available. */
         if (component == "dft") {
-            dft->param_changed(param_name);
+            if (param_name.find("cache-") == 0) {
+                dft_cache_configure();
+            } else {
+                dft->param_changed(param_name);
+            }
+        } else if (component == "routing") {
+            lfdb->param_changed(param_name);
         }
     }
 
@@ -1580,6 +1759,8 @@ normal_appl_register(struct uipcp *uipcp, const struct rl_msg_base *msg)
     uipcp_rib *rib                    = UIPCP_RIB(uipcp);
     std::lock_guard<std::mutex> guard(rib->mutex);
 
+    /* Cached resolutions of this name are not valid anymore. */
+    rib->dft_cache.invalidate(req->appl_name);
     rib->dft->appl_register(req);
 
     return 0;
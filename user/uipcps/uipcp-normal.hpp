@@ -30,6 +30,7 @@
 #include <unordered_set>
 #include <set>
 #include <list>
+#include <vector>
 #include <ctime>
 #include <sstream>
 #include <utility>
@@ -48,6 +49,7 @@
 #include "rina/cdap.hpp"
 
 #include "uipcp-normal-codecs.hpp"
+#include "uipcp-normal-digest.hpp"
 #include "uipcp-container.h"
 
 namespace obj_class {
@@ -68,6 +70,8 @@ extern std::string raft_req_vote;
 extern std::string raft_req_vote_resp;
 extern std::string raft_append_entries;
 extern std::string raft_append_entries_resp;
+extern std::string digests;
+extern std::string dht_find;
 }; // namespace obj_class
 
 namespace obj_name {
@@ -83,6 +87,7 @@ extern std::string flows;
 extern std::string keepalive;
 extern std::string lowerflow;
 extern std::string addr_alloc_table;
+extern std::string digests;
 }; // namespace obj_name
 
 enum class PolicyParamType {
@@ -192,6 +197,10 @@ struct NeighFlow {
     std::unique_ptr<TimeoutEvent> keepalive_timer;
     int pending_keepalive_reqs;
 
+    /* When the last keepalive request was sent, to measure the round
+     * trip time. */
+    std::chrono::steady_clock::time_point keepalive_sent;
+
     /* Statistics about management traffic. */
     struct {
         struct {
@@ -227,6 +236,7 @@ struct NeighFlow {
     void enrollment_abort();
 
     int send_to_port_id(CDAPMessage *m, int invoke_id, const UipcpObject *obj);
+    void tx_account(unsigned int bytes);
 };
 
 /* Holds the information about a neighbor IPCP. */
@@ -265,6 +275,16 @@ struct Neighbor {
      * We don't consider requests, as timeout on responses. */
     std::chrono::system_clock::time_point unheard_since;
 
+    /* Metrics of the link towards the neighbor, advertised in the local
+     * lower flow (zero if not measured yet): smoothed round trip time of
+     * the keepalives, in microseconds, and bandwidth available on the
+     * kernel-bound N-1 flows, in bits per second, estimated from their
+     * transmission counters. */
+    unsigned int srtt_us   = 0;
+    uint64_t avail_bw      = 0;
+    uint64_t tx_bytes_last = 0;
+    std::chrono::steady_clock::time_point tx_last;
+
     RL_NODEFAULT_NONCOPIABLE(Neighbor);
     Neighbor(struct uipcp_rib *rib, const std::string &name);
     bool operator==(const Neighbor &other) const
@@ -284,12 +304,27 @@ struct Neighbor {
     bool enrollment_complete() const;
     int flow_alloc(const char *supp_dif_name);
 
+    /* Update the link metrics with a new round trip time sample, or with
+     * new transmission counters, and advertise them if they changed
+     * significantly. */
+    void rtt_sample(std::chrono::microseconds rtt);
+    void bandwidth_measure();
+    void link_metrics_update();
+
     int neigh_sync_obj(const NeighFlow *nf, bool create,
                        const std::string &obj_class,
                        const std::string &obj_name,
                        const UipcpObject *obj_value) const;
 
-    int neigh_sync_rib(NeighFlow *nf) const;
+    /* Send to the neighbor the selected buckets of the RIB subtrees
+     * listed in 'masks'. */
+    int neigh_sync_rib(
+        NeighFlow *nf,
+        const std::map<std::string, DigestTree::BucketMask> &masks) const;
+
+    /* Send the root digests of the RIB subtrees to the neighbor, and
+     * possibly also the bucket digests. */
+    int neigh_sync_digests(NeighFlow *nf, bool buckets) const;
 
 private:
     const NeighFlow *_mgmt_conn() const;
@@ -326,11 +361,57 @@ struct DFT {
     virtual void update_address(rlm_addr_t new_addr)                    = 0;
     virtual int rib_handler(const CDAPMessage *rm, NeighFlow *nf,
                             rlm_addr_t src_addr)                        = 0;
-    virtual int sync_neigh(NeighFlow *nf, unsigned int limit) const
+    virtual void digest(DigestTree &dt) const {}
+    virtual int sync_neigh(NeighFlow *nf, unsigned int limit,
+                           const DigestTree::BucketMask *buckets) const
     {
         return 0;
     }
-    virtual int neighs_refresh(size_t limit) { return 0; }
+};
+
+/* Bounded LRU cache of the names resolved by the DFT, used by the flow
+ * allocator to avoid a DFT lookup for each new flow towards the same
+ * destination. All the addresses of a name are cached, so that each
+ * flow still selects one as the DFT would. Unresolved names are cached
+ * too (as negative entries), with a separate TTL. Entries are
+ * invalidated when the DFT changes the corresponding name, if the local
+ * node knows about the change, or when a flow allocation towards the
+ * name is refused. */
+class DFTCache {
+public:
+    /* Set the maximum number of entries (0 disables the cache) and the
+     * TTLs of positive and negative entries, in seconds. */
+    void configure(size_t size, int ttl_secs, int negative_ttl_secs);
+
+    /* Returns true on hit, setting *dstaddr to RL_ADDR_NULL if the name
+     * is known not to be resolvable. */
+    bool lookup(const std::string &appl_name, rlm_addr_t preferred,
+                uint32_t cookie, rlm_addr_t *dstaddr);
+    void insert(const std::string &appl_name,
+                const std::vector<rlm_addr_t> &addrs);
+    void invalidate(const std::string &appl_name);
+    void clear();
+
+    void dump(std::stringstream &ss) const;
+
+private:
+    struct Entry {
+        std::string appl_name;
+        std::vector<rlm_addr_t> addrs; /* empty if unresolved */
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    size_t max_entries = 0;
+    std::chrono::seconds ttl;
+    std::chrono::seconds negative_ttl;
+
+    /* Most recently used entries first. */
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+
+    unsigned long hits     = 0;
+    unsigned long neg_hits = 0;
+    unsigned long misses   = 0;
 };
 
 /* Allocation and deallocation of N-flows used applications. */
@@ -370,6 +451,7 @@ struct LFDB {
     LFDB(struct uipcp_rib *_ur) : rib(_ur) {}
     virtual ~LFDB() {}
 
+    virtual int param_changed(const std::string &param_name) { return 0; }
     virtual void dump(std::stringstream &ss) const         = 0;
     virtual void dump_routing(std::stringstream &ss) const = 0;
 
@@ -386,9 +468,14 @@ struct LFDB {
     virtual int rib_handler(const CDAPMessage *rm, NeighFlow *nf,
                             rlm_addr_t src_addr) = 0;
 
-    virtual int sync_neigh(NeighFlow *nf, unsigned int limit) const = 0;
-    virtual int neighs_refresh(size_t limit)                        = 0;
-    virtual void age_incr()                                         = 0;
+    /* Anti-entropy support: add the replicated objects to 'dt', and send
+     * to a neighbor the objects in the selected buckets (all of them
+     * if 'buckets' is nullptr). */
+    virtual void digest(DigestTree &dt) const                           = 0;
+    virtual int sync_neigh(NeighFlow *nf, unsigned int limit,
+                           const DigestTree::BucketMask *buckets) const = 0;
+    virtual int neighs_refresh(size_t limit)                            = 0;
+    virtual void age_incr()                                             = 0;
 };
 
 /* Address allocation for the members of the N-DIF. */
@@ -400,11 +487,13 @@ struct AddrAllocator {
     AddrAllocator(struct uipcp_rib *_ur) : rib(_ur) {}
     virtual ~AddrAllocator() {}
 
-    virtual void dump(std::stringstream &ss) const                  = 0;
-    virtual rlm_addr_t allocate()                                   = 0;
+    virtual void dump(std::stringstream &ss) const                      = 0;
+    virtual rlm_addr_t allocate()                                       = 0;
     virtual int rib_handler(const CDAPMessage *rm, NeighFlow *nf,
-                            rlm_addr_t src_addr)                    = 0;
-    virtual int sync_neigh(NeighFlow *nf, unsigned int limit) const = 0;
+                            rlm_addr_t src_addr)                        = 0;
+    virtual void digest(DigestTree &dt) const                           = 0;
+    virtual int sync_neigh(NeighFlow *nf, unsigned int limit,
+                           const DigestTree::BucketMask *buckets) const = 0;
 };
 
 /* Object used to store policy names and allocate/switch policies. */
@@ -469,6 +558,11 @@ struct uipcp_rib {
                        std::unordered_map<std::string, PolicyParam>>
         params_map;
 
+    /* Local ports of the kernel-bound N-1 flows that are currently
+     * members of the kNeighsMcastAddr group in the kernel PDUFT. Declared
+     * before 'neighbors', as NeighFlow destructors update it. */
+    mutable std::unordered_set<rl_port_t> neighs_mcast_ports;
+
     /* Neighbors. We keep track of all the NeighborCandidate objects seen,
      * even for candidates that have no lower DIF in common with us. This
      * is used to implement propagation of the CandidateNeighbors information,
@@ -479,6 +573,8 @@ struct uipcp_rib {
      * to the object. */
     std::unordered_map<std::string, std::shared_ptr<Neighbor>> neighbors;
     std::unordered_map<std::string, NeighborCandidate> neighbors_seen;
+    /* Digest of neighbors_seen, updated by neighbors_handler(). */
+    DigestTree neighbors_dt;
     std::unordered_set<std::string> neighbors_cand;
     std::unordered_set<std::string> neighbors_deleted;
 
@@ -491,8 +587,16 @@ struct uipcp_rib {
                        std::list<std::unique_ptr<struct rl_kmsg_fa_req>>>
         pending_fa_reqs;
 
-    /* Called by the DFT when a name lookup has been resolved asynchronously. */
-    void dft_lookup_resolved(const std::string &name, rlm_addr_t remote_addr);
+    /* Called by the DFT when a name lookup has been resolved asynchronously,
+     * with all the addresses of the name (none if unresolved). The result
+     * is only cached if the DFT invalidates the cache on changes. */
+    void dft_lookup_resolved(const std::string &name,
+                             const std::vector<rlm_addr_t> &addrs,
+                             bool cacheable);
+
+    /* Names resolved asynchronously by the DFT. See uipcp_rib::fa_req(). */
+    DFTCache dft_cache;
+    void dft_cache_configure();
 
     std::unique_ptr<AddrAllocator> addra;
 
@@ -526,13 +630,32 @@ struct uipcp_rib {
     /* Max age (in seconds) for an LFDB entry not to be discarded. */
     static constexpr int kAgeMax = 120;
 
+    /* Route computation throttling (in milliseconds): delay before the
+     * computation triggered by the first LFDB change, initial hold-down
+     * window for the following changes, and maximum value reached by the
+     * hold-down window when it is doubled under sustained churn. */
+    static constexpr int kSPFInitialWait = 10;
+    static constexpr int kSPFHoldTime    = 200;
+    static constexpr int kSPFMaxHoldTime = 5000;
+    static constexpr int kSPFWaitMax     = 60000;
+
     /* Time interval (in seconds) between two consecutive periodic
      * RIB synchronizations. */
     static constexpr int kRIBRefreshIntval = 30;
 
+    /* Lifetime (in seconds) of the tombstones of the objects deleted from
+     * the fully replicated RIB subtrees. It must be long enough for the
+     * deletion to reach all the replicas through the anti-entropy
+     * synchronization. */
+    static constexpr int kTombstoneLifetime = 600;
+
     /* Default value for keepalive parameter. */
     static constexpr int kKeepaliveTimeout = 10;
 
+    /* Multicast address used to reach all the enrolled neighbors with
+     * a single management write. Never allocated to an IPCP. */
+    static constexpr rlm_addr_t kNeighsMcastAddr = ~((rlm_addr_t)0);
+
     /* Timeout intervals are expressed in milliseconds. */
     static constexpr int kKeepaliveThresh = 3;
     static constexpr int kEnrollTimeout   = 7000;
@@ -565,6 +688,38 @@ struct uipcp_rib {
     /* Upper bound for the AddrAllocator NACK timer. */
     static constexpr int kAddrAllocDistrNackWaitSecsMax = 99;
 
+    /* Default number of nodes storing each entry of the DHT-based DFT,
+     * and number of concurrent queries issued by each DHT lookup. */
+    static constexpr int kDHTReplicationFactor    = 20;
+    static constexpr int kDHTReplicationFactorMax = 64;
+    static constexpr int kDHTParallelism          = 3;
+    static constexpr int kDHTParallelismMax       = 16;
+
+    /* Default size of the DFT lookup cache, and default TTLs (in seconds)
+     * for resolved and unresolved names. */
+    static constexpr int kDFTCacheSize        = 1024;
+    static constexpr int kDFTCacheSizeMax     = 65536;
+    static constexpr int kDFTCacheTTL         = 30;
+    static constexpr int kDFTCacheNegativeTTL = 5;
+    static constexpr int kDFTCacheTTLMax      = 3600;
+
+    /* QoS identifiers for the forwarding tables computed by the
+     * QoS-aware routing. The flow allocator selects one according to
+     * the flow specification. */
+    static constexpr rl_qosid_t kQosIdDefault       = 0;
+    static constexpr rl_qosid_t kQosIdLowDelay      = 1;
+    static constexpr rl_qosid_t kQosIdHighBandwidth = 2;
+
+    /* Default capacity of the N-1 flows (in Mbps), used to estimate the
+     * available bandwidth, and maximum value for the bandwidth
+     * parameters. */
+    static constexpr int kLinkCapacity    = 1000;
+    static constexpr int kLinkCapacityMax = 1000000;
+
+    /* Link metrics are advertised again when they change by more than
+     * this percentage. */
+    static constexpr int kLinkMetricsThreshold = 25;
+
     /* Time window to compute statistics about management traffic (in seconds).
      */
     static constexpr int kNeighFlowStatsPeriod = 20;
@@ -596,6 +751,11 @@ struct uipcp_rib {
     void check_for_address_conflicts();
 
     NeighborCandidate neighbor_cand_get() const;
+    void neighbors_digest(DigestTree &dt) const;
+
+    /* Compute the digests of all the fully replicated RIB subtrees,
+     * indexed by subtree name. */
+    std::map<std::string, DigestTree> digests_compute() const;
     NeighFlow *lookup_neigh_flow_by_port_id(rl_port_t port_id);
     void neigh_flow_prune(NeighFlow *nf);
     int enroll(const char *neigh_name, const char *supp_dif_name,
@@ -614,6 +774,9 @@ struct uipcp_rib {
     int send_to_myself(std::unique_ptr<CDAPMessage> m, const UipcpObject *obj);
 
     /* Synchronize with neighbors. */
+    void neighs_mcast_update(std::vector<NeighFlow *> &members,
+                             std::vector<NeighFlow *> &leftover,
+                             rl_port_t exclude_port) const;
     int neighs_sync_obj_excluding(const Neighbor *exclude, bool create,
                                   const std::string &obj_class,
                                   const std::string &obj_name,
@@ -650,6 +813,8 @@ struct uipcp_rib {
     {
         return addra->rib_handler(rm, nf, src_addr);
     }
+    int digests_handler(const CDAPMessage *rm, NeighFlow *nf,
+                        rlm_addr_t src_addr);
 
     void neighs_refresh();
     void neighs_refresh_tmr_restart();